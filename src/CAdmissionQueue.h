@@ -0,0 +1,318 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CDeadline.h"
+#include "CPhaseStatistics.h"
+#include "OutputWriter.h"
+
+using namespace std;
+
+// Lets one snapshot set at a time through creation, from StartSnapshotSet
+// until DoSnapshotSet has finished, since VSS refuses to create two at
+// once. Callers in this process queue on a semaphore; other processes
+// using this library queue on a named mutex. A mutex belongs to the
+// thread that took it, and a ShadowSpawnAsync job moves between pool
+// threads before it lets go, so the mutex is taken by a short-lived
+// thread of the queue's own. If a process dies holding it, the next one
+// in line finds it abandoned and carries on. Callers that mustn't block,
+// such as jobs on the system thread pool, poll with TryAcquire instead.
+class CAdmissionQueue
+{
+private:
+    static const DWORD POLL_INTERVAL_MS = 50;
+
+    static CAdmissionQueue s_vss;
+    static CAdmissionQueue s_mock;
+
+    CComAutoCriticalSection _lock;
+    CString _name;
+    bool _opened;
+    HANDLE _hMutex;
+    HANDLE _hSlot;
+    HANDLE _hHolder;
+    HANDLE _hCancel;
+    HANDLE _hGranted;
+    HANDLE _hRefused;
+    HANDLE _hRelease;
+
+    static DWORD WINAPI HoldProc(LPVOID parameter)
+    {
+        ((CAdmissionQueue*) parameter)->Hold();
+        return 0;
+    }
+
+    void Hold(void)
+    {
+        HANDLE handles[] = { _hMutex, _hCancel };
+        DWORD wait = ::WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+        if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED_0)
+        {
+            ::SetEvent(_hRefused);
+            return;
+        }
+
+        ::SetEvent(_hGranted);
+        ::WaitForSingleObject(_hRelease, INFINITE);
+        ::ReleaseMutex(_hMutex);
+    }
+
+    // The mutex is shared by every session on the machine, so it goes in
+    // the global namespace if we're allowed, and the session's if not.
+    void Open(OutputWriter& logger)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        if (_opened)
+        {
+            return;
+        }
+        _opened = true;
+
+        CString globalName(TEXT("Global\\"));
+        globalName.Append(_name);
+        _hMutex = ::CreateMutex(NULL, FALSE, globalName);
+        if (_hMutex == NULL)
+        {
+            _hMutex = ::OpenMutex(SYNCHRONIZE | MUTEX_MODIFY_STATE, FALSE, globalName);
+        }
+        if (_hMutex == NULL)
+        {
+            CString localName(TEXT("Local\\"));
+            localName.Append(_name);
+            _hMutex = ::CreateMutex(NULL, FALSE, localName);
+        }
+        if (_hMutex == NULL)
+        {
+            logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL,
+                TEXT("Unable to open the %s mutex, so snapshots are only queued within this process. Error: %d"), _name, ::GetLastError());
+        }
+    }
+
+    // Sets the holder thread queuing on the mutex. Returns false if it
+    // couldn't be started, in which case the caller goes ahead without
+    // the mutex. Only the caller holding the semaphore may call this.
+    bool StartHolder(OutputWriter& logger)
+    {
+        ::ResetEvent(_hCancel);
+        ::ResetEvent(_hGranted);
+        ::ResetEvent(_hRefused);
+        ::ResetEvent(_hRelease);
+
+        _hHolder = ::CreateThread(NULL, 0, HoldProc, this, 0, NULL);
+        if (_hHolder == NULL)
+        {
+            logger.WriteFormat(TEXT("Unable to start a thread to queue on the %s mutex. Error: %d"), _name, ::GetLastError());
+            return false;
+        }
+        return true;
+    }
+
+    // Tells the holder thread to stop queuing, or to let go of the mutex
+    // if it got it just as we gave up, and waits for it to finish.
+    void StopHolder(void)
+    {
+        ::SetEvent(_hCancel);
+        HANDLE handles[] = { _hGranted, _hRefused };
+        if (::WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0)
+        {
+            ::SetEvent(_hRelease);
+        }
+        JoinHolder();
+    }
+
+    // For when the holder thread couldn't wait on the mutex: the caller
+    // goes ahead without it, as it would if the mutex couldn't be opened.
+    void ProceedWithoutMutex(OutputWriter& logger)
+    {
+        StopHolder();
+        logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL,
+            TEXT("Unable to wait for the %s mutex, so this snapshot set is only queued within this process"), _name);
+    }
+
+    // Waits for the mutex, or returns false, without it, once deadline is
+    // over. Returns true without the mutex if it couldn't be waited for.
+    bool AcquireMutex(CDeadline& deadline, OutputWriter& logger)
+    {
+        if (!StartHolder(logger))
+        {
+            return true;
+        }
+
+        HANDLE handles[] = { _hGranted, _hRefused };
+        DWORD wait;
+        while ((wait = ::WaitForMultipleObjects(2, handles, FALSE, min(deadline.get_RemainingMs(), POLL_INTERVAL_MS))) == WAIT_TIMEOUT)
+        {
+            if (deadline.get_IsOver())
+            {
+                StopHolder();
+                return false;
+            }
+        }
+
+        if (wait != WAIT_OBJECT_0)
+        {
+            ProceedWithoutMutex(logger);
+        }
+        return true;
+    }
+
+    // Waits for the holder thread to let go of the mutex, which it does
+    // straight away once told to, so its events can be reused.
+    void JoinHolder(void)
+    {
+        ::WaitForSingleObject(_hHolder, INFINITE);
+        ::CloseHandle(_hHolder);
+        _hHolder = NULL;
+    }
+
+public:
+    CAdmissionQueue::CAdmissionQueue(LPCTSTR name)
+    {
+        _name = name;
+        _opened = false;
+        _hMutex = NULL;
+        _hSlot = ::CreateSemaphore(NULL, 1, 1, NULL);
+        _hHolder = NULL;
+        _hCancel = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+        _hGranted = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+        _hRefused = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+        _hRelease = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
+
+    CAdmissionQueue::~CAdmissionQueue()
+    {
+        if (_hMutex != NULL)
+        {
+            ::CloseHandle(_hMutex);
+        }
+        ::CloseHandle(_hSlot);
+        ::CloseHandle(_hCancel);
+        ::CloseHandle(_hGranted);
+        ::CloseHandle(_hRefused);
+        ::CloseHandle(_hRelease);
+    }
+
+    // Mock snapshots queue separately, so they never hold up real ones.
+    static CAdmissionQueue& get_Instance(bool mock)
+    {
+        return mock ? s_mock : s_vss;
+    }
+
+    // Waits for the caller's turn, recording the time spent waiting as the
+    // admission phase. Throws if deadline runs out first.
+    void Acquire(CDeadline& deadline, OutputWriter& logger)
+    {
+        Open(logger);
+
+        CPhaseTimer queueTimer;
+        while (::WaitForSingleObject(_hSlot, min(deadline.get_RemainingMs(), POLL_INTERVAL_MS)) != WAIT_OBJECT_0)
+        {
+            deadline.Check(TEXT("Waiting for other snapshot sets to be created"));
+        }
+
+        if (_hMutex != NULL && !AcquireMutex(deadline, logger))
+        {
+            ::ReleaseSemaphore(_hSlot, 1, NULL);
+            deadline.Check(TEXT("Waiting for other processes' snapshot sets to be created"));
+        }
+
+        queueTimer.Record(SHADOWSPAWN_PHASE_ADMISSION, logger);
+    }
+
+    // Like Acquire, but never waits: returns true once the caller's turn
+    // has come, or false if it should call again later. holdsSlot keeps
+    // the caller's place in the queue from one call to the next and must
+    // start out false; queueTimer should be started when the caller first
+    // asks. Throws, having given up the caller's place, once deadline runs
+    // out.
+    bool TryAcquire(bool& holdsSlot, CDeadline& deadline, CPhaseTimer& queueTimer, OutputWriter& logger)
+    {
+        Open(logger);
+
+        if (!holdsSlot)
+        {
+            if (::WaitForSingleObject(_hSlot, 0) != WAIT_OBJECT_0)
+            {
+                deadline.Check(TEXT("Waiting for other snapshot sets to be created"));
+                return false;
+            }
+
+            holdsSlot = true;
+            if (_hMutex == NULL || !StartHolder(logger))
+            {
+                queueTimer.Record(SHADOWSPAWN_PHASE_ADMISSION, logger);
+                return true;
+            }
+        }
+
+        HANDLE handles[] = { _hGranted, _hRefused };
+        DWORD wait = ::WaitForMultipleObjects(2, handles, FALSE, 0);
+        if (wait == WAIT_TIMEOUT)
+        {
+            if (deadline.get_IsOver())
+            {
+                Abandon(holdsSlot);
+                deadline.Check(TEXT("Waiting for other processes' snapshot sets to be created"));
+            }
+            return false;
+        }
+
+        if (wait != WAIT_OBJECT_0)
+        {
+            ProceedWithoutMutex(logger);
+        }
+
+        queueTimer.Record(SHADOWSPAWN_PHASE_ADMISSION, logger);
+        return true;
+    }
+
+    // Gives up a place TryAcquire is holding, whether or not the caller's
+    // turn has come yet.
+    void Abandon(bool& holdsSlot)
+    {
+        if (!holdsSlot)
+        {
+            return;
+        }
+
+        if (_hHolder != NULL)
+        {
+            StopHolder();
+        }
+        ::ReleaseSemaphore(_hSlot, 1, NULL);
+        holdsSlot = false;
+    }
+
+    // Lets the next caller in. Only the caller whose Acquire succeeded may
+    // call this, and only once.
+    void Release(void)
+    {
+        if (_hHolder != NULL)
+        {
+            ::SetEvent(_hRelease);
+            JoinHolder();
+        }
+        ::ReleaseSemaphore(_hSlot, 1, NULL);
+    }
+};
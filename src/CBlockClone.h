@@ -0,0 +1,134 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <winioctl.h>
+
+#include "OutputWriter.h"
+
+// Block cloning arrived with ReFS in Windows Server 2016, after the SDK
+// this project builds against.
+#ifndef FSCTL_DUPLICATE_EXTENTS_TO_FILE
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 209, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+typedef struct _DUPLICATE_EXTENTS_DATA
+{
+    HANDLE FileHandle;
+    LARGE_INTEGER SourceFileOffset;
+    LARGE_INTEGER TargetFileOffset;
+    LARGE_INTEGER ByteCount;
+} DUPLICATE_EXTENTS_DATA;
+#endif
+
+#ifndef FILE_SUPPORTS_BLOCK_REFCOUNTING
+#define FILE_SUPPORTS_BLOCK_REFCOUNTING 0x08000000
+#endif
+
+// Makes one file share another's data blocks instead of copying them,
+// which costs no I/O. Only works within one volume, and only on file
+// systems that support it (ReFS).
+class CBlockClone
+{
+private:
+    // Cloned per call; a multiple of every cluster size.
+    static const LONGLONG CHUNK_BYTES = 1024 * 1024 * 1024;
+
+public:
+    // Returns the cluster size, which clones have to be a multiple of, if
+    // files under source can be cloned to target, or zero.
+    static DWORD GetClusterSize(LPCTSTR source, LPCTSTR target, OutputWriter& logger)
+    {
+        TCHAR wszSourceVolume[MAX_PATH];
+        TCHAR wszTargetVolume[MAX_PATH];
+        if (!::GetVolumePathName(source, wszSourceVolume, MAX_PATH) ||
+            !::GetVolumePathName(target, wszTargetVolume, MAX_PATH) ||
+            _tcsicmp(wszSourceVolume, wszTargetVolume) != 0)
+        {
+            logger.WriteLine(TEXT("The target is on a different volume from the source, so files can't be block-cloned."));
+            return 0;
+        }
+
+        DWORD flags;
+        if (!::GetVolumeInformation(wszSourceVolume, NULL, 0, NULL, NULL, &flags, NULL, 0) ||
+            (flags & FILE_SUPPORTS_BLOCK_REFCOUNTING) == 0)
+        {
+            logger.WriteLine(TEXT("The volume doesn't support block cloning."));
+            return 0;
+        }
+
+        DWORD sectorsPerCluster;
+        DWORD bytesPerSector;
+        DWORD freeClusters;
+        DWORD totalClusters;
+        if (!::GetDiskFreeSpace(wszSourceVolume, &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters))
+        {
+            return 0;
+        }
+
+        logger.WriteFormat(TEXT("Block cloning files with a cluster size of %d bytes."), sectorsPerCluster * bytesPerSector);
+        return sectorsPerCluster * bytesPerSector;
+    }
+
+    // Gives hTarget, a new empty file, the size bytes of hSource. Returns
+    // ERROR_SUCCESS or the error, which is ERROR_NOT_SUPPORTED or
+    // ERROR_INVALID_FUNCTION if the volume can't clone at all.
+    static DWORD CloneData(HANDLE hSource, HANDLE hTarget, ULONGLONG size, bool sparse, DWORD clusterSize)
+    {
+        DWORD returned;
+        if (sparse && !::DeviceIoControl(hTarget, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL))
+        {
+            return ::GetLastError();
+        }
+
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG) size;
+        if (!::SetFilePointerEx(hTarget, end, NULL, FILE_BEGIN) || !::SetEndOfFile(hTarget))
+        {
+            return ::GetLastError();
+        }
+
+        // Clones have to cover whole clusters, even past the end of the file.
+        LONGLONG clonedBytes = (end.QuadPart + clusterSize - 1) / clusterSize * clusterSize;
+        for (LONGLONG offset = 0; offset < clonedBytes; offset += CHUNK_BYTES)
+        {
+            DUPLICATE_EXTENTS_DATA extents;
+            extents.FileHandle = hSource;
+            extents.SourceFileOffset.QuadPart = offset;
+            extents.TargetFileOffset.QuadPart = offset;
+            extents.ByteCount.QuadPart = min(CHUNK_BYTES, clonedBytes - offset);
+
+            if (!::DeviceIoControl(hTarget, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), NULL, 0, &returned, NULL))
+            {
+                return ::GetLastError();
+            }
+        }
+
+        return ERROR_SUCCESS;
+    }
+
+    static bool IsUnsupported(DWORD error)
+    {
+        return error == ERROR_NOT_SUPPORTED || error == ERROR_INVALID_FUNCTION;
+    }
+};
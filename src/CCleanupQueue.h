@@ -0,0 +1,215 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CComException.h"
+#include "CShadowSpawnException.h"
+#include "CShadowSpawnSession.h"
+#include "CSnapshotSet.h"
+#include "OutputWriter.h"
+#include "Utilities.h"
+
+using namespace std;
+
+// Finishes snapshot sets on a background thread once their callbacks
+// have returned: BackupComplete, and then deleting the snapshots, which
+// together can take seconds on a busy volume. The caller gets control
+// back as soon as it hands the set over. Failures can only be logged by
+// then. The queue is bounded; when it's full (or off, which a capacity of zero
+// means) the caller is told to do the work itself.
+class CCleanupQueue
+{
+private:
+    CComAutoCriticalSection _lock;
+    DWORD _capacity;
+    CAtlList<CSnapshotSet*> _items;
+    DWORD _busy;
+    bool _stopping;
+    HANDLE _hWork;
+    HANDLE _hIdle;
+    HANDLE _hThread;
+
+    static DWORD WINAPI WorkerProc(LPVOID parameter)
+    {
+        // Whatever VSS calls the snapshot sets make need COM on this
+        // thread.
+        ::CoInitializeEx(NULL, COINIT_MULTITHREADED);
+        ((CCleanupQueue*) parameter)->Run();
+        ::CoUninitialize();
+        return 0;
+    }
+
+    static void Finish(CSnapshotSet* pSnapshotSet)
+    {
+        CShadowSpawnSession& session = pSnapshotSet->get_Session();
+        OutputWriter& logger = session.get_Logger();
+
+        bool bAbnormalAbort = false;
+        try
+        {
+            pSnapshotSet->Complete();
+        }
+        catch (CComException* e)
+        {
+            bAbnormalAbort = true;
+            pSnapshotSet->Abort();
+            Utilities::ReportException(e, logger);
+        }
+        catch (CShadowSpawnException* e)
+        {
+            bAbnormalAbort = true;
+            pSnapshotSet->Abort();
+            Utilities::ReportException(e, logger);
+        }
+        pSnapshotSet->Delete(bAbnormalAbort);
+
+        delete pSnapshotSet;
+        // Last, since it may delete a throwaway session.
+        session.EndDeferredCleanup();
+    }
+
+    void Run(void)
+    {
+        while (true)
+        {
+            CSnapshotSet* pSnapshotSet;
+            {
+                CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+                while (_items.IsEmpty())
+                {
+                    if (_stopping)
+                    {
+                        return;
+                    }
+                    lock.Unlock();
+                    ::WaitForSingleObject(_hWork, INFINITE);
+                    lock.Lock();
+                }
+
+                pSnapshotSet = _items.RemoveHead();
+            }
+
+            Finish(pSnapshotSet);
+
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            if (--_busy == 0)
+            {
+                ::SetEvent(_hIdle);
+            }
+        }
+    }
+
+    // Call with the lock held.
+    bool StartWorker(void)
+    {
+        if (_hThread == NULL)
+        {
+            _hThread = ::CreateThread(NULL, 0, WorkerProc, this, 0, NULL);
+        }
+        return _hThread != NULL;
+    }
+
+public:
+    CCleanupQueue::CCleanupQueue()
+    {
+        _capacity = 0;
+        _busy = 0;
+        _stopping = false;
+        _hWork = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+        _hIdle = ::CreateEvent(NULL, TRUE, TRUE, NULL);
+        _hThread = NULL;
+    }
+
+    // Runs while the DLL is being unloaded, under the loader lock, so it
+    // mustn't wait for the worker. Hosts that turned the queue on should
+    // set its capacity back to zero before unloading the library.
+    CCleanupQueue::~CCleanupQueue()
+    {
+        if (_hThread != NULL)
+        {
+            ::CloseHandle(_hThread);
+        }
+        ::CloseHandle(_hWork);
+        ::CloseHandle(_hIdle);
+    }
+
+    DWORD get_Capacity(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        return _capacity;
+    }
+
+    // Setting the capacity to zero finishes everything already queued and
+    // stops the worker thread before returning.
+    void set_Capacity(DWORD value)
+    {
+        HANDLE hThread = NULL;
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            _capacity = value;
+            if (value > 0 || _hThread == NULL)
+            {
+                return;
+            }
+
+            hThread = _hThread;
+            _hThread = NULL;
+            _stopping = true;
+            ::SetEvent(_hWork);
+        }
+
+        ::WaitForSingleObject(hThread, INFINITE);
+        ::CloseHandle(hThread);
+
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _stopping = false;
+    }
+
+    // Takes ownership of pSnapshotSet, whose callback must have returned
+    // and devices been unmounted. Returns false, leaving pSnapshotSet with
+    // the caller, if the queue is off or full.
+    bool Enqueue(CSnapshotSet* pSnapshotSet)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+
+        if (_stopping || _items.GetCount() >= _capacity || !StartWorker())
+        {
+            return false;
+        }
+
+        pSnapshotSet->get_Session().BeginDeferredCleanup();
+
+        _items.AddTail(pSnapshotSet);
+        ++_busy;
+        ::ResetEvent(_hIdle);
+        ::SetEvent(_hWork);
+        return true;
+    }
+
+    // Waits up to timeoutMs for everything queued so far to finish.
+    bool Drain(DWORD timeoutMs)
+    {
+        return ::WaitForSingleObject(_hIdle, timeoutMs) == WAIT_OBJECT_0;
+    }
+};
@@ -0,0 +1,990 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CBlockClone.h"
+#include "CShadowSpawnException.h"
+#include "CStealingQueues.h"
+#include "CTreeWalker.h"
+#include "Exports.h"
+#include "OutputWriter.h"
+#include "Utilities.h"
+
+// Defined from Vista on; XP's CopyFileEx rejects it.
+#ifndef COPY_FILE_NO_BUFFERING
+#define COPY_FILE_NO_BUFFERING 0x00001000
+#endif
+
+using namespace std;
+
+// A fixed set of equally sized buffers shared by every copying thread,
+// which bounds how much memory a copy uses however many files are in
+// flight. Buffers are page-aligned.
+class CCopyBufferPool
+{
+private:
+    CComAutoCriticalSection _lock;
+    CAtlList<BYTE*> _free;
+    vector<BYTE*> _buffers;
+    HANDLE _hAvailable;
+    DWORD _bufferSize;
+
+public:
+    CCopyBufferPool::CCopyBufferPool(DWORD bufferCount, DWORD bufferSize)
+    {
+        _bufferSize = bufferSize;
+        for (DWORD iBuffer = 0; iBuffer < bufferCount; ++iBuffer)
+        {
+            BYTE* pBuffer = (BYTE*) ::VirtualAlloc(NULL, bufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+            if (pBuffer == NULL)
+            {
+                break;
+            }
+            _buffers.push_back(pBuffer);
+            _free.AddTail(pBuffer);
+        }
+        _hAvailable = ::CreateSemaphore(NULL, (LONG) _buffers.size(), (LONG) _buffers.size(), NULL);
+    }
+
+    CCopyBufferPool::~CCopyBufferPool()
+    {
+        ::CloseHandle(_hAvailable);
+        for (unsigned int iBuffer = 0; iBuffer < _buffers.size(); ++iBuffer)
+        {
+            ::VirtualFree(_buffers[iBuffer], 0, MEM_RELEASE);
+        }
+    }
+
+    // Fewer than asked for if memory ran out, but never none unless
+    // there was no memory at all.
+    DWORD get_BufferCount(void)
+    {
+        return (DWORD) _buffers.size();
+    }
+
+    DWORD get_BufferSize(void)
+    {
+        return _bufferSize;
+    }
+
+    // Waits until a buffer is free.
+    BYTE* Acquire(void)
+    {
+        ::WaitForSingleObject(_hAvailable, INFINITE);
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        return _free.RemoveHead();
+    }
+
+    // Returns NULL rather than wait.
+    BYTE* TryAcquire(void)
+    {
+        if (::WaitForSingleObject(_hAvailable, 0) != WAIT_OBJECT_0)
+        {
+            return NULL;
+        }
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        return _free.RemoveHead();
+    }
+
+    void Release(BYTE* pBuffer)
+    {
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            _free.AddHead(pBuffer);
+        }
+        ::ReleaseSemaphore(_hAvailable, 1, NULL);
+    }
+};
+
+// Copies a directory tree, typically out of a mounted snapshot from inside
+// the callback, without starting another process. Directories and files
+// are shared out between the threads through CStealingQueues, so a thread
+// that finds a big subtree shares it out. File data goes
+// through a CCopyBufferPool unless there is a cheaper way to copy it: see
+// CopyFile. A file that can't be copied is logged and counted, and the
+// rest of the tree is copied anyway.
+class CCopyEngine
+{
+private:
+    struct WorkItem
+    {
+        CString relativePath;       // Ends in a backslash for directories
+        DWORD attributes;
+        FILETIME creationTime;
+        FILETIME lastAccessTime;
+        FILETIME lastWriteTime;
+        ULONGLONG size;
+    };
+
+    // One read or write of a file being copied by CopyOverlapped.
+    struct Request
+    {
+        OVERLAPPED overlapped;
+        BYTE* pBuffer;
+        bool writing;
+        bool inFlight;          // Issued, and its completion not yet dequeued
+    };
+
+    struct Worker
+    {
+        CCopyEngine* pEngine;
+        DWORD index;
+        HANDLE hPort;           // NULL if overlapped copying isn't possible
+        ULONGLONG directoryCount;
+        ULONGLONG fileCount;
+        ULONGLONG byteCount;
+        DWORD failedCount;
+        ULONGLONG methodFileCounts[SHADOWSPAWN_COPY_METHOD_COUNT];
+        ULONGLONG methodByteCounts[SHADOWSPAWN_COPY_METHOD_COUNT];
+    };
+
+    // Below this, CopyFileEx's setup costs more than the cache it saves.
+    static const ULONGLONG UNBUFFERED_MIN_BYTES = 16 * 1024 * 1024;
+
+    // Most requests one file has in flight at once.
+    static const DWORD MAX_QUEUE_DEPTH = 8;
+
+    static const DWORD DEFAULT_BUFFER_SIZE = 1024 * 1024;
+    static const DWORD DEFAULT_BUFFERS_PER_THREAD = 2;
+
+    static const DWORD COPIED_ATTRIBUTES = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM |
+        FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED | FILE_ATTRIBUTE_TEMPORARY;
+
+    OutputWriter& _logger;
+    DWORD _flags;
+    CString _sourceRoot;
+    CString _targetRoot;
+    vector<Worker*> _workers;
+    CAutoPtr<CCopyBufferPool> _pBuffers;
+    DWORD _clusterSize;
+    volatile LONG _canClone;
+    volatile LONG _canSkipBuffering;
+
+    CAutoPtr<CStealingQueues<WorkItem> > _pQueues;
+
+    CComAutoCriticalSection _lock;
+    CAtlList<WorkItem> _directories;    // Copied, waiting for their metadata
+    HRESULT _hrFirstFailure;
+
+    volatile LONG _running;
+    HANDLE _hThreadsDone;
+
+    static DWORD WINAPI ThreadProc(LPVOID parameter)
+    {
+        Worker* pWorker = (Worker*) parameter;
+        CCopyEngine* pEngine = pWorker->pEngine;
+        pEngine->Work(*pWorker);
+        if (::InterlockedDecrement(&pEngine->_running) == 0)
+        {
+            ::SetEvent(pEngine->_hThreadsDone);
+        }
+        return 0;
+    }
+
+    static void MakeItem(const CString& relativePath, const WIN32_FIND_DATA& findData, WorkItem& item)
+    {
+        item.relativePath = relativePath;
+        item.attributes = findData.dwFileAttributes;
+        item.creationTime = findData.ftCreationTime;
+        item.lastAccessTime = findData.ftLastAccessTime;
+        item.lastWriteTime = findData.ftLastWriteTime;
+        item.size = ((ULONGLONG) findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+    }
+
+    void Work(Worker& worker)
+    {
+        WorkItem item;
+        while (_pQueues->Take(worker.index, item))
+        {
+            HRESULT hr;
+            if ((item.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+            {
+                hr = CopyDirectory(worker, item);
+            }
+            else
+            {
+                hr = CopyFile(worker, item);
+            }
+
+            if (FAILED(hr))
+            {
+                RecordFailure(worker, hr);
+            }
+            _pQueues->Finish();
+        }
+    }
+
+    void RecordFailure(Worker& worker, HRESULT hr)
+    {
+        ++worker.failedCount;
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        if (SUCCEEDED(_hrFirstFailure))
+        {
+            _hrFirstFailure = hr;
+        }
+    }
+
+    HRESULT ReportFailure(LPCTSTR operation, LPCTSTR path)
+    {
+        DWORD error = ::GetLastError();
+        CString errorMessage;
+        Utilities::FormatErrorMessage(error, errorMessage);
+        _logger.WriteFormat(VERBOSITY_THRESHOLD_UNLESS_SILENT, TEXT("Unable to copy %s: %s failed. Error: %s"),
+            path, operation, errorMessage);
+        return HRESULT_FROM_WIN32(error);
+    }
+
+    // Creates the subdirectories of item in the copy and queues them and
+    // its files.
+    HRESULT CopyDirectory(Worker& worker, const WorkItem& item)
+    {
+        CString pattern(_sourceRoot + item.relativePath);
+        pattern.AppendChar(TEXT('*'));
+
+        WIN32_FIND_DATA findData;
+        HANDLE hFind = CTreeWalker::FindFirst(pattern, findData);
+        if (hFind == INVALID_HANDLE_VALUE)
+        {
+            return ReportFailure(TEXT("FindFirstFileEx"), _sourceRoot + item.relativePath);
+        }
+
+        ++worker.directoryCount;
+        do
+        {
+            if (_tcscmp(findData.cFileName, TEXT(".")) == 0 || _tcscmp(findData.cFileName, TEXT("..")) == 0)
+            {
+                continue;
+            }
+
+            WorkItem child;
+            MakeItem(item.relativePath + findData.cFileName, findData, child);
+            if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+            {
+                _pQueues->Push(worker.index, child);
+                continue;
+            }
+
+            if ((findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+            {
+                // Following junctions could leave the tree, or loop.
+                _logger.WriteFormat(TEXT("Not following reparse point %s"), child.relativePath);
+                continue;
+            }
+
+            CString target(_targetRoot + child.relativePath);
+            if (!::CreateDirectory(target, NULL) && ::GetLastError() != ERROR_ALREADY_EXISTS)
+            {
+                RecordFailure(worker, ReportFailure(TEXT("CreateDirectory"), target));
+                continue;
+            }
+
+            child.relativePath.AppendChar(TEXT('\\'));
+            {
+                CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+                _directories.AddTail(child);
+            }
+            _pQueues->Push(worker.index, child);
+        } while (::FindNextFile(hFind, &findData));
+
+        DWORD error = ::GetLastError();
+        ::FindClose(hFind);
+        if (error != ERROR_NO_MORE_FILES)
+        {
+            ::SetLastError(error);
+            return ReportFailure(TEXT("FindNextFile"), _sourceRoot + item.relativePath);
+        }
+        return S_OK;
+    }
+
+    static LPCTSTR MethodName(ShadowSpawnCopyMethod method)
+    {
+        switch (method)
+        {
+        case SHADOWSPAWN_COPY_METHOD_CLONE:
+            return TEXT("Cloned");
+        case SHADOWSPAWN_COPY_METHOD_UNBUFFERED:
+            return TEXT("Copied unbuffered");
+        case SHADOWSPAWN_COPY_METHOD_OVERLAPPED:
+            return TEXT("Copied overlapped");
+        default:
+            return TEXT("Copied");
+        }
+    }
+
+    // Tries block cloning, then CopyFileEx without buffering for large
+    // files unless SHADOWSPAWN_COPY_CACHED is set, then overlapped copying for anything bigger than a buffer,
+    // then copying through a buffer. A method that turns out not to work on
+    // this system isn't tried again.
+    HRESULT CopyFile(Worker& worker, const WorkItem& item)
+    {
+        CString source(_sourceRoot + item.relativePath);
+        CString target(_targetRoot + item.relativePath);
+
+        if ((_flags & SHADOWSPAWN_COPY_OVERWRITE) != 0)
+        {
+            ::SetFileAttributes(target, FILE_ATTRIBUTE_NORMAL);
+        }
+
+        // S_FALSE means the method didn't apply, and left nothing behind.
+        ShadowSpawnCopyMethod method = SHADOWSPAWN_COPY_METHOD_CLONE;
+        HRESULT hr = S_FALSE;
+        if (_canClone)
+        {
+            hr = CloneFile(source, target, item);
+        }
+        if (hr == S_FALSE && _canSkipBuffering && (_flags & SHADOWSPAWN_COPY_CACHED) == 0 && item.size >= UNBUFFERED_MIN_BYTES)
+        {
+            method = SHADOWSPAWN_COPY_METHOD_UNBUFFERED;
+            hr = CopyUnbuffered(source, target, item);
+        }
+        if (hr == S_FALSE && worker.hPort != NULL && item.size > _pBuffers->get_BufferSize())
+        {
+            method = SHADOWSPAWN_COPY_METHOD_OVERLAPPED;
+            hr = CopyOverlapped(worker, source, target, item);
+        }
+        if (hr == S_FALSE)
+        {
+            method = SHADOWSPAWN_COPY_METHOD_BUFFERED;
+            hr = CopyBuffered(source, target, item);
+        }
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        CopyMetadata(source, target, item);
+        ++worker.fileCount;
+        worker.byteCount += item.size;
+        ++worker.methodFileCounts[method];
+        worker.methodByteCounts[method] += item.size;
+        _logger.WriteFormat(TEXT("%s %s"), MethodName(method), item.relativePath);
+        _logger.WriteEvent(SHADOWSPAWN_EVENT_FILE_COPIED, SHADOWSPAWN_PHASE_COPY, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE,
+            S_OK, method, item.relativePath);
+        return S_OK;
+    }
+
+    HANDLE OpenSource(LPCTSTR source)
+    {
+        return ::CreateFile(source, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    }
+
+    HANDLE CreateTarget(LPCTSTR target)
+    {
+        bool overwrite = (_flags & SHADOWSPAWN_COPY_OVERWRITE) != 0;
+        return ::CreateFile(target, GENERIC_READ | GENERIC_WRITE, 0, NULL, overwrite ? CREATE_ALWAYS : CREATE_NEW,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    }
+
+    void SetTimes(HANDLE hTarget, const WorkItem& item)
+    {
+        if ((_flags & SHADOWSPAWN_COPY_TIMESTAMPS) != 0)
+        {
+            ::SetFileTime(hTarget, &item.creationTime, &item.lastAccessTime, &item.lastWriteTime);
+        }
+    }
+
+    HRESULT CloneFile(LPCTSTR source, LPCTSTR target, const WorkItem& item)
+    {
+        HANDLE hSource = OpenSource(source);
+        if (hSource == INVALID_HANDLE_VALUE)
+        {
+            return ReportFailure(TEXT("CreateFile"), source);
+        }
+
+        HANDLE hTarget = CreateTarget(target);
+        if (hTarget == INVALID_HANDLE_VALUE)
+        {
+            HRESULT hr = ReportFailure(TEXT("CreateFile"), target);
+            ::CloseHandle(hSource);
+            return hr;
+        }
+
+        DWORD error = CBlockClone::CloneData(hSource, hTarget, item.size, (item.attributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0,
+            _clusterSize);
+        if (error == ERROR_SUCCESS)
+        {
+            SetTimes(hTarget, item);
+        }
+        ::CloseHandle(hTarget);
+        ::CloseHandle(hSource);
+
+        if (error == ERROR_SUCCESS)
+        {
+            return S_OK;
+        }
+
+        if (CBlockClone::IsUnsupported(error) && ::InterlockedExchange(&_canClone, FALSE))
+        {
+            _logger.WriteLine(TEXT("Block cloning isn't supported here after all."));
+        }
+        ::DeleteFile(target);
+        return S_FALSE;
+    }
+
+    HRESULT CopyUnbuffered(LPCTSTR source, LPCTSTR target, const WorkItem& item)
+    {
+        DWORD copyFlags = COPY_FILE_NO_BUFFERING;
+        if ((_flags & SHADOWSPAWN_COPY_OVERWRITE) == 0)
+        {
+            copyFlags |= COPY_FILE_FAIL_IF_EXISTS;
+        }
+
+        if (!::CopyFileEx(source, target, NULL, NULL, NULL, copyFlags))
+        {
+            // Other threads may have tried before the first of them found
+            // out, so each falls back, and only the first says why.
+            if (::GetLastError() == ERROR_INVALID_PARAMETER)
+            {
+                if (::InterlockedExchange(&_canSkipBuffering, FALSE))
+                {
+                    _logger.WriteLine(TEXT("CopyFileEx can't bypass the file cache on this system."));
+                }
+                return S_FALSE;
+            }
+            return ReportFailure(TEXT("CopyFileEx"), source);
+        }
+
+        // CopyFileEx brings the attributes and last write time along by
+        // itself, so only the rest needs doing.
+        if ((_flags & SHADOWSPAWN_COPY_ATTRIBUTES) == 0 && (item.attributes & COPIED_ATTRIBUTES) != 0)
+        {
+            ::SetFileAttributes(target, FILE_ATTRIBUTE_NORMAL);
+        }
+        if ((_flags & SHADOWSPAWN_COPY_TIMESTAMPS) != 0)
+        {
+            HANDLE hTarget = ::CreateFile(target, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                NULL, OPEN_EXISTING, 0, NULL);
+            if (hTarget != INVALID_HANDLE_VALUE)
+            {
+                SetTimes(hTarget, item);
+                ::CloseHandle(hTarget);
+            }
+        }
+        return S_OK;
+    }
+
+    static void SetOffset(Request& request, ULONGLONG offset, bool writing)
+    {
+        ::ZeroMemory(&request.overlapped, sizeof(request.overlapped));
+        request.overlapped.Offset = (DWORD) offset;
+        request.overlapped.OffsetHigh = (DWORD) (offset >> 32);
+        request.writing = writing;
+    }
+
+    // Waits, without the completion port, until every request still in
+    // flight has finished, cancelled or not.
+    static void WaitForRequests(Request* requests, DWORD requestCount)
+    {
+        for (DWORD iRequest = 0; iRequest < requestCount; ++iRequest)
+        {
+            while (requests[iRequest].inFlight && !HasOverlappedIoCompleted(&requests[iRequest].overlapped))
+            {
+                ::Sleep(1);
+            }
+            requests[iRequest].inFlight = false;
+        }
+    }
+
+    static ULONGLONG GetOffset(const Request& request)
+    {
+        return ((ULONGLONG) request.overlapped.OffsetHigh << 32) | request.overlapped.Offset;
+    }
+
+    // Returns S_FALSE if the read found the end of the file straight away,
+    // in which case no completion will arrive for it.
+    HRESULT StartRead(HANDLE hSource, LPCTSTR source, Request& request, ULONGLONG& nextOffset)
+    {
+        SetOffset(request, nextOffset, false);
+        nextOffset += _pBuffers->get_BufferSize();
+
+        if (!::ReadFile(hSource, request.pBuffer, _pBuffers->get_BufferSize(), NULL, &request.overlapped))
+        {
+            DWORD error = ::GetLastError();
+            if (error == ERROR_HANDLE_EOF)
+            {
+                return S_FALSE;
+            }
+            if (error != ERROR_IO_PENDING)
+            {
+                return ReportFailure(TEXT("ReadFile"), source);
+            }
+        }
+        return S_OK;
+    }
+
+    // Copies a file through the worker's completion port with up to
+    // MAX_QUEUE_DEPTH requests in flight, each reading a buffer's worth and
+    // then writing it, so the file's reads overlap its writes and the disk
+    // sees a deeper queue. Uses as many buffers as are free at the start,
+    // and at least one, so the depth shrinks while the pool is busy.
+    HRESULT CopyOverlapped(Worker& worker, LPCTSTR source, LPCTSTR target, const WorkItem& item)
+    {
+        HANDLE hSource = ::CreateFile(source, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        if (hSource == INVALID_HANDLE_VALUE)
+        {
+            return ReportFailure(TEXT("CreateFile"), source);
+        }
+
+        bool overwrite = (_flags & SHADOWSPAWN_COPY_OVERWRITE) != 0;
+        HANDLE hTarget = ::CreateFile(target, GENERIC_READ | GENERIC_WRITE, 0, NULL, overwrite ? CREATE_ALWAYS : CREATE_NEW,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, NULL);
+        if (hTarget == INVALID_HANDLE_VALUE)
+        {
+            HRESULT hr = ReportFailure(TEXT("CreateFile"), target);
+            ::CloseHandle(hSource);
+            return hr;
+        }
+
+        if (::CreateIoCompletionPort(hSource, worker.hPort, 0, 0) == NULL ||
+            ::CreateIoCompletionPort(hTarget, worker.hPort, 0, 0) == NULL)
+        {
+            ::CloseHandle(hTarget);
+            ::CloseHandle(hSource);
+            ::DeleteFile(target);
+            return S_FALSE;
+        }
+
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG) item.size;
+        ::SetFilePointerEx(hTarget, end, NULL, FILE_BEGIN);
+        ::SetEndOfFile(hTarget);
+
+        ULONGLONG chunkCount = (item.size + _pBuffers->get_BufferSize() - 1) / _pBuffers->get_BufferSize();
+        DWORD depth = (DWORD) min((ULONGLONG) MAX_QUEUE_DEPTH, chunkCount);
+        Request requests[MAX_QUEUE_DEPTH];
+        for (DWORD iRequest = 0; iRequest < MAX_QUEUE_DEPTH; ++iRequest)
+        {
+            requests[iRequest].inFlight = false;
+        }
+        DWORD requestCount = 0;
+        requests[requestCount++].pBuffer = _pBuffers->Acquire();
+        while (requestCount < depth && (requests[requestCount].pBuffer = _pBuffers->TryAcquire()) != NULL)
+        {
+            ++requestCount;
+        }
+
+        HRESULT hr = S_OK;
+        ULONGLONG nextOffset = 0;
+        ULONGLONG endWritten = 0;
+        DWORD pending = 0;
+        for (DWORD iRequest = 0; iRequest < requestCount && hr == S_OK; ++iRequest)
+        {
+            hr = StartRead(hSource, source, requests[iRequest], nextOffset);
+            if (hr == S_OK)
+            {
+                requests[iRequest].inFlight = true;
+                ++pending;
+            }
+        }
+        if (hr == S_FALSE)
+        {
+            hr = S_OK;
+        }
+
+        // After a failure, this only waits for what is already in flight.
+        // Nothing may be left in flight when the loop ends: the requests
+        // live on this stack frame, their buffers go back to the pool, and
+        // a stray completion would turn up while the worker's port is
+        // copying its next file.
+        bool cancelled = false;
+        while (pending > 0)
+        {
+            DWORD transferred;
+            ULONG_PTR key;
+            LPOVERLAPPED pOverlapped;
+            BOOL bWorked = ::GetQueuedCompletionStatus(worker.hPort, &transferred, &key, &pOverlapped, INFINITE);
+            if (pOverlapped == NULL)
+            {
+                // Nothing was dequeued. Cancel what is in flight and go on
+                // dequeuing until it has all come back.
+                HRESULT hrPort = ReportFailure(TEXT("GetQueuedCompletionStatus"), source);
+                hr = FAILED(hr) ? hr : hrPort;
+                if (!cancelled)
+                {
+                    ::CancelIo(hSource);
+                    ::CancelIo(hTarget);
+                    cancelled = true;
+                    continue;
+                }
+
+                // An infinite wait failing twice means the port itself is
+                // gone, and with it any completions still to come, so wait
+                // on the requests instead.
+                WaitForRequests(requests, requestCount);
+                pending = 0;
+                break;
+            }
+
+            --pending;
+            Request& request = *CONTAINING_RECORD(pOverlapped, Request, overlapped);
+            request.inFlight = false;
+            if (!bWorked)
+            {
+                if (!request.writing && ::GetLastError() == ERROR_HANDLE_EOF)
+                {
+                    transferred = 0;
+                }
+                else
+                {
+                    HRESULT hrRequest = request.writing ? ReportFailure(TEXT("WriteFile"), target) : ReportFailure(TEXT("ReadFile"), source);
+                    hr = FAILED(hr) ? hr : hrRequest;
+                    continue;
+                }
+            }
+
+            if (FAILED(hr))
+            {
+                continue;
+            }
+
+            if (request.writing)
+            {
+                HRESULT hrRead = StartRead(hSource, source, request, nextOffset);
+                if (hrRead == S_OK)
+                {
+                    request.inFlight = true;
+                    ++pending;
+                }
+                else if (FAILED(hrRead))
+                {
+                    hr = hrRead;
+                }
+                continue;
+            }
+
+            // A read at the end of the file retires its request.
+            if (transferred == 0)
+            {
+                continue;
+            }
+
+            ULONGLONG offset = GetOffset(request);
+            endWritten = max(endWritten, offset + transferred);
+            SetOffset(request, offset, true);
+            if (!::WriteFile(hTarget, request.pBuffer, transferred, NULL, &request.overlapped) &&
+                ::GetLastError() != ERROR_IO_PENDING)
+            {
+                hr = ReportFailure(TEXT("WriteFile"), target);
+                continue;
+            }
+            request.inFlight = true;
+            ++pending;
+        }
+
+        for (DWORD iRequest = 0; iRequest < requestCount; ++iRequest)
+        {
+            _pBuffers->Release(requests[iRequest].pBuffer);
+        }
+
+        // The file may have shrunk since it was listed.
+        if (SUCCEEDED(hr))
+        {
+            end.QuadPart = (LONGLONG) endWritten;
+            if (!::SetFilePointerEx(hTarget, end, NULL, FILE_BEGIN) || !::SetEndOfFile(hTarget))
+            {
+                hr = ReportFailure(TEXT("SetEndOfFile"), target);
+            }
+        }
+        if (SUCCEEDED(hr))
+        {
+            SetTimes(hTarget, item);
+        }
+
+        ::CloseHandle(hTarget);
+        ::CloseHandle(hSource);
+
+        if (FAILED(hr))
+        {
+            ::DeleteFile(target);
+        }
+        return hr;
+    }
+
+    HRESULT CopyBuffered(LPCTSTR source, LPCTSTR target, const WorkItem& item)
+    {
+        HANDLE hSource = OpenSource(source);
+        if (hSource == INVALID_HANDLE_VALUE)
+        {
+            return ReportFailure(TEXT("CreateFile"), source);
+        }
+
+        HANDLE hTarget = CreateTarget(target);
+        if (hTarget == INVALID_HANDLE_VALUE)
+        {
+            HRESULT hr = ReportFailure(TEXT("CreateFile"), target);
+            ::CloseHandle(hSource);
+            return hr;
+        }
+
+        HRESULT hr = CopyData(hSource, hTarget, item.size, source, target);
+        if (SUCCEEDED(hr))
+        {
+            SetTimes(hTarget, item);
+        }
+
+        ::CloseHandle(hTarget);
+        ::CloseHandle(hSource);
+
+        if (FAILED(hr))
+        {
+            ::DeleteFile(target);
+        }
+        return hr;
+    }
+
+    HRESULT CopyData(HANDLE hSource, HANDLE hTarget, ULONGLONG size, LPCTSTR source, LPCTSTR target)
+    {
+        // Setting the size up front lets the file system allocate the file
+        // in one piece.
+        LARGE_INTEGER end;
+        LARGE_INTEGER start;
+        end.QuadPart = (LONGLONG) size;
+        start.QuadPart = 0;
+        if (size > 0)
+        {
+            ::SetFilePointerEx(hTarget, end, NULL, FILE_BEGIN);
+            ::SetEndOfFile(hTarget);
+            ::SetFilePointerEx(hTarget, start, NULL, FILE_BEGIN);
+        }
+
+        BYTE* pBuffer = _pBuffers->Acquire();
+        HRESULT hr = S_OK;
+        for (;;)
+        {
+            DWORD read;
+            if (!::ReadFile(hSource, pBuffer, _pBuffers->get_BufferSize(), &read, NULL))
+            {
+                hr = ReportFailure(TEXT("ReadFile"), source);
+                break;
+            }
+            if (read == 0)
+            {
+                break;
+            }
+
+            DWORD written;
+            if (!::WriteFile(hTarget, pBuffer, read, &written, NULL))
+            {
+                hr = ReportFailure(TEXT("WriteFile"), target);
+                break;
+            }
+        }
+        _pBuffers->Release(pBuffer);
+
+        // The file may have shrunk since it was listed.
+        if (SUCCEEDED(hr) && !::SetEndOfFile(hTarget))
+        {
+            hr = ReportFailure(TEXT("SetEndOfFile"), target);
+        }
+        return hr;
+    }
+
+    // Attributes and security, which have to be set after the data. Failures
+    // are only logged: the data did get copied.
+    void CopyMetadata(LPCTSTR source, LPCTSTR target, const WorkItem& item)
+    {
+        if ((_flags & SHADOWSPAWN_COPY_SECURITY) != 0)
+        {
+            DWORD length = 0;
+            ::GetFileSecurity(source, DACL_SECURITY_INFORMATION, NULL, 0, &length);
+            vector<BYTE> descriptor(length > 0 ? length : 1);
+            if (length == 0 ||
+                !::GetFileSecurity(source, DACL_SECURITY_INFORMATION, &descriptor[0], length, &length) ||
+                !::SetFileSecurity(target, DACL_SECURITY_INFORMATION, &descriptor[0]))
+            {
+                _logger.WriteFormat(TEXT("Unable to copy the security of %s"), source);
+            }
+        }
+
+        if ((_flags & SHADOWSPAWN_COPY_ATTRIBUTES) != 0 && (item.attributes & COPIED_ATTRIBUTES) != 0)
+        {
+            if (!::SetFileAttributes(target, item.attributes & COPIED_ATTRIBUTES))
+            {
+                _logger.WriteFormat(TEXT("Unable to copy the attributes of %s"), source);
+            }
+        }
+    }
+
+    // Done last, since copying into a directory changes its times.
+    void CopyDirectoryMetadata(void)
+    {
+        POSITION position = _directories.GetHeadPosition();
+        while (position != NULL)
+        {
+            const WorkItem& directory = _directories.GetNext(position);
+            CString source(_sourceRoot + directory.relativePath);
+            CString target(_targetRoot + directory.relativePath);
+
+            if ((_flags & SHADOWSPAWN_COPY_TIMESTAMPS) != 0)
+            {
+                HANDLE hTarget = ::CreateFile(target, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                    NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+                if (hTarget != INVALID_HANDLE_VALUE)
+                {
+                    SetTimes(hTarget, directory);
+                    ::CloseHandle(hTarget);
+                }
+            }
+
+            CopyMetadata(source, target, directory);
+        }
+    }
+
+public:
+    // threadCount, bufferCount and bufferSize may be zero for the defaults:
+    // a thread per processor, two buffers per thread, and 1 MB buffers.
+    CCopyEngine::CCopyEngine(DWORD threadCount, DWORD bufferCount, DWORD bufferSize, DWORD flags, OutputWriter& logger) :
+        _logger(logger)
+    {
+        if (threadCount == 0)
+        {
+            SYSTEM_INFO systemInfo;
+            ::GetSystemInfo(&systemInfo);
+            threadCount = systemInfo.dwNumberOfProcessors;
+        }
+        if (bufferCount == 0)
+        {
+            bufferCount = threadCount * DEFAULT_BUFFERS_PER_THREAD;
+        }
+        if (bufferSize == 0)
+        {
+            bufferSize = DEFAULT_BUFFER_SIZE;
+        }
+
+        _flags = flags;
+        for (DWORD iWorker = 0; iWorker < threadCount; ++iWorker)
+        {
+            Worker* pWorker = new Worker();
+            pWorker->pEngine = this;
+            pWorker->index = iWorker;
+            pWorker->hPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+            pWorker->directoryCount = 0;
+            pWorker->fileCount = 0;
+            pWorker->byteCount = 0;
+            pWorker->failedCount = 0;
+            ::ZeroMemory(pWorker->methodFileCounts, sizeof(pWorker->methodFileCounts));
+            ::ZeroMemory(pWorker->methodByteCounts, sizeof(pWorker->methodByteCounts));
+            _workers.push_back(pWorker);
+        }
+        _pBuffers.Attach(new CCopyBufferPool(bufferCount, bufferSize));
+        _clusterSize = 0;
+        _canClone = FALSE;
+        _canSkipBuffering = TRUE;
+
+        _pQueues.Attach(new CStealingQueues<WorkItem>(threadCount));
+        _hrFirstFailure = S_OK;
+        _running = 0;
+        _hThreadsDone = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
+
+    CCopyEngine::~CCopyEngine()
+    {
+        for (unsigned int iWorker = 0; iWorker < _workers.size(); ++iWorker)
+        {
+            if (_workers[iWorker]->hPort != NULL)
+            {
+                ::CloseHandle(_workers[iWorker]->hPort);
+            }
+            delete _workers[iWorker];
+        }
+        ::CloseHandle(_hThreadsDone);
+    }
+
+    // Copies everything below source into target, creating target if
+    // need be. Returns the first failure once everything else is copied.
+    HRESULT Copy(LPCTSTR source, LPCTSTR target)
+    {
+        if (_pBuffers->get_BufferCount() == 0)
+        {
+            throw new CShadowSpawnException(E_OUTOFMEMORY, TEXT("Unable to allocate any copy buffers."));
+        }
+
+        if (!Utilities::DirectoryExists(target))
+        {
+            Utilities::CreateDirectory(target);
+        }
+
+        _sourceRoot = source;
+        _targetRoot = target;
+        if (_sourceRoot.Right(1) != TEXT("\\"))
+        {
+            _sourceRoot.AppendChar(TEXT('\\'));
+        }
+        if (_targetRoot.Right(1) != TEXT("\\"))
+        {
+            _targetRoot.AppendChar(TEXT('\\'));
+        }
+        _clusterSize = CBlockClone::GetClusterSize(_sourceRoot, _targetRoot, _logger);
+        _canClone = (_clusterSize != 0);
+        Utilities::FixLongFilenames(_sourceRoot);
+        Utilities::FixLongFilenames(_targetRoot);
+
+        WorkItem root;
+        root.attributes = FILE_ATTRIBUTE_DIRECTORY;
+        root.size = 0;
+        _pQueues->Push(0, root);
+
+        // This thread is the first worker, rather than just waiting.
+        _running = (LONG) _workers.size();
+        for (unsigned int iWorker = 1; iWorker < _workers.size(); ++iWorker)
+        {
+            if (!::QueueUserWorkItem(ThreadProc, _workers[iWorker], WT_EXECUTELONGFUNCTION))
+            {
+                ::InterlockedDecrement(&_running);
+            }
+        }
+        ThreadProc(_workers[0]);
+        ::WaitForSingleObject(_hThreadsDone, INFINITE);
+
+        CopyDirectoryMetadata();
+
+        ShadowSpawnCopyStats stats;
+        GetStats(stats);
+        _logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Copied %I64u directories and %I64u files (%I64u bytes); %d failed."),
+            stats.directoryCount, stats.fileCount, stats.byteCount, stats.failedCount);
+        _logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("%I64u files cloned, %I64u copied unbuffered, %I64u overlapped, %I64u through a single buffer."),
+            stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_CLONE], stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_UNBUFFERED],
+            stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_OVERLAPPED], stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_BUFFERED]);
+        return _hrFirstFailure;
+    }
+
+    void GetStats(ShadowSpawnCopyStats& stats)
+    {
+        ::ZeroMemory(&stats, sizeof(stats));
+        for (unsigned int iWorker = 0; iWorker < _workers.size(); ++iWorker)
+        {
+            stats.directoryCount += _workers[iWorker]->directoryCount;
+            stats.fileCount += _workers[iWorker]->fileCount;
+            stats.byteCount += _workers[iWorker]->byteCount;
+            stats.failedCount += _workers[iWorker]->failedCount;
+            for (int iMethod = 0; iMethod < SHADOWSPAWN_COPY_METHOD_COUNT; ++iMethod)
+            {
+                stats.methodFileCounts[iMethod] += _workers[iWorker]->methodFileCounts[iMethod];
+                stats.methodByteCounts[iMethod] += _workers[iWorker]->methodByteCounts[iMethod];
+            }
+        }
+    }
+};
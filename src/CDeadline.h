@@ -0,0 +1,266 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CShadowSpawnException.h"
+
+using namespace std;
+
+// Lets a caller on another thread stop a ShadowSpawn call. Reference
+// counted, since the caller's handle and any calls using it may let go in
+// either order.
+class CCancellation
+{
+private:
+    LONG _refCount;
+    HANDLE _hCancelled;
+
+public:
+    CCancellation::CCancellation()
+    {
+        _refCount = 1;
+        _hCancelled = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
+
+    CCancellation::~CCancellation()
+    {
+        ::CloseHandle(_hCancelled);
+    }
+
+    void AddRef(void)
+    {
+        ::InterlockedIncrement(&_refCount);
+    }
+
+    void Release(void)
+    {
+        if (::InterlockedDecrement(&_refCount) == 0)
+        {
+            delete this;
+        }
+    }
+
+    void Cancel(void)
+    {
+        ::SetEvent(_hCancelled);
+    }
+
+    bool get_IsCancelled(void)
+    {
+        return ::WaitForSingleObject(_hCancelled, 0) == WAIT_OBJECT_0;
+    }
+
+    HANDLE get_CancelledEvent(void)
+    {
+        return _hCancelled;
+    }
+};
+
+// The time budget and cancellation for one call, which every phase waits
+// within. A default-constructed deadline never expires and can't be
+// cancelled. Tick counts wrap after 49 days, so budgets must be shorter.
+// The clock can be paused for time the budget doesn't cover, such as the
+// host's callback.
+class CDeadline
+{
+private:
+    DWORD _startTicks;
+    DWORD _timeoutMs;
+    DWORD _spentMs;
+    bool _isPaused;
+    CCancellation* _pCancellation;
+
+public:
+    CDeadline::CDeadline()
+    {
+        _startTicks = ::GetTickCount();
+        _timeoutMs = INFINITE;
+        _spentMs = 0;
+        _isPaused = false;
+        _pCancellation = NULL;
+    }
+
+    // timeoutMs may be INFINITE and pCancellation NULL.
+    CDeadline::CDeadline(DWORD timeoutMs, CCancellation* pCancellation)
+    {
+        _startTicks = ::GetTickCount();
+        _timeoutMs = timeoutMs;
+        _spentMs = 0;
+        _isPaused = false;
+        _pCancellation = pCancellation;
+        if (_pCancellation != NULL)
+        {
+            _pCancellation->AddRef();
+        }
+    }
+
+    CDeadline::CDeadline(const CDeadline& other)
+    {
+        _startTicks = other._startTicks;
+        _timeoutMs = other._timeoutMs;
+        _spentMs = other._spentMs;
+        _isPaused = other._isPaused;
+        _pCancellation = other._pCancellation;
+        if (_pCancellation != NULL)
+        {
+            _pCancellation->AddRef();
+        }
+    }
+
+    CDeadline::~CDeadline()
+    {
+        if (_pCancellation != NULL)
+        {
+            _pCancellation->Release();
+        }
+    }
+
+    CDeadline& operator=(const CDeadline& other)
+    {
+        if (other._pCancellation != NULL)
+        {
+            other._pCancellation->AddRef();
+        }
+        if (_pCancellation != NULL)
+        {
+            _pCancellation->Release();
+        }
+        _startTicks = other._startTicks;
+        _timeoutMs = other._timeoutMs;
+        _spentMs = other._spentMs;
+        _isPaused = other._isPaused;
+        _pCancellation = other._pCancellation;
+        return *this;
+    }
+
+    // True if waiting within this deadline is the same as waiting forever.
+    bool get_IsUnbounded(void)
+    {
+        return _timeoutMs == INFINITE && _pCancellation == NULL;
+    }
+
+    // Milliseconds left on the budget, or INFINITE if there is no limit.
+    DWORD get_RemainingMs(void)
+    {
+        if (_timeoutMs == INFINITE)
+        {
+            return INFINITE;
+        }
+
+        DWORD elapsed = get_ElapsedMs();
+        return elapsed >= _timeoutMs ? 0 : _timeoutMs - elapsed;
+    }
+
+    // Time counted against the budget so far.
+    DWORD get_ElapsedMs(void)
+    {
+        return _isPaused ? _spentMs : _spentMs + (::GetTickCount() - _startTicks);
+    }
+
+    // Stops the clock until Resume. Cancellation still applies.
+    void Pause(void)
+    {
+        if (!_isPaused)
+        {
+            _spentMs = get_ElapsedMs();
+            _isPaused = true;
+        }
+    }
+
+    void Resume(void)
+    {
+        if (_isPaused)
+        {
+            _startTicks = ::GetTickCount();
+            _isPaused = false;
+        }
+    }
+
+    bool get_IsCancelled(void)
+    {
+        return _pCancellation != NULL && _pCancellation->get_IsCancelled();
+    }
+
+    bool get_IsOver(void)
+    {
+        return get_IsCancelled() || get_RemainingMs() == 0;
+    }
+
+    // Throws E_ABORT if the call has been cancelled, or
+    // HRESULT_FROM_WIN32(ERROR_TIMEOUT) if it has run out of time.
+    void Check(LPCTSTR operation)
+    {
+        CString message;
+        if (get_IsCancelled())
+        {
+            message.AppendFormat(TEXT("%s was cancelled."), operation);
+            throw new CShadowSpawnException(E_ABORT, message);
+        }
+
+        if (get_RemainingMs() == 0)
+        {
+            message.AppendFormat(TEXT("%s did not finish within %d ms."), operation, _timeoutMs);
+            throw new CShadowSpawnException(HRESULT_FROM_WIN32(ERROR_TIMEOUT), message);
+        }
+    }
+
+    // Sleeps for up to intervalMs, waking early if the deadline passes or
+    // the call is cancelled.
+    void Wait(DWORD intervalMs)
+    {
+        DWORD remaining = get_RemainingMs();
+        if (remaining < intervalMs)
+        {
+            intervalMs = remaining;
+        }
+
+        if (_pCancellation != NULL)
+        {
+            ::WaitForSingleObject(_pCancellation->get_CancelledEvent(), intervalMs);
+        }
+        else
+        {
+            ::Sleep(intervalMs);
+        }
+    }
+
+    // Waits up to intervalMs for hEvent, giving up early if the deadline
+    // passes or the call is cancelled. Returns true if hEvent was set.
+    bool WaitFor(HANDLE hEvent, DWORD intervalMs)
+    {
+        DWORD remaining = get_RemainingMs();
+        if (remaining < intervalMs)
+        {
+            intervalMs = remaining;
+        }
+
+        if (_pCancellation != NULL)
+        {
+            HANDLE handles[] = { hEvent, _pCancellation->get_CancelledEvent() };
+            return ::WaitForMultipleObjects(_countof(handles), handles, FALSE, intervalMs) == WAIT_OBJECT_0;
+        }
+
+        return ::WaitForSingleObject(hEvent, intervalMs) == WAIT_OBJECT_0;
+    }
+};
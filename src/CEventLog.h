@@ -0,0 +1,290 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "Exports.h"
+
+using namespace std;
+
+// Collects ShadowSpawnEventRecords in a fixed buffer and hands them to the
+// host's ShadowSpawnEventCallback in batches, when the buffer fills or on
+// Flush. Writing an event is a copy into the buffer: nothing is formatted
+// until someone decodes the records, see Format. A full buffer is swapped
+// for a spare one and handed over outside the lock, so threads writing
+// events never wait for the callback of another.
+class CEventLog
+{
+private:
+    static const DWORD BUFFER_SIZE = 64 * 1024;
+    static const size_t MAX_TEXT_LENGTH = 1024;
+
+    struct Batch
+    {
+        BYTE* buffer;
+        DWORD used;
+    };
+
+    // Guards the buffers. Never held while calling the callback.
+    CComAutoCriticalSection _lock;
+    BYTE* _buffer;
+    DWORD _used;
+    CAtlList<Batch> _full;
+    CAtlList<BYTE*> _spare;
+
+    // Held while calling the callback, so batches arrive one at a time and
+    // in the order they filled.
+    CComAutoCriticalSection _deliveryLock;
+    ShadowSpawnEventCallback* _callback;
+    void* _context;
+
+    // Queues the current buffer for delivery and starts a new one. Called
+    // with _lock held.
+    void SwapLocked(void)
+    {
+        if (_used == 0)
+        {
+            return;
+        }
+
+        Batch batch;
+        batch.buffer = _buffer;
+        batch.used = _used;
+        _full.AddTail(batch);
+
+        _buffer = _spare.IsEmpty() ? new BYTE[BUFFER_SIZE] : _spare.RemoveHead();
+        _used = 0;
+    }
+
+    // Hands every queued batch to the callback. Called without _lock.
+    void Deliver(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> deliveryLock(_deliveryLock);
+        while (true)
+        {
+            Batch batch;
+            {
+                CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+                if (_full.IsEmpty())
+                {
+                    return;
+                }
+                batch = _full.RemoveHead();
+            }
+
+            _callback(batch.buffer, batch.used, _context);
+
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            _spare.AddTail(batch.buffer);
+        }
+    }
+
+    static LPCTSTR EventName(DWORD eventId)
+    {
+        switch (eventId)
+        {
+        case SHADOWSPAWN_EVENT_PHASE_FINISHED:
+            return TEXT("PhaseFinished");
+        case SHADOWSPAWN_EVENT_WRITER:
+            return TEXT("Writer");
+        case SHADOWSPAWN_EVENT_COMPONENT_ADDED:
+            return TEXT("ComponentAdded");
+        case SHADOWSPAWN_EVENT_COMPONENT_SKIPPED:
+            return TEXT("ComponentSkipped");
+        case SHADOWSPAWN_EVENT_VOLUME_ADDED:
+            return TEXT("VolumeAdded");
+        case SHADOWSPAWN_EVENT_SNAPSHOT_MOUNTED:
+            return TEXT("SnapshotMounted");
+        case SHADOWSPAWN_EVENT_ERROR:
+            return TEXT("Error");
+        case SHADOWSPAWN_EVENT_FILE_COPIED:
+            return TEXT("FileCopied");
+        default:
+            return TEXT("Unknown");
+        }
+    }
+
+    static LPCTSTR PhaseName(DWORD phase)
+    {
+        switch (phase)
+        {
+        case SHADOWSPAWN_PHASE_PROVIDER_DISCOVERY:
+            return TEXT("ProviderDiscovery");
+        case SHADOWSPAWN_PHASE_GATHER_WRITER_METADATA:
+            return TEXT("GatherWriterMetadata");
+        case SHADOWSPAWN_PHASE_ADD_COMPONENTS:
+            return TEXT("AddComponents");
+        case SHADOWSPAWN_PHASE_PREPARE_FOR_BACKUP:
+            return TEXT("PrepareForBackup");
+        case SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET:
+            return TEXT("DoSnapshotSet");
+        case SHADOWSPAWN_PHASE_MOUNT:
+            return TEXT("Mount");
+        case SHADOWSPAWN_PHASE_CALLBACK:
+            return TEXT("Callback");
+        case SHADOWSPAWN_PHASE_UNMOUNT:
+            return TEXT("Unmount");
+        case SHADOWSPAWN_PHASE_BACKUP_COMPLETE:
+            return TEXT("BackupComplete");
+        case SHADOWSPAWN_PHASE_DELETE_SNAPSHOTS:
+            return TEXT("DeleteSnapshots");
+        case SHADOWSPAWN_PHASE_ADMISSION:
+            return TEXT("Admission");
+        case SHADOWSPAWN_PHASE_CLONE:
+            return TEXT("Clone");
+        case SHADOWSPAWN_PHASE_COPY:
+            return TEXT("Copy");
+        case SHADOWSPAWN_PHASE_WALK:
+            return TEXT("Walk");
+        case SHADOWSPAWN_PHASE_DELETE_CLONE:
+            return TEXT("DeleteClone");
+        default:
+            return TEXT("-");
+        }
+    }
+
+    static void AppendIndex(LPCTSTR label, DWORD index, CString& output)
+    {
+        if (index == SHADOWSPAWN_EVENT_NONE)
+        {
+            output.AppendFormat(TEXT(" %s=-"), label);
+        }
+        else
+        {
+            output.AppendFormat(TEXT(" %s=%u"), label, index);
+        }
+    }
+
+public:
+    CEventLog::CEventLog(ShadowSpawnEventCallback* callback, void* context)
+    {
+        _buffer = new BYTE[BUFFER_SIZE];
+        _used = 0;
+        _callback = callback;
+        _context = context;
+    }
+
+    CEventLog::~CEventLog()
+    {
+        Flush();
+        delete [] _buffer;
+        while (!_spare.IsEmpty())
+        {
+            delete [] _spare.RemoveHead();
+        }
+    }
+
+    void Write(ShadowSpawnEventId eventId, DWORD phase, DWORD writerIndex, DWORD componentIndex, HRESULT hr, DWORD value, LPCTSTR text)
+    {
+        size_t textLength = (text == NULL) ? 0 : _tcslen(text);
+        if (textLength > MAX_TEXT_LENGTH)
+        {
+            textLength = MAX_TEXT_LENGTH;
+        }
+        DWORD textSize = (DWORD) (textLength * sizeof(TCHAR));
+        DWORD size = (sizeof(ShadowSpawnEventRecord) + textSize + 7) & ~7;
+
+        ShadowSpawnEventRecord record;
+        record.size = (WORD) size;
+        record.eventId = (WORD) eventId;
+        record.phase = phase;
+        ::GetSystemTimeAsFileTime((LPFILETIME) &record.timestamp);
+        record.writerIndex = writerIndex;
+        record.componentIndex = componentIndex;
+        record.hr = hr;
+        record.value = value;
+
+        bool swapped = false;
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            if (_used + size > BUFFER_SIZE)
+            {
+                SwapLocked();
+                swapped = true;
+            }
+
+            BYTE* pRecord = _buffer + _used;
+            ::CopyMemory(pRecord, &record, sizeof(record));
+            ::CopyMemory(pRecord + sizeof(record), text, textSize);
+            ::ZeroMemory(pRecord + sizeof(record) + textSize, size - sizeof(record) - textSize);
+            _used += size;
+        }
+
+        // Only the thread that filled the buffer waits for the callback,
+        // so there are never more full buffers than threads writing.
+        if (swapped)
+        {
+            Deliver();
+        }
+    }
+
+    void Flush(void)
+    {
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            SwapLocked();
+        }
+        Deliver();
+    }
+
+    // Turns the record at records into one line of text. Returns the size
+    // of the record, or zero if what's there isn't a whole record.
+    static DWORD Format(const BYTE* records, DWORD length, CString& output)
+    {
+        ShadowSpawnEventRecord record;
+        if (length < sizeof(record))
+        {
+            return 0;
+        }
+        ::CopyMemory(&record, records, sizeof(record));
+        if (record.size < sizeof(record) || record.size > length)
+        {
+            return 0;
+        }
+
+        SYSTEMTIME utcTime;
+        ::FileTimeToSystemTime((const FILETIME*) &record.timestamp, &utcTime);
+
+        output.Format(TEXT("%04d-%02d-%02d %02d:%02d:%02d.%03d %s phase=%s"),
+            utcTime.wYear, utcTime.wMonth, utcTime.wDay,
+            utcTime.wHour, utcTime.wMinute, utcTime.wSecond, utcTime.wMilliseconds,
+            EventName(record.eventId), PhaseName(record.phase));
+        AppendIndex(TEXT("writer"), record.writerIndex, output);
+        AppendIndex(TEXT("component"), record.componentIndex, output);
+        output.AppendFormat(TEXT(" hr=0x%08x value=%u"), record.hr, record.value);
+
+        DWORD textLength = (record.size - sizeof(record)) / sizeof(TCHAR);
+        const TCHAR* text = (const TCHAR*) (records + sizeof(record));
+        while (textLength > 0 && text[textLength - 1] == 0)
+        {
+            --textLength;
+        }
+        if (textLength > 0)
+        {
+            output.AppendChar(TEXT(' '));
+            output.Append(text, textLength);
+        }
+
+        return record.size;
+    }
+};
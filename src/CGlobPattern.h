@@ -0,0 +1,528 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CShadowSpawnException.h"
+#include "Exports.h"
+
+using namespace std;
+
+// A wildcard pattern compiled once and then matched against any number of
+// strings without allocating. Matching ignores case. The wildcards are
+//
+//   ?      any one character but a backslash
+//   *      any run of characters without a backslash in it
+//   **     any run of characters at all
+//   [...]  one of the characters or ranges listed, e.g. [a-z_]; [!...]
+//          or [^...] is any character not listed. A ] right after the
+//          opening [ is one of the characters. Never a backslash.
+//
+// Backslash is the path separator, so there's no escape character; [*]
+// and [?] match the characters themselves. Compiled with
+// starCrossesSeparators, * behaves like ** and "*.*" matches everything.
+// Utilities::IsMatch, where ? and [ are literal, uses MatchStars instead.
+//
+// Patterns that are a literal, or a literal prefix and suffix around one
+// star, are matched by comparing those directly; anything else by walking
+// the tokens, remembering the last * and ** to go back to on a mismatch.
+class CGlobPattern
+{
+private:
+    enum TokenType
+    {
+        TOKEN_LITERAL,
+        TOKEN_ANY,
+        TOKEN_CLASS,
+        TOKEN_STAR,
+        TOKEN_GLOBSTAR,
+    };
+
+    // Literals are offsets into _text, classes into _ranges.
+    struct Token
+    {
+        TokenType type;
+        DWORD start;
+        DWORD length;
+        bool negated;
+    };
+
+    enum Kind
+    {
+        KIND_EVERYTHING,
+        KIND_LITERAL,
+        KIND_PREFIX_SUFFIX,
+        KIND_GENERAL,
+    };
+
+    static const size_t NO_STAR = (size_t) -1;
+    static const TCHAR SEPARATOR = TEXT('\\');
+
+    CString _pattern;
+    Kind _kind;
+    bool _separatorsMatter;
+    vector<Token> _tokens;
+    vector<TCHAR> _text;            // Lower case
+    vector<TCHAR> _ranges;          // Pairs of first and last characters
+    size_t _minLength;
+
+    // The literal at each end, for the fast paths and for turning down
+    // strings that can't match before walking the tokens.
+    DWORD _prefixStart;
+    DWORD _prefixLength;
+    DWORD _suffixStart;
+    DWORD _suffixLength;
+    bool _starInMiddle;
+
+    static TCHAR ToLower(TCHAR c)
+    {
+        if (c < 0x80)
+        {
+            return (c >= TEXT('A') && c <= TEXT('Z')) ? (TCHAR) (c + (TEXT('a') - TEXT('A'))) : c;
+        }
+        // A pointer with a zero high word is taken as a single character.
+        return (TCHAR) (UINT_PTR) ::CharLower((LPTSTR) (UINT_PTR) c);
+    }
+
+    static TCHAR ToUpper(TCHAR c)
+    {
+        if (c < 0x80)
+        {
+            return (c >= TEXT('a') && c <= TEXT('z')) ? (TCHAR) (c - (TEXT('a') - TEXT('A'))) : c;
+        }
+        return (TCHAR) (UINT_PTR) ::CharUpper((LPTSTR) (UINT_PTR) c);
+    }
+
+    bool MatchLiteral(DWORD start, DWORD length, LPCTSTR input) const
+    {
+        const TCHAR* text = &_text[start];
+        for (DWORD iChar = 0; iChar < length; ++iChar)
+        {
+            if (text[iChar] != input[iChar] && text[iChar] != ToLower(input[iChar]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool InRanges(const Token& token, TCHAR c) const
+    {
+        const TCHAR* ranges = &_ranges[token.start];
+        for (DWORD iRange = 0; iRange < token.length; ++iRange)
+        {
+            if (c >= ranges[iRange * 2] && c <= ranges[iRange * 2 + 1])
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool MatchClass(const Token& token, TCHAR c) const
+    {
+        bool inClass = InRanges(token, c) || InRanges(token, ToLower(c)) || InRanges(token, ToUpper(c));
+        return inClass != token.negated;
+    }
+
+    bool IsSeparator(TCHAR c) const
+    {
+        return _separatorsMatter && c == SEPARATOR;
+    }
+
+    // Matches one token that isn't a star at input[iChar], moving iChar
+    // past it if it matches.
+    bool MatchToken(const Token& token, LPCTSTR input, size_t length, size_t& iChar) const
+    {
+        switch (token.type)
+        {
+        case TOKEN_LITERAL:
+            if (length - iChar < token.length || !MatchLiteral(token.start, token.length, input + iChar))
+            {
+                return false;
+            }
+            iChar += token.length;
+            return true;
+
+        case TOKEN_ANY:
+            if (iChar == length || IsSeparator(input[iChar]))
+            {
+                return false;
+            }
+            ++iChar;
+            return true;
+
+        case TOKEN_CLASS:
+            if (iChar == length || IsSeparator(input[iChar]) || !MatchClass(token, input[iChar]))
+            {
+                return false;
+            }
+            ++iChar;
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+    // Once a * has matched, only the last one ever needs to match more
+    // characters: whatever the ones before it matched, the rest of the
+    // string is still there for it. A * can't take in a separator, though,
+    // so when it runs into one it's the last ** that has to grow instead.
+    bool MatchTokens(LPCTSTR input, size_t length) const
+    {
+        size_t tokenCount = _tokens.size();
+        size_t iToken = 0;
+        size_t iChar = 0;
+        size_t starToken = NO_STAR;
+        size_t starChar = 0;
+        size_t globToken = NO_STAR;
+        size_t globChar = 0;
+
+        for (;;)
+        {
+            if (iToken < tokenCount)
+            {
+                const Token& token = _tokens[iToken];
+                if (token.type == TOKEN_STAR)
+                {
+                    starToken = ++iToken;
+                    starChar = iChar;
+                    continue;
+                }
+                if (token.type == TOKEN_GLOBSTAR)
+                {
+                    globToken = ++iToken;
+                    globChar = iChar;
+                    starToken = NO_STAR;
+                    continue;
+                }
+                if (MatchToken(token, input, length, iChar))
+                {
+                    ++iToken;
+                    continue;
+                }
+            }
+            else if (iChar == length)
+            {
+                return true;
+            }
+
+            if (starToken != NO_STAR && starChar < length && !IsSeparator(input[starChar]))
+            {
+                iToken = starToken;
+                iChar = ++starChar;
+            }
+            else if (globToken != NO_STAR && globChar < length)
+            {
+                iToken = globToken;
+                iChar = ++globChar;
+                starToken = NO_STAR;
+            }
+            else
+            {
+                return false;
+            }
+        }
+    }
+
+    void AddToken(TokenType type, DWORD start, DWORD length, bool negated)
+    {
+        Token token;
+        token.type = type;
+        token.start = start;
+        token.length = length;
+        token.negated = negated;
+        _tokens.push_back(token);
+    }
+
+    // Parses the class starting at pattern[iChar], which is a [, and
+    // returns the index of the ] that ends it.
+    size_t AddClass(LPCTSTR pattern, size_t iChar)
+    {
+        size_t iClass = iChar + 1;
+        bool negated = false;
+        if (pattern[iClass] == TEXT('!') || pattern[iClass] == TEXT('^'))
+        {
+            negated = true;
+            ++iClass;
+        }
+
+        DWORD start = (DWORD) _ranges.size();
+        size_t first = iClass;
+        while (pattern[iClass] != TEXT('\0') && (pattern[iClass] != TEXT(']') || iClass == first))
+        {
+            TCHAR low = pattern[iClass];
+            TCHAR high = low;
+            if (pattern[iClass + 1] == TEXT('-') && pattern[iClass + 2] != TEXT('\0') && pattern[iClass + 2] != TEXT(']'))
+            {
+                high = pattern[iClass + 2];
+                iClass += 3;
+            }
+            else
+            {
+                ++iClass;
+            }
+
+            if (low > high)
+            {
+                CString message;
+                message.AppendFormat(TEXT("The pattern %s is illegal: the range %c-%c is backwards."), pattern, low, high);
+                throw new CShadowSpawnException(E_INVALIDARG, message);
+            }
+            _ranges.push_back(low);
+            _ranges.push_back(high);
+        }
+
+        if (pattern[iClass] == TEXT('\0'))
+        {
+            CString message;
+            message.AppendFormat(TEXT("The pattern %s is illegal: a [ has no matching ]."), pattern);
+            throw new CShadowSpawnException(E_INVALIDARG, message);
+        }
+
+        AddToken(TOKEN_CLASS, start, (DWORD) (_ranges.size() - start) / 2, negated);
+        return iClass;
+    }
+
+    void Classify(void)
+    {
+        _minLength = 0;
+        int starCount = 0;
+        for (unsigned int iToken = 0; iToken < _tokens.size(); ++iToken)
+        {
+            switch (_tokens[iToken].type)
+            {
+            case TOKEN_LITERAL:
+                _minLength += _tokens[iToken].length;
+                break;
+            case TOKEN_ANY:
+            case TOKEN_CLASS:
+                ++_minLength;
+                break;
+            default:
+                ++starCount;
+                break;
+            }
+        }
+
+        _prefixStart = _prefixLength = 0;
+        _suffixStart = _suffixLength = 0;
+        if (!_tokens.empty() && _tokens.front().type == TOKEN_LITERAL)
+        {
+            _prefixStart = _tokens.front().start;
+            _prefixLength = _tokens.front().length;
+        }
+        if (!_tokens.empty() && _tokens.back().type == TOKEN_LITERAL)
+        {
+            _suffixStart = _tokens.back().start;
+            _suffixLength = _tokens.back().length;
+        }
+
+        size_t literalCount = _tokens.size() - starCount;
+        size_t endLiteralCount = (_prefixLength > 0 ? 1 : 0) + (_suffixLength > 0 ? 1 : 0);
+        if (_tokens.size() == 1 && _tokens[0].type == TOKEN_GLOBSTAR)
+        {
+            _kind = KIND_EVERYTHING;
+        }
+        else if (!_separatorsMatter && _pattern == TEXT("*.*"))
+        {
+            _kind = KIND_EVERYTHING;
+        }
+        else if (_tokens.empty() || (_tokens.size() == 1 && _tokens[0].type == TOKEN_LITERAL))
+        {
+            _kind = KIND_LITERAL;
+            _suffixLength = 0;
+        }
+        else if (starCount == 1 && endLiteralCount == literalCount)
+        {
+            _kind = KIND_PREFIX_SUFFIX;
+            _starInMiddle = (_tokens[_prefixLength > 0 ? 1 : 0].type == TOKEN_STAR);
+        }
+        else
+        {
+            _kind = KIND_GENERAL;
+        }
+    }
+
+public:
+    CGlobPattern::CGlobPattern()
+    {
+        _separatorsMatter = true;
+        _text.push_back(TEXT('\0'));
+        Classify();
+    }
+
+    CString& get_Pattern(void)
+    {
+        return _pattern;
+    }
+
+    // Throws a CShadowSpawnException with E_INVALIDARG for a malformed
+    // pattern.
+    void Compile(LPCTSTR pattern, bool starCrossesSeparators)
+    {
+        _pattern = (pattern == NULL) ? TEXT("") : pattern;
+        _separatorsMatter = !starCrossesSeparators;
+        _tokens.clear();
+        _text.clear();
+        _ranges.clear();
+
+        LPCTSTR text = _pattern;
+        for (size_t iChar = 0; text[iChar] != TEXT('\0'); ++iChar)
+        {
+            TCHAR c = text[iChar];
+            if (c == TEXT('*'))
+            {
+                TokenType type = starCrossesSeparators ? TOKEN_GLOBSTAR : TOKEN_STAR;
+                while (text[iChar + 1] == TEXT('*'))
+                {
+                    type = TOKEN_GLOBSTAR;
+                    ++iChar;
+                }
+                AddToken(type, 0, 0, false);
+            }
+            else if (c == TEXT('?'))
+            {
+                AddToken(TOKEN_ANY, 0, 0, false);
+            }
+            else if (c == TEXT('['))
+            {
+                iChar = AddClass(text, iChar);
+            }
+            else
+            {
+                if (_tokens.empty() || _tokens.back().type != TOKEN_LITERAL)
+                {
+                    AddToken(TOKEN_LITERAL, (DWORD) _text.size(), 0, false);
+                }
+                _text.push_back(ToLower(c));
+                ++_tokens.back().length;
+            }
+        }
+
+        // So that &_text[0] is always valid.
+        _text.push_back(TEXT('\0'));
+        Classify();
+    }
+
+    bool IsMatch(LPCTSTR input, size_t length) const
+    {
+        if (_kind == KIND_EVERYTHING)
+        {
+            return true;
+        }
+
+        if (length < _minLength)
+        {
+            return false;
+        }
+
+        if (_kind == KIND_LITERAL)
+        {
+            return length == _minLength && MatchLiteral(_prefixStart, _prefixLength, input);
+        }
+
+        if (!MatchLiteral(_prefixStart, _prefixLength, input) ||
+            !MatchLiteral(_suffixStart, _suffixLength, input + length - _suffixLength))
+        {
+            return false;
+        }
+
+        if (_kind == KIND_PREFIX_SUFFIX)
+        {
+            if (_starInMiddle)
+            {
+                for (size_t iChar = _prefixLength; iChar < length - _suffixLength; ++iChar)
+                {
+                    if (input[iChar] == SEPARATOR)
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        return MatchTokens(input, length);
+    }
+
+    bool IsMatch(LPCTSTR input) const
+    {
+        return IsMatch(input, _tcslen(input));
+    }
+
+    // Matches input against a pattern whose only wildcard is *, which
+    // matches any run of characters, backslashes included; everything else
+    // is literal. Nothing is compiled or allocated, which suits a pattern
+    // used once.
+    static bool MatchStars(LPCTSTR input, size_t length, LPCTSTR pattern)
+    {
+        size_t iInput = 0;
+        size_t iPattern = 0;
+        size_t resumePattern = NO_STAR;
+        size_t resumeInput = 0;
+        while (iInput < length)
+        {
+            if (pattern[iPattern] == TEXT('*'))
+            {
+                resumePattern = ++iPattern;
+                resumeInput = iInput;
+            }
+            else if (pattern[iPattern] != TEXT('\0') && ToLower(pattern[iPattern]) == ToLower(input[iInput]))
+            {
+                ++iPattern;
+                ++iInput;
+            }
+            else if (resumePattern != NO_STAR)
+            {
+                // Let the last star take one more character.
+                iPattern = resumePattern;
+                iInput = ++resumeInput;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        while (pattern[iPattern] == TEXT('*'))
+        {
+            ++iPattern;
+        }
+        return pattern[iPattern] == TEXT('\0');
+    }
+
+    // Sets results[i] to whether entries[i].path matches, and returns how
+    // many did.
+    DWORD IsMatch(const ShadowSpawnWalkEntry* entries, DWORD count, BYTE* results) const
+    {
+        DWORD matchCount = 0;
+        for (DWORD iEntry = 0; iEntry < count; ++iEntry)
+        {
+            results[iEntry] = IsMatch(entries[iEntry].path, entries[iEntry].pathLength) ? 1 : 0;
+            matchCount += results[iEntry];
+        }
+        return matchCount;
+    }
+};
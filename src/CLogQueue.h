@@ -0,0 +1,267 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "Exports.h"
+
+using namespace std;
+
+// A bounded queue of log messages between the threads that log and the
+// host's LogCallback, which is called from a background thread instead so
+// a slow sink can't hold up a VSS phase. Any number of threads may log;
+// only the background thread takes messages out. Enqueueing never takes a
+// lock: slots are claimed with a compare-and-swap on a sequence number, in
+// the style of Dmitry Vyukov's bounded queue. Messages are copied into a
+// buffer in the slot itself, so only the rare message longer than that
+// costs a heap allocation.
+class CLogQueue
+{
+private:
+    static const size_t SLOT_LENGTH = 256;
+
+    struct CLogSlot
+    {
+        volatile LONG sequence;
+        LPTSTR overflow;
+        TCHAR text[SLOT_LENGTH];
+
+        LPCTSTR get_Message(void)
+        {
+            return overflow != NULL ? overflow : text;
+        }
+    };
+
+    static const DWORD BLOCK_RETRY_MS = 10;
+
+    CLogSlot* _slots;
+    LONG _mask;
+    ShadowSpawnLogOverflowPolicy _overflowPolicy;
+    LogCallback* _logCallback;
+
+    volatile LONG _enqueuePosition;
+    LONG _dequeuePosition;
+    volatile LONG _enqueued;
+    volatile LONG _delivered;
+    volatile LONG _dropped;
+    volatile LONG _stopping;
+
+    HANDLE _hWork;
+    HANDLE _hSpace;
+    HANDLE _hDelivered;
+    HANDLE _hThread;
+
+    static DWORD WINAPI DrainProc(LPVOID parameter)
+    {
+        ((CLogQueue*) parameter)->Drain();
+        return 0;
+    }
+
+    bool TryEnqueue(LPCTSTR message, size_t length)
+    {
+        LONG position = _enqueuePosition;
+        CLogSlot* pSlot;
+        while (true)
+        {
+            pSlot = &_slots[position & _mask];
+            LONG difference = pSlot->sequence - position;
+            if (difference == 0)
+            {
+                if (::InterlockedCompareExchange(&_enqueuePosition, position + 1, position) == position)
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            position = _enqueuePosition;
+        }
+
+        // The slot is ours until the sequence number says otherwise.
+        if (length < SLOT_LENGTH)
+        {
+            ::CopyMemory(pSlot->text, message, (length + 1) * sizeof(TCHAR));
+        }
+        else
+        {
+            pSlot->overflow = new TCHAR[length + 1];
+            ::CopyMemory(pSlot->overflow, message, (length + 1) * sizeof(TCHAR));
+        }
+        ::InterlockedExchange(&pSlot->sequence, position + 1);
+        return true;
+    }
+
+    // The slot stays out of the producers' reach until ReleaseSlot, so
+    // its message can be delivered straight from the slot.
+    CLogSlot* TryDequeue(void)
+    {
+        CLogSlot* pSlot = &_slots[_dequeuePosition & _mask];
+        if (pSlot->sequence - (_dequeuePosition + 1) < 0)
+        {
+            return NULL;
+        }
+        return pSlot;
+    }
+
+    void ReleaseSlot(CLogSlot* pSlot)
+    {
+        delete [] pSlot->overflow;
+        pSlot->overflow = NULL;
+        ::InterlockedExchange(&pSlot->sequence, _dequeuePosition + _mask + 1);
+        ++_dequeuePosition;
+        ::SetEvent(_hSpace);
+    }
+
+    void Deliver(LPCTSTR message)
+    {
+        (*_logCallback)(message);
+    }
+
+    void Drain(void)
+    {
+        while (true)
+        {
+            ::WaitForSingleObject(_hWork, INFINITE);
+
+            CLogSlot* pSlot;
+            while ((pSlot = TryDequeue()) != NULL)
+            {
+                Deliver(pSlot->get_Message());
+                ReleaseSlot(pSlot);
+                ::InterlockedIncrement(&_delivered);
+            }
+            ::SetEvent(_hDelivered);
+
+            LONG dropped = ::InterlockedExchange(&_dropped, 0);
+            if (dropped > 0)
+            {
+                CString notice;
+                notice.Format(TEXT("%d log messages were dropped because the log queue was full."), dropped);
+                Deliver(notice);
+            }
+
+            if (_stopping && _delivered == _enqueued)
+            {
+                return;
+            }
+        }
+    }
+
+public:
+    // capacity is rounded up to a power of two.
+    CLogQueue::CLogQueue(DWORD capacity, ShadowSpawnLogOverflowPolicy overflowPolicy, LogCallback* logCallback)
+    {
+        LONG size = 2;
+        while ((DWORD) size < capacity && size < 0x10000000)
+        {
+            size <<= 1;
+        }
+
+        _slots = new CLogSlot[size];
+        for (LONG iSlot = 0; iSlot < size; ++iSlot)
+        {
+            _slots[iSlot].sequence = iSlot;
+            _slots[iSlot].overflow = NULL;
+        }
+        _mask = size - 1;
+        _overflowPolicy = overflowPolicy;
+        _logCallback = logCallback;
+
+        _enqueuePosition = 0;
+        _dequeuePosition = 0;
+        _enqueued = 0;
+        _delivered = 0;
+        _dropped = 0;
+        _stopping = 0;
+
+        _hWork = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+        _hSpace = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+        _hDelivered = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+        _hThread = ::CreateThread(NULL, 0, DrainProc, this, 0, NULL);
+    }
+
+    // Delivers whatever is still queued before returning.
+    CLogQueue::~CLogQueue()
+    {
+        ::InterlockedExchange(&_stopping, 1);
+        ::SetEvent(_hWork);
+        if (_hThread != NULL)
+        {
+            ::WaitForSingleObject(_hThread, INFINITE);
+            ::CloseHandle(_hThread);
+        }
+        ::CloseHandle(_hWork);
+        ::CloseHandle(_hSpace);
+        ::CloseHandle(_hDelivered);
+        delete [] _slots;
+    }
+
+    // Without a background thread there is nothing to drain the queue, so
+    // the owner should log directly instead.
+    bool get_IsRunning(void)
+    {
+        return _hThread != NULL;
+    }
+
+    void Enqueue(LPCTSTR message)
+    {
+        size_t length = _tcslen(message);
+        while (!TryEnqueue(message, length))
+        {
+            if (_overflowPolicy == SHADOWSPAWN_LOG_OVERFLOW_DROP)
+            {
+                ::InterlockedIncrement(&_dropped);
+                ::SetEvent(_hWork);
+                return;
+            }
+
+            ::SetEvent(_hWork);
+            ::WaitForSingleObject(_hSpace, BLOCK_RETRY_MS);
+        }
+
+        ::InterlockedIncrement(&_enqueued);
+        ::SetEvent(_hWork);
+    }
+
+    // Waits until everything logged before the call has reached the
+    // LogCallback.
+    void Flush(void)
+    {
+        LONG target = _enqueued;
+        while (true)
+        {
+            ::ResetEvent(_hDelivered);
+            if (_delivered - target >= 0)
+            {
+                return;
+            }
+            // Every pass of the background thread ends by setting
+            // _hDelivered. The timeout only covers another Flush resetting
+            // it between that and this wait.
+            ::SetEvent(_hWork);
+            ::WaitForSingleObject(_hDelivered, BLOCK_RETRY_MS);
+        }
+    }
+};
@@ -0,0 +1,349 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "Exports.h"
+#include "ISnapshotProvider.h"
+#include "CMockVssAsync.h"
+#include "CWriterMetadataCache.h"
+#include "OutputWriter.h"
+
+using namespace std;
+
+// A snapshot provider that never talks to VSS. Every call sleeps for the
+// configured latency and the writers it reports are synthesized from the
+// configured counts and names, which makes the orchestration in _ShadowSpawn
+// repeatable on machines without (or without access to) VSS. The
+// "snapshot" of a volume is the live volume itself.
+class CMockSnapshotProvider : public ISnapshotProvider
+{
+private:
+    ShadowSpawnMockOptions _options;
+    vector<CString> _writerNames;
+    CString _componentFilePath;
+    OutputWriter& _logger;
+    CWriterMetadataCache* _pMetadataCache;
+    bool _initialized;
+    LONG _nextId;
+    vector<pair<GUID, CString> > _snapshots;
+    vector<GUID> _cachedInstanceIds;
+    DWORD _disabledWriterCount;
+
+    GUID NextId(void)
+    {
+        GUID id = GUID_NULL;
+        id.Data1 = (unsigned long) ::InterlockedIncrement(&_nextId);
+        id.Data4[7] = 0x5A;
+        return id;
+    }
+
+    void SimulateCall(LPCTSTR name)
+    {
+        _logger.WriteFormat(TEXT("Mock provider: %s"), name);
+
+        if (_options.callLatencyMs > 0)
+        {
+            ::Sleep(_options.callLatencyMs);
+        }
+    }
+
+    HRESULT SimulateAsyncCall(LPCTSTR name, ShadowSpawnPhase phase, IVssAsync** ppAsync, DWORD extraLatencyMs = 0)
+    {
+        SimulateCall(name);
+
+        if ((_options.hangPhases & (1 << phase)) != 0)
+        {
+            _logger.WriteFormat(TEXT("Mock provider: %s will hang"), name);
+            return CMockVssAsync::Create(INFINITE, ppAsync);
+        }
+
+        return CMockVssAsync::Create(_options.asyncLatencyMs + extraLatencyMs, ppAsync);
+    }
+
+    // What each writer taking part adds to the freeze, the way a real
+    // writer's freeze and thaw do.
+    DWORD GetFreezeLatencyMs(void)
+    {
+        DWORD writerCount = _options.writerCount - min(_disabledWriterCount, _options.writerCount);
+        return writerCount * _options.freezeLatencyMsPerWriter;
+    }
+
+    // The same for every provider, like a real writer's between runs, so
+    // cached metadata can be found again.
+    static GUID WriterGuid(DWORD iWriter, BYTE kind)
+    {
+        GUID id = GUID_NULL;
+        id.Data1 = iWriter + 1;
+        id.Data4[6] = kind;
+        id.Data4[7] = 0x5A;
+        return id;
+    }
+
+public:
+    // Writer names and the component file path are passed apart from
+    // options, whose pointers to them aren't used. writerNames may be
+    // empty and componentFilePath blank. pMetadataCache may be NULL, in
+    // which case every writer is synthesized.
+    CMockSnapshotProvider::CMockSnapshotProvider(const ShadowSpawnMockOptions& options, const vector<CString>& writerNames,
+        const CString& componentFilePath, OutputWriter& logger, CWriterMetadataCache* pMetadataCache) : _logger(logger)
+    {
+        _options = options;
+        _writerNames = writerNames;
+        _componentFilePath = componentFilePath;
+        _pMetadataCache = pMetadataCache;
+        _initialized = false;
+        _nextId = 0;
+        _disabledWriterCount = 0;
+    }
+
+    GUID GetSystemProviderId(void)
+    {
+        SimulateCall(TEXT("GetSystemProviderId"));
+        return NextId();
+    }
+
+    HRESULT InitializeForBackup(void)
+    {
+        SimulateCall(TEXT("InitializeForBackup"));
+        _initialized = true;
+        return S_OK;
+    }
+
+    bool IsInitialized(void)
+    {
+        return _initialized;
+    }
+
+    HRESULT GatherWriterMetadata(IVssAsync** ppAsync)
+    {
+        return SimulateAsyncCall(TEXT("GatherWriterMetadata"), SHADOWSPAWN_PHASE_GATHER_WRITER_METADATA, ppAsync);
+    }
+
+    // Each writer reports a single non-selectable root component with
+    // the rest of its components as selectable children, whose files, if
+    // a component file path is configured, are all at that path. Goes
+    // through the metadata cache the way CVssSnapshotProvider does, with
+    // synthesizing the components standing in for the COM walk.
+    void GetWriters(vector<CWriter>& writers)
+    {
+        SimulateCall(TEXT("GetWriters"));
+
+        CString rootPath(TEXT("Root"));
+
+        writers.reserve(writers.size() + _options.writerCount);
+        for (DWORD iWriter = 0; iWriter < _options.writerCount; ++iWriter)
+        {
+            writers.push_back(CWriter());
+            CWriter& writer = writers.back();
+
+            GUID instanceId = WriterGuid(iWriter, 'I');
+            GUID writerId = WriterGuid(iWriter, 'W');
+            writer.set_InstanceId(instanceId);
+            writer.set_WriterId(writerId);
+
+            CString writerName;
+            if (iWriter < _writerNames.size())
+            {
+                writerName = _writerNames[iWriter];
+            }
+            else
+            {
+                writerName.Format(TEXT("Mock Writer %d"), iWriter);
+            }
+            writer.set_Name(writerName);
+
+            bool hasFilePaths = !_componentFilePath.IsEmpty();
+            ULONGLONG fingerprint = 0;
+            ULONGLONG contentFingerprint = 0;
+            if (_pMetadataCache != NULL)
+            {
+                fingerprint = CWriterMetadataCache::ComputeFingerprint(writer, VSS_UT_USERDATA, VSS_ST_OTHER, 0, 0, _options.componentsPerWriter);
+                if (hasFilePaths)
+                {
+                    contentFingerprint = CWriterMetadataCache::Hash((LPCTSTR) _componentFilePath, _componentFilePath.GetLength() * sizeof(TCHAR));
+                }
+            }
+
+            if (_pMetadataCache != NULL && _pMetadataCache->Lookup(instanceId, fingerprint, hasFilePaths, contentFingerprint, writer))
+            {
+                _logger.WriteLine(TEXT("Using cached metadata for writer"));
+                _cachedInstanceIds.push_back(instanceId);
+
+                for (unsigned int iComponent = 0; iComponent < writer.get_Components().size(); ++iComponent)
+                {
+                    writer.get_Components()[iComponent].set_Writer(iWriter);
+                }
+
+                writer.ComputeComponentTree();
+                continue;
+            }
+
+            writer.get_Components().reserve(_options.componentsPerWriter);
+            for (DWORD iComponent = 0; iComponent < _options.componentsPerWriter; ++iComponent)
+            {
+                writer.get_Components().push_back(CWriterComponent());
+                CWriterComponent& component = writer.get_Components().back();
+                component.set_Writer(iWriter);
+                component.set_Type(VSS_CT_FILEGROUP);
+
+                if (iComponent == 0)
+                {
+                    component.set_Name(rootPath);
+                    component.set_LogicalPath(CString());
+                    component.set_SelectableForBackup(false);
+                }
+                else
+                {
+                    CString componentName;
+                    componentName.Format(TEXT("Component %d"), iComponent);
+                    component.set_Name(componentName);
+                    component.set_LogicalPath(rootPath);
+                    component.set_SelectableForBackup(true);
+
+                    if (hasFilePaths)
+                    {
+                        component.set_FilePathsKnown(true);
+                        component.get_FilePaths().push_back(_componentFilePath);
+                    }
+                }
+            }
+
+            writer.ComputeComponentTree();
+
+            if (_pMetadataCache != NULL)
+            {
+                _pMetadataCache->Store(writer, fingerprint, contentFingerprint);
+            }
+        }
+    }
+
+    bool EvictCachedWriters(void)
+    {
+        if (_cachedInstanceIds.empty())
+        {
+            return false;
+        }
+
+        for (unsigned int iWriter = 0; iWriter < _cachedInstanceIds.size(); ++iWriter)
+        {
+            _pMetadataCache->Remove(_cachedInstanceIds[iWriter]);
+        }
+
+        _logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Dropped %d writers from the writer metadata cache"), (int) _cachedInstanceIds.size());
+        _cachedInstanceIds.clear();
+        return true;
+    }
+
+    HRESULT StartSnapshotSet(GUID* pSnapshotSetId)
+    {
+        SimulateCall(TEXT("StartSnapshotSet"));
+        *pSnapshotSetId = NextId();
+        return S_OK;
+    }
+
+    HRESULT AddToSnapshotSet(LPCTSTR volumeName, GUID providerId, GUID* pSnapshotId)
+    {
+        SimulateCall(TEXT("AddToSnapshotSet"));
+
+        // Shaped like a real snapshot's device object, so both the
+        // \\?\GLOBALROOT path handed to ShadowSpawnCallbackEx and the NT
+        // path CSnapshotMounter::Mount derives from it lead to the live
+        // volume through the \??\ namespace.
+        CString deviceObject(TEXT("\\\\?\\GLOBALROOT\\?\?\\"));
+        deviceObject.Append(volumeName);
+        deviceObject.TrimRight(TEXT('\\'));
+
+        *pSnapshotId = NextId();
+        _snapshots.push_back(make_pair(*pSnapshotId, deviceObject));
+        return S_OK;
+    }
+
+    HRESULT AddComponent(CWriter& writer, CWriterComponent& component)
+    {
+        SimulateCall(TEXT("AddComponent"));
+        return S_OK;
+    }
+
+    HRESULT DisableWriterInstances(const vector<GUID>& instanceIds)
+    {
+        if (instanceIds.empty())
+        {
+            return S_OK;
+        }
+
+        SimulateCall(TEXT("DisableWriterInstances"));
+        _disabledWriterCount += (DWORD) instanceIds.size();
+        return S_OK;
+    }
+
+    HRESULT SetBackupState(void)
+    {
+        SimulateCall(TEXT("SetBackupState"));
+        return S_OK;
+    }
+
+    HRESULT PrepareForBackup(IVssAsync** ppAsync)
+    {
+        return SimulateAsyncCall(TEXT("PrepareForBackup"), SHADOWSPAWN_PHASE_PREPARE_FOR_BACKUP, ppAsync, GetFreezeLatencyMs());
+    }
+
+    HRESULT DoSnapshotSet(IVssAsync** ppAsync)
+    {
+        return SimulateAsyncCall(TEXT("DoSnapshotSet"), SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET, ppAsync, GetFreezeLatencyMs());
+    }
+
+    HRESULT GetSnapshotDeviceObject(GUID snapshotId, CString& deviceObject)
+    {
+        SimulateCall(TEXT("GetSnapshotDeviceObject"));
+
+        for (unsigned int iSnapshot = 0; iSnapshot < _snapshots.size(); ++iSnapshot)
+        {
+            if (::IsEqualGUID(_snapshots[iSnapshot].first, snapshotId))
+            {
+                deviceObject = _snapshots[iSnapshot].second;
+                return S_OK;
+            }
+        }
+
+        return VSS_E_OBJECT_NOT_FOUND;
+    }
+
+    HRESULT BackupComplete(IVssAsync** ppAsync)
+    {
+        return SimulateAsyncCall(TEXT("BackupComplete"), SHADOWSPAWN_PHASE_BACKUP_COMPLETE, ppAsync);
+    }
+
+    HRESULT AbortBackup(void)
+    {
+        SimulateCall(TEXT("AbortBackup"));
+        return S_OK;
+    }
+
+    HRESULT DeleteSnapshots(GUID snapshotSetId)
+    {
+        SimulateCall(TEXT("DeleteSnapshots"));
+        _snapshots.clear();
+        return S_OK;
+    }
+};
@@ -0,0 +1,152 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+// An IVssAsync that finishes a fixed number of milliseconds after it
+// was created, or, given INFINITE, only ever finishes by being
+// cancelled. Used by CMockSnapshotProvider.
+class CMockVssAsync : public IVssAsync
+{
+private:
+    LONG _refCount;
+    DWORD _startTicks;
+    DWORD _latency;
+    volatile LONG _cancelled;       // Set by Cancel, from any thread
+
+    CMockVssAsync::CMockVssAsync(DWORD latency)
+    {
+        _refCount = 1;
+        _startTicks = ::GetTickCount();
+        _latency = latency;
+        _cancelled = FALSE;
+    }
+
+    bool get_IsCancelled(void)
+    {
+        return ::InterlockedCompareExchange(&_cancelled, FALSE, FALSE) != FALSE;
+    }
+
+    DWORD get_Remaining(void)
+    {
+        DWORD elapsed = ::GetTickCount() - _startTicks;
+        return elapsed >= _latency ? 0 : _latency - elapsed;
+    }
+
+public:
+    static HRESULT Create(DWORD latency, IVssAsync** ppAsync)
+    {
+        if (ppAsync == NULL)
+        {
+            return E_POINTER;
+        }
+
+        *ppAsync = new CMockVssAsync(latency);
+        return S_OK;
+    }
+
+    STDMETHODIMP QueryInterface(REFIID riid, void** ppvObject)
+    {
+        if (ppvObject == NULL)
+        {
+            return E_POINTER;
+        }
+
+        if (::IsEqualIID(riid, IID_IUnknown) || ::IsEqualIID(riid, __uuidof(IVssAsync)))
+        {
+            *ppvObject = static_cast<IVssAsync*>(this);
+            AddRef();
+            return S_OK;
+        }
+
+        *ppvObject = NULL;
+        return E_NOINTERFACE;
+    }
+
+    STDMETHODIMP_(ULONG) AddRef(void)
+    {
+        return ::InterlockedIncrement(&_refCount);
+    }
+
+    STDMETHODIMP_(ULONG) Release(void)
+    {
+        LONG refCount = ::InterlockedDecrement(&_refCount);
+        if (refCount == 0)
+        {
+            delete this;
+        }
+        return refCount;
+    }
+
+    STDMETHODIMP Cancel(void)
+    {
+        if (get_Remaining() == 0)
+        {
+            return VSS_S_ASYNC_FINISHED;
+        }
+
+        ::InterlockedExchange(&_cancelled, TRUE);
+        return S_OK;
+    }
+
+    STDMETHODIMP Wait(DWORD dwMilliseconds = INFINITE)
+    {
+        if (get_IsCancelled())
+        {
+            return S_OK;
+        }
+
+        DWORD remaining = get_Remaining();
+        if (remaining > dwMilliseconds)
+        {
+            ::Sleep(dwMilliseconds);
+            return S_OK;
+        }
+
+        ::Sleep(remaining);
+        return S_OK;
+    }
+
+    STDMETHODIMP QueryStatus(HRESULT* pHrResult, INT* pReserved)
+    {
+        if (pHrResult == NULL)
+        {
+            return E_POINTER;
+        }
+
+        if (get_IsCancelled())
+        {
+            *pHrResult = VSS_S_ASYNC_CANCELLED;
+        }
+        else if (get_Remaining() > 0)
+        {
+            *pHrResult = VSS_S_ASYNC_PENDING;
+        }
+        else
+        {
+            *pHrResult = VSS_S_ASYNC_FINISHED;
+        }
+
+        return S_OK;
+    }
+};
@@ -0,0 +1,106 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+using namespace std;
+
+// Stores paths back to back in large blocks, so building millions of them
+// costs a copy each rather than a heap allocation each. Like a BSTR, each
+// path is preceded by its length in characters and followed by a null, and
+// the pointer handed out is to its first character. Paths stay where they
+// are until Reset or the arena goes away. Not thread-safe: only one thread
+// may add paths, though any may read the ones already added.
+class CPathArena
+{
+private:
+    // Comfortably more than the longest path Windows allows.
+    static const DWORD BLOCK_BYTES = 256 * 1024;
+
+    vector<BYTE*> _blocks;
+    size_t _blockIndex;
+    DWORD _used;
+
+public:
+    CPathArena::CPathArena()
+    {
+        _blockIndex = 0;
+        _used = 0;
+    }
+
+    CPathArena::~CPathArena()
+    {
+        for (unsigned int iBlock = 0; iBlock < _blocks.size(); ++iBlock)
+        {
+            delete [] _blocks[iBlock];
+        }
+    }
+
+    static DWORD get_Length(LPCTSTR path)
+    {
+        return ((const DWORD*) path)[-1];
+    }
+
+    // Adds prefix, then separator unless it is zero or prefix is empty,
+    // then name.
+    LPCTSTR Add(LPCTSTR prefix, DWORD prefixLength, TCHAR separator, LPCTSTR name, DWORD nameLength)
+    {
+        DWORD separatorLength = (separator != 0 && prefixLength > 0) ? 1 : 0;
+        DWORD length = prefixLength + separatorLength + nameLength;
+        DWORD size = (sizeof(DWORD) + (length + 1) * sizeof(TCHAR) + 3) & ~3;
+
+        if (_blocks.empty())
+        {
+            _blocks.push_back(new BYTE[BLOCK_BYTES]);
+        }
+        else if (_used + size > BLOCK_BYTES)
+        {
+            if (++_blockIndex == _blocks.size())
+            {
+                _blocks.push_back(new BYTE[BLOCK_BYTES]);
+            }
+            _used = 0;
+        }
+
+        BYTE* pEntry = _blocks[_blockIndex] + _used;
+        _used += size;
+
+        *((DWORD*) pEntry) = length;
+        LPTSTR path = (LPTSTR) (pEntry + sizeof(DWORD));
+        ::CopyMemory(path, prefix, prefixLength * sizeof(TCHAR));
+        if (separatorLength > 0)
+        {
+            path[prefixLength] = separator;
+        }
+        ::CopyMemory(path + prefixLength + separatorLength, name, nameLength * sizeof(TCHAR));
+        path[length] = TEXT('\0');
+        return path;
+    }
+
+    // Forgets every path, keeping the blocks for reuse.
+    void Reset(void)
+    {
+        _blockIndex = 0;
+        _used = 0;
+    }
+};
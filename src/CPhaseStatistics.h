@@ -0,0 +1,168 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "Exports.h"
+#include "OutputWriter.h"
+
+using namespace std;
+
+// Durations of one phase, bucketed by powers of two of microseconds.
+class CLatencyHistogram
+{
+private:
+    DWORD _count;
+    ULONGLONG _totalMicroseconds;
+    ULONGLONG _minMicroseconds;
+    ULONGLONG _maxMicroseconds;
+    DWORD _buckets[SHADOWSPAWN_HISTOGRAM_BUCKETS];
+
+    static int BucketFor(ULONGLONG microseconds)
+    {
+        int bucket = 0;
+        while (microseconds > 1 && bucket < SHADOWSPAWN_HISTOGRAM_BUCKETS - 1)
+        {
+            microseconds >>= 1;
+            ++bucket;
+        }
+        return bucket;
+    }
+
+public:
+    CLatencyHistogram::CLatencyHistogram()
+    {
+        Reset();
+    }
+
+    void Record(ULONGLONG microseconds)
+    {
+        if (_count == 0 || microseconds < _minMicroseconds)
+        {
+            _minMicroseconds = microseconds;
+        }
+        if (microseconds > _maxMicroseconds)
+        {
+            _maxMicroseconds = microseconds;
+        }
+        ++_count;
+        _totalMicroseconds += microseconds;
+        ++_buckets[BucketFor(microseconds)];
+    }
+
+    void Reset(void)
+    {
+        _count = 0;
+        _totalMicroseconds = 0;
+        _minMicroseconds = 0;
+        _maxMicroseconds = 0;
+        ::ZeroMemory(_buckets, sizeof(_buckets));
+    }
+
+    void CopyTo(ShadowSpawnPhaseStats& stats)
+    {
+        stats.count = _count;
+        stats.totalMicroseconds = _totalMicroseconds;
+        stats.minMicroseconds = _minMicroseconds;
+        stats.maxMicroseconds = _maxMicroseconds;
+        ::CopyMemory(stats.buckets, _buckets, sizeof(_buckets));
+    }
+};
+
+// Per-process latency histograms, one per ShadowSpawnPhase, shared by
+// every session and readable through ShadowSpawnGetPhaseStats.
+class CPhaseStatistics
+{
+private:
+    static CPhaseStatistics s_process;
+
+    CComAutoCriticalSection _lock;
+    CLatencyHistogram _histograms[SHADOWSPAWN_PHASE_COUNT];
+
+public:
+    static CPhaseStatistics& get_Process(void)
+    {
+        return s_process;
+    }
+
+    void Record(ShadowSpawnPhase phase, ULONGLONG microseconds)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _histograms[phase].Record(microseconds);
+    }
+
+    void CopyTo(ShadowSpawnPhase phase, ShadowSpawnPhaseStats& stats)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _histograms[phase].CopyTo(stats);
+    }
+
+    void Reset(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        for (int iPhase = 0; iPhase < SHADOWSPAWN_PHASE_COUNT; ++iPhase)
+        {
+            _histograms[iPhase].Reset();
+        }
+    }
+};
+
+// Measures phases with the performance counter, which unlike the system
+// time can't jump while a phase is running.
+class CPhaseTimer
+{
+private:
+    LARGE_INTEGER _start;
+
+public:
+    CPhaseTimer::CPhaseTimer()
+    {
+        Restart();
+    }
+
+    void Restart(void)
+    {
+        ::QueryPerformanceCounter(&_start);
+    }
+
+    ULONGLONG get_ElapsedMicroseconds(void)
+    {
+        LARGE_INTEGER now;
+        LARGE_INTEGER frequency;
+        ::QueryPerformanceCounter(&now);
+        ::QueryPerformanceFrequency(&frequency);
+
+        ULONGLONG ticks = (ULONGLONG) (now.QuadPart - _start.QuadPart);
+        return (ticks / frequency.QuadPart) * 1000000 + ((ticks % frequency.QuadPart) * 1000000) / frequency.QuadPart;
+    }
+
+    // Adds the time since the last Restart to phase's histogram, and
+    // reports it as a PhaseFinished event.
+    void Record(ShadowSpawnPhase phase, OutputWriter& logger)
+    {
+        ULONGLONG microseconds = get_ElapsedMicroseconds();
+        CPhaseStatistics::get_Process().Record(phase, microseconds);
+        logger.WriteEvent(SHADOWSPAWN_EVENT_PHASE_FINISHED, phase, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE,
+            S_OK, microseconds > MAXDWORD ? MAXDWORD : (DWORD) microseconds, NULL);
+    }
+};
@@ -0,0 +1,257 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CGlobPattern.h"
+#include "CShadowSpawnException.h"
+#include "CWriter.h"
+#include "CWriterComponent.h"
+#include "Exports.h"
+
+using namespace std;
+
+class CSelectionRule
+{
+private:
+    ShadowSpawnSelectionAction _action;
+    ShadowSpawnSelectionField _field;
+    CString _pattern;
+    CGlobPattern _glob;
+    GUID _writerId;
+
+public:
+    CSelectionRule::CSelectionRule(ShadowSpawnSelectionAction action, ShadowSpawnSelectionField field, LPCTSTR pattern)
+    {
+        _action = action;
+        _field = field;
+        _pattern = (pattern == NULL) ? TEXT("") : pattern;
+        _writerId = GUID_NULL;
+    }
+
+    ShadowSpawnSelectionAction get_Action(void)
+    {
+        return _action;
+    }
+
+    ShadowSpawnSelectionField get_Field(void)
+    {
+        return _field;
+    }
+
+    CString& get_Pattern(void)
+    {
+        return _pattern;
+    }
+
+    // Compiled by CSelectionPolicy::AddRule for rules on names and paths.
+    CGlobPattern& get_Glob(void)
+    {
+        return _glob;
+    }
+
+    GUID& get_WriterId(void)
+    {
+        return _writerId;
+    }
+
+    void set_WriterId(GUID& value)
+    {
+        _writerId = value;
+    }
+};
+
+// Decides which writers and components take part in a snapshot, from an
+// ordered list of include/exclude rules. The first rule that matches a
+// component decides it; a component no rule matches is included unless
+// volume filtering has been turned on and its files are known to be only
+// on volumes outside the snapshot set. Rules on the writer name or id match every
+// component of that writer.
+class CSelectionPolicy
+{
+private:
+    vector<CSelectionRule> _rules;
+    bool _filterByVolume;
+
+public:
+    // Whether a component's files are on one of the volumes being
+    // snapshotted, as far as anyone knows.
+    enum VolumeMatch
+    {
+        VOLUME_UNKNOWN,
+        VOLUME_ON,
+        VOLUME_OFF,
+    };
+
+    CSelectionPolicy::CSelectionPolicy()
+    {
+        _filterByVolume = false;
+    }
+
+    bool get_IsEmpty(void)
+    {
+        return _rules.empty();
+    }
+
+    bool get_FilterByVolume(void)
+    {
+        return _filterByVolume;
+    }
+
+    void set_FilterByVolume(bool value)
+    {
+        _filterByVolume = value;
+    }
+
+    // True if evaluating the policy needs to know where components' files
+    // are, which means reading every component's file descriptors.
+    bool get_UsesVolumes(void)
+    {
+        if (_filterByVolume)
+        {
+            return true;
+        }
+
+        for (unsigned int iRule = 0; iRule < _rules.size(); ++iRule)
+        {
+            if (_rules[iRule].get_Field() == SHADOWSPAWN_SELECT_ON_SNAPSHOT_VOLUME ||
+                _rules[iRule].get_Field() == SHADOWSPAWN_SELECT_OFF_SNAPSHOT_VOLUME)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Throws a CShadowSpawnException with E_INVALIDARG for a rule that
+    // could never be evaluated.
+    void AddRule(ShadowSpawnSelectionAction action, ShadowSpawnSelectionField field, LPCTSTR pattern)
+    {
+        if (action != SHADOWSPAWN_SELECT_INCLUDE && action != SHADOWSPAWN_SELECT_EXCLUDE)
+        {
+            throw new CShadowSpawnException(E_INVALIDARG, TEXT("Unknown selection rule action."));
+        }
+
+        CSelectionRule rule(action, field, pattern);
+        switch (field)
+        {
+        case SHADOWSPAWN_SELECT_WRITER_NAME:
+        case SHADOWSPAWN_SELECT_LOGICAL_PATH:
+            // A * takes in backslashes too, as it always has, so a rule
+            // on a logical path covers the components below it.
+            rule.get_Glob().Compile(rule.get_Pattern(), true);
+            break;
+
+        case SHADOWSPAWN_SELECT_WRITER_ID:
+            {
+                GUID writerId;
+                if (FAILED(::CLSIDFromString(const_cast<LPOLESTR>((LPCTSTR) rule.get_Pattern()), &writerId)))
+                {
+                    CString message;
+                    message.AppendFormat(TEXT("%s is not a writer id of the form {xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}."), rule.get_Pattern());
+                    throw new CShadowSpawnException(E_INVALIDARG, message);
+                }
+                rule.set_WriterId(writerId);
+            }
+            break;
+
+        case SHADOWSPAWN_SELECT_ON_SNAPSHOT_VOLUME:
+        case SHADOWSPAWN_SELECT_OFF_SNAPSHOT_VOLUME:
+            break;
+
+        default:
+            throw new CShadowSpawnException(E_INVALIDARG, TEXT("Unknown selection rule field."));
+        }
+
+        _rules.push_back(rule);
+    }
+
+    void Clear(void)
+    {
+        _rules.clear();
+    }
+
+    // Describes the policy in a form that is equal for two policies
+    // exactly when they would pick the same components.
+    void AppendKey(CString& key)
+    {
+        key.AppendFormat(TEXT("|filter=%d"), _filterByVolume ? 1 : 0);
+        for (unsigned int iRule = 0; iRule < _rules.size(); ++iRule)
+        {
+            // The length keeps a | in a pattern from running into the
+            // next rule.
+            CString& pattern = _rules[iRule].get_Pattern();
+            key.AppendFormat(TEXT("|%d,%d,%d:%s"), _rules[iRule].get_Action(), _rules[iRule].get_Field(),
+                pattern.GetLength(), (LPCTSTR) pattern);
+        }
+    }
+
+    bool ShouldInclude(CWriter& writer, CWriterComponent& component, VolumeMatch volumeMatch)
+    {
+        for (unsigned int iRule = 0; iRule < _rules.size(); ++iRule)
+        {
+            CSelectionRule& rule = _rules[iRule];
+
+            bool matches = false;
+            switch (rule.get_Field())
+            {
+            case SHADOWSPAWN_SELECT_WRITER_NAME:
+                matches = rule.get_Glob().IsMatch(writer.get_Name(), writer.get_Name().GetLength());
+                break;
+
+            case SHADOWSPAWN_SELECT_WRITER_ID:
+                matches = ::IsEqualGUID(writer.get_WriterId(), rule.get_WriterId()) != FALSE;
+                break;
+
+            case SHADOWSPAWN_SELECT_LOGICAL_PATH:
+                {
+                    CString fullPath(component.get_LogicalPath());
+                    if (fullPath.GetLength() > 0)
+                    {
+                        fullPath.Append(TEXT("\\"));
+                    }
+                    fullPath.Append(component.get_Name());
+                    matches = rule.get_Glob().IsMatch(fullPath, fullPath.GetLength());
+                }
+                break;
+
+            // A component whose files we know nothing about matches
+            // neither volume rule.
+            case SHADOWSPAWN_SELECT_ON_SNAPSHOT_VOLUME:
+                matches = (volumeMatch == VOLUME_ON);
+                break;
+
+            case SHADOWSPAWN_SELECT_OFF_SNAPSHOT_VOLUME:
+                matches = (volumeMatch == VOLUME_OFF);
+                break;
+            }
+
+            if (matches)
+            {
+                return rule.get_Action() == SHADOWSPAWN_SELECT_INCLUDE;
+            }
+        }
+
+        return !(_filterByVolume && volumeMatch == VOLUME_OFF);
+    }
+};
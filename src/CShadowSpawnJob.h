@@ -0,0 +1,342 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CComException.h"
+#include "CShadowSpawnException.h"
+#include "CDeadline.h"
+#include "CPhaseStatistics.h"
+#include "CShadowSpawnSession.h"
+#include "CSnapshotMounter.h"
+#include "CSnapshotSet.h"
+#include "Exports.h"
+#include "OutputWriter.h"
+#include "Utilities.h"
+
+using namespace std;
+
+// One ShadowSpawn run driven as a state machine on the system thread pool
+// instead of on the caller's thread. Each step issues the next VSS call
+// and returns; while an IVssAsync is outstanding the job polls it from a
+// timer rather than blocking a thread in IVssAsync::Wait, so many jobs can
+// be in flight on a handful of threads. Only the user callback itself
+// occupies a pool thread for its full duration.
+//
+// Jobs are reference counted: the caller's handle holds one reference and
+// the running state machine holds another until it finishes.
+class CShadowSpawnJob
+{
+private:
+    static const DWORD POLL_INTERVAL_MS = 50;
+
+    LONG _refCount;
+    CShadowSpawnSession& _session;
+    OutputWriter& _logger;
+    CString _source;
+    CString _device;
+    CString _volumePathName;
+    ShadowSpawnCallback* _callback;
+    ShadowSpawnCompletionCallback* _completionCallback;
+    void* _context;
+
+    CSnapshotSet _snapshotSet;
+    CCancellation* _pCancellation;
+    CComPtr<IVssAsync> _pPending;
+    LPCTSTR _pendingOperation;
+    vector<CString> _mountedDevices;
+    HANDLE _hTimer;
+
+    volatile LONG _state;
+    HRESULT _result;
+    HANDLE _hFinished;
+
+    static DWORD WINAPI StepProc(LPVOID parameter)
+    {
+        ((CShadowSpawnJob*) parameter)->Run();
+        return 0;
+    }
+
+    static VOID CALLBACK PollProc(PVOID parameter, BOOLEAN timerFired)
+    {
+        ((CShadowSpawnJob*) parameter)->Run();
+    }
+
+    void SetState(ShadowSpawnJobState state)
+    {
+        ::InterlockedExchange(&_state, state);
+    }
+
+    void BeginAsync(LPCTSTR operation)
+    {
+        _pendingOperation = operation;
+
+        _logger.WriteFormat(TEXT("Polling for call to %s to finish..."), operation);
+    }
+
+    void SchedulePoll(void)
+    {
+        if (!::CreateTimerQueueTimer(&_hTimer, NULL, PollProc, this, POLL_INTERVAL_MS, 0, WT_EXECUTEONLYONCE))
+        {
+            DWORD error = ::GetLastError();
+            _hTimer = NULL;
+            throw new CShadowSpawnException(HRESULT_FROM_WIN32(error), TEXT("Unable to schedule a poll of a pending VSS call."));
+        }
+    }
+
+    // Issues VSS calls until one of them has to be waited for, then
+    // schedules a poll and returns. Runs on a pool thread.
+    void Run(void)
+    {
+        if (_hTimer != NULL)
+        {
+            // Can't wait for the timer from its own callback; with no
+            // completion event this just marks it for deletion.
+            ::DeleteTimerQueueTimer(NULL, _hTimer, NULL);
+            _hTimer = NULL;
+        }
+
+        HRESULT hrCoInitialize = ::CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+        try
+        {
+            while (Step())
+            {
+            }
+        }
+        catch (CComException* e)
+        {
+            Fail(Utilities::ReportException(e, _logger));
+        }
+        catch (CShadowSpawnException* e)
+        {
+            Fail(Utilities::ReportException(e, _logger));
+        }
+
+        if (SUCCEEDED(hrCoInitialize))
+        {
+            ::CoUninitialize();
+        }
+    }
+
+    // Advances one phase. Returns false once the job has to wait for
+    // something or is finished.
+    bool Step(void)
+    {
+        if (_pPending != NULL)
+        {
+            if (_snapshotSet.PollAsync(_pPending, _pendingOperation))
+            {
+                SchedulePoll();
+                return false;
+            }
+
+            _snapshotSet.EndAsync(_pPending, _pendingOperation);
+            _pPending.Release();
+        }
+
+        switch (_state)
+        {
+        case SHADOWSPAWN_JOB_PENDING:
+            {
+                CSnapshotMounter::CheckSource(_source);
+
+                _logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Shadowing %s at %s"), _source, _device);
+
+                _session.RefreshVolumePaths();
+                _session.GetVolumePathName(_source, _volumePathName);
+
+                SetState(SHADOWSPAWN_JOB_GATHERING_WRITER_METADATA);
+                BeginAsync(TEXT("GatherWriterMetadata"));
+                _snapshotSet.BeginGatherWriterMetadata(&_pPending);
+            }
+            return true;
+
+        case SHADOWSPAWN_JOB_GATHERING_WRITER_METADATA:
+            // Waiting for other snapshot sets would tie up this pool
+            // thread, so check back from the timer instead.
+            if (!_snapshotSet.TryAdmit())
+            {
+                SchedulePoll();
+                return false;
+            }
+
+            {
+                vector<CString> volumes(1, _volumePathName);
+                _snapshotSet.AddVolumes(volumes);
+            }
+
+            SetState(SHADOWSPAWN_JOB_PREPARING_FOR_BACKUP);
+            BeginAsync(TEXT("PrepareForBackup"));
+            _snapshotSet.BeginPrepareForBackup(&_pPending);
+            return true;
+
+        case SHADOWSPAWN_JOB_PREPARING_FOR_BACKUP:
+            SetState(SHADOWSPAWN_JOB_CREATING_SNAPSHOT);
+            BeginAsync(TEXT("DoSnapshotSet"));
+            _snapshotSet.BeginDoSnapshotSet(&_pPending);
+            return true;
+
+        case SHADOWSPAWN_JOB_CREATING_SNAPSHOT:
+            {
+                CString snapshotDeviceObject;
+                _snapshotSet.GetSnapshotDeviceObject(_volumePathName, snapshotDeviceObject);
+
+                CSnapshotMounter::Mount(snapshotDeviceObject, _source, _volumePathName, _device, _logger);
+                _mountedDevices.push_back(_device);
+            }
+
+            SetState(SHADOWSPAWN_JOB_RUNNING_CALLBACK);
+            return true;
+
+        case SHADOWSPAWN_JOB_RUNNING_CALLBACK:
+            {
+                _snapshotSet.PauseDeadline();
+                CPhaseTimer callbackTimer;
+                _callback();
+                callbackTimer.Record(SHADOWSPAWN_PHASE_CALLBACK, _logger);
+            }
+
+            CSnapshotMounter::Unmount(_device, _logger);
+            _mountedDevices.clear();
+
+            SetState(SHADOWSPAWN_JOB_COMPLETING_BACKUP);
+            BeginAsync(TEXT("BackupComplete"));
+            _snapshotSet.BeginBackupComplete(&_pPending);
+            return true;
+
+        case SHADOWSPAWN_JOB_COMPLETING_BACKUP:
+            _snapshotSet.Delete(false);
+            _logger.WriteLine(TEXT("Shadowing successfully completed."), VERBOSITY_THRESHOLD_NORMAL);
+            Finish(S_OK);
+            return false;
+        }
+
+        return false;
+    }
+
+    void Fail(HRESULT hr)
+    {
+        _pPending.Release();
+        _snapshotSet.Abort();
+        CSnapshotMounter::Dismount(true, _mountedDevices, _logger);
+        _mountedDevices.clear();
+        _snapshotSet.Delete(true);
+        Finish(hr);
+    }
+
+    void Finish(HRESULT hr)
+    {
+        _result = hr;
+        SetState(SUCCEEDED(hr) ? SHADOWSPAWN_JOB_SUCCEEDED : SHADOWSPAWN_JOB_FAILED);
+
+        if (_completionCallback != NULL)
+        {
+            _completionCallback(this, hr, _context);
+        }
+
+        // Signalled after the completion callback so that a caller who
+        // waits on the job knows the callback has returned too.
+        ::SetEvent(_hFinished);
+
+        // Drop the state machine's reference.
+        Release();
+    }
+
+public:
+    CShadowSpawnJob::CShadowSpawnJob(CShadowSpawnSession& session, LPCTSTR source, LPCTSTR device,
+        ShadowSpawnCallback* callback, ShadowSpawnCompletionCallback* completionCallback, void* context) :
+        _session(session),
+        _logger(session.get_Logger()),
+        _snapshotSet(session)
+    {
+        _refCount = 1;
+        _source = source;
+        _device = device;
+        _callback = callback;
+        _completionCallback = completionCallback;
+        _context = context;
+        _pendingOperation = NULL;
+        _hTimer = NULL;
+        _state = SHADOWSPAWN_JOB_PENDING;
+        _result = E_PENDING;
+        _hFinished = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+
+        _pCancellation = new CCancellation();
+        _snapshotSet.set_Deadline(CDeadline(INFINITE, _pCancellation));
+    }
+
+    CShadowSpawnJob::~CShadowSpawnJob()
+    {
+        _pCancellation->Release();
+        ::CloseHandle(_hFinished);
+    }
+
+    void AddRef(void)
+    {
+        ::InterlockedIncrement(&_refCount);
+    }
+
+    void Release(void)
+    {
+        if (::InterlockedDecrement(&_refCount) == 0)
+        {
+            delete this;
+        }
+    }
+
+    ShadowSpawnJobState get_State(void)
+    {
+        return (ShadowSpawnJobState) _state;
+    }
+
+    // E_PENDING until the job has finished.
+    HRESULT get_Result(void)
+    {
+        return _result;
+    }
+
+    HANDLE get_FinishedEvent(void)
+    {
+        return _hFinished;
+    }
+
+    // Makes the job fail with E_ABORT at its next poll of a VSS call, or
+    // at the start of its next one. Has no effect once the job is done.
+    void Cancel(void)
+    {
+        _pCancellation->Cancel();
+    }
+
+    // Queues the first step and returns straight away.
+    void Start(void)
+    {
+        AddRef();
+        if (!::QueueUserWorkItem(StepProc, this, WT_EXECUTEDEFAULT))
+        {
+            DWORD error = ::GetLastError();
+            Release();
+            throw new CShadowSpawnException(HRESULT_FROM_WIN32(error), TEXT("Unable to queue a ShadowSpawn job."));
+        }
+    }
+};
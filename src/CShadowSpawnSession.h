@@ -0,0 +1,410 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "Exports.h"
+#include "OutputWriter.h"
+#include "ISnapshotProvider.h"
+#include "CVssSnapshotProvider.h"
+#include "CMockSnapshotProvider.h"
+#include "CWriterMetadataCache.h"
+#include "CLogQueue.h"
+#include "CEventLog.h"
+#include "CSelectionPolicy.h"
+#include "CVolumePathCache.h"
+
+using namespace std;
+
+// State shared by every snapshot taken through one ShadowSpawnSession
+// handle: the logger, which provider to use, and the results of
+// provider discovery and volume lookups, which only need to happen once
+// per session rather than once per snapshot. The one-shot ShadowSpawn
+// export uses a throwaway session, so it behaves exactly as before.
+class CShadowSpawnSession
+{
+private:
+    OutputWriter _logger;
+    LogCallback* _logCallback;
+    CAutoPtr<CLogQueue> _pLogQueue;
+    CAutoPtr<CEventLog> _pEventLog;
+    // Serializes changes to the log queue and event log. Kept apart from
+    // _lock because swapping waits for threads that are logging.
+    CComAutoCriticalSection _outputLock;
+    bool _useMockProvider;
+    ShadowSpawnMockOptions _mockOptions;
+    // The strings _mockOptions pointed at, whose pointers it doesn't keep.
+    vector<CString> _mockWriterNames;
+    CString _mockComponentFilePath;
+
+    CComAutoCriticalSection _lock;
+    bool _hasSystemProviderId;
+    GUID _systemProviderId;
+    CVolumePathCache _volumePathNames;
+
+    CWriterMetadataCache _metadataCache;
+    CString _metadataCachePath;
+
+    CSelectionPolicy _selectionPolicy;
+
+    DWORD _deferredCleanups;
+    HANDLE _hNoDeferredCleanups;
+    bool _deleteWhenIdle;
+
+public:
+    CShadowSpawnSession::CShadowSpawnSession(int verbosityLevel, LogCallback* logCallback, const ShadowSpawnMockOptions* mockOptions)
+    {
+        _logCallback = logCallback;
+        _logger.SetLogger(logCallback);
+        _logger.SetVerbosityLevel((VERBOSITY_LEVEL) verbosityLevel);
+
+        _useMockProvider = (mockOptions != NULL);
+        if (_useMockProvider)
+        {
+            _mockOptions = *mockOptions;
+
+            if (mockOptions->writerNames != NULL)
+            {
+                for (DWORD iWriter = 0; iWriter < mockOptions->writerCount; ++iWriter)
+                {
+                    _mockWriterNames.push_back(CString(mockOptions->writerNames[iWriter]));
+                }
+            }
+            if (mockOptions->componentFilePath != NULL)
+            {
+                _mockComponentFilePath = mockOptions->componentFilePath;
+            }
+            _mockOptions.writerNames = NULL;
+            _mockOptions.componentFilePath = NULL;
+        }
+        else
+        {
+            ::ZeroMemory(&_mockOptions, sizeof(_mockOptions));
+        }
+
+        _hasSystemProviderId = false;
+        _systemProviderId = GUID_NULL;
+
+        _deferredCleanups = 0;
+        _hNoDeferredCleanups = ::CreateEvent(NULL, TRUE, TRUE, NULL);
+        _deleteWhenIdle = false;
+    }
+
+    CShadowSpawnSession::~CShadowSpawnSession()
+    {
+        // Snapshot sets still being finished in the background refer to
+        // this session.
+        ::WaitForSingleObject(_hNoDeferredCleanups, INFINITE);
+        ::CloseHandle(_hNoDeferredCleanups);
+
+        // Delivers anything still queued or buffered.
+        _logger.SetEventLog(NULL);
+        _pEventLog.Free();
+        _logger.SetLogQueue(NULL);
+        _pLogQueue.Free();
+    }
+
+    OutputWriter& get_Logger(void)
+    {
+        return _logger;
+    }
+
+    bool get_UsesMockProvider(void)
+    {
+        return _useMockProvider;
+    }
+
+    // Each snapshot set needs its own IVssBackupComponents, so this hands
+    // out a fresh provider every time. The caller owns the result.
+    ISnapshotProvider* CreateProvider(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        if (_useMockProvider)
+        {
+            return new CMockSnapshotProvider(_mockOptions, _mockWriterNames, _mockComponentFilePath, _logger,
+                _metadataCachePath.IsEmpty() ? NULL : &_metadataCache);
+        }
+
+        return new CVssSnapshotProvider(_logger, _metadataCachePath.IsEmpty() ? NULL : &_metadataCache,
+            _selectionPolicy.get_UsesVolumes());
+    }
+
+    // Counts the snapshot sets of this session that are still to be
+    // finished after its call returned: by CCleanupQueue, or by another
+    // caller sharing a coalesced snapshot.
+    void BeginDeferredCleanup(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        if (_deferredCleanups++ == 0)
+        {
+            ::ResetEvent(_hNoDeferredCleanups);
+        }
+    }
+
+    // May delete the session, after DeleteWhenIdle, so the caller mustn't
+    // touch it afterwards.
+    void EndDeferredCleanup(void)
+    {
+        bool deleteNow = false;
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            if (--_deferredCleanups == 0)
+            {
+                ::SetEvent(_hNoDeferredCleanups);
+                deleteNow = _deleteWhenIdle;
+            }
+        }
+
+        if (deleteNow)
+        {
+            delete this;
+        }
+    }
+
+    // Deletes a throwaway session now, or has the last EndDeferredCleanup
+    // delete it if it still has snapshot sets to finish. Unlike deleting
+    // it, never waits: those sets may only be finished once other callers'
+    // callbacks return, or behind the cleanup queue's current work.
+    void DeleteWhenIdle(void)
+    {
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            if (_deferredCleanups > 0)
+            {
+                _deleteWhenIdle = true;
+                return;
+            }
+        }
+
+        delete this;
+    }
+
+    // Leaves components out of later snapshots when their files are known
+    // to be only on volumes outside the snapshot set. Off by default;
+    // selection rules are applied first.
+    void SetVolumeFiltering(bool enabled)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _selectionPolicy.set_FilterByVolume(enabled);
+    }
+
+    // Builds the key under which a snapshot of volumePathName taken
+    // through this session can be shared with other callers: the volume,
+    // the provider and its options, the metadata cache and the selection
+    // policy, since any of those can change what the snapshot holds.
+    void GetCoalescingKey(LPCTSTR volumePathName, CString& key)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+
+        key = volumePathName;
+        if (_useMockProvider)
+        {
+            key.AppendFormat(TEXT("|mock=%u,%u,%u,%u,%u,%u"), _mockOptions.writerCount, _mockOptions.componentsPerWriter,
+                _mockOptions.callLatencyMs, _mockOptions.asyncLatencyMs, _mockOptions.hangPhases, _mockOptions.freezeLatencyMsPerWriter);
+            for (unsigned int iWriter = 0; iWriter < _mockWriterNames.size(); ++iWriter)
+            {
+                key.AppendFormat(TEXT(",%d:%s"), _mockWriterNames[iWriter].GetLength(), (LPCTSTR) _mockWriterNames[iWriter]);
+            }
+            key.AppendFormat(TEXT("|files=%d:%s"), _mockComponentFilePath.GetLength(), (LPCTSTR) _mockComponentFilePath);
+        }
+        key.AppendFormat(TEXT("|cache=%s"), (LPCTSTR) _metadataCachePath);
+        _selectionPolicy.AppendKey(key);
+    }
+
+    // Rules apply to snapshots started after they're added.
+    void AddSelectionRule(ShadowSpawnSelectionAction action, ShadowSpawnSelectionField field, LPCTSTR pattern)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _selectionPolicy.AddRule(action, field, pattern);
+    }
+
+    void ClearSelectionRules(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _selectionPolicy.Clear();
+    }
+
+    // Copies the policy out, so a snapshot in flight isn't affected by
+    // rules changing underneath it.
+    void GetSelectionPolicy(CSelectionPolicy& selectionPolicy)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        selectionPolicy = _selectionPolicy;
+    }
+
+    // Hands log messages to the LogCallback from a background thread
+    // through a queue of capacity messages, or directly again when
+    // capacity is zero. Safe while snapshots are in flight: the old queue
+    // is only freed once nothing is still logging through it.
+    void SetLogQueue(DWORD capacity, ShadowSpawnLogOverflowPolicy overflowPolicy)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_outputLock);
+        _logger.SetLogQueue(NULL);
+        _pLogQueue.Free();
+
+        if (capacity == 0)
+        {
+            return;
+        }
+
+        CAutoPtr<CLogQueue> pLogQueue(new CLogQueue(capacity, overflowPolicy, _logCallback));
+        if (!pLogQueue->get_IsRunning())
+        {
+            throw new CShadowSpawnException(HRESULT_FROM_WIN32(::GetLastError()), TEXT("Unable to start the log queue thread."));
+        }
+
+        _pLogQueue = pLogQueue;
+        _logger.SetLogQueue(_pLogQueue);
+    }
+
+    // Waits until everything logged so far has reached the LogCallback.
+    void FlushLog(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_outputLock);
+        if (_pLogQueue != NULL)
+        {
+            _pLogQueue->Flush();
+        }
+    }
+
+    // Sends structured events to callback in batches, or stops recording
+    // them when callback is NULL. Like SetLogQueue, safe while snapshots
+    // are in flight.
+    void SetEventCallback(ShadowSpawnEventCallback* callback, void* context)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_outputLock);
+        _logger.SetEventLog(NULL);
+        _pEventLog.Free();
+
+        if (callback == NULL)
+        {
+            return;
+        }
+
+        _pEventLog.Attach(new CEventLog(callback, context));
+        _logger.SetEventLog(_pEventLog);
+    }
+
+    void FlushEvents(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_outputLock);
+        if (_pEventLog != NULL)
+        {
+            _pEventLog->Flush();
+        }
+    }
+
+    // Loads the writer metadata cache from path and keeps it up to date
+    // there from now on.
+    void SetWriterMetadataCachePath(LPCTSTR path)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _metadataCachePath = path;
+        _metadataCache.Load(path, _logger);
+    }
+
+    void SaveWriterMetadataCache(void)
+    {
+        CString path;
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            path = _metadataCachePath;
+        }
+
+        if (!path.IsEmpty())
+        {
+            _metadataCache.Save(path, _logger);
+        }
+    }
+
+    GUID GetSystemProviderId(ISnapshotProvider& provider)
+    {
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            if (_hasSystemProviderId)
+            {
+                _logger.WriteLine(TEXT("Using cached system VSS provider id"));
+                return _systemProviderId;
+            }
+        }
+
+        // Discovery is slow, so don't hold the lock while it runs. Two
+        // threads racing here will both find the same provider.
+        GUID systemProviderId = provider.GetSystemProviderId();
+
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _systemProviderId = systemProviderId;
+        _hasSystemProviderId = true;
+        return systemProviderId;
+    }
+
+    // Forgets the cached provider, e.g. because VSS no longer recognizes it.
+    void InvalidateSystemProviderId(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _hasSystemProviderId = false;
+        _systemProviderId = GUID_NULL;
+    }
+
+    // Called as each snapshot starts. If the selection policy matches
+    // components' files to volumes, makes the next GetVolumePathName read
+    // the system's mount points again, so a snapshot taken after a volume
+    // was mounted or dismounted doesn't leave out the wrong components;
+    // lookups for the components of one snapshot still share a single
+    // read. Otherwise only the sources are looked up, and the cache's own
+    // maximum age is fresh enough for them.
+    void RefreshVolumePaths(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        if (_selectionPolicy.get_UsesVolumes())
+        {
+            _volumePathNames.Invalidate();
+        }
+    }
+
+    void GetVolumePathName(LPCTSTR path, CString& volumePathName)
+    {
+        if (_volumePathNames.Lookup(path, volumePathName, _logger))
+        {
+            return;
+        }
+
+        _logger.WriteLine(TEXT("Calling GetVolumePathName"));
+        WCHAR wszVolumePathName[MAX_PATH];
+        BOOL bWorked = ::GetVolumePathName(path, wszVolumePathName, MAX_PATH);
+
+        if (!bWorked)
+        {
+            DWORD error = ::GetLastError();
+            CString errorMessage;
+            Utilities::FormatErrorMessage(error, errorMessage);
+            CString message;
+            message.AppendFormat(TEXT("There was an error retrieving the volume name from the path. Path: %s Error: %s"),
+                path, errorMessage);
+            throw new CShadowSpawnException(message.GetString());
+        }
+
+        volumePathName = wszVolumePathName;
+        _volumePathNames.Remember(path, volumePathName);
+    }
+};
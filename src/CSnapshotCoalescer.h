@@ -0,0 +1,238 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CDeadline.h"
+#include "CSnapshotSet.h"
+
+using namespace std;
+
+// A snapshot shared by every caller that asked for the same volume, with
+// the same policy, while it was still open for joining. The first caller
+// (the leader) creates the snapshot, hands the snapshot set over and
+// signals Ready; every caller, leader included, releases it through
+// CSnapshotCoalescer once its callback has returned, and whoever releases
+// last finishes the snapshot set and deletes this object. Nobody waits
+// for anybody else's callback.
+class CCoalescedSnapshot
+{
+private:
+    CString _key;
+    DWORD _openedTicks;
+    DWORD _joinableMs;
+    HANDLE _hReady;
+    LONG _refCount;
+    HRESULT _hrCreate;
+    CString _deviceObject;
+    FILETIME _snapshotTime;
+    CSnapshotSet* _pSnapshotSet;
+
+public:
+    // Callers can join for joinableMs from now.
+    CCoalescedSnapshot::CCoalescedSnapshot(LPCTSTR key, DWORD joinableMs)
+    {
+        _key = key;
+        _openedTicks = ::GetTickCount();
+        _joinableMs = joinableMs;
+        _hReady = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+        _refCount = 0;
+        _hrCreate = E_PENDING;
+        ::ZeroMemory(&_snapshotTime, sizeof(_snapshotTime));
+        _pSnapshotSet = NULL;
+    }
+
+    CCoalescedSnapshot::~CCoalescedSnapshot()
+    {
+        ::CloseHandle(_hReady);
+    }
+
+    CString& get_Key(void)
+    {
+        return _key;
+    }
+
+    bool get_IsJoinable(void)
+    {
+        return ::GetTickCount() - _openedTicks < _joinableMs;
+    }
+
+    HRESULT get_CreateResult(void)
+    {
+        return _hrCreate;
+    }
+
+    CString& get_DeviceObject(void)
+    {
+        return _deviceObject;
+    }
+
+    const FILETIME& get_SnapshotTime(void)
+    {
+        return _snapshotTime;
+    }
+
+    // Only CSnapshotCoalescer counts references, under its lock, so that
+    // nobody joins a snapshot whose last reference is already gone.
+    void AddRef(void)
+    {
+        ::InterlockedIncrement(&_refCount);
+    }
+
+    bool Release(void)
+    {
+        return ::InterlockedDecrement(&_refCount) == 0;
+    }
+
+    // Takes ownership of pSnapshotSet, which may be NULL if creating it
+    // failed, and lets the callers waiting in WaitUntilReady go.
+    void SignalReady(HRESULT hrCreate, LPCTSTR deviceObject, const FILETIME& snapshotTime, CSnapshotSet* pSnapshotSet)
+    {
+        _hrCreate = hrCreate;
+        _deviceObject = deviceObject;
+        _snapshotTime = snapshotTime;
+        _pSnapshotSet = pSnapshotSet;
+        ::SetEvent(_hReady);
+    }
+
+    // Returns false if deadline ran out, or its call was cancelled, before
+    // the leader was done creating the snapshot.
+    bool WaitUntilReady(CDeadline& deadline)
+    {
+        return deadline.WaitFor(_hReady, INFINITE);
+    }
+
+    CSnapshotSet* DetachSnapshotSet(void)
+    {
+        CSnapshotSet* pSnapshotSet = _pSnapshotSet;
+        _pSnapshotSet = NULL;
+        return pSnapshotSet;
+    }
+};
+
+// Groups concurrent in-process requests for the same volume into one
+// snapshot. A request only joins one with the same key, which callers
+// build from the volume and everything about their session that shapes
+// the snapshot. The leader starts creating the snapshot straight away,
+// and it stays open for joining for the window after the leader arrived,
+// or as much of it as the leader's deadline leaves, whether it is still
+// being created by then or not. A joiner can therefore be handed a
+// snapshot taken up to the window before it asked. A window of zero
+// turns coalescing off.
+class CSnapshotCoalescer
+{
+private:
+    CComAutoCriticalSection _lock;
+    DWORD _window;
+    vector<CCoalescedSnapshot*> _open;
+
+    // Call with the lock held.
+    void Remove(CCoalescedSnapshot* pSnapshot)
+    {
+        for (unsigned int iOpen = 0; iOpen < _open.size(); ++iOpen)
+        {
+            if (_open[iOpen] == pSnapshot)
+            {
+                _open.erase(_open.begin() + iOpen);
+                return;
+            }
+        }
+    }
+
+public:
+    CSnapshotCoalescer::CSnapshotCoalescer()
+    {
+        _window = 0;
+    }
+
+    DWORD get_Window(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        return _window;
+    }
+
+    void set_Window(DWORD value)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _window = value;
+    }
+
+    // Returns the open snapshot for key, creating it (and making the
+    // caller, whose deadline bounds how long it stays open, its leader)
+    // if there isn't one. The caller holds a reference to the result
+    // either way, which it gives back with Release.
+    CCoalescedSnapshot* Join(LPCTSTR key, CDeadline& deadline, bool& isLeader)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+
+        unsigned int iOpen = 0;
+        while (iOpen < _open.size())
+        {
+            CCoalescedSnapshot* pOpen = _open[iOpen];
+            if (!pOpen->get_IsJoinable())
+            {
+                // Its holders still release it; it's just not open any more.
+                _open.erase(_open.begin() + iOpen);
+                continue;
+            }
+
+            if (pOpen->get_Key().CompareNoCase(key) == 0)
+            {
+                isLeader = false;
+                pOpen->AddRef();
+                return pOpen;
+            }
+            ++iOpen;
+        }
+
+        CCoalescedSnapshot* pSnapshot = new CCoalescedSnapshot(key, min(_window, deadline.get_RemainingMs()));
+        pSnapshot->AddRef();
+        _open.push_back(pSnapshot);
+        isLeader = true;
+        return pSnapshot;
+    }
+
+    // Stops further callers from joining pSnapshot before its window is
+    // up, e.g. because it couldn't be created.
+    void Close(CCoalescedSnapshot* pSnapshot)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        Remove(pSnapshot);
+    }
+
+    // Gives back a reference Join handed out. Returns true for the last
+    // one, in which case nobody can join pSnapshot any more and the caller
+    // must take the snapshot set with DetachSnapshotSet and then delete
+    // pSnapshot.
+    bool Release(CCoalescedSnapshot* pSnapshot)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        if (!pSnapshot->Release())
+        {
+            return false;
+        }
+
+        Remove(pSnapshot);
+        return true;
+    }
+};
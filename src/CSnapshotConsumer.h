@@ -0,0 +1,192 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "Exports.h"
+
+using namespace std;
+
+// Whatever the caller wants done while the snapshot is mounted: either
+// the original ShadowSpawnCallback, or a ShadowSpawnCallbackEx, which is
+// told where the snapshot is and may run as several workers at once.
+class CSnapshotConsumer
+{
+private:
+    struct Worker
+    {
+        CSnapshotConsumer* pConsumer;
+        ShadowSpawnSnapshotInfo info;
+        HRESULT hr;
+    };
+
+    ShadowSpawnCallback* _callback;
+    ShadowSpawnCallbackEx* _callbackEx;
+    void* _context;
+    DWORD _workerCount;
+
+    volatile LONG _running;
+    HANDLE _hAllDone;
+
+    static DWORD WINAPI WorkerProc(LPVOID parameter)
+    {
+        Worker* pWorker = (Worker*) parameter;
+        CSnapshotConsumer* pConsumer = pWorker->pConsumer;
+        pWorker->hr = pConsumer->_callbackEx(&pWorker->info, pConsumer->_context);
+        pConsumer->WorkerDone();
+        return 0;
+    }
+
+    void WorkerDone(void)
+    {
+        if (::InterlockedDecrement(&_running) == 0)
+        {
+            ::SetEvent(_hAllDone);
+        }
+    }
+
+public:
+    CSnapshotConsumer::CSnapshotConsumer(ShadowSpawnCallback* callback)
+    {
+        _callback = callback;
+        _callbackEx = NULL;
+        _context = NULL;
+        _workerCount = 1;
+        _running = 0;
+        _hAllDone = NULL;
+    }
+
+    // Runs callbackEx workerCount times at once, on the system thread
+    // pool, when workerCount is more than one.
+    CSnapshotConsumer::CSnapshotConsumer(ShadowSpawnCallbackEx* callbackEx, void* context, DWORD workerCount)
+    {
+        _callback = NULL;
+        _callbackEx = callbackEx;
+        _context = context;
+        _workerCount = (workerCount == 0) ? 1 : workerCount;
+        _running = 0;
+        _hAllDone = NULL;
+    }
+
+    CSnapshotConsumer::~CSnapshotConsumer()
+    {
+        if (_hAllDone != NULL)
+        {
+            ::CloseHandle(_hAllDone);
+        }
+    }
+
+    // Only a ShadowSpawnCallbackEx is told where the snapshot is, so only
+    // it can do without a device.
+    bool get_UsesSnapshotRoot(void)
+    {
+        return _callbackEx != NULL;
+    }
+
+    // Calls back for source, now visible at snapshotRoot (a device or a
+    // snapshot path), and waits for every worker to return. Returns the
+    // first failure, by worker index.
+    HRESULT Invoke(LPCTSTR source, LPCTSTR snapshotRoot, const FILETIME& snapshotTime)
+    {
+        if (_callback != NULL)
+        {
+            _callback();
+            return S_OK;
+        }
+
+        CString root(snapshotRoot);
+        if (root.Right(1) != TEXT("\\"))
+        {
+            root.AppendChar(TEXT('\\'));
+        }
+
+        vector<Worker> workers(_workerCount);
+        for (DWORD iWorker = 0; iWorker < _workerCount; ++iWorker)
+        {
+            workers[iWorker].pConsumer = this;
+            workers[iWorker].info.snapshotRoot = root;
+            workers[iWorker].info.source = source;
+            workers[iWorker].info.snapshotTime = snapshotTime;
+            workers[iWorker].info.workerIndex = iWorker;
+            workers[iWorker].info.workerCount = _workerCount;
+            workers[iWorker].hr = E_PENDING;
+        }
+
+        if (_workerCount == 1)
+        {
+            return _callbackEx(&workers[0].info, _context);
+        }
+
+        if (_hAllDone == NULL)
+        {
+            _hAllDone = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+        }
+
+        // The last worker is run on this thread, which would otherwise
+        // only be waiting.
+        _running = (LONG) _workerCount;
+        for (DWORD iWorker = 0; iWorker + 1 < _workerCount; ++iWorker)
+        {
+            if (!::QueueUserWorkItem(WorkerProc, &workers[iWorker], WT_EXECUTELONGFUNCTION))
+            {
+                workers[iWorker].hr = HRESULT_FROM_WIN32(::GetLastError());
+                WorkerDone();
+            }
+        }
+        WorkerProc(&workers[_workerCount - 1]);
+        ::WaitForSingleObject(_hAllDone, INFINITE);
+
+        for (DWORD iWorker = 0; iWorker < _workerCount; ++iWorker)
+        {
+            if (FAILED(workers[iWorker].hr))
+            {
+                return workers[iWorker].hr;
+            }
+        }
+        return S_OK;
+    }
+
+    // Calls back for every one of sources, each now visible at the
+    // snapshotRoot of the same index, and returns the first failure. A
+    // ShadowSpawnCallback knows nothing of sources, so it is called once
+    // for all of them; a ShadowSpawnCallbackEx is invoked for each source
+    // in turn, stopping at the first that fails.
+    HRESULT Invoke(const vector<CString>& sources, const vector<CString>& snapshotRoots, const FILETIME& snapshotTime)
+    {
+        if (_callback != NULL)
+        {
+            _callback();
+            return S_OK;
+        }
+
+        for (unsigned int iSource = 0; iSource < sources.size(); ++iSource)
+        {
+            HRESULT hr = Invoke(sources[iSource], snapshotRoots[iSource], snapshotTime);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+        return S_OK;
+    }
+};
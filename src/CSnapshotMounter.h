@@ -0,0 +1,143 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CPhaseStatistics.h"
+#include "CShadowSpawnException.h"
+#include "OutputWriter.h"
+#include "Utilities.h"
+
+using namespace std;
+
+// Makes a snapshot of a source directory visible at a DOS device (usually
+// a drive letter) and takes it away again, or works out the path it can be
+// reached at without one. Kept apart from CSnapshotSet because a coalesced
+// snapshot is mounted by callers that don't own it.
+class CSnapshotMounter
+{
+public:
+    static void CheckSource(LPCTSTR source)
+    {
+        if (!Utilities::DirectoryExists(source))
+        {
+            CString message;
+            message.AppendFormat(TEXT("Source path is not an existing directory: %s"), source);
+            throw new CShadowSpawnException(HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND), message);
+        }
+    }
+
+    static void CalculateSourcePath(LPCTSTR wszSnapshotDevice, LPCTSTR wszBackupSource, LPCTSTR wszMountPoint, CString& output)
+    {
+        CString backupSource(wszBackupSource);
+        CString mountPoint(wszMountPoint);
+
+        CString subdirectory = backupSource.Mid(mountPoint.GetLength());
+
+        Utilities::CombinePath(wszSnapshotDevice, subdirectory, output);
+    }
+
+    // The \\?\GLOBALROOT path of source inside the snapshot, with a trailing
+    // backslash. Unlike a device, it needs no drive letter and no cleanup,
+    // so any number of callers can use snapshots this way at once.
+    static void GetSnapshotPath(LPCTSTR snapshotDeviceObject, LPCTSTR source, LPCTSTR volumePathName, CString& snapshotPath)
+    {
+        CalculateSourcePath(snapshotDeviceObject, source, volumePathName, snapshotPath);
+        if (snapshotPath.Right(1) != TEXT("\\"))
+        {
+            snapshotPath.AppendChar(TEXT('\\'));
+        }
+    }
+
+    static void Mount(LPCTSTR snapshotDeviceObject, LPCTSTR source, LPCTSTR volumePathName, LPCTSTR device, OutputWriter& logger)
+    {
+        CPhaseTimer mountTimer;
+        logger.WriteLine(TEXT("Calling CalculateSourcePath"));
+        // TODO: We'll eventually have to deal with mount points
+        CString wszSource;
+        CalculateSourcePath(
+            snapshotDeviceObject,
+            source,
+            volumePathName,
+            wszSource
+            );
+
+        logger.WriteLine(TEXT("Calling DefineDosDevice to mount device."));
+        if (0 == wszSource.Find(TEXT("\\\\?\\GLOBALROOT")))
+        {
+            wszSource = wszSource.Mid(_tcslen(TEXT("\\\\?\\GLOBALROOT")));
+        }
+        BOOL bWorked = ::DefineDosDevice(DDD_RAW_TARGET_PATH, device, wszSource);
+        if (!bWorked)
+        {
+            DWORD error = ::GetLastError();
+            CString errorMessage;
+            Utilities::FormatErrorMessage(error, errorMessage);
+            CString message;
+            message.AppendFormat(TEXT("There was an error calling DefineDosDevice when mounting a device. Error: %s"), errorMessage);
+            throw new CShadowSpawnException(message.GetString());
+        }
+        mountTimer.Record(SHADOWSPAWN_PHASE_MOUNT, logger);
+        logger.WriteEvent(SHADOWSPAWN_EVENT_SNAPSHOT_MOUNTED, SHADOWSPAWN_PHASE_MOUNT, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE,
+            S_OK, 0, device);
+    }
+
+    static void Unmount(LPCTSTR device, OutputWriter& logger)
+    {
+        logger.WriteLine(TEXT("Calling DefineDosDevice to remove device."));
+        CPhaseTimer unmountTimer;
+        BOOL bWorked = ::DefineDosDevice(DDD_REMOVE_DEFINITION, device, NULL);
+        if (!bWorked)
+        {
+            DWORD error = ::GetLastError();
+            CString errorMessage;
+            Utilities::FormatErrorMessage(error, errorMessage);
+            CString message;
+            message.AppendFormat(TEXT("There was an error calling DefineDosDevice. Error: %s"), errorMessage);
+            throw new CShadowSpawnException(message.GetString());
+        }
+        unmountTimer.Record(SHADOWSPAWN_PHASE_UNMOUNT, logger);
+    }
+
+    // Removes every device in mountedDevices for cleanup. Failures are
+    // logged rather than thrown.
+    static void Dismount(bool bAbnormalAbort, const vector<CString>& mountedDevices, OutputWriter& logger)
+    {
+        for (unsigned int iDevice = 0; iDevice < mountedDevices.size(); ++iDevice)
+        {
+            const CString& mountedDevice = mountedDevices[iDevice];
+            if (bAbnormalAbort)
+            {
+                logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Dismounting device: %s"), mountedDevice);
+            }
+            BOOL bWorked = ::DefineDosDevice(DDD_REMOVE_DEFINITION, mountedDevice, NULL);
+            if (!bWorked)
+            {
+                DWORD error = ::GetLastError();
+                CString errorMessage;
+                Utilities::FormatErrorMessage(error, errorMessage);
+                logger.WriteFormat(TEXT("There was an error calling DefineDosDevice during Cleanup. Error: %s"), errorMessage);
+            }
+        }
+    }
+};
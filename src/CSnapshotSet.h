@@ -0,0 +1,712 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CAdmissionQueue.h"
+#include "CComException.h"
+#include "CShadowSpawnException.h"
+#include "CShadowSpawnSession.h"
+#include "CDeadline.h"
+#include "CPhaseStatistics.h"
+#include "CSelectionPolicy.h"
+#include "ISnapshotProvider.h"
+#include "OutputWriter.h"
+
+using namespace std;
+
+// One VSS snapshot set, from provider discovery through DoSnapshotSet and
+// on to BackupComplete and deletion. Mounting the snapshot somewhere
+// useful is left to the caller. Failures are thrown as CComException or
+// CShadowSpawnException; call Abort and then Delete to clean up.
+class CSnapshotSet
+{
+private:
+    static const DWORD POLL_INTERVAL_MS = 50;
+    static const DWORD MAX_CREATE_ATTEMPTS = 5;
+    static const DWORD RETRY_BASE_MS = 250;
+    static const DWORD RETRY_MAX_MS = 8000;
+
+    CShadowSpawnSession& _session;
+    OutputWriter& _logger;
+    CAutoPtr<ISnapshotProvider> _pProvider;
+    GUID _systemProviderId;
+    GUID _snapshotSetId;
+    bool _snapshotCreated;
+    vector<CString> _volumes;
+    vector<GUID> _snapshotIds;
+    CPhaseTimer _asyncTimer;
+    ShadowSpawnPhase _asyncPhase;
+    CSelectionPolicy _selectionPolicy;
+    CDeadline _deadline;
+    bool _admitted;
+    bool _queuing;
+    bool _holdsSlot;
+    CPhaseTimer _admissionTimer;
+    bool _writersRejected;
+    FILETIME _snapshotTime;
+
+    static bool ShouldAddComponent(CWriterComponent& component)
+    {
+        // Component should not be added if
+        // 1) It is not selectable for backup and
+        // 2) It has a selectable ancestor
+        // Otherwise, add it.
+
+        if (component.get_SelectableForBackup())
+        {
+            return true;
+        }
+
+        return !component.get_HasSelectableAncestor();
+    }
+
+    // Queues behind any other snapshot set being created, in this process
+    // or another, until this one's turn comes.
+    // Does nothing if TryAdmit already let this set in.
+    void Admit(void)
+    {
+        if (_admitted)
+        {
+            return;
+        }
+
+        CAdmissionQueue::get_Instance(_session.get_UsesMockProvider()).Acquire(_deadline, _logger);
+        _admitted = true;
+    }
+
+    void Leave(void)
+    {
+        CAdmissionQueue& admissionQueue = CAdmissionQueue::get_Instance(_session.get_UsesMockProvider());
+        if (_admitted)
+        {
+            _admitted = false;
+            _holdsSlot = false;
+            admissionQueue.Release();
+        }
+        else
+        {
+            admissionQueue.Abandon(_holdsSlot);
+        }
+        _queuing = false;
+    }
+
+    // Something other than this library, such as Windows Backup, can still
+    // be creating a snapshot set; that's worth waiting out a few times.
+    bool ShouldRetry(HRESULT hr, DWORD attempt)
+    {
+        return hr == VSS_E_SNAPSHOT_SET_IN_PROGRESS && attempt < MAX_CREATE_ATTEMPTS && !_deadline.get_IsOver();
+    }
+
+    // A writer refusing a component, or PrepareForBackup failing, is what
+    // cached metadata that no longer matches the writer looks like. Worth
+    // one more try with the metadata read afresh, if any of it was cached.
+    bool ShouldRetryWithoutCache(bool& retriedWithoutCache)
+    {
+        if (retriedWithoutCache || !_writersRejected || _deadline.get_IsOver() || !_pProvider->EvictCachedWriters())
+        {
+            return false;
+        }
+
+        _logger.WriteLine(TEXT("Cached writer metadata may be out of date. Trying again without it."), VERBOSITY_THRESHOLD_NORMAL);
+        retriedWithoutCache = true;
+        return true;
+    }
+
+    // Sleeps a random time up to a limit that doubles with every attempt,
+    // so that callers who collided don't all try again at once.
+    void Backoff(DWORD attempt)
+    {
+        DWORD limit = RETRY_BASE_MS << (attempt - 1);
+        if (limit > RETRY_MAX_MS)
+        {
+            limit = RETRY_MAX_MS;
+        }
+
+        LARGE_INTEGER counter;
+        ::QueryPerformanceCounter(&counter);
+        DWORD seed = counter.LowPart ^ (::GetCurrentThreadId() * 2654435761U);
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        DWORD delay = seed % (limit + 1);
+
+        _logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL,
+            TEXT("Another snapshot set is being created. Trying again in %d ms (attempt %d of %d)."), delay, attempt + 1, MAX_CREATE_ATTEMPTS);
+        _deadline.Wait(delay);
+    }
+
+    // Gets ready to start over after a failed attempt at Create.
+    void Reset(void)
+    {
+        Abort();
+        Delete(true);
+        _pProvider.Free();
+        _pProvider.Attach(_session.CreateProvider());
+        _snapshotSetId = GUID_NULL;
+        _volumes.clear();
+        _snapshotIds.clear();
+        _writersRejected = false;
+    }
+
+    void CreateOnce(const vector<CString>& volumes, bool simulate)
+    {
+        CComPtr<IVssAsync> pWriterMetadataStatus;
+        BeginGatherWriterMetadata(&pWriterMetadataStatus);
+        WaitForAsync(pWriterMetadataStatus, TEXT("GatherWriterMetadata"));
+
+        AddVolumes(volumes);
+
+        CComPtr<IVssAsync> pPrepareForBackupResults;
+        BeginPrepareForBackup(&pPrepareForBackupResults);
+        WaitForAsync(pPrepareForBackupResults, TEXT("PrepareForBackup"));
+
+        if (simulate)
+        {
+            Leave();
+            return;
+        }
+
+        CComPtr<IVssAsync> pDoSnapshotSetResults;
+        BeginDoSnapshotSet(&pDoSnapshotSetResults);
+        WaitForAsync(pDoSnapshotSetResults, TEXT("DoSnapshotSet"));
+    }
+
+    // Times the asynchronous phase about to start, up to its EndAsync,
+    // and doesn't let it start at all once the deadline is over.
+    void StartAsyncTimer(ShadowSpawnPhase phase)
+    {
+        _deadline.Check(TEXT("The snapshot"));
+
+        DWORD remaining = _deadline.get_RemainingMs();
+        if (remaining != INFINITE)
+        {
+            _logger.WriteFormat(TEXT("%d ms of the time budget left"), remaining);
+        }
+
+        _asyncPhase = phase;
+        _asyncTimer.Restart();
+    }
+
+    void WaitForAsync(IVssAsync* pAsync, LPCTSTR operation)
+    {
+        _logger.WriteFormat(TEXT("Waiting for call to %s to finish..."), operation);
+
+        if (_deadline.get_IsUnbounded())
+        {
+            CHECK_HRESULT(pAsync->Wait());
+        }
+        else
+        {
+            while (PollAsync(pAsync, operation))
+            {
+                _deadline.Wait(POLL_INTERVAL_MS);
+            }
+        }
+
+        EndAsync(pAsync, operation);
+    }
+
+    // Works out whether component's own files are on any of the volumes
+    // in the set. Must be called after the volumes have been added.
+    CSelectionPolicy::VolumeMatch MatchVolumes(CWriterComponent& component)
+    {
+        if (!component.get_FilePathsKnown())
+        {
+            return CSelectionPolicy::VOLUME_UNKNOWN;
+        }
+
+        CSelectionPolicy::VolumeMatch volumeMatch = CSelectionPolicy::VOLUME_OFF;
+        vector<CString>& filePaths = component.get_FilePaths();
+        for (unsigned int iPath = 0; iPath < filePaths.size(); ++iPath)
+        {
+            // Writers report paths like %SystemRoot%\System32.
+            WCHAR wszExpanded[MAX_PATH];
+            DWORD cchExpanded = ::ExpandEnvironmentStrings(filePaths[iPath], wszExpanded, MAX_PATH);
+            if (cchExpanded == 0 || cchExpanded > MAX_PATH)
+            {
+                volumeMatch = CSelectionPolicy::VOLUME_UNKNOWN;
+                continue;
+            }
+
+            CString volumePathName;
+            try
+            {
+                _session.GetVolumePathName(wszExpanded, volumePathName);
+            }
+            catch (CShadowSpawnException* e)
+            {
+                delete e;
+                volumeMatch = CSelectionPolicy::VOLUME_UNKNOWN;
+                continue;
+            }
+
+            for (unsigned int iVolume = 0; iVolume < _volumes.size(); ++iVolume)
+            {
+                if (_volumes[iVolume].CompareNoCase(volumePathName) == 0)
+                {
+                    return CSelectionPolicy::VOLUME_ON;
+                }
+            }
+        }
+
+        return volumeMatch;
+    }
+
+    // Matches every component of writer against the volumes in the set.
+    // Adding a component brings its subcomponents along, so a component
+    // counts as on a volume if any of its descendants is, and as unknown
+    // if any of them is and none is on one.
+    void MatchVolumes(CWriter& writer, vector<CSelectionPolicy::VolumeMatch>& volumeMatches)
+    {
+        vector<CWriterComponent>& components = writer.get_Components();
+        volumeMatches.resize(components.size());
+        for (unsigned int iComponent = 0; iComponent < components.size(); ++iComponent)
+        {
+            volumeMatches[iComponent] = MatchVolumes(components[iComponent]);
+        }
+
+        // A component only ever moves from off to unknown to on, and the
+        // walk stops at the first ancestor already as far along, so each
+        // ancestor is passed at most twice in all.
+        for (unsigned int iComponent = 0; iComponent < components.size(); ++iComponent)
+        {
+            CSelectionPolicy::VolumeMatch volumeMatch = volumeMatches[iComponent];
+            if (volumeMatch == CSelectionPolicy::VOLUME_OFF)
+            {
+                continue;
+            }
+
+            int iParent = components[iComponent].get_ParentIndex();
+            while (iParent >= 0 && !(volumeMatches[iParent] == CSelectionPolicy::VOLUME_ON ||
+                volumeMatches[iParent] == volumeMatch))
+            {
+                volumeMatches[iParent] = volumeMatch;
+                iParent = components[iParent].get_ParentIndex();
+            }
+        }
+    }
+
+    void AddComponents(vector<CWriter>& writers)
+    {
+        bool usesVolumes = _selectionPolicy.get_UsesVolumes();
+
+        // Writers the policy leaves with nothing to back up are disabled
+        // outright, so they don't freeze and thaw for nothing.
+        vector<GUID> disabledInstanceIds;
+        vector<CSelectionPolicy::VolumeMatch> volumeMatches;
+
+        for (unsigned int iWriter = 0; iWriter < writers.size(); ++iWriter)
+        {
+            CWriter& writer = writers[iWriter];
+            bool addedAny = false;
+            bool excludedAny = false;
+
+            if (usesVolumes)
+            {
+                MatchVolumes(writer, volumeMatches);
+            }
+
+            _logger.WriteFormat(TEXT("Adding components to snapshot set for writer %s"), writer.get_Name());
+            _logger.WriteEvent(SHADOWSPAWN_EVENT_WRITER, SHADOWSPAWN_PHASE_ADD_COMPONENTS, iWriter, SHADOWSPAWN_EVENT_NONE,
+                S_OK, (DWORD) writer.get_Components().size(), writer.get_Name());
+            for (unsigned int iComponent = 0; iComponent < writer.get_Components().size(); ++iComponent)
+            {
+                CWriterComponent& component = writer.get_Components()[iComponent];
+
+                CSelectionPolicy::VolumeMatch volumeMatch = usesVolumes ? volumeMatches[iComponent] : CSelectionPolicy::VOLUME_UNKNOWN;
+
+                bool add = ShouldAddComponent(component);
+                if (add && !_selectionPolicy.ShouldInclude(writer, component, volumeMatch))
+                {
+                    add = false;
+                    excludedAny = true;
+                }
+
+                if (add)
+                {
+                    _logger.WriteFormat(TEXT("Adding component %s (%s) from writer %s"),
+                        component.get_Name(),
+                        component.get_LogicalPath(),
+                        writer.get_Name());
+                    HRESULT hrAddComponent = _pProvider->AddComponent(writer, component);
+                    _writersRejected = FAILED(hrAddComponent);
+                    CHECK_HRESULT(hrAddComponent);
+                    _logger.WriteEvent(SHADOWSPAWN_EVENT_COMPONENT_ADDED, SHADOWSPAWN_PHASE_ADD_COMPONENTS, iWriter, iComponent,
+                        S_OK, 0, NULL);
+                    addedAny = true;
+                }
+                else
+                {
+                    _logger.WriteFormat(TEXT("Not adding component %s from writer %s."),
+                        component.get_Name(), writer.get_Name());
+                    _logger.WriteEvent(SHADOWSPAWN_EVENT_COMPONENT_SKIPPED, SHADOWSPAWN_PHASE_ADD_COMPONENTS, iWriter, iComponent,
+                        S_OK, 0, NULL);
+                }
+            }
+
+            if (!addedAny && excludedAny)
+            {
+                disabledInstanceIds.push_back(writer.get_InstanceId());
+            }
+        }
+
+        // Not being able to disable a writer only costs time, so carry on.
+        HRESULT hrDisable = _pProvider->DisableWriterInstances(disabledInstanceIds);
+        if (FAILED(hrDisable))
+        {
+            _logger.WriteFormat(TEXT("Unable to disable %d unselected writers: 0x%x"), (int) disabledInstanceIds.size(), hrDisable);
+        }
+    }
+
+public:
+    CSnapshotSet::CSnapshotSet(CShadowSpawnSession& session) :
+        _session(session),
+        _logger(session.get_Logger()),
+        _pProvider(session.CreateProvider())
+    {
+        _systemProviderId = GUID_NULL;
+        _snapshotSetId = GUID_NULL;
+        _snapshotCreated = false;
+        _asyncPhase = SHADOWSPAWN_PHASE_GATHER_WRITER_METADATA;
+        _admitted = false;
+        _queuing = false;
+        _holdsSlot = false;
+        _writersRejected = false;
+        ::ZeroMemory(&_snapshotTime, sizeof(_snapshotTime));
+        session.GetSelectionPolicy(_selectionPolicy);
+    }
+
+    CSnapshotSet::~CSnapshotSet()
+    {
+        Leave();
+    }
+
+    CShadowSpawnSession& get_Session(void)
+    {
+        return _session;
+    }
+
+    bool get_SnapshotCreated(void)
+    {
+        return _snapshotCreated;
+    }
+
+    // When DoSnapshotSet finished, in UTC; zero until then.
+    const FILETIME& get_SnapshotTime(void)
+    {
+        return _snapshotTime;
+    }
+
+    // Bounds every wait from now on, including BackupComplete's.
+    void set_Deadline(const CDeadline& value)
+    {
+        _deadline = value;
+    }
+
+    // Stops the deadline's clock once the snapshot is ready for the host,
+    // since neither its callback nor a wait in the cleanup queue counts
+    // against the time limit. BackupComplete starts the clock again with
+    // whatever was left.
+    void PauseDeadline(void)
+    {
+        _deadline.Pause();
+    }
+
+    // Returns true while the operation behind pAsync is still running.
+    // Never blocks, so callers can poll a set instead of waiting on it.
+    static bool IsAsyncPending(IVssAsync* pAsync)
+    {
+        HRESULT hrStatus;
+        CHECK_HRESULT(pAsync->QueryStatus(&hrStatus, NULL));
+        return hrStatus == VSS_S_ASYNC_PENDING;
+    }
+
+    // Like IsAsyncPending, but cancels the operation and throws once the
+    // deadline is over.
+    bool PollAsync(IVssAsync* pAsync, LPCTSTR operation)
+    {
+        if (!IsAsyncPending(pAsync))
+        {
+            return false;
+        }
+
+        if (_deadline.get_IsOver())
+        {
+            _logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Cancelling call to %s."), operation);
+            pAsync->Cancel();
+            _deadline.Check(operation);
+        }
+        return true;
+    }
+
+    // Checks how the operation behind a finished pAsync turned out, and
+    // throws if it was cancelled or failed.
+    void EndAsync(IVssAsync* pAsync, LPCTSTR operation)
+    {
+        HRESULT hrStatus;
+        CHECK_HRESULT(pAsync->QueryStatus(&hrStatus, NULL));
+        _asyncTimer.Record(_asyncPhase, _logger);
+
+        // Once DoSnapshotSet is over, successfully or not, the next
+        // snapshot set can start.
+        if (_asyncPhase == SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET)
+        {
+            Leave();
+        }
+
+        CString message;
+        if (hrStatus != VSS_S_ASYNC_FINISHED)
+        {
+            if (hrStatus == VSS_S_ASYNC_CANCELLED)
+            {
+                message.AppendFormat(TEXT("%s was cancelled."), operation);
+                throw new CShadowSpawnException(E_ABORT, message);
+            }
+
+            if (_asyncPhase == SHADOWSPAWN_PHASE_PREPARE_FOR_BACKUP)
+            {
+                _writersRejected = true;
+            }
+
+            message.AppendFormat(TEXT("%s failed."), operation);
+            throw new CShadowSpawnException(FAILED(hrStatus) ? hrStatus : E_FAIL, message);
+        }
+
+        if (_asyncPhase == SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET)
+        {
+            ::GetSystemTimeAsFileTime(&_snapshotTime);
+        }
+
+        message.AppendFormat(TEXT("Call to %s finished."), operation);
+        _logger.WriteLine(message);
+    }
+
+    // The phases of Create, one call per step, for callers that would
+    // rather poll the IVssAsync each Begin method hands back than block on
+    // it. Pass every result to EndAsync before calling the next step.
+    void BeginGatherWriterMetadata(IVssAsync** ppAsync)
+    {
+        CPhaseTimer discoveryTimer;
+        _systemProviderId = _session.GetSystemProviderId(*_pProvider);
+        discoveryTimer.Record(SHADOWSPAWN_PHASE_PROVIDER_DISCOVERY, _logger);
+
+        CHECK_HRESULT(_pProvider->InitializeForBackup());
+
+        StartAsyncTimer(SHADOWSPAWN_PHASE_GATHER_WRITER_METADATA);
+        CHECK_HRESULT(_pProvider->GatherWriterMetadata(ppAsync));
+    }
+
+    // Admit for callers on the thread pool, which mustn't block while
+    // other snapshot sets are created: returns false while this set still
+    // has to wait its turn, in which case call it again later, and true
+    // once AddVolumes can go ahead without waiting. Throws once the
+    // deadline is over.
+    bool TryAdmit(void)
+    {
+        if (_admitted)
+        {
+            return true;
+        }
+
+        if (!_queuing)
+        {
+            _queuing = true;
+            _admissionTimer.Restart();
+        }
+
+        _admitted = CAdmissionQueue::get_Instance(_session.get_UsesMockProvider()).TryAcquire(_holdsSlot, _deadline, _admissionTimer, _logger);
+        return _admitted;
+    }
+
+    // Holds this snapshot set's place in the admission queue from here
+    // until DoSnapshotSet finishes, or Abort.
+    void AddVolumes(const vector<CString>& volumes)
+    {
+        Admit();
+
+        CPhaseTimer addTimer;
+
+        vector<CWriter> writers;
+        _pProvider->GetWriters(writers);
+        _session.SaveWriterMetadataCache();
+
+        CHECK_HRESULT(_pProvider->StartSnapshotSet(&_snapshotSetId));
+
+        for (unsigned int iVolume = 0; iVolume < volumes.size(); ++iVolume)
+        {
+            GUID snapshotId;
+            HRESULT hrAddToSnapshotSet = _pProvider->AddToSnapshotSet(volumes[iVolume], _systemProviderId, &snapshotId);
+            if (hrAddToSnapshotSet == VSS_E_PROVIDER_NOT_REGISTERED)
+            {
+                _session.InvalidateSystemProviderId();
+            }
+            CHECK_HRESULT(hrAddToSnapshotSet);
+
+            _logger.WriteEvent(SHADOWSPAWN_EVENT_VOLUME_ADDED, SHADOWSPAWN_PHASE_ADD_COMPONENTS, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE,
+                S_OK, 0, volumes[iVolume]);
+
+            _volumes.push_back(volumes[iVolume]);
+            _snapshotIds.push_back(snapshotId);
+        }
+
+        AddComponents(writers);
+
+        CHECK_HRESULT(_pProvider->SetBackupState());
+
+        addTimer.Record(SHADOWSPAWN_PHASE_ADD_COMPONENTS, _logger);
+    }
+
+    void BeginPrepareForBackup(IVssAsync** ppAsync)
+    {
+        StartAsyncTimer(SHADOWSPAWN_PHASE_PREPARE_FOR_BACKUP);
+        HRESULT hrPrepareForBackup = _pProvider->PrepareForBackup(ppAsync);
+        _writersRejected = FAILED(hrPrepareForBackup);
+        CHECK_HRESULT(hrPrepareForBackup);
+    }
+
+    void BeginDoSnapshotSet(IVssAsync** ppAsync)
+    {
+        StartAsyncTimer(SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET);
+        CHECK_HRESULT(_pProvider->DoSnapshotSet(ppAsync));
+
+        // Once DoSnapshotSet has been called there may be something to
+        // delete, even if it goes on to fail.
+        _snapshotCreated = true;
+    }
+
+    void BeginBackupComplete(IVssAsync** ppAsync)
+    {
+        _deadline.Resume();
+        StartAsyncTimer(SHADOWSPAWN_PHASE_BACKUP_COMPLETE);
+        CHECK_HRESULT(_pProvider->BackupComplete(ppAsync));
+    }
+
+    // Snapshots every volume in volumes as one set. With simulate set,
+    // stops after PrepareForBackup without creating anything. If VSS is
+    // busy with another snapshot set, starts over after a randomized
+    // backoff, a few times at most. If writers reject what cached metadata
+    // said about them, starts over once straight away without the cache.
+    void Create(const vector<CString>& volumes, bool simulate)
+    {
+        bool retriedWithoutCache = false;
+        for (DWORD attempt = 1; ; ++attempt)
+        {
+            bool backoff = true;
+            try
+            {
+                CreateOnce(volumes, simulate);
+                return;
+            }
+            catch (CComException* e)
+            {
+                if (ShouldRetryWithoutCache(retriedWithoutCache))
+                {
+                    backoff = false;
+                }
+                else if (!ShouldRetry(e->get_Hresult(), attempt))
+                {
+                    throw;
+                }
+                delete e;
+            }
+            catch (CShadowSpawnException* e)
+            {
+                if (ShouldRetryWithoutCache(retriedWithoutCache))
+                {
+                    backoff = false;
+                }
+                else if (!ShouldRetry(e->get_HResult(), attempt))
+                {
+                    throw;
+                }
+                delete e;
+            }
+
+            Reset();
+            if (backoff)
+            {
+                Backoff(attempt);
+            }
+        }
+    }
+
+    void GetSnapshotDeviceObject(LPCTSTR volume, CString& deviceObject)
+    {
+        for (unsigned int iVolume = 0; iVolume < _volumes.size(); ++iVolume)
+        {
+            if (_volumes[iVolume].CompareNoCase(volume) == 0)
+            {
+                CHECK_HRESULT(_pProvider->GetSnapshotDeviceObject(_snapshotIds[iVolume], deviceObject));
+                return;
+            }
+        }
+
+        CString message;
+        message.AppendFormat(TEXT("Volume %s is not part of the snapshot set."), volume);
+        throw new CShadowSpawnException(E_INVALIDARG, message);
+    }
+
+    void Complete(void)
+    {
+        CComPtr<IVssAsync> pBackupCompleteResults;
+        BeginBackupComplete(&pBackupCompleteResults);
+        WaitForAsync(pBackupCompleteResults, TEXT("BackupComplete"));
+    }
+
+    // Best effort, for use on the error path: failures are ignored.
+    void Abort(void)
+    {
+        if (_pProvider->IsInitialized())
+        {
+            _logger.WriteLine(TEXT("Aborting backup."), VERBOSITY_THRESHOLD_NORMAL);
+            _pProvider->AbortBackup();
+        }
+
+        // Whoever runs next, in this process or a later one, shouldn't
+        // trip over the same stale cache entries.
+        if (_writersRejected && _pProvider->EvictCachedWriters())
+        {
+            _session.SaveWriterMetadataCache();
+        }
+
+        Leave();
+    }
+
+    void Delete(bool bAbnormalAbort)
+    {
+        if (!_pProvider->IsInitialized() || !_snapshotCreated)
+        {
+            return;
+        }
+
+        if (bAbnormalAbort)
+        {
+            _logger.WriteLine(TEXT("Deleting snapshot."), VERBOSITY_THRESHOLD_NORMAL);
+        }
+        CPhaseTimer deleteTimer;
+        _pProvider->DeleteSnapshots(_snapshotSetId);
+        deleteTimer.Record(SHADOWSPAWN_PHASE_DELETE_SNAPSHOTS, _logger);
+        _snapshotCreated = false;
+    }
+};
@@ -0,0 +1,124 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+using namespace std;
+
+// A queue of work items per thread, for a fixed set of threads working
+// through a tree. Each thread takes the newest item from its own queue,
+// which keeps it in the part of the tree it is already in, and once that
+// is empty takes the oldest item from another thread's queue, which is the
+// one most likely to lead to a lot more work. Finished once every queue is
+// empty and no item is being worked on, or once Stop is called.
+template <class T>
+class CStealingQueues
+{
+private:
+    struct Queue
+    {
+        CComAutoCriticalSection lock;
+        CAtlList<T> items;
+    };
+
+    vector<Queue*> _queues;
+    volatile LONG _outstanding;     // Items queued or being worked on
+    HANDLE _hQueued;                // One count per item not yet taken
+    HANDLE _hDone;
+
+public:
+    CStealingQueues::CStealingQueues(DWORD queueCount)
+    {
+        for (DWORD iQueue = 0; iQueue < queueCount; ++iQueue)
+        {
+            _queues.push_back(new Queue());
+        }
+        _outstanding = 0;
+        _hQueued = ::CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+        _hDone = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
+
+    CStealingQueues::~CStealingQueues()
+    {
+        for (unsigned int iQueue = 0; iQueue < _queues.size(); ++iQueue)
+        {
+            delete _queues[iQueue];
+        }
+        ::CloseHandle(_hQueued);
+        ::CloseHandle(_hDone);
+    }
+
+    void Push(DWORD queue, const T& item)
+    {
+        ::InterlockedIncrement(&_outstanding);
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_queues[queue]->lock);
+            _queues[queue]->items.AddTail(item);
+        }
+        ::ReleaseSemaphore(_hQueued, 1, NULL);
+    }
+
+    // Waits for an item for queue's thread. Returns false once there is no
+    // more work.
+    bool Take(DWORD queue, T& item)
+    {
+        HANDLE handles[2] = { _hDone, _hQueued };
+        if (::WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+        {
+            return false;
+        }
+
+        // Having taken a count from _hQueued, there is an item somewhere.
+        for (DWORD iStep = 0; ; ++iStep)
+        {
+            Queue& victim = *_queues[(queue + iStep) % _queues.size()];
+            CComCritSecLock<CComAutoCriticalSection> lock(victim.lock);
+            if (!victim.items.IsEmpty())
+            {
+                item = (iStep == 0) ? victim.items.RemoveTail() : victim.items.RemoveHead();
+                return true;
+            }
+        }
+    }
+
+    // Called for each item Take returned, once anything it led to has
+    // been pushed.
+    void Finish(void)
+    {
+        if (::InterlockedDecrement(&_outstanding) == 0)
+        {
+            ::SetEvent(_hDone);
+        }
+    }
+
+    // Makes Take return false from now on, leaving queued items alone.
+    void Stop(void)
+    {
+        ::SetEvent(_hDone);
+    }
+
+    bool get_IsStopped(void)
+    {
+        return ::WaitForSingleObject(_hDone, 0) == WAIT_OBJECT_0;
+    }
+};
@@ -0,0 +1,63 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+using namespace std;
+
+// Hands out one shared copy of each distinct string. CString buffers are
+// reference counted, so every component interned through the same pool
+// points at a single buffer for, say, a logical path that a writer's
+// thousand components all have in common, instead of allocating one each.
+class CStringPool
+{
+private:
+    // CStringElementTraits lets Lookup take an LPCTSTR, so finding a
+    // string that is already pooled allocates nothing.
+    CAtlMap<CString, int, CStringElementTraits<CString> > _strings;
+
+public:
+    CStringPool::CStringPool()
+    {
+        _strings.InitHashTable(257);
+    }
+
+    const CString& Intern(LPCTSTR value)
+    {
+        LPCTSTR key = (value == NULL) ? TEXT("") : value;
+
+        const CAtlMap<CString, int, CStringElementTraits<CString> >::CPair* pPair = _strings.Lookup(key);
+        if (pPair != NULL)
+        {
+            return pPair->m_key;
+        }
+
+        POSITION position = _strings.SetAt(CString(key), 0);
+        return _strings.GetKeyAt(position);
+    }
+
+    size_t get_Count(void)
+    {
+        return _strings.GetCount();
+    }
+};
@@ -0,0 +1,457 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CBlockClone.h"
+#include "CShadowSpawnException.h"
+#include "CTreeWalker.h"
+#include "OutputWriter.h"
+#include "Utilities.h"
+
+using namespace std;
+
+// Copies a directory tree for callers that want a private copy of it
+// rather than a VSS snapshot, which needs neither VSS nor administrator
+// rights. Directories are shared out between threadCount threads. Files
+// are block-cloned when the copy is on the same volume as the source and
+// the file system supports it (ReFS), which shares the data instead of
+// copying it, and copied with CopyFileEx otherwise. Unlike a snapshot, the
+// copy is not taken at a single point in time.
+class CTreeCloner
+{
+private:
+    static const DWORD COPIED_ATTRIBUTES = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM |
+        FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED | FILE_ATTRIBUTE_TEMPORARY;
+
+    OutputWriter& _logger;
+    CString _sourceRoot;
+    CString _targetRoot;
+    bool _targetCreated;
+    DWORD _threadCount;
+    volatile LONG _canClone;
+    DWORD _clusterSize;
+
+    CComAutoCriticalSection _lock;
+    CAtlList<CString> _pending;     // Directories to copy, relative to the roots
+    LONG _outstanding;              // Directories pending or being copied
+    HANDLE _hPending;
+    HANDLE _hDone;
+    HRESULT _hr;
+    CString _errorMessage;
+
+    volatile LONG _running;
+    HANDLE _hThreadsDone;
+
+    volatile LONG _directoryCount;
+    volatile LONG _clonedCount;
+    volatile LONG _copiedCount;
+
+    static void ThrowLastError(LPCTSTR operation, LPCTSTR path)
+    {
+        DWORD error = ::GetLastError();
+        CString errorMessage;
+        Utilities::FormatErrorMessage(error, errorMessage);
+        CString message;
+        message.AppendFormat(TEXT("There was an error calling %s on %s. Error: %s"), operation, path, errorMessage);
+        throw new CShadowSpawnException(error, message.GetString());
+    }
+
+    static bool IsDots(LPCTSTR name)
+    {
+        return _tcscmp(name, TEXT(".")) == 0 || _tcscmp(name, TEXT("..")) == 0;
+    }
+
+    static void GetFullPath(LPCTSTR path, CString& fullPath)
+    {
+        TCHAR wszFullPath[MAX_PATH];
+        DWORD length = ::GetFullPathName(path, MAX_PATH, wszFullPath, NULL);
+        if (length == 0 || length >= MAX_PATH)
+        {
+            ThrowLastError(TEXT("GetFullPathName"), path);
+        }
+
+        fullPath = wszFullPath;
+        if (fullPath.Right(1) != TEXT("\\"))
+        {
+            fullPath.AppendChar(TEXT('\\'));
+        }
+    }
+
+    static DWORD WINAPI ThreadProc(LPVOID parameter)
+    {
+        CTreeCloner* pCloner = (CTreeCloner*) parameter;
+        pCloner->Work();
+        if (::InterlockedDecrement(&pCloner->_running) == 0)
+        {
+            ::SetEvent(pCloner->_hThreadsDone);
+        }
+        return 0;
+    }
+
+    // Copies directories until there are none left or one has failed.
+    void Work(void)
+    {
+        HANDLE handles[2] = { _hDone, _hPending };
+        while (::WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+        {
+            CString directory;
+            {
+                CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+                directory = _pending.RemoveHead();
+            }
+
+            try
+            {
+                CopyDirectory(directory);
+            }
+            catch (CShadowSpawnException* e)
+            {
+                Fail(e->get_HResult(), e->get_Message());
+                delete e;
+            }
+
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            if (--_outstanding == 0)
+            {
+                ::SetEvent(_hDone);
+            }
+        }
+    }
+
+    void Fail(HRESULT hr, LPCTSTR message)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        if (SUCCEEDED(_hr))
+        {
+            _hr = hr;
+            _errorMessage = message;
+        }
+        ::SetEvent(_hDone);
+    }
+
+    void Enqueue(const CString& directory)
+    {
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+            _pending.AddTail(directory);
+            ++_outstanding;
+        }
+        ::ReleaseSemaphore(_hPending, 1, NULL);
+    }
+
+    // Creates the subdirectories of directory in the copy and queues them,
+    // then copies its files.
+    void CopyDirectory(const CString& directory)
+    {
+        CString pattern(_sourceRoot + directory);
+        pattern.AppendChar(TEXT('*'));
+
+        WIN32_FIND_DATA findData;
+        HANDLE hFind = CTreeWalker::FindFirst(pattern, findData);
+        if (hFind == INVALID_HANDLE_VALUE)
+        {
+            ThrowLastError(TEXT("FindFirstFileEx"), pattern);
+        }
+
+        ::InterlockedIncrement(&_directoryCount);
+        vector<WIN32_FIND_DATA> files;
+        do
+        {
+            if (IsDots(findData.cFileName))
+            {
+                continue;
+            }
+
+            CString relativePath(directory + findData.cFileName);
+            if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+            {
+                files.push_back(findData);
+            }
+            else if ((findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+            {
+                // Following junctions could leave the tree, or loop.
+                _logger.WriteFormat(TEXT("Not following reparse point %s"), relativePath);
+            }
+            else
+            {
+                if (!::CreateDirectoryEx(_sourceRoot + relativePath, _targetRoot + relativePath, NULL))
+                {
+                    DWORD error = ::GetLastError();
+                    ::FindClose(hFind);
+                    ::SetLastError(error);
+                    ThrowLastError(TEXT("CreateDirectoryEx"), _targetRoot + relativePath);
+                }
+                relativePath.AppendChar(TEXT('\\'));
+                Enqueue(relativePath);
+            }
+        } while (::FindNextFile(hFind, &findData));
+
+        DWORD error = ::GetLastError();
+        ::FindClose(hFind);
+        if (error != ERROR_NO_MORE_FILES)
+        {
+            ::SetLastError(error);
+            ThrowLastError(TEXT("FindNextFile"), pattern);
+        }
+
+        for (unsigned int iFile = 0; iFile < files.size(); ++iFile)
+        {
+            if (::WaitForSingleObject(_hDone, 0) == WAIT_OBJECT_0)
+            {
+                return;
+            }
+            CopyFile(directory + files[iFile].cFileName, files[iFile]);
+        }
+    }
+
+    void CopyFile(const CString& relativePath, const WIN32_FIND_DATA& findData)
+    {
+        CString source(_sourceRoot + relativePath);
+        CString target(_targetRoot + relativePath);
+
+        if (_canClone && CloneFile(source, target, findData))
+        {
+            ::InterlockedIncrement(&_clonedCount);
+            return;
+        }
+
+        if (!::CopyFileEx(source, target, NULL, NULL, NULL, COPY_FILE_FAIL_IF_EXISTS))
+        {
+            ThrowLastError(TEXT("CopyFileEx"), source);
+        }
+        ::InterlockedIncrement(&_copiedCount);
+    }
+
+    // Returns false, leaving nothing behind at target, if the file has to
+    // be copied instead.
+    bool CloneFile(LPCTSTR source, LPCTSTR target, const WIN32_FIND_DATA& findData)
+    {
+        HANDLE hSource = ::CreateFile(source, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+            OPEN_EXISTING, 0, NULL);
+        if (hSource == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        HANDLE hTarget = ::CreateFile(target, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hTarget == INVALID_HANDLE_VALUE)
+        {
+            ::CloseHandle(hSource);
+            return false;
+        }
+
+        ULONGLONG size = ((ULONGLONG) findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+        DWORD error = CBlockClone::CloneData(hSource, hTarget, size, (findData.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0,
+            _clusterSize);
+        if (CBlockClone::IsUnsupported(error) && ::InterlockedExchange(&_canClone, FALSE))
+        {
+            _logger.WriteLine(TEXT("Block cloning isn't supported here after all; copying files instead."));
+        }
+
+        bool cloned = (error == ERROR_SUCCESS);
+        if (cloned)
+        {
+            ::SetFileTime(hTarget, &findData.ftCreationTime, &findData.ftLastAccessTime, &findData.ftLastWriteTime);
+        }
+
+        ::CloseHandle(hTarget);
+        ::CloseHandle(hSource);
+
+        if (!cloned)
+        {
+            ::DeleteFile(target);
+            return false;
+        }
+
+        ::SetFileAttributes(target, findData.dwFileAttributes & COPIED_ATTRIBUTES);
+        return true;
+    }
+
+    // Junctions and symbolic links to directories are removed without
+    // looking inside, since what they point at isn't part of the clone.
+    // error is set to the first failure, if it is still zero.
+    static bool DeleteDirectory(const CString& directory, DWORD& error, OutputWriter& logger)
+    {
+        bool deletedAll = true;
+
+        WIN32_FIND_DATA findData;
+        HANDLE hFind = ::FindFirstFile(directory + TEXT("*"), &findData);
+        if (hFind != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                if (IsDots(findData.cFileName))
+                {
+                    continue;
+                }
+
+                CString path(directory + findData.cFileName);
+                if ((findData.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0)
+                {
+                    ::SetFileAttributes(path, findData.dwFileAttributes & ~FILE_ATTRIBUTE_READONLY);
+                }
+
+                bool isDirectory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+                bool isReparsePoint = (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+                if (isDirectory && !isReparsePoint)
+                {
+                    deletedAll = DeleteDirectory(path + TEXT("\\"), error, logger) && deletedAll;
+                }
+                else if (!(isDirectory ? ::RemoveDirectory(path) : ::DeleteFile(path)))
+                {
+                    RecordDeleteFailure(path, error, logger);
+                    deletedAll = false;
+                }
+            } while (::FindNextFile(hFind, &findData));
+            ::FindClose(hFind);
+        }
+
+        if (!::RemoveDirectory(directory))
+        {
+            RecordDeleteFailure(directory, error, logger);
+            return false;
+        }
+        return deletedAll;
+    }
+
+    static void RecordDeleteFailure(LPCTSTR path, DWORD& error, OutputWriter& logger)
+    {
+        DWORD lastError = ::GetLastError();
+        logger.WriteFormat(TEXT("Unable to delete %s: %d"), path, lastError);
+        if (error == ERROR_SUCCESS)
+        {
+            error = lastError;
+        }
+    }
+
+public:
+    CTreeCloner::CTreeCloner(DWORD threadCount, OutputWriter& logger) :
+        _logger(logger)
+    {
+        _targetCreated = false;
+        _threadCount = (threadCount == 0) ? 1 : threadCount;
+        _canClone = FALSE;
+        _clusterSize = 0;
+        _outstanding = 0;
+        _hPending = ::CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+        _hDone = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+        _hr = S_OK;
+        _running = 0;
+        _hThreadsDone = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+        _directoryCount = 0;
+        _clonedCount = 0;
+        _copiedCount = 0;
+    }
+
+    CTreeCloner::~CTreeCloner()
+    {
+        ::CloseHandle(_hPending);
+        ::CloseHandle(_hDone);
+        ::CloseHandle(_hThreadsDone);
+    }
+
+    // Whether Clone got as far as creating the target, which then needs
+    // to be deleted even if Clone failed.
+    bool get_TargetCreated(void)
+    {
+        return _targetCreated;
+    }
+
+    LONG get_ClonedCount(void)
+    {
+        return _clonedCount;
+    }
+
+    LONG get_CopiedCount(void)
+    {
+        return _copiedCount;
+    }
+
+    // Copies the tree at source to target, which must not exist yet. On
+    // failure, whatever was copied is left for Delete.
+    void Clone(LPCTSTR source, LPCTSTR target)
+    {
+        if (Utilities::DirectoryExists(target))
+        {
+            CString message;
+            message.AppendFormat(TEXT("The clone directory already exists: %s"), target);
+            throw new CShadowSpawnException(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), message);
+        }
+        Utilities::CreateDirectory(target);
+        _targetCreated = true;
+
+        GetFullPath(source, _sourceRoot);
+        GetFullPath(target, _targetRoot);
+        _clusterSize = CBlockClone::GetClusterSize(_sourceRoot, _targetRoot, _logger);
+        _canClone = (_clusterSize != 0);
+        Utilities::FixLongFilenames(_sourceRoot);
+        Utilities::FixLongFilenames(_targetRoot);
+
+        Enqueue(CString());
+
+        // This thread works too, rather than just waiting.
+        _running = (LONG) _threadCount;
+        for (DWORD iThread = 0; iThread + 1 < _threadCount; ++iThread)
+        {
+            if (!::QueueUserWorkItem(ThreadProc, this, WT_EXECUTELONGFUNCTION))
+            {
+                ::InterlockedDecrement(&_running);
+            }
+        }
+        ThreadProc(this);
+        ::WaitForSingleObject(_hThreadsDone, INFINITE);
+
+        if (FAILED(_hr))
+        {
+            throw new CShadowSpawnException(_hr, _errorMessage);
+        }
+
+        _logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Cloned %d directories: %d files block-cloned, %d copied."),
+            _directoryCount, _clonedCount, _copiedCount);
+    }
+
+    // Deletes a clone made by Clone, carrying on past anything that can't
+    // be deleted. Failures are logged rather than thrown; the first one is
+    // returned.
+    static HRESULT Delete(LPCTSTR target, OutputWriter& logger)
+    {
+        CString root;
+        try
+        {
+            GetFullPath(target, root);
+        }
+        catch (CShadowSpawnException* e)
+        {
+            return Utilities::ReportException(e, logger);
+        }
+        Utilities::FixLongFilenames(root);
+
+        DWORD error = ERROR_SUCCESS;
+        if (DeleteDirectory(root, error, logger))
+        {
+            return S_OK;
+        }
+        return HRESULT_FROM_WIN32(error != ERROR_SUCCESS ? error : ERROR_DIR_NOT_EMPTY);
+    }
+};
@@ -0,0 +1,326 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CPathArena.h"
+#include "CShadowSpawnException.h"
+#include "CStealingQueues.h"
+#include "Exports.h"
+#include "OutputWriter.h"
+#include "Utilities.h"
+
+// Windows 7 additions, newer than the version this project targets.
+#ifndef FIND_FIRST_EX_LARGE_FETCH
+#define FIND_FIRST_EX_LARGE_FETCH 0x00000002
+#endif
+
+using namespace std;
+
+// Lists a directory tree on several threads at once, handing the callback
+// the entries of one directory at a time (or MAX_BATCH at a time) from
+// whichever thread listed it. Directories are shared out through
+// CStealingQueues. Paths are relative to the root and are kept in each
+// thread's CPathArenas rather than in CStrings: a directory's path lasts
+// the whole walk, since its subdirectories are queued as pointers to it,
+// but other paths only last until their batch has been handed over.
+class CTreeWalker
+{
+private:
+    struct Worker
+    {
+        CTreeWalker* pWalker;
+        DWORD index;
+        CPathArena directoryPaths;
+        CPathArena otherPaths;
+        vector<ShadowSpawnWalkEntry> batch;
+        vector<TCHAR> pattern;
+        ULONGLONG directoryCount;
+        ULONGLONG fileCount;
+        DWORD failedCount;
+    };
+
+    static const DWORD MAX_BATCH = 1024;
+
+    // Cleared the first time Windows turns down a large fetch.
+    static volatile LONG s_largeFetch;
+
+    OutputWriter& _logger;
+    ShadowSpawnWalkCallback* _callback;
+    void* _context;
+    CString _root;
+    vector<Worker*> _workers;
+    CAutoPtr<CStealingQueues<LPCTSTR> > _pQueues;
+
+    CComAutoCriticalSection _lock;
+    HRESULT _hrStop;
+
+    volatile LONG _running;
+    HANDLE _hThreadsDone;
+
+    static DWORD WINAPI ThreadProc(LPVOID parameter)
+    {
+        Worker* pWorker = (Worker*) parameter;
+        CTreeWalker* pWalker = pWorker->pWalker;
+        pWalker->Work(*pWorker);
+        if (::InterlockedDecrement(&pWalker->_running) == 0)
+        {
+            ::SetEvent(pWalker->_hThreadsDone);
+        }
+        return 0;
+    }
+
+    void Work(Worker& worker)
+    {
+        LPCTSTR directory;
+        while (_pQueues->Take(worker.index, directory))
+        {
+            HRESULT hr = ListDirectory(worker, directory);
+            if (FAILED(hr))
+            {
+                CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+                if (SUCCEEDED(_hrStop))
+                {
+                    _hrStop = hr;
+                }
+                _pQueues->Stop();
+            }
+            _pQueues->Finish();
+        }
+    }
+
+    // Hands the batch to the callback and forgets the paths only it used.
+    HRESULT Deliver(Worker& worker)
+    {
+        if (worker.batch.empty())
+        {
+            return S_OK;
+        }
+
+        HRESULT hr = _callback(&worker.batch[0], (DWORD) worker.batch.size(), _context);
+        worker.batch.clear();
+        worker.otherPaths.Reset();
+        return hr;
+    }
+
+    // Returns a failure only if the callback did: directories that can't
+    // be listed are logged and counted, and the walk goes on.
+    HRESULT ListDirectory(Worker& worker, LPCTSTR directory)
+    {
+        DWORD rootLength = (DWORD) _root.GetLength();
+        DWORD directoryLength = CPathArena::get_Length(directory);
+        worker.pattern.resize(rootLength + directoryLength + 3);
+        ::CopyMemory(&worker.pattern[0], (LPCTSTR) _root, rootLength * sizeof(TCHAR));
+        ::CopyMemory(&worker.pattern[rootLength], directory, directoryLength * sizeof(TCHAR));
+        DWORD patternLength = rootLength + directoryLength;
+        if (directoryLength > 0)
+        {
+            worker.pattern[patternLength++] = TEXT('\\');
+        }
+        worker.pattern[patternLength++] = TEXT('*');
+        worker.pattern[patternLength] = TEXT('\0');
+
+        WIN32_FIND_DATA findData;
+        HANDLE hFind = FindFirst(&worker.pattern[0], findData);
+        if (hFind == INVALID_HANDLE_VALUE)
+        {
+            ReportFailure(worker, TEXT("FindFirstFileEx"), &worker.pattern[0]);
+            return S_OK;
+        }
+
+        ++worker.directoryCount;
+        HRESULT hr = S_OK;
+        BOOL bMore;
+        do
+        {
+            LPCTSTR name = findData.cFileName;
+            if (name[0] == TEXT('.') && (name[1] == TEXT('\0') || (name[1] == TEXT('.') && name[2] == TEXT('\0'))))
+            {
+                bMore = ::FindNextFile(hFind, &findData);
+                continue;
+            }
+
+            // Junctions are listed but not followed: they could leave the
+            // tree, or loop.
+            bool isDirectory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 &&
+                (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0;
+            CPathArena& arena = isDirectory ? worker.directoryPaths : worker.otherPaths;
+            LPCTSTR path = arena.Add(directory, directoryLength, TEXT('\\'), name, (DWORD) _tcslen(name));
+
+            ShadowSpawnWalkEntry entry;
+            entry.path = path;
+            entry.pathLength = CPathArena::get_Length(path);
+            entry.attributes = findData.dwFileAttributes;
+            entry.size = ((ULONGLONG) findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+            entry.lastWriteTime = findData.ftLastWriteTime;
+            worker.batch.push_back(entry);
+
+            if (isDirectory)
+            {
+                _pQueues->Push(worker.index, path);
+            }
+            else
+            {
+                ++worker.fileCount;
+            }
+
+            if (worker.batch.size() == MAX_BATCH)
+            {
+                hr = Deliver(worker);
+                if (FAILED(hr))
+                {
+                    break;
+                }
+            }
+            bMore = ::FindNextFile(hFind, &findData);
+        } while (bMore);
+
+        if (SUCCEEDED(hr) && ::GetLastError() != ERROR_NO_MORE_FILES)
+        {
+            ReportFailure(worker, TEXT("FindNextFile"), &worker.pattern[0]);
+        }
+        ::FindClose(hFind);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = Deliver(worker);
+        }
+        return hr;
+    }
+
+    void ReportFailure(Worker& worker, LPCTSTR operation, LPCTSTR path)
+    {
+        DWORD error = ::GetLastError();
+        CString errorMessage;
+        Utilities::FormatErrorMessage(error, errorMessage);
+        _logger.WriteFormat(VERBOSITY_THRESHOLD_UNLESS_SILENT, TEXT("Unable to list %s: %s failed. Error: %s"),
+            path, operation, errorMessage);
+        ++worker.failedCount;
+    }
+
+public:
+    // threadCount may be zero for a thread per processor.
+    CTreeWalker::CTreeWalker(DWORD threadCount, ShadowSpawnWalkCallback* callback, void* context, OutputWriter& logger) :
+        _logger(logger)
+    {
+        if (threadCount == 0)
+        {
+            SYSTEM_INFO systemInfo;
+            ::GetSystemInfo(&systemInfo);
+            threadCount = systemInfo.dwNumberOfProcessors;
+        }
+
+        _callback = callback;
+        _context = context;
+        for (DWORD iWorker = 0; iWorker < threadCount; ++iWorker)
+        {
+            Worker* pWorker = new Worker();
+            pWorker->pWalker = this;
+            pWorker->index = iWorker;
+            pWorker->directoryCount = 0;
+            pWorker->fileCount = 0;
+            pWorker->failedCount = 0;
+            _workers.push_back(pWorker);
+        }
+        _pQueues.Attach(new CStealingQueues<LPCTSTR>(threadCount));
+        _hrStop = S_OK;
+        _running = 0;
+        _hThreadsDone = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
+
+    CTreeWalker::~CTreeWalker()
+    {
+        for (unsigned int iWorker = 0; iWorker < _workers.size(); ++iWorker)
+        {
+            delete _workers[iWorker];
+        }
+        ::CloseHandle(_hThreadsDone);
+    }
+
+    // FindFirstFile, but without short names and fetching entries in
+    // bigger batches where Windows supports it (7 and later).
+    static HANDLE FindFirst(LPCTSTR pattern, WIN32_FIND_DATA& findData)
+    {
+        if (s_largeFetch)
+        {
+            HANDLE hFind = ::FindFirstFileEx(pattern, (FINDEX_INFO_LEVELS) 1 /* FindExInfoBasic */, &findData,
+                FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+            if (hFind != INVALID_HANDLE_VALUE || ::GetLastError() != ERROR_INVALID_PARAMETER)
+            {
+                return hFind;
+            }
+            ::InterlockedExchange(&s_largeFetch, FALSE);
+        }
+        return ::FindFirstFile(pattern, &findData);
+    }
+
+    // Lists everything below root. Returns the first failure the callback
+    // returned, which stops the walk.
+    HRESULT Walk(LPCTSTR root)
+    {
+        if (!Utilities::DirectoryExists(root))
+        {
+            CString message;
+            message.AppendFormat(TEXT("The path to walk is not an existing directory: %s"), root);
+            throw new CShadowSpawnException(HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND), message);
+        }
+
+        _root = root;
+        if (_root.Right(1) != TEXT("\\"))
+        {
+            _root.AppendChar(TEXT('\\'));
+        }
+        Utilities::FixLongFilenames(_root);
+
+        _pQueues->Push(0, _workers[0]->directoryPaths.Add(TEXT(""), 0, 0, TEXT(""), 0));
+
+        // This thread is the first worker, rather than just waiting.
+        _running = (LONG) _workers.size();
+        for (unsigned int iWorker = 1; iWorker < _workers.size(); ++iWorker)
+        {
+            if (!::QueueUserWorkItem(ThreadProc, _workers[iWorker], WT_EXECUTELONGFUNCTION))
+            {
+                ::InterlockedDecrement(&_running);
+            }
+        }
+        ThreadProc(_workers[0]);
+        ::WaitForSingleObject(_hThreadsDone, INFINITE);
+
+        ShadowSpawnWalkStats stats;
+        GetStats(stats);
+        _logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Listed %I64u directories and %I64u files; %d directories couldn't be listed."),
+            stats.directoryCount, stats.fileCount, stats.failedCount);
+        return _hrStop;
+    }
+
+    void GetStats(ShadowSpawnWalkStats& stats)
+    {
+        ::ZeroMemory(&stats, sizeof(stats));
+        for (unsigned int iWorker = 0; iWorker < _workers.size(); ++iWorker)
+        {
+            stats.directoryCount += _workers[iWorker]->directoryCount;
+            stats.fileCount += _workers[iWorker]->fileCount;
+            stats.failedCount += _workers[iWorker]->failedCount;
+        }
+    }
+};
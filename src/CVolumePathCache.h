@@ -0,0 +1,188 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "OutputWriter.h"
+
+using namespace std;
+
+// Finds the volume mount point holding a path, as GetVolumePathName does,
+// but by matching the path against the system's mount points rather than
+// asking the system once per path. Every directory prefix resolved along
+// the way is remembered, so each distinct prefix is only walked once.
+// Paths under no known mount point, such as network shares or volumes
+// mounted after the list was read, are left to the caller. Volumes come
+// and go, so the list is read again once it is older than the maximum
+// age given at construction, and the owner calls Invalidate whenever a
+// stale answer would matter sooner.
+class CVolumePathCache
+{
+private:
+    CComAutoCriticalSection _lock;
+    bool _loaded;
+    DWORD _loadedTicks;
+    DWORD _maxAgeMs;
+    CAtlMap<CString, CString, CStringElementTraitsI<CString> > _prefixes;
+
+    // Seeds the cache with every mount point, each mapped to itself. Any
+    // prefix that isn't in the cache afterwards is therefore not a mount
+    // point, and is on the same volume as its parent.
+    void LoadMountPoints(OutputWriter& logger)
+    {
+        logger.WriteLine(TEXT("Enumerating volume mount points"));
+
+        WCHAR wszVolumeName[MAX_PATH];
+        HANDLE hFind = ::FindFirstVolume(wszVolumeName, MAX_PATH);
+        if (hFind == INVALID_HANDLE_VALUE)
+        {
+            logger.WriteFormat(TEXT("Unable to enumerate volumes: %d"), ::GetLastError());
+            return;
+        }
+
+        vector<WCHAR> pathNames(MAX_PATH);
+        do
+        {
+            DWORD cchPathNames;
+            if (!::GetVolumePathNamesForVolumeName(wszVolumeName, &pathNames[0], (DWORD) pathNames.size(), &cchPathNames))
+            {
+                if (::GetLastError() != ERROR_MORE_DATA)
+                {
+                    continue;
+                }
+
+                pathNames.resize(cchPathNames);
+                if (!::GetVolumePathNamesForVolumeName(wszVolumeName, &pathNames[0], (DWORD) pathNames.size(), &cchPathNames))
+                {
+                    continue;
+                }
+            }
+
+            for (LPCWSTR pathName = &pathNames[0]; *pathName != L'\0'; pathName += wcslen(pathName) + 1)
+            {
+                CString mountPoint(pathName);
+                _prefixes.SetAt(mountPoint, mountPoint);
+            }
+        } while (::FindNextVolume(hFind, wszVolumeName, MAX_PATH));
+
+        ::FindVolumeClose(hFind);
+        logger.WriteFormat(TEXT("Found %d volume mount points"), (int) _prefixes.GetCount());
+    }
+
+    // Makes path absolute and gives it a trailing backslash, so it
+    // compares equal to the mount points, which have one.
+    static bool Normalize(LPCTSTR path, CString& prefix)
+    {
+        WCHAR wszFullPath[MAX_PATH];
+        DWORD cchFullPath = ::GetFullPathName(path, MAX_PATH, wszFullPath, NULL);
+        if (cchFullPath == 0 || cchFullPath >= MAX_PATH)
+        {
+            return false;
+        }
+
+        prefix = wszFullPath;
+        if (prefix.Right(1) != TEXT("\\"))
+        {
+            prefix.AppendChar(TEXT('\\'));
+        }
+        return true;
+    }
+
+public:
+    // The mount points are read again when maxAgeMs have passed since
+    // they last were; INFINITE keeps them until Invalidate.
+    CVolumePathCache::CVolumePathCache(DWORD maxAgeMs = 60 * 1000)
+    {
+        _loaded = false;
+        _loadedTicks = 0;
+        _maxAgeMs = maxAgeMs;
+    }
+
+    // Returns false if path isn't under any mount point we know of.
+    bool Lookup(LPCTSTR path, CString& volumePathName, OutputWriter& logger)
+    {
+        CString prefix;
+        if (!Normalize(path, prefix))
+        {
+            return false;
+        }
+
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+
+        if (_loaded && _maxAgeMs != INFINITE && ::GetTickCount() - _loadedTicks >= _maxAgeMs)
+        {
+            _prefixes.RemoveAll();
+            _loaded = false;
+        }
+
+        if (!_loaded)
+        {
+            LoadMountPoints(logger);
+            _loaded = true;
+            _loadedTicks = ::GetTickCount();
+        }
+
+        // Walk up to the nearest prefix already known, then remember the
+        // answer for every prefix passed on the way.
+        vector<CString> walked;
+        while (!_prefixes.Lookup(prefix, volumePathName))
+        {
+            walked.push_back(prefix);
+
+            int iSlash = prefix.Left(prefix.GetLength() - 1).ReverseFind(TEXT('\\'));
+            if (iSlash < 0)
+            {
+                return false;
+            }
+            prefix = prefix.Left(iSlash + 1);
+        }
+
+        for (unsigned int iWalked = 0; iWalked < walked.size(); ++iWalked)
+        {
+            _prefixes.SetAt(walked[iWalked], volumePathName);
+        }
+        return true;
+    }
+
+    // Forgets every mount point and prefix.
+    void Invalidate(void)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _prefixes.RemoveAll();
+        _loaded = false;
+    }
+
+    // Records the answer for a path Lookup couldn't place, once the caller
+    // has found it some other way.
+    void Remember(LPCTSTR path, LPCTSTR volumePathName)
+    {
+        CString prefix;
+        if (!Normalize(path, prefix))
+        {
+            return;
+        }
+
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+        _prefixes.SetAt(prefix, CString(volumePathName));
+    }
+};
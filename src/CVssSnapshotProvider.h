@@ -0,0 +1,427 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CComException.h"
+#include "CShadowSpawnException.h"
+#include "ISnapshotProvider.h"
+#include "CWriterMetadataCache.h"
+#include "CStringPool.h"
+#include "OutputWriter.h"
+
+using namespace std;
+
+// Snapshot provider backed by the real Volume Shadow Copy Service.
+class CVssSnapshotProvider : public ISnapshotProvider
+{
+private:
+    CComPtr<IVssBackupComponents> _pBackupComponents;
+    OutputWriter& _logger;
+    CWriterMetadataCache* _pMetadataCache;
+    bool _collectFilePaths;
+    vector<GUID> _cachedInstanceIds;
+
+public:
+    // pMetadataCache may be NULL, in which case every writer is walked.
+    // collectFilePaths records where each component's files live, which
+    // costs a few extra calls per component.
+    CVssSnapshotProvider::CVssSnapshotProvider(OutputWriter& logger, CWriterMetadataCache* pMetadataCache, bool collectFilePaths) : _logger(logger)
+    {
+        _pMetadataCache = pMetadataCache;
+        _collectFilePaths = collectFilePaths;
+    }
+
+    GUID GetSystemProviderId(void)
+    {
+        CComPtr<IVssBackupComponents> backupComponents;
+
+        _logger.WriteLine(TEXT("Calling CreateVssBackupComponents in GetSystemProviderId"));
+        CHECK_HRESULT(::CreateVssBackupComponents(&backupComponents));
+
+        _logger.WriteLine(TEXT("Calling InitializeForBackup in GetSystemProviderId"));
+        CHECK_HRESULT(backupComponents->InitializeForBackup());
+
+        // The following code for selecting the system proviider is necessary
+        // per http://forum.storagecraft.com/Community/forums/p/177/542.aspx#542
+        // which is a totally awesome post
+        _logger.WriteLine(TEXT("Looking for the system VSS provider"));
+
+        _logger.WriteLine(TEXT("Calling backupComponents->Query(enum providers)"));
+        CComPtr<IVssEnumObject> pEnum;
+        CHECK_HRESULT(backupComponents->Query(GUID_NULL, VSS_OBJECT_NONE, VSS_OBJECT_PROVIDER, &pEnum));
+
+        GUID systemProviderId = GUID_NULL;
+        VSS_OBJECT_PROP prop;
+        ULONG nFetched;
+        do
+        {
+            _logger.WriteLine(TEXT("Calling IVssEnumObject::Next"));
+            HRESULT hr = pEnum->Next(1, &prop, &nFetched);
+
+            if (hr == S_OK)
+            {
+                _logger.WriteFormat(TEXT("Examining provider %s to see if it's the system provider..."), prop.Obj.Prov.m_pwszProviderName);
+
+                bool isSystemProvider = (prop.Obj.Prov.m_eProviderType == VSS_PROV_SYSTEM);
+                if (isSystemProvider)
+                {
+                    systemProviderId = prop.Obj.Prov.m_ProviderId;
+                }
+
+                ::CoTaskMemFree(prop.Obj.Prov.m_pwszProviderName);
+                ::CoTaskMemFree(prop.Obj.Prov.m_pwszProviderVersion);
+
+                if (isSystemProvider)
+                {
+                    _logger.WriteLine(TEXT("...and it is."));
+                    break;
+                }
+            }
+            else if (hr == S_FALSE)
+            {
+                _logger.WriteLine(TEXT("...but it's not."));
+                break;
+            }
+            else
+            {
+                throw new CComException(hr, __FILE__, __LINE__);
+            }
+        } while (true);
+
+        if (::IsEqualGUID(systemProviderId, GUID_NULL))
+        {
+            throw new CShadowSpawnException(TEXT("Unable to locate the system snapshot provider."));
+        }
+
+        return systemProviderId;
+    }
+
+    HRESULT InitializeForBackup(void)
+    {
+        _logger.WriteLine(TEXT("Calling CreateVssBackupComponents"));
+        HRESULT hr = ::CreateVssBackupComponents(&_pBackupComponents);
+        if (hr != S_OK)
+        {
+            return hr;
+        }
+
+        _logger.WriteLine(TEXT("Calling InitializeForBackup"));
+        return _pBackupComponents->InitializeForBackup();
+    }
+
+    bool IsInitialized(void)
+    {
+        return _pBackupComponents != NULL;
+    }
+
+    HRESULT GatherWriterMetadata(IVssAsync** ppAsync)
+    {
+        _logger.WriteLine(TEXT("Calling GatherWriterMetadata"));
+        return _pBackupComponents->GatherWriterMetadata(ppAsync);
+    }
+
+    void GetWriters(vector<CWriter>& writers)
+    {
+        _logger.WriteLine(TEXT("Calling GetWriterMetadataCount"));
+
+        UINT cWriters;
+        CHECK_HRESULT(_pBackupComponents->GetWriterMetadataCount(&cWriters));
+
+        // Components repeat the same handful of logical paths, so they
+        // share one copy of each.
+        CStringPool strings;
+
+        writers.reserve(writers.size() + cWriters);
+        for (UINT iWriter = 0; iWriter < cWriters; ++iWriter)
+        {
+            // Built in place so the components aren't copied afterwards.
+            writers.push_back(CWriter());
+            CWriter& writer = writers.back();
+            CComPtr<IVssExamineWriterMetadata> pExamineWriterMetadata;
+            GUID id;
+            _logger.WriteLine(TEXT("Calling GetWriterMetadata"));
+            CHECK_HRESULT(_pBackupComponents->GetWriterMetadata(iWriter, &id, &pExamineWriterMetadata));
+            GUID idInstance;
+            GUID idWriter;
+            BSTR bstrWriterName;
+            VSS_USAGE_TYPE usage;
+            VSS_SOURCE_TYPE source;
+            CHECK_HRESULT(pExamineWriterMetadata->GetIdentity(&idInstance, &idWriter, &bstrWriterName, &usage, &source));
+
+            writer.set_InstanceId(idInstance);
+            writer.set_Name(bstrWriterName);
+            writer.set_WriterId(idWriter);
+
+            CComBSTR writerName;
+            writerName.Attach(bstrWriterName);
+            _logger.WriteFormat(TEXT("Writer %d named %s"), iWriter, (LPCTSTR) writerName);
+
+            UINT cIncludeFiles;
+            UINT cExcludeFiles;
+            UINT cComponents;
+            CHECK_HRESULT(pExamineWriterMetadata->GetFileCounts(&cIncludeFiles, &cExcludeFiles, &cComponents));
+
+            _logger.WriteFormat(TEXT("Writer has %d components"), cComponents);
+
+            ULONGLONG fingerprint = 0;
+            ULONGLONG contentFingerprint = 0;
+            if (_pMetadataCache != NULL)
+            {
+                fingerprint = CWriterMetadataCache::ComputeFingerprint(writer, usage, source, cIncludeFiles, cExcludeFiles, cComponents);
+            }
+            if (_pMetadataCache != NULL && _collectFilePaths)
+            {
+                CComBSTR bstrMetadata;
+                CHECK_HRESULT(pExamineWriterMetadata->SaveAsXML(&bstrMetadata));
+                contentFingerprint = CWriterMetadataCache::ComputeContentFingerprint(bstrMetadata, bstrMetadata.Length());
+            }
+
+            if (_pMetadataCache != NULL && _pMetadataCache->Lookup(idInstance, fingerprint, _collectFilePaths, contentFingerprint, writer))
+            {
+                _logger.WriteLine(TEXT("Using cached metadata for writer"));
+                _cachedInstanceIds.push_back(idInstance);
+
+                for (unsigned int iComponent = 0; iComponent < writer.get_Components().size(); ++iComponent)
+                {
+                    writer.get_Components()[iComponent].set_Writer(iWriter);
+                }
+
+                writer.ComputeComponentTree();
+                continue;
+            }
+
+            // The file descriptors are only read to be logged or collected.
+            bool logFiles = _logger.IsEnabled(VERBOSITY_THRESHOLD_IF_VERBOSE);
+            bool readFiles = logFiles || _collectFilePaths;
+
+            writer.get_Components().reserve(cComponents);
+            for (UINT iComponent = 0; iComponent < cComponents; ++iComponent)
+            {
+                writer.get_Components().push_back(CWriterComponent());
+                CWriterComponent& component = writer.get_Components().back();
+
+                CComPtr<IVssWMComponent> pComponent;
+                CHECK_HRESULT(pExamineWriterMetadata->GetComponent(iComponent, &pComponent));
+
+                PVSSCOMPONENTINFO pComponentInfo;
+                CHECK_HRESULT(pComponent->GetComponentInfo(&pComponentInfo));
+
+                _logger.WriteFormat(TEXT("Component %d is named %s, has a path of %s, and is %sselectable for backup. %d files, %d databases, %d log files."),
+                    iComponent,
+                    pComponentInfo->bstrComponentName,
+                    pComponentInfo->bstrLogicalPath,
+                    pComponentInfo->bSelectable ? TEXT("") : TEXT("not "),
+                    pComponentInfo->cFileCount,
+                    pComponentInfo->cDatabases,
+                    pComponentInfo->cLogFiles);
+
+                component.set_LogicalPath(strings.Intern(pComponentInfo->bstrLogicalPath));
+                component.set_SelectableForBackup(pComponentInfo->bSelectable);
+                component.set_Writer(iWriter);
+                component.set_Name(strings.Intern(pComponentInfo->bstrComponentName));
+                component.set_Type(pComponentInfo->type);
+                component.set_FilePathsKnown(_collectFilePaths);
+
+                for (UINT iFile = 0; readFiles && iFile < pComponentInfo->cFileCount; ++iFile)
+                {
+                    CComPtr<IVssWMFiledesc> pFileDesc;
+                    CHECK_HRESULT(pComponent->GetFile(iFile, &pFileDesc));
+
+                    CComBSTR bstrPath;
+                    CHECK_HRESULT(pFileDesc->GetPath(&bstrPath));
+
+                    CComBSTR bstrFileSpec;
+                    CHECK_HRESULT(pFileDesc->GetFilespec(&bstrFileSpec));
+
+                    if (_collectFilePaths)
+                    {
+                        component.get_FilePaths().push_back(strings.Intern(bstrPath));
+                    }
+                    _logger.WriteFormat(TEXT("File %d has path %s\\%s"), iFile, bstrPath, bstrFileSpec);
+                }
+
+                for (UINT iDatabase = 0; readFiles && iDatabase < pComponentInfo->cDatabases; ++iDatabase)
+                {
+                    CComPtr<IVssWMFiledesc> pFileDesc;
+                    CHECK_HRESULT(pComponent->GetDatabaseFile(iDatabase, &pFileDesc));
+
+                    CComBSTR bstrPath;
+                    CHECK_HRESULT(pFileDesc->GetPath(&bstrPath));
+
+                    CComBSTR bstrFileSpec;
+                    CHECK_HRESULT(pFileDesc->GetFilespec(&bstrFileSpec));
+
+                    if (_collectFilePaths)
+                    {
+                        component.get_FilePaths().push_back(strings.Intern(bstrPath));
+                    }
+                    _logger.WriteFormat(TEXT("Database file %d has path %s\\%s"), iDatabase, bstrPath, bstrFileSpec);
+                }
+
+                for (UINT iDatabaseLogFile = 0; readFiles && iDatabaseLogFile < pComponentInfo->cLogFiles; ++iDatabaseLogFile)
+                {
+                    CComPtr<IVssWMFiledesc> pFileDesc;
+                    CHECK_HRESULT(pComponent->GetDatabaseLogFile(iDatabaseLogFile, &pFileDesc));
+
+                    CComBSTR bstrPath;
+                    CHECK_HRESULT(pFileDesc->GetPath(&bstrPath));
+
+                    CComBSTR bstrFileSpec;
+                    CHECK_HRESULT(pFileDesc->GetFilespec(&bstrFileSpec));
+
+                    if (_collectFilePaths)
+                    {
+                        component.get_FilePaths().push_back(strings.Intern(bstrPath));
+                    }
+                    _logger.WriteFormat(TEXT("Database log file %d has path %s\\%s"), iDatabaseLogFile, bstrPath, bstrFileSpec);
+                }
+
+                CHECK_HRESULT(pComponent->FreeComponentInfo(pComponentInfo));
+            }
+
+            writer.ComputeComponentTree();
+
+            if (_pMetadataCache != NULL)
+            {
+                _pMetadataCache->Store(writer, fingerprint, contentFingerprint);
+            }
+
+            // The arguments below aren't free to evaluate, so skip the loop
+            // altogether unless it will log something.
+            for (unsigned int iComponent = 0; logFiles && iComponent < writer.get_Components().size(); ++iComponent)
+            {
+                CWriterComponent& component = writer.get_Components()[iComponent];
+                _logger.WriteFormat(TEXT("Component %d has name %s, path %s, is %sselectable for backup, and has parent %s"),
+                    iComponent,
+                    component.get_Name(),
+                    component.get_LogicalPath(),
+                    component.get_SelectableForBackup() ? TEXT("") : TEXT("not "),
+                    writer.FindParent(component) == NULL ? TEXT("(no parent)") : (LPCTSTR) writer.FindParent(component)->get_Name());
+            }
+        }
+    }
+
+    bool EvictCachedWriters(void)
+    {
+        if (_cachedInstanceIds.empty())
+        {
+            return false;
+        }
+
+        for (unsigned int iWriter = 0; iWriter < _cachedInstanceIds.size(); ++iWriter)
+        {
+            _pMetadataCache->Remove(_cachedInstanceIds[iWriter]);
+        }
+
+        _logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Dropped %d writers from the writer metadata cache"), (int) _cachedInstanceIds.size());
+        _cachedInstanceIds.clear();
+        return true;
+    }
+
+    HRESULT StartSnapshotSet(GUID* pSnapshotSetId)
+    {
+        _logger.WriteLine(TEXT("Calling StartSnapshotSet"));
+        return _pBackupComponents->StartSnapshotSet(pSnapshotSetId);
+    }
+
+    HRESULT AddToSnapshotSet(LPCTSTR volumeName, GUID providerId, GUID* pSnapshotId)
+    {
+        _logger.WriteLine(TEXT("Calling AddToSnapshotSet"));
+        return _pBackupComponents->AddToSnapshotSet(const_cast<LPTSTR>(volumeName), providerId, pSnapshotId);
+    }
+
+    HRESULT AddComponent(CWriter& writer, CWriterComponent& component)
+    {
+        return _pBackupComponents->AddComponent(
+            writer.get_InstanceId(),
+            writer.get_WriterId(),
+            component.get_Type(),
+            component.get_LogicalPath(),
+            component.get_Name()
+            );
+    }
+
+    HRESULT DisableWriterInstances(const vector<GUID>& instanceIds)
+    {
+        if (instanceIds.empty())
+        {
+            return S_OK;
+        }
+
+        _logger.WriteLine(TEXT("Calling DisableWriterInstances"));
+        return _pBackupComponents->DisableWriterInstances(&instanceIds[0], (UINT) instanceIds.size());
+    }
+
+    HRESULT SetBackupState(void)
+    {
+        _logger.WriteLine(TEXT("Calling SetBackupState"));
+        return _pBackupComponents->SetBackupState(TRUE, FALSE, VSS_BACKUP_TYPE::VSS_BT_FULL, FALSE);
+    }
+
+    HRESULT PrepareForBackup(IVssAsync** ppAsync)
+    {
+        _logger.WriteLine(TEXT("Calling PrepareForBackup"));
+        return _pBackupComponents->PrepareForBackup(ppAsync);
+    }
+
+    HRESULT DoSnapshotSet(IVssAsync** ppAsync)
+    {
+        _logger.WriteLine(TEXT("Calling DoSnapshotSet"));
+        return _pBackupComponents->DoSnapshotSet(ppAsync);
+    }
+
+    HRESULT GetSnapshotDeviceObject(GUID snapshotId, CString& deviceObject)
+    {
+        _logger.WriteLine(TEXT("Calling GetSnapshotProperties"));
+        VSS_SNAPSHOT_PROP snapshotProperties;
+        HRESULT hr = _pBackupComponents->GetSnapshotProperties(snapshotId, &snapshotProperties);
+        if (hr != S_OK)
+        {
+            return hr;
+        }
+
+        deviceObject = snapshotProperties.m_pwszSnapshotDeviceObject;
+        ::VssFreeSnapshotProperties(&snapshotProperties);
+        return S_OK;
+    }
+
+    HRESULT BackupComplete(IVssAsync** ppAsync)
+    {
+        _logger.WriteLine(TEXT("Calling BackupComplete"));
+        return _pBackupComponents->BackupComplete(ppAsync);
+    }
+
+    HRESULT AbortBackup(void)
+    {
+        return _pBackupComponents->AbortBackup();
+    }
+
+    HRESULT DeleteSnapshots(GUID snapshotSetId)
+    {
+        LONG cDeletedSnapshots;
+        GUID nonDeletedSnapshotId;
+        return _pBackupComponents->DeleteSnapshots(snapshotSetId, VSS_OBJECT_SNAPSHOT_SET, TRUE,
+            &cDeletedSnapshots, &nonDeletedSnapshotId);
+    }
+};
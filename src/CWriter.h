@@ -31,7 +31,6 @@ class CWriter
 {
 private:
     vector<CWriterComponent> _components;
-    vector<CWriterComponent> _componentTree; 
     GUID _instanceId;
     CString _name; 
     GUID _writerId; 
@@ -42,6 +41,17 @@ public:
         return _components; 
     }
 
+    // NULL if component has no parent. 
+    CWriterComponent* FindParent(CWriterComponent& component)
+    {
+        if (component.get_ParentIndex() < 0)
+        {
+            return NULL; 
+        }
+
+        return &_components[component.get_ParentIndex()]; 
+    }
+
     GUID get_InstanceId(void)
     {
         return _instanceId; 
@@ -72,27 +82,88 @@ public:
         _writerId = value; 
     }
 
+    // Links every component to its parent - the component whose logical
+    // path plus name is the child's logical path - and works out which
+    // components have a selectable ancestor. Linear in the number of
+    // components: parents are found through a hash index of full paths,
+    // and each ancestor chain is walked only once.
     void ComputeComponentTree(void)
     {
-        for (unsigned int iComponent = 0; iComponent < _components.size(); ++iComponent)
+        unsigned int count = (unsigned int) _components.size(); 
+
+        CAtlMap<CString, unsigned int> fullPaths; 
+        fullPaths.InitHashTable(count < 17 ? 17 : count + count / 2 + 1); 
+        for (unsigned int iComponent = 0; iComponent < count; ++iComponent)
         {
-            CWriterComponent& current = _components[iComponent];
+            CWriterComponent& component = _components[iComponent]; 
 
-            for (unsigned int iComponentParent = 0; iComponentParent < _components.size(); ++iComponentParent)
+            CString fullPath(component.get_LogicalPath()); 
+            if (fullPath.GetLength() > 0)
             {
-                if (iComponentParent == iComponent)
+                fullPath.Append(TEXT("\\")); 
+            }
+            fullPath.Append(component.get_Name()); 
+
+            // Like the lookup below, the first component with a given path wins. 
+            unsigned int existing; 
+            if (!fullPaths.Lookup(fullPath, existing))
+            {
+                fullPaths.SetAt(fullPath, iComponent); 
+            }
+        }
+
+        for (unsigned int iComponent = 0; iComponent < count; ++iComponent)
+        {
+            CWriterComponent& current = _components[iComponent]; 
+            current.set_ParentIndex(-1); 
+
+            unsigned int iParent; 
+            if (current.get_LogicalPath().GetLength() > 0 
+                && fullPaths.Lookup(current.get_LogicalPath(), iParent) 
+                && iParent != iComponent)
+            {
+                current.set_ParentIndex((int) iParent); 
+            }
+        }
+
+        // Resolve each chain from the top down, stopping at the first
+        // component already resolved. Malformed metadata can make a chain
+        // loop back on itself; a loop is treated as having no ancestor.
+        enum { UNRESOLVED, RESOLVING, RESOLVED }; 
+        vector<int> states(count, UNRESOLVED); 
+        vector<unsigned int> chain; 
+        for (unsigned int iComponent = 0; iComponent < count; ++iComponent)
+        {
+            chain.clear(); 
+            unsigned int iCurrent = iComponent; 
+            while (states[iCurrent] == UNRESOLVED)
+            {
+                states[iCurrent] = RESOLVING; 
+                chain.push_back(iCurrent); 
+
+                int iParent = _components[iCurrent].get_ParentIndex(); 
+                if (iParent < 0)
                 {
-                    continue; 
+                    break; 
                 }
+                iCurrent = (unsigned int) iParent; 
+            }
+
+            for (size_t iLink = chain.size(); iLink > 0; --iLink)
+            {
+                CWriterComponent& component = _components[chain[iLink - 1]]; 
+                int iParent = component.get_ParentIndex(); 
 
-                CWriterComponent& potentialParent = _components[iComponentParent]; 
-                if (potentialParent.IsParentOf(current))
+                bool hasSelectableAncestor = false; 
+                if (iParent >= 0 && states[iParent] == RESOLVED)
                 {
-                    current.set_Parent(&potentialParent); 
-                    break; 
+                    CWriterComponent& parent = _components[iParent]; 
+                    hasSelectableAncestor = parent.get_SelectableForBackup() || parent.get_HasSelectableAncestor(); 
                 }
+
+                component.set_HasSelectableAncestor(hasSelectableAncestor); 
+                states[chain[iLink - 1]] = RESOLVED; 
             }
         }
-
     }
 };
\ No newline at end of file
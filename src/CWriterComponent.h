@@ -34,7 +34,10 @@ private:
     CString _logicalPath;
     bool _logicalPathParsed; 
     CString _name; 
-    CWriterComponent* _pParent; 
+    int _parent; 
+    bool _hasSelectableAncestor; 
+    vector<CString> _filePaths; 
+    bool _filePathsKnown; 
 //    vector<CString> _pathComponents;
     bool _selectableForBackup; 
     VSS_COMPONENT_TYPE _type; 
@@ -43,25 +46,41 @@ private:
 public:
     CWriterComponent::CWriterComponent()
     {
-        _pParent = NULL; 
+        _parent = -1; 
+        _hasSelectableAncestor = false; 
+        _filePathsKnown = false; 
     }
 
-    bool get_HasSelectableAncestor(void)
+    // The directories holding the component's files, databases and
+    // database logs, exactly as the writer reported them. Only meaningful
+    // when get_FilePathsKnown is true. 
+    vector<CString>& get_FilePaths(void)
     {
-        if (_pParent == NULL)
-        {
-            return false; 
-        }
+        return _filePaths; 
+    }
 
-        if (_pParent->get_SelectableForBackup())
-        {
-            return true; 
-        }
+    bool get_FilePathsKnown(void)
+    {
+        return _filePathsKnown; 
+    }
 
-        return _pParent->get_HasSelectableAncestor(); 
+    void set_FilePathsKnown(bool value)
+    {
+        _filePathsKnown = value; 
+    }
+
+    // Set by CWriter::ComputeComponentTree. 
+    bool get_HasSelectableAncestor(void)
+    {
+        return _hasSelectableAncestor; 
+    }
+
+    void set_HasSelectableAncestor(bool value)
+    {
+        _hasSelectableAncestor = value; 
     }
 
-    CString get_LogicalPath(void)
+    CString& get_LogicalPath(void)
     {
         return _logicalPath; 
     }
@@ -72,7 +91,7 @@ public:
         _logicalPathParsed = false; 
     }
 
-    CString get_Name(void)
+    CString& get_Name(void)
     {
         return _name; 
     }
@@ -82,14 +101,16 @@ public:
         _name = value; 
     }
 
-    CWriterComponent* get_Parent(void)
+    // The parent's index in the writer's components, or -1 for none. An
+    // index rather than a pointer, so it survives the writer being copied. 
+    int get_ParentIndex(void)
     {
-        return _pParent; 
+        return _parent; 
     }
 
-    void set_Parent(CWriterComponent* value)
+    void set_ParentIndex(int value)
     {
-        _pParent = value; 
+        _parent = value; 
     }
 
     bool get_SelectableForBackup(void)
@@ -0,0 +1,440 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CWriter.h"
+#include "CStringPool.h"
+#include "OutputWriter.h"
+
+using namespace std;
+
+// Remembers the CWriter/CWriterComponent model built from writer metadata
+// so that later runs can skip the per-component COM walk. Entries are
+// keyed by writer instance id and only used if the writer's fingerprint,
+// a hash of its identity and counts, still matches; entries whose file
+// paths are wanted must also match the hash of the whole metadata
+// document. Entries that turn out to be stale anyway are dropped with
+// Remove.
+//
+// File layout, all integers little endian:
+//   DWORD magic, DWORD format version, DWORD writer count, then per writer
+//   GUID instance id, GUID writer id, ULONGLONG fingerprint, ULONGLONG
+//   content fingerprint, string name,
+//   DWORD file paths known, DWORD component count, then per component
+//   DWORD type, DWORD selectable, string logical path, string name, DWORD
+//   file path count and that many strings. Strings are a DWORD character
+//   count followed by that many WCHARs.
+class CWriterMetadataCache
+{
+private:
+    static const DWORD MAGIC = 0x4D575353; // "SSWM"
+    static const DWORD FORMAT_VERSION = 4;
+
+    struct Entry
+    {
+        ULONGLONG fingerprint;
+        ULONGLONG contentFingerprint;
+        bool filePathsKnown;
+        CWriter writer;
+    };
+
+    CComAutoCriticalSection _lock;
+    vector<Entry> _entries;
+    bool _dirty;
+
+    int Find(const GUID& instanceId)
+    {
+        for (unsigned int iEntry = 0; iEntry < _entries.size(); ++iEntry)
+        {
+            if (::IsEqualGUID(_entries[iEntry].writer.get_InstanceId(), instanceId))
+            {
+                return (int) iEntry;
+            }
+        }
+        return -1;
+    }
+
+    static void Append(vector<BYTE>& buffer, const void* data, size_t length)
+    {
+        const BYTE* bytes = (const BYTE*) data;
+        buffer.insert(buffer.end(), bytes, bytes + length);
+    }
+
+    static void AppendDword(vector<BYTE>& buffer, DWORD value)
+    {
+        Append(buffer, &value, sizeof(value));
+    }
+
+    static void AppendString(vector<BYTE>& buffer, LPCWSTR value)
+    {
+        DWORD length = (DWORD) wcslen(value);
+        AppendDword(buffer, length);
+        Append(buffer, value, length * sizeof(WCHAR));
+    }
+
+    static bool Read(const vector<BYTE>& buffer, size_t& offset, void* data, size_t length)
+    {
+        if (buffer.size() - offset < length)
+        {
+            return false;
+        }
+        memcpy(data, &buffer[offset], length);
+        offset += length;
+        return true;
+    }
+
+    static bool ReadDword(const vector<BYTE>& buffer, size_t& offset, DWORD& value)
+    {
+        return Read(buffer, offset, &value, sizeof(value));
+    }
+
+    static bool ReadString(const vector<BYTE>& buffer, size_t& offset, CString& value)
+    {
+        DWORD length;
+        if (!ReadDword(buffer, offset, length) || (buffer.size() - offset) / sizeof(WCHAR) < length)
+        {
+            return false;
+        }
+        value.SetString((LPCWSTR) (buffer.empty() ? NULL : &buffer[offset]), (int) length);
+        offset += length * sizeof(WCHAR);
+        return true;
+    }
+
+    bool Parse(const vector<BYTE>& buffer)
+    {
+        size_t offset = 0;
+        DWORD magic;
+        DWORD version;
+        DWORD cWriters;
+        if (!ReadDword(buffer, offset, magic) || magic != MAGIC ||
+            !ReadDword(buffer, offset, version) || version != FORMAT_VERSION ||
+            !ReadDword(buffer, offset, cWriters))
+        {
+            return false;
+        }
+
+        CStringPool strings;
+        vector<Entry> entries;
+        entries.reserve(cWriters);
+        for (DWORD iWriter = 0; iWriter < cWriters; ++iWriter)
+        {
+            entries.push_back(Entry());
+            Entry& entry = entries.back();
+            GUID instanceId;
+            GUID writerId;
+            CString name;
+            DWORD filePathsKnown;
+            DWORD cComponents;
+            if (!Read(buffer, offset, &instanceId, sizeof(instanceId)) ||
+                !Read(buffer, offset, &writerId, sizeof(writerId)) ||
+                !Read(buffer, offset, &entry.fingerprint, sizeof(entry.fingerprint)) ||
+                !Read(buffer, offset, &entry.contentFingerprint, sizeof(entry.contentFingerprint)) ||
+                !ReadString(buffer, offset, name) ||
+                !ReadDword(buffer, offset, filePathsKnown) ||
+                !ReadDword(buffer, offset, cComponents))
+            {
+                return false;
+            }
+
+            entry.filePathsKnown = (filePathsKnown != 0);
+
+            entry.writer.set_InstanceId(instanceId);
+            entry.writer.set_WriterId(writerId);
+            entry.writer.set_Name(name);
+
+            entry.writer.get_Components().reserve(cComponents);
+            for (DWORD iComponent = 0; iComponent < cComponents; ++iComponent)
+            {
+                DWORD type;
+                DWORD selectable;
+                CString logicalPath;
+                CString componentName;
+                DWORD cFilePaths;
+                if (!ReadDword(buffer, offset, type) ||
+                    !ReadDword(buffer, offset, selectable) ||
+                    !ReadString(buffer, offset, logicalPath) ||
+                    !ReadString(buffer, offset, componentName) ||
+                    !ReadDword(buffer, offset, cFilePaths))
+                {
+                    return false;
+                }
+
+                entry.writer.get_Components().push_back(CWriterComponent());
+                CWriterComponent& component = entry.writer.get_Components().back();
+                component.set_Type((VSS_COMPONENT_TYPE) type);
+                component.set_SelectableForBackup(selectable != 0);
+                component.set_LogicalPath(strings.Intern(logicalPath));
+                component.set_Name(strings.Intern(componentName));
+                component.set_FilePathsKnown(entry.filePathsKnown);
+
+                for (DWORD iFilePath = 0; iFilePath < cFilePaths; ++iFilePath)
+                {
+                    CString filePath;
+                    if (!ReadString(buffer, offset, filePath))
+                    {
+                        return false;
+                    }
+                    component.get_FilePaths().push_back(strings.Intern(filePath));
+                }
+            }
+        }
+
+        _entries.swap(entries);
+        return true;
+    }
+
+public:
+    CWriterMetadataCache::CWriterMetadataCache()
+    {
+        _dirty = false;
+    }
+
+    // FNV-1a, continuing from hash.
+    static ULONGLONG Hash(const void* data, size_t length, ULONGLONG hash = 14695981039346656037ULL)
+    {
+        const BYTE* bytes = (const BYTE*) data;
+        for (size_t iByte = 0; iByte < length; ++iByte)
+        {
+            hash ^= bytes[iByte];
+            hash *= 1099511628211ULL;
+        }
+
+        return hash;
+    }
+
+    // Answers "has this writer's metadata changed" from what
+    // IVssExamineWriterMetadata::GetIdentity and GetFileCounts report, so
+    // a hit costs no more calls than the writer's first two. Renaming or
+    // swapping a component without changing the counts slips past it, but
+    // AddComponent then fails and CSnapshotSet evicts the entry and starts
+    // over.
+    static ULONGLONG ComputeFingerprint(CWriter& writer, VSS_USAGE_TYPE usage, VSS_SOURCE_TYPE source,
+        UINT cIncludeFiles, UINT cExcludeFiles, UINT cComponents)
+    {
+        GUID instanceId = writer.get_InstanceId();
+        GUID writerId = writer.get_WriterId();
+        UINT counts[] = { (UINT) usage, (UINT) source, cIncludeFiles, cExcludeFiles, cComponents };
+
+        ULONGLONG hash = Hash(&instanceId, sizeof(instanceId));
+        hash = Hash(&writerId, sizeof(writerId), hash);
+        hash = Hash((LPCWSTR) writer.get_Name(), writer.get_Name().GetLength() * sizeof(WCHAR), hash);
+        return Hash(counts, sizeof(counts), hash);
+    }
+
+    // A hash of the document IVssExamineWriterMetadata::SaveAsXML returns,
+    // which covers every component and file descriptor. Serializing that is
+    // about as slow as the walk the cache saves, so it's only worth it for
+    // the file paths volume filtering relies on: a stale path could quietly
+    // leave a component out, where a stale name just fails.
+    static ULONGLONG ComputeContentFingerprint(LPCWSTR metadataXml, UINT length)
+    {
+        return Hash(metadataXml, length * sizeof(WCHAR));
+    }
+
+    // With needFilePaths set, entries stored without file paths, or whose
+    // content fingerprint doesn't match contentFingerprint, don't count as
+    // hits. contentFingerprint is ignored otherwise.
+    bool Lookup(const GUID& instanceId, ULONGLONG fingerprint, bool needFilePaths, ULONGLONG contentFingerprint, CWriter& writer)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+
+        int index = Find(instanceId);
+        if (index < 0 || _entries[index].fingerprint != fingerprint ||
+            (needFilePaths && (!_entries[index].filePathsKnown || _entries[index].contentFingerprint != contentFingerprint)))
+        {
+            return false;
+        }
+
+        writer = _entries[index].writer;
+        return true;
+    }
+
+    // contentFingerprint only matters if writer's file paths are known.
+    void Store(CWriter& writer, ULONGLONG fingerprint, ULONGLONG contentFingerprint)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+
+        Entry entry;
+        entry.fingerprint = fingerprint;
+        entry.contentFingerprint = contentFingerprint;
+        entry.filePathsKnown = true;
+        entry.writer.set_InstanceId(writer.get_InstanceId());
+        entry.writer.set_WriterId(writer.get_WriterId());
+        entry.writer.set_Name(writer.get_Name());
+
+        // Only the fields that come from the metadata are cached; parent
+        // links are recomputed by whoever uses the entry.
+        for (unsigned int iComponent = 0; iComponent < writer.get_Components().size(); ++iComponent)
+        {
+            CWriterComponent& source = writer.get_Components()[iComponent];
+            CWriterComponent component;
+            component.set_Type(source.get_Type());
+            component.set_SelectableForBackup(source.get_SelectableForBackup());
+            component.set_LogicalPath(source.get_LogicalPath());
+            component.set_Name(source.get_Name());
+            component.set_FilePathsKnown(source.get_FilePathsKnown());
+            component.get_FilePaths() = source.get_FilePaths();
+            entry.filePathsKnown = entry.filePathsKnown && source.get_FilePathsKnown();
+            entry.writer.get_Components().push_back(component);
+        }
+
+        int index = Find(entry.writer.get_InstanceId());
+        if (index < 0)
+        {
+            _entries.push_back(entry);
+        }
+        else
+        {
+            _entries[index] = entry;
+        }
+        _dirty = true;
+    }
+
+    // Drops the entry for instanceId, if any, so the next run walks that
+    // writer's metadata again.
+    void Remove(const GUID& instanceId)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+
+        int index = Find(instanceId);
+        if (index >= 0)
+        {
+            _entries.erase(_entries.begin() + index);
+            _dirty = true;
+        }
+    }
+
+    // Missing, unreadable or out-of-date cache files just leave the cache
+    // empty: the cache is an optimization, never a reason to fail.
+    void Load(LPCTSTR path, OutputWriter& logger)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+
+        _entries.clear();
+        _dirty = false;
+
+        HANDLE hFile = ::CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+        {
+            logger.WriteFormat(TEXT("No writer metadata cache at %s"), path);
+            return;
+        }
+
+        vector<BYTE> buffer;
+        LARGE_INTEGER size;
+        bool worked = ::GetFileSizeEx(hFile, &size) != FALSE && size.HighPart == 0;
+        if (worked && size.LowPart > 0)
+        {
+            buffer.resize(size.LowPart);
+            DWORD cbRead;
+            worked = ::ReadFile(hFile, &buffer[0], size.LowPart, &cbRead, NULL) != FALSE && cbRead == size.LowPart;
+        }
+        ::CloseHandle(hFile);
+
+        if (!worked || !Parse(buffer))
+        {
+            _entries.clear();
+            logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Ignoring unreadable writer metadata cache at %s"), path);
+            return;
+        }
+
+        logger.WriteFormat(TEXT("Loaded %d writers from writer metadata cache at %s"), (int) _entries.size(), path);
+    }
+
+    // Writes to a temporary file and renames it over the old cache so a
+    // crash mid-write cannot leave a truncated cache behind.
+    void Save(LPCTSTR path, OutputWriter& logger)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(_lock);
+
+        if (!_dirty)
+        {
+            return;
+        }
+
+        vector<BYTE> buffer;
+        AppendDword(buffer, MAGIC);
+        AppendDword(buffer, FORMAT_VERSION);
+        AppendDword(buffer, (DWORD) _entries.size());
+        for (unsigned int iEntry = 0; iEntry < _entries.size(); ++iEntry)
+        {
+            Entry& entry = _entries[iEntry];
+            GUID instanceId = entry.writer.get_InstanceId();
+            GUID writerId = entry.writer.get_WriterId();
+            Append(buffer, &instanceId, sizeof(instanceId));
+            Append(buffer, &writerId, sizeof(writerId));
+            Append(buffer, &entry.fingerprint, sizeof(entry.fingerprint));
+            Append(buffer, &entry.contentFingerprint, sizeof(entry.contentFingerprint));
+            AppendString(buffer, entry.writer.get_Name());
+            AppendDword(buffer, entry.filePathsKnown ? 1 : 0);
+
+            vector<CWriterComponent>& components = entry.writer.get_Components();
+            AppendDword(buffer, (DWORD) components.size());
+            for (unsigned int iComponent = 0; iComponent < components.size(); ++iComponent)
+            {
+                CWriterComponent& component = components[iComponent];
+                AppendDword(buffer, (DWORD) component.get_Type());
+                AppendDword(buffer, component.get_SelectableForBackup() ? 1 : 0);
+                AppendString(buffer, component.get_LogicalPath());
+                AppendString(buffer, component.get_Name());
+
+                vector<CString>& filePaths = component.get_FilePaths();
+                AppendDword(buffer, (DWORD) filePaths.size());
+                for (unsigned int iFilePath = 0; iFilePath < filePaths.size(); ++iFilePath)
+                {
+                    AppendString(buffer, filePaths[iFilePath]);
+                }
+            }
+        }
+
+        CString tempPath(path);
+        tempPath.Append(TEXT(".tmp"));
+
+        HANDLE hFile = ::CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        bool worked = (hFile != INVALID_HANDLE_VALUE);
+        if (worked)
+        {
+            DWORD cbWritten;
+            worked = ::WriteFile(hFile, &buffer[0], (DWORD) buffer.size(), &cbWritten, NULL) != FALSE && cbWritten == buffer.size();
+            ::CloseHandle(hFile);
+        }
+
+        if (worked)
+        {
+            worked = ::MoveFileEx(tempPath, path, MOVEFILE_REPLACE_EXISTING) != FALSE;
+        }
+
+        if (!worked)
+        {
+            DWORD error = ::GetLastError();
+            CString errorMessage;
+            Utilities::FormatErrorMessage(error, errorMessage);
+            logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Unable to save writer metadata cache to %s. Error: %s"), path, errorMessage);
+            ::DeleteFile(tempPath);
+            return;
+        }
+
+        _dirty = false;
+    }
+};
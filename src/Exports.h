@@ -5,4 +5,229 @@ extern "C"
 {
 	typedef void (__stdcall ShadowSpawnCallback)(void);
 	typedef void (__stdcall LogCallback)(const LPCTSTR);
+
+	// What a ShadowSpawnCallbackEx is told about the snapshot it runs
+	// against. Only valid until the callback returns.
+	typedef struct ShadowSpawnSnapshotInfo
+	{
+		LPCTSTR snapshotRoot;		// Where source can be read from (the device, or a \\?\GLOBALROOT path without one), with a trailing backslash
+		LPCTSTR source;				// The path that was snapshotted
+		FILETIME snapshotTime;		// When the snapshot was taken, in UTC
+		DWORD workerIndex;			// 0 to workerCount - 1
+		DWORD workerCount;
+	} ShadowSpawnSnapshotInfo;
+
+	// Returning a failure HRESULT fails the call with it.
+	typedef HRESULT (__stdcall ShadowSpawnCallbackEx)(const ShadowSpawnSnapshotInfo*, void*);
+
+	// Opaque handle returned by ShadowSpawnCreateSession.
+	typedef void* ShadowSpawnSession;
+
+	// Opaque handle returned by ShadowSpawnAsync.
+	typedef void* ShadowSpawnJob;
+
+	// Opaque handle returned by ShadowSpawnCreateCancellation.
+	typedef void* ShadowSpawnCancellation;
+
+	// Opaque handle returned by ShadowSpawnCreateGlob.
+	typedef void* ShadowSpawnGlob;
+
+	// Where a ShadowSpawnAsync job has got to.
+	typedef enum ShadowSpawnJobState
+	{
+		SHADOWSPAWN_JOB_PENDING = 0,
+		SHADOWSPAWN_JOB_GATHERING_WRITER_METADATA = 1,
+		SHADOWSPAWN_JOB_PREPARING_FOR_BACKUP = 2,
+		SHADOWSPAWN_JOB_CREATING_SNAPSHOT = 3,
+		SHADOWSPAWN_JOB_RUNNING_CALLBACK = 4,
+		SHADOWSPAWN_JOB_COMPLETING_BACKUP = 5,
+		SHADOWSPAWN_JOB_SUCCEEDED = 6,
+		SHADOWSPAWN_JOB_FAILED = 7,
+	} ShadowSpawnJobState;
+
+	// The timed phases of a ShadowSpawn run; see ShadowSpawnGetPhaseStats.
+	typedef enum ShadowSpawnPhase
+	{
+		SHADOWSPAWN_PHASE_PROVIDER_DISCOVERY = 0,
+		SHADOWSPAWN_PHASE_GATHER_WRITER_METADATA = 1,
+		SHADOWSPAWN_PHASE_ADD_COMPONENTS = 2,
+		SHADOWSPAWN_PHASE_PREPARE_FOR_BACKUP = 3,
+		SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET = 4,		// The writer freeze window
+		SHADOWSPAWN_PHASE_MOUNT = 5,
+		SHADOWSPAWN_PHASE_CALLBACK = 6,
+		SHADOWSPAWN_PHASE_UNMOUNT = 7,
+		SHADOWSPAWN_PHASE_BACKUP_COMPLETE = 8,
+		SHADOWSPAWN_PHASE_DELETE_SNAPSHOTS = 9,
+		SHADOWSPAWN_PHASE_ADMISSION = 10,			// Queued behind other snapshot sets being created
+		SHADOWSPAWN_PHASE_CLONE = 11,				// Copying the tree for ShadowSpawnWithClone
+		SHADOWSPAWN_PHASE_COPY = 12,				// ShadowSpawnCopyTree
+		SHADOWSPAWN_PHASE_WALK = 13,				// ShadowSpawnWalkTree
+		SHADOWSPAWN_PHASE_DELETE_CLONE = 14,		// Deleting the copy ShadowSpawnWithClone made
+		SHADOWSPAWN_PHASE_COUNT = 15,
+	} ShadowSpawnPhase;
+
+	#define SHADOWSPAWN_HISTOGRAM_BUCKETS 32
+
+	// Latencies recorded for one phase since the process started (or
+	// since ShadowSpawnResetPhaseStats). buckets[i] counts runs that took
+	// [2^i, 2^(i+1)) microseconds; bucket 0 also counts zero and the last
+	// bucket everything longer.
+	typedef struct ShadowSpawnPhaseStats
+	{
+		DWORD count;
+		ULONGLONG totalMicroseconds;
+		ULONGLONG minMicroseconds;
+		ULONGLONG maxMicroseconds;
+		DWORD buckets[SHADOWSPAWN_HISTOGRAM_BUCKETS];
+	} ShadowSpawnPhaseStats;
+
+	// Called once, on a thread pool thread, when a ShadowSpawnAsync job
+	// finishes. hr is what ShadowSpawn would have returned.
+	typedef void (__stdcall ShadowSpawnCompletionCallback)(ShadowSpawnJob, HRESULT, void*);
+
+	// What logging does when the queue set up by ShadowSpawnSetLogQueue is
+	// full: throw the message away, or wait for the LogCallback to catch up.
+	typedef enum ShadowSpawnLogOverflowPolicy
+	{
+		SHADOWSPAWN_LOG_OVERFLOW_DROP = 0,
+		SHADOWSPAWN_LOG_OVERFLOW_BLOCK = 1,
+	} ShadowSpawnLogOverflowPolicy;
+
+	// Identifies a ShadowSpawnEventRecord.
+	typedef enum ShadowSpawnEventId
+	{
+		SHADOWSPAWN_EVENT_PHASE_FINISHED = 0,		// value: elapsed microseconds
+		SHADOWSPAWN_EVENT_WRITER = 1,				// value: component count; text: writer name
+		SHADOWSPAWN_EVENT_COMPONENT_ADDED = 2,
+		SHADOWSPAWN_EVENT_COMPONENT_SKIPPED = 3,
+		SHADOWSPAWN_EVENT_VOLUME_ADDED = 4,		// text: volume
+		SHADOWSPAWN_EVENT_SNAPSHOT_MOUNTED = 5,	// text: device
+		SHADOWSPAWN_EVENT_ERROR = 6,				// text: the message that was logged
+		SHADOWSPAWN_EVENT_FILE_COPIED = 7,		// value: ShadowSpawnCopyMethod; text: path below the source
+		SHADOWSPAWN_EVENT_COUNT = 8,
+	} ShadowSpawnEventId;
+
+	// Used for a phase, writer index or component index that doesn't apply.
+	#define SHADOWSPAWN_EVENT_NONE 0xFFFFFFFF
+
+	// One binary event. Records are packed back to back, each size bytes
+	// long: the fixed part below, then the text (if any) as TCHARs with no
+	// terminator, padded to a multiple of 8 bytes.
+	typedef struct ShadowSpawnEventRecord
+	{
+		WORD size;
+		WORD eventId;			// ShadowSpawnEventId
+		DWORD phase;			// ShadowSpawnPhase
+		LONGLONG timestamp;		// UTC, as a FILETIME
+		DWORD writerIndex;
+		DWORD componentIndex;
+		HRESULT hr;
+		DWORD value;
+	} ShadowSpawnEventRecord;
+
+	// Receives a batch of back-to-back ShadowSpawnEventRecords. The buffer
+	// is only valid for the duration of the call.
+	typedef void (__stdcall ShadowSpawnEventCallback)(const BYTE*, DWORD, void*);
+
+	// What a rule added with ShadowSpawnAddSelectionRule does to the
+	// writers and components it matches.
+	typedef enum ShadowSpawnSelectionAction
+	{
+		SHADOWSPAWN_SELECT_INCLUDE = 0,
+		SHADOWSPAWN_SELECT_EXCLUDE = 1,
+	} ShadowSpawnSelectionAction;
+
+	// What a selection rule's pattern is matched against. Name and path
+	// patterns are case-insensitive and may contain the wildcards
+	// ShadowSpawnCreateGlob accepts, except that * matches backslashes too.
+	typedef enum ShadowSpawnSelectionField
+	{
+		SHADOWSPAWN_SELECT_WRITER_NAME = 0,
+		SHADOWSPAWN_SELECT_WRITER_ID = 1,				// Pattern is the writer class id, "{...}"
+		SHADOWSPAWN_SELECT_LOGICAL_PATH = 2,			// Matched against "logicalPath\name"
+		SHADOWSPAWN_SELECT_ON_SNAPSHOT_VOLUME = 3,		// Pattern unused: components with files on a snapshotted volume
+		SHADOWSPAWN_SELECT_OFF_SNAPSHOT_VOLUME = 4,	// Pattern unused: components with no files on one
+	} ShadowSpawnSelectionField;
+
+	// Limits on a single call to ShadowSpawnWithOptions. The time limit
+	// covers everything but the callback, which is never interrupted.
+	typedef struct ShadowSpawnCallOptions
+	{
+		DWORD timeoutMs;						// INFINITE for no time limit
+		ShadowSpawnCancellation cancellation;	// NULL if the call can't be cancelled
+	} ShadowSpawnCallOptions;
+
+	// What ShadowSpawnCopyTree preserves besides file data.
+	typedef enum ShadowSpawnCopyFlags
+	{
+		SHADOWSPAWN_COPY_ATTRIBUTES = 0x1,		// Read-only, hidden, system, archive, ...
+		SHADOWSPAWN_COPY_TIMESTAMPS = 0x2,		// Creation, last access and last write times
+		SHADOWSPAWN_COPY_SECURITY = 0x4,		// The DACL
+		SHADOWSPAWN_COPY_OVERWRITE = 0x8,		// Replace existing files rather than failing them
+		SHADOWSPAWN_COPY_CACHED = 0x10,			// Never bypass the file cache, e.g. when the copy is read again straight away
+	} ShadowSpawnCopyFlags;
+
+	// Zero for any count or size picks its default.
+	typedef struct ShadowSpawnCopyOptions
+	{
+		DWORD threadCount;		// Default: one per processor
+		DWORD bufferCount;		// Buffers in use at once across all threads; default: two per thread
+		DWORD bufferSize;		// Default: 1 MB
+		DWORD flags;			// ShadowSpawnCopyFlags
+	} ShadowSpawnCopyOptions;
+
+	// How ShadowSpawnCopyTree copied a file. Each file gets the first of
+	// these that works for it.
+	typedef enum ShadowSpawnCopyMethod
+	{
+		SHADOWSPAWN_COPY_METHOD_CLONE = 0,			// Block-cloned, so no data was copied (ReFS, same volume)
+		SHADOWSPAWN_COPY_METHOD_UNBUFFERED = 1,	// CopyFileEx, bypassing the file cache (large files)
+		SHADOWSPAWN_COPY_METHOD_OVERLAPPED = 2,	// Several reads and writes in flight at once through copy buffers
+		SHADOWSPAWN_COPY_METHOD_BUFFERED = 3,		// Read and written through a copy buffer
+		SHADOWSPAWN_COPY_METHOD_COUNT = 4,
+	} ShadowSpawnCopyMethod;
+
+	typedef struct ShadowSpawnCopyStats
+	{
+		ULONGLONG directoryCount;
+		ULONGLONG fileCount;
+		ULONGLONG byteCount;
+		DWORD failedCount;
+		ULONGLONG methodFileCounts[SHADOWSPAWN_COPY_METHOD_COUNT];	// Indexed by ShadowSpawnCopyMethod
+		ULONGLONG methodByteCounts[SHADOWSPAWN_COPY_METHOD_COUNT];
+	} ShadowSpawnCopyStats;
+
+	// One file or directory found by ShadowSpawnWalkTree.
+	typedef struct ShadowSpawnWalkEntry
+	{
+		LPCTSTR path;				// Relative to the root; only valid until the callback returns
+		DWORD pathLength;			// In characters
+		DWORD attributes;
+		ULONGLONG size;
+		FILETIME lastWriteTime;
+	} ShadowSpawnWalkEntry;
+
+	// Called with count entries at a time. Returning a failure HRESULT
+	// stops the walk.
+	typedef HRESULT (__stdcall ShadowSpawnWalkCallback)(const ShadowSpawnWalkEntry*, DWORD, void*);
+
+	typedef struct ShadowSpawnWalkStats
+	{
+		ULONGLONG directoryCount;
+		ULONGLONG fileCount;
+		DWORD failedCount;			// Directories that couldn't be listed
+	} ShadowSpawnWalkStats;
+
+	// Configures the mock snapshot provider used by ShadowSpawnMock.
+	typedef struct ShadowSpawnMockOptions
+	{
+		DWORD writerCount;
+		DWORD componentsPerWriter;
+		DWORD callLatencyMs;		// Added to every synchronous provider call
+		DWORD asyncLatencyMs;		// Time until each IVssAsync reports completion
+		DWORD hangPhases;			// Bit (1 << phase) set: that phase's IVssAsync never completes unless cancelled
+		const LPCTSTR* writerNames;	// writerCount names, or NULL for "Mock Writer n"; copied by the session
+		LPCTSTR componentFilePath;	// Reported as the files of every selectable component, or NULL for none known
+		DWORD freezeLatencyMsPerWriter;	// Added to PrepareForBackup and DoSnapshotSet for each writer not disabled
+	} ShadowSpawnMockOptions;
 }
\ No newline at end of file
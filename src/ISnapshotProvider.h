@@ -0,0 +1,65 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CWriter.h"
+
+using namespace std;
+
+// The subset of IVssBackupComponents that _ShadowSpawn drives. Methods
+// that are asynchronous in VSS hand back an IVssAsync so the caller
+// still decides how to wait on them. Everything returning an HRESULT
+// is meant to be wrapped in CHECK_HRESULT, exactly like the VSS calls
+// it stands in for.
+class ISnapshotProvider
+{
+public:
+    virtual ~ISnapshotProvider(void)
+    {
+    }
+
+    virtual GUID GetSystemProviderId(void) = 0;
+    virtual HRESULT InitializeForBackup(void) = 0;
+    virtual bool IsInitialized(void) = 0;
+
+    virtual HRESULT GatherWriterMetadata(IVssAsync** ppAsync) = 0;
+    virtual void GetWriters(vector<CWriter>& writers) = 0;
+
+    // Forgets any cached metadata GetWriters used, so the next provider
+    // reads those writers afresh. Returns false if nothing came from a
+    // cache, in which case there's nothing to be gained by trying again.
+    virtual bool EvictCachedWriters(void) = 0;
+
+    virtual HRESULT StartSnapshotSet(GUID* pSnapshotSetId) = 0;
+    virtual HRESULT AddToSnapshotSet(LPCTSTR volumeName, GUID providerId, GUID* pSnapshotId) = 0;
+    virtual HRESULT AddComponent(CWriter& writer, CWriterComponent& component) = 0;
+    virtual HRESULT DisableWriterInstances(const vector<GUID>& instanceIds) = 0;
+    virtual HRESULT SetBackupState(void) = 0;
+    virtual HRESULT PrepareForBackup(IVssAsync** ppAsync) = 0;
+    virtual HRESULT DoSnapshotSet(IVssAsync** ppAsync) = 0;
+    virtual HRESULT GetSnapshotDeviceObject(GUID snapshotId, CString& deviceObject) = 0;
+    virtual HRESULT BackupComplete(IVssAsync** ppAsync) = 0;
+    virtual HRESULT AbortBackup(void) = 0;
+    virtual HRESULT DeleteSnapshots(GUID snapshotSetId) = 0;
+};
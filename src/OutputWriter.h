@@ -24,6 +24,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
 #include "Exports.h"
+#include "CLogQueue.h"
+#include "CEventLog.h"
 using namespace std; 
 
 
@@ -49,6 +51,18 @@ class OutputWriter
 private: 
 	VERBOSITY_LEVEL s_verbosityLevel; 
 	LogCallback* s_logCallback;
+	CLogQueue* volatile s_pLogQueue;
+	CEventLog* volatile s_pEventLog;
+
+	// Every Deliver and WriteEvent counts itself in the counter for the
+	// epoch that was current when it started. Swapping the log queue or
+	// event log out moves on to the next epoch and waits for the old
+	// counter to reach zero, after which nothing can still be using the
+	// old one.
+	volatile LONG s_epoch;
+	volatile LONG s_activeWriters[2];
+	volatile LONG s_retiring;
+	HANDLE s_hWriterLeft;
 
 	/*
 	static LPCTSTR LogLevelToString(VERBOSITY_LEVEL level)
@@ -70,7 +84,83 @@ private:
 	}
 	}
 	*/
+	LONG EnterWriter(void)
+	{
+		while (true)
+		{
+			LONG epoch = s_epoch; 
+			::InterlockedIncrement(&s_activeWriters[epoch & 1]); 
+			if (s_epoch == epoch)
+			{
+				return epoch; 
+			}
+			// A swap started in between, and may already have stopped
+			// waiting for this counter. 
+			LeaveWriter(epoch); 
+		}
+	}
+	void LeaveWriter(LONG epoch)
+	{
+		if (::InterlockedDecrement(&s_activeWriters[epoch & 1]) == 0 && s_retiring != 0)
+		{
+			::SetEvent(s_hWriterLeft); 
+		}
+	}
+	// Waits until every Deliver that started before the call has returned.
+	// Callers are serialized by the owner, and must not be writers
+	// themselves (a LogCallback can't change the log queue). 
+	void WaitForWriters(void)
+	{
+		LONG epoch = s_epoch; 
+		::InterlockedExchange(&s_epoch, epoch + 1); 
+		::InterlockedExchange(&s_retiring, 1); 
+		while (true)
+		{
+			::ResetEvent(s_hWriterLeft); 
+			if (s_activeWriters[epoch & 1] == 0)
+			{
+				break; 
+			}
+			::WaitForSingleObject(s_hWriterLeft, INFINITE); 
+		}
+		::InterlockedExchange(&s_retiring, 0); 
+	}
+
+	void Deliver(LPCTSTR message)
+	{
+		LONG epoch = EnterWriter(); 
+		CLogQueue* pLogQueue = s_pLogQueue; 
+		if (pLogQueue != NULL)
+		{
+			pLogQueue->Enqueue(message);
+		}
+		else
+		{
+			(*s_logCallback)(message);
+		}
+		LeaveWriter(epoch); 
+	}
 public: 
+	OutputWriter::OutputWriter()
+	{
+		s_verbosityLevel = VERBOSITY_LEVEL_NORMAL;
+		s_logCallback = NULL;
+		s_pLogQueue = NULL;
+		s_pEventLog = NULL;
+		s_epoch = 0; 
+		s_activeWriters[0] = 0; 
+		s_activeWriters[1] = 0; 
+		s_retiring = 0; 
+		s_hWriterLeft = ::CreateEvent(NULL, TRUE, FALSE, NULL); 
+	}
+	OutputWriter::~OutputWriter()
+	{
+		::CloseHandle(s_hWriterLeft); 
+	}
+	bool IsEnabled(VERBOSITY_THRESHOLD threshold)
+	{
+		return s_verbosityLevel >= threshold;
+	}
 	void WriteLine(LPCTSTR message)
 	{
 		WriteLine(message, VERBOSITY_THRESHOLD_IF_VERBOSE); 
@@ -79,8 +169,61 @@ public:
 	{
 		if (OutputWriter::s_verbosityLevel >= threshold)
 		{
-			(*s_logCallback)(message);
+			Deliver(message);
+		}
+	}
+
+	// printf-style counterparts of WriteLine. The message is only built
+	// when threshold is enabled, so a disabled message costs a comparison
+	// instead of a format and a heap allocation.
+	void WriteFormat(LPCTSTR format, ...)
+	{
+		if (!IsEnabled(VERBOSITY_THRESHOLD_IF_VERBOSE))
+		{
+			return;
+		}
+		va_list args;
+		va_start(args, format);
+		WriteFormatV(VERBOSITY_THRESHOLD_IF_VERBOSE, format, args);
+		va_end(args);
+	}
+	void WriteFormat(VERBOSITY_THRESHOLD threshold, LPCTSTR format, ...)
+	{
+		if (!IsEnabled(threshold))
+		{
+			return;
+		}
+		va_list args;
+		va_start(args, format);
+		WriteFormatV(threshold, format, args);
+		va_end(args);
+	}
+	void WriteFormatV(VERBOSITY_THRESHOLD threshold, LPCTSTR format, va_list args)
+	{
+		if (!IsEnabled(threshold))
+		{
+			return;
 		}
+		CString message;
+		message.FormatV(format, args);
+		Deliver(message);
+	}
+
+	// Records a structured event if an event log is attached. Unlike the
+	// text messages, events don't depend on the verbosity level.
+	void WriteEvent(ShadowSpawnEventId eventId, DWORD phase, DWORD writerIndex, DWORD componentIndex, HRESULT hr, DWORD value, LPCTSTR text)
+	{
+		if (s_pEventLog == NULL)
+		{
+			return; 
+		}
+		LONG epoch = EnterWriter(); 
+		CEventLog* pEventLog = s_pEventLog; 
+		if (pEventLog != NULL)
+		{
+			pEventLog->Write(eventId, phase, writerIndex, componentIndex, hr, value, text);
+		}
+		LeaveWriter(epoch); 
 	}
 
 	void SetVerbosityLevel(VERBOSITY_LEVEL verbosityLevel)
@@ -91,4 +234,21 @@ public:
 	{
 		s_logCallback = logCallback; 
 	}
+	// Routes messages through pLogQueue, or straight to the LogCallback
+	// when it is NULL. The caller keeps ownership of the queue, and may
+	// free the previous one as soon as this returns: messages being logged
+	// on other threads have finished with it by then.
+	void SetLogQueue(CLogQueue* pLogQueue)
+	{
+		s_pLogQueue = pLogQueue; 
+		WaitForWriters(); 
+	}
+	// Sends structured events to pEventLog, or nowhere when it is NULL. The
+	// caller keeps ownership of the event log, and may free the previous
+	// one as soon as this returns.
+	void SetEventLog(CEventLog* pEventLog)
+	{
+		s_pEventLog = pEventLog; 
+		WaitForWriters(); 
+	}
 };
\ No newline at end of file
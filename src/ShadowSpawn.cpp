@@ -29,552 +29,1239 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "CWriter.h"
 #include "CWriterComponent.h"
 #include "Exports.h"
+#include "ISnapshotProvider.h"
+#include "CVssSnapshotProvider.h"
+#include "CMockSnapshotProvider.h"
+#include "CShadowSpawnSession.h"
+#include "CSnapshotSet.h"
+#include "CSnapshotCoalescer.h"
+#include "CSnapshotConsumer.h"
+#include "CSnapshotMounter.h"
+#include "CTreeCloner.h"
+#include "CCopyEngine.h"
+#include "CTreeWalker.h"
+#include "CGlobPattern.h"
+#include "CShadowSpawnJob.h"
+#include "CPhaseStatistics.h"
+#include "CEventLog.h"
+#include "CCleanupQueue.h"
+#include "CDeadline.h"
+
+
+
+// Requests for the same volume that arrive within the coalescing window
+// share one snapshot. Off (a zero window) unless the host turns it on.
+static CSnapshotCoalescer s_coalescer;
+
+// Finishes snapshot sets after the call that made them has returned. Off
+// (a zero capacity) unless the host turns it on.
+static CCleanupQueue s_cleanupQueue;
+
+
+
+// pSnapshotSet may be NULL when the caller does not own the snapshot. 
+void Cleanup(bool bAbnormalAbort, const vector<CString>& mountedDevices, CSnapshotSet* pSnapshotSet, OutputWriter& logger)
+{
+	if (bAbnormalAbort && pSnapshotSet != NULL)
+	{
+		pSnapshotSet->Abort(); 
+	}
+	CSnapshotMounter::Dismount(bAbnormalAbort, mountedDevices, logger); 
+	if (pSnapshotSet != NULL)
+	{
+		pSnapshotSet->Delete(bAbnormalAbort); 
+	}
+}
 
+// Snapshots every volume that holds one of sources as a single snapshot
+// set, so writers are frozen once no matter how many volumes are
+// involved, then mounts sources[i] at devices[i] for the consumer, which
+// is told about each of them in turn. 
+HRESULT _ShadowSpawnMultiple(CShadowSpawnSession& session,const vector<CString>& sources,const vector<CString>& devices,bool debug,bool simulate,const CDeadline& deadline,CSnapshotConsumer& consumer)
+{
+	OutputWriter& logger = session.get_Logger();
+	CAutoPtr<CSnapshotSet> pSnapshotSet(new CSnapshotSet(session));
+	pSnapshotSet->set_Deadline(deadline);
+	vector<CString> mountedDevices;
 
+	try
+	{
 
-// Forward declarations
-void CalculateSourcePath(LPCTSTR wszSnapshotDevice, LPCTSTR wszBackupSource, LPCTSTR wszMountPoint, CString& output);
-bool ShouldAddComponent(CWriterComponent& component);
+		if (debug)
+		{
+			::DebugBreak(); 
+		}
 
+		if (sources.empty() || sources.size() != devices.size())
+		{
+			throw new CShadowSpawnException(E_INVALIDARG, TEXT("Every source needs exactly one device.")); 
+		}
 
+		session.RefreshVolumePaths(); 
+		vector<CString> sourceVolumes; 
+		vector<CString> volumes; 
+		for (unsigned int iSource = 0; iSource < sources.size(); ++iSource)
+		{
+			CSnapshotMounter::CheckSource(sources[iSource]); 
+
+			if (devices[iSource].IsEmpty())
+			{
+				if (!consumer.get_UsesSnapshotRoot())
+				{
+					throw new CShadowSpawnException(E_INVALIDARG, TEXT("A device is needed unless the callback is told where the snapshot is.")); 
+				}
+				logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Shadowing %s without a device"), sources[iSource]); 
+			}
+			else
+			{
+				logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Shadowing %s at %s"), 
+					sources[iSource], 
+					devices[iSource]); 
+			}
+
+			CString volumePathName; 
+			session.GetVolumePathName(sources[iSource], volumePathName); 
+			sourceVolumes.push_back(volumePathName); 
+
+			bool isNewVolume = true; 
+			for (unsigned int iVolume = 0; iVolume < volumes.size(); ++iVolume)
+			{
+				if (volumes[iVolume].CompareNoCase(volumePathName) == 0)
+				{
+					isNewVolume = false; 
+					break; 
+				}
+			}
+			if (isNewVolume)
+			{
+				volumes.push_back(volumePathName); 
+			}
+		}
+
+		pSnapshotSet->Create(volumes, simulate); 
+
+		if (!simulate)
+		{
+			vector<CString> snapshotRoots; 
+			for (unsigned int iSource = 0; iSource < sources.size(); ++iSource)
+			{
+				CString snapshotDeviceObject; 
+				pSnapshotSet->GetSnapshotDeviceObject(sourceVolumes[iSource], snapshotDeviceObject); 
+
+				if (devices[iSource].IsEmpty())
+				{
+					CString snapshotPath; 
+					CSnapshotMounter::GetSnapshotPath(snapshotDeviceObject, sources[iSource], sourceVolumes[iSource], snapshotPath); 
+					snapshotRoots.push_back(snapshotPath); 
+					continue; 
+				}
+
+				CSnapshotMounter::Mount(snapshotDeviceObject, sources[iSource], sourceVolumes[iSource], devices[iSource], logger); 
+				mountedDevices.push_back(devices[iSource]);
+				snapshotRoots.push_back(devices[iSource]); 
+			}
+
+			pSnapshotSet->PauseDeadline(); 
+			CPhaseTimer callbackTimer; 
+			HRESULT hrCallback = consumer.Invoke(sources, snapshotRoots, pSnapshotSet->get_SnapshotTime()); 
+			callbackTimer.Record(SHADOWSPAWN_PHASE_CALLBACK, logger); 
+			if (FAILED(hrCallback))
+			{
+				throw new CShadowSpawnException(hrCallback, TEXT("The callback failed.")); 
+			}
+
+			while (!mountedDevices.empty())
+			{
+				CSnapshotMounter::Unmount(mountedDevices.back(), logger); 
+				mountedDevices.pop_back();
+			}
+
+			if (s_cleanupQueue.Enqueue(pSnapshotSet))
+			{
+				pSnapshotSet.Detach(); 
+				logger.WriteLine(TEXT("Leaving BackupComplete and snapshot deletion to the cleanup queue.")); 
+			}
+			else
+			{
+				pSnapshotSet->Complete(); 
+			}
+		}
+	}
+	catch (CComException* e)
+	{
+		Cleanup(true, mountedDevices, pSnapshotSet, logger);
+		return Utilities::ReportException(e, logger); 
+	}
+	catch (CShadowSpawnException* e)
+	{
+		Cleanup(true, mountedDevices, pSnapshotSet, logger);
+		return Utilities::ReportException(e, logger); 
+	}
 
-void CalculateSourcePath(LPCTSTR wszSnapshotDevice, LPCTSTR wszBackupSource, LPCTSTR wszMountPoint, CString& output)
+	Cleanup(false, mountedDevices, pSnapshotSet, logger);
+	logger.WriteLine(TEXT("Shadowing successfully completed."), VERBOSITY_THRESHOLD_NORMAL); 
+	return S_OK;
+}
+
+HRESULT _ShadowSpawn(CShadowSpawnSession& session,LPCTSTR source,LPCTSTR device,bool debug,bool simulate,const CDeadline& deadline,CSnapshotConsumer& consumer)
 {
-	CString backupSource(wszBackupSource); 
-	CString mountPoint(wszMountPoint); 
+	vector<CString> sources(1, CString(source)); 
+	vector<CString> devices(1, CString(device)); 
+	return _ShadowSpawnMultiple(session,sources,devices,debug,simulate,deadline,consumer); 
+}
 
-	CString subdirectory = backupSource.Mid(mountPoint.GetLength()); 
+HRESULT CreateCoalescedSnapshot(CSnapshotSet& snapshotSet, LPCTSTR volumePathName, CString& snapshotDeviceObject, OutputWriter& logger)
+{
+	try
+	{
+		vector<CString> volumes; 
+		volumes.push_back(volumePathName); 
+		snapshotSet.Create(volumes, false); 
+		snapshotSet.GetSnapshotDeviceObject(volumePathName, snapshotDeviceObject); 
+	}
+	catch (CComException* e)
+	{
+		Cleanup(true, vector<CString>(), &snapshotSet, logger);
+		return Utilities::ReportException(e, logger); 
+	}
+	catch (CShadowSpawnException* e)
+	{
+		Cleanup(true, vector<CString>(), &snapshotSet, logger);
+		return Utilities::ReportException(e, logger); 
+	}
 
-	Utilities::CombinePath(wszSnapshotDevice, subdirectory, output); 
+	return S_OK; 
 }
 
-void Cleanup(bool bAbnormalAbort, bool bSnapshotCreated, const CString& mountedDevice, CComPtr<IVssBackupComponents> pBackupComponents, GUID snapshotSetId,OutputWriter& logger)
+// Finishes the snapshot set of pCoalesced, whose last reference the
+// caller has just released, and deletes pCoalesced: hands the set to the
+// cleanup queue, or completes and deletes it here. 
+HRESULT FinishCoalescedSnapshot(CCoalescedSnapshot* pCoalesced)
 {
-	if (pBackupComponents == NULL)
+	CAutoPtr<CSnapshotSet> pSnapshotSet(pCoalesced->DetachSnapshotSet()); 
+	delete pCoalesced; 
+
+	if (pSnapshotSet == NULL)
 	{
-		return; 
+		return S_OK; 
 	}
 
-	if (bAbnormalAbort)
+	CShadowSpawnSession& session = pSnapshotSet->get_Session(); 
+	OutputWriter& logger = session.get_Logger(); 
+	HRESULT hr = S_OK; 
+	if (s_cleanupQueue.Enqueue(pSnapshotSet))
 	{
-		logger.WriteLine(TEXT("Aborting backup."), VERBOSITY_THRESHOLD_NORMAL);
-		pBackupComponents->AbortBackup(); 
+		pSnapshotSet.Detach(); 
+		logger.WriteLine(TEXT("Leaving BackupComplete and snapshot deletion to the cleanup queue.")); 
 	}
-	if (!mountedDevice.IsEmpty())
+	else
 	{
-		if (bAbnormalAbort)
+		bool bAbnormalAbort = false; 
+		try
 		{
-			CString message;
-			message.AppendFormat(TEXT("Dismounting device: %s"), mountedDevice);
-			logger.WriteLine(message, VERBOSITY_THRESHOLD_NORMAL);
+			pSnapshotSet->Complete(); 
 		}
-		BOOL bWorked = DefineDosDevice(DDD_REMOVE_DEFINITION, mountedDevice, NULL); 
-		if (!bWorked)
+		catch (CComException* e)
 		{
-			DWORD error = ::GetLastError(); 
-			CString errorMessage; 
-			Utilities::FormatErrorMessage(error, errorMessage); 
-			CString message; 
-			message.AppendFormat(TEXT("There was an error calling DefineDosDevice during Cleanup. Error: %s"), errorMessage); 
-			logger.WriteLine(message);
+			bAbnormalAbort = true; 
+			pSnapshotSet->Abort(); 
+			hr = Utilities::ReportException(e, logger); 
 		}
-	}
-	if (bSnapshotCreated)
-	{
-		if (bAbnormalAbort)
+		catch (CShadowSpawnException* e)
 		{
-			logger.WriteLine(TEXT("Deleting snapshot."), VERBOSITY_THRESHOLD_NORMAL);
+			bAbnormalAbort = true; 
+			pSnapshotSet->Abort(); 
+			hr = Utilities::ReportException(e, logger); 
 		}
-		LONG cDeletedSnapshots; 
-		GUID nonDeletedSnapshotId; 
-		pBackupComponents->DeleteSnapshots(snapshotSetId, VSS_OBJECT_SNAPSHOT_SET, TRUE, 
-			&cDeletedSnapshots, &nonDeletedSnapshotId); 
+		pSnapshotSet->Delete(bAbnormalAbort); 
+		pSnapshotSet.Free(); 
 	}
+
+	// Taken by the leader when it handed the set over. Last, since it may
+	// delete the leader's session if that was a throwaway one. 
+	session.EndDeferredCleanup(); 
+	return hr; 
 }
 
-bool ShouldAddComponent(CWriterComponent& component)
+// Like _ShadowSpawn, but shares the snapshot with any other callers that
+// ask for the same volume, with the same policy, within the coalescing
+// window of the first of them. Each caller mounts its own source at its own device. Whichever
+// caller's callback returns last completes and deletes the snapshot, so
+// only that caller sees a BackupComplete failure; until then the leader's
+// session counts the snapshot as a deferred cleanup. Waiting for the
+// snapshot counts against each caller's own deadline. 
+HRESULT _ShadowSpawnCoalesced(CShadowSpawnSession& session,LPCTSTR source,LPCTSTR device,const CDeadline& deadline,CSnapshotConsumer& consumer)
 {
-	// Component should not be added if
-	// 1) It is not selectable for backup and 
-	// 2) It has a selectable ancestor
-	// Otherwise, add it. 
+	OutputWriter& logger = session.get_Logger();
+	CDeadline callDeadline(deadline); 
 
-	if (component.get_SelectableForBackup())
+	CString volumePathName; 
+	CString key; 
+	try
 	{
-		return true; 
-	}
+		CSnapshotMounter::CheckSource(source); 
 
-	return !component.get_HasSelectableAncestor();
-
-}
-
-
-GUID GetSystemProviderID(OutputWriter& logger)
-{
-	CComPtr<IVssBackupComponents> backupComponents; 
+		if (device == NULL || *device == TEXT('\0'))
+		{
+			if (!consumer.get_UsesSnapshotRoot())
+			{
+				throw new CShadowSpawnException(E_INVALIDARG, TEXT("A device is needed unless the callback is told where the snapshot is.")); 
+			}
+			logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Shadowing %s without a device"), source); 
+		}
+		else
+		{
+			logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Shadowing %s at %s"), 
+				source, 
+				device); 
+		}
 
-	logger.WriteLine(TEXT("Calling CreateVssBackupComponents in GetSystemProviderId")); 
-	CHECK_HRESULT(::CreateVssBackupComponents(&backupComponents)); 
+		session.RefreshVolumePaths(); 
+		session.GetVolumePathName(source, volumePathName); 
+		session.GetCoalescingKey(volumePathName, key); 
+	}
+	catch (CComException* e)
+	{
+		return Utilities::ReportException(e, logger); 
+	}
+	catch (CShadowSpawnException* e)
+	{
+		return Utilities::ReportException(e, logger); 
+	}
 
-	logger.WriteLine(TEXT("Calling InitializeForBackup in GetSystemProviderId")); 
-	CHECK_HRESULT(backupComponents->InitializeForBackup()); 
+	bool isLeader; 
+	CCoalescedSnapshot* pCoalesced = s_coalescer.Join(key, callDeadline, isLeader); 
+	CAutoPtr<CSnapshotSet> pSnapshotSet; 
 
-	// The following code for selecting the system proviider is necessary 
-	// per http://forum.storagecraft.com/Community/forums/p/177/542.aspx#542
-	// which is a totally awesome post
-	logger.WriteLine(TEXT("Looking for the system VSS provider"));
+	if (isLeader)
+	{
+		pSnapshotSet.Attach(new CSnapshotSet(session)); 
+		pSnapshotSet->set_Deadline(deadline); 
+		CString snapshotDeviceObject; 
+		HRESULT hrCreate = CreateCoalescedSnapshot(*pSnapshotSet, volumePathName, snapshotDeviceObject, logger); 
+		FILETIME snapshotTime = pSnapshotSet->get_SnapshotTime(); 
+		if (SUCCEEDED(hrCreate))
+		{
+			pSnapshotSet->PauseDeadline(); 
+			session.BeginDeferredCleanup(); 
+			pCoalesced->SignalReady(hrCreate, snapshotDeviceObject, snapshotTime, pSnapshotSet.Detach()); 
+		}
+		else
+		{
+			s_coalescer.Close(pCoalesced); 
+			pCoalesced->SignalReady(hrCreate, snapshotDeviceObject, snapshotTime, NULL); 
+		}
+	}
+	else
+	{
+		logger.WriteLine(TEXT("Joining a shared snapshot of the same volume.")); 
+	}
 
-	logger.WriteLine(TEXT("Calling backupComponents->Query(enum providers)"));
-	CComPtr<IVssEnumObject> pEnum; 
-	CHECK_HRESULT(backupComponents->Query(GUID_NULL, VSS_OBJECT_NONE, VSS_OBJECT_PROVIDER, &pEnum));
+	HRESULT hr; 
+	if (pCoalesced->WaitUntilReady(callDeadline))
+	{
+		hr = pCoalesced->get_CreateResult(); 
+		if (FAILED(hr) && !isLeader)
+		{
+			logger.WriteLine(TEXT("The shared snapshot could not be created."), VERBOSITY_THRESHOLD_UNLESS_SILENT); 
+		}
+	}
+	else
+	{
+		try
+		{
+			callDeadline.Check(TEXT("Waiting for the shared snapshot")); 
+			throw new CShadowSpawnException(E_UNEXPECTED, TEXT("Unable to wait for the shared snapshot.")); 
+		}
+		catch (CShadowSpawnException* e)
+		{
+			hr = Utilities::ReportException(e, logger); 
+		}
+	}
 
-	GUID systemProviderId = GUID_NULL;
-	VSS_OBJECT_PROP prop;
-	ULONG nFetched;
-	do 
+	if (SUCCEEDED(hr))
 	{
-		logger.WriteLine(TEXT("Calling IVssEnumObject::Next"));
-		HRESULT hr = pEnum->Next(1, &prop, &nFetched);
+		vector<CString> mountedDevices; 
+		try
+		{
+			CString snapshotRoot(device); 
+			if (snapshotRoot.IsEmpty())
+			{
+				CSnapshotMounter::GetSnapshotPath(pCoalesced->get_DeviceObject(), source, volumePathName, snapshotRoot); 
+			}
+			else
+			{
+				CSnapshotMounter::Mount(pCoalesced->get_DeviceObject(), source, volumePathName, device, logger); 
+				mountedDevices.push_back(device); 
+			}
 
-		CString message;
-		message.AppendFormat(TEXT("Examining provider %s to see if it's the system provider..."), prop.Obj.Prov.m_pwszProviderName);
-		logger.WriteLine(message);
+			CPhaseTimer callbackTimer; 
+			HRESULT hrCallback = consumer.Invoke(source, snapshotRoot, pCoalesced->get_SnapshotTime()); 
+			callbackTimer.Record(SHADOWSPAWN_PHASE_CALLBACK, logger); 
+			if (FAILED(hrCallback))
+			{
+				throw new CShadowSpawnException(hrCallback, TEXT("The callback failed.")); 
+			}
 
-		if (hr == S_OK)
-		{
-			if (prop.Obj.Prov.m_eProviderType == VSS_PROV_SYSTEM)
+			if (!mountedDevices.empty())
 			{
-				systemProviderId = prop.Obj.Prov.m_ProviderId; 
-				logger.WriteLine(TEXT("...and it is."));
-				break;
+				CSnapshotMounter::Unmount(device, logger); 
+				mountedDevices.clear(); 
 			}
 		}
-		else if (hr == S_FALSE)
+		catch (CComException* e)
 		{
-			logger.WriteLine(TEXT("...but it's not."));
-			break;
+			Cleanup(true, mountedDevices, NULL, logger); 
+			hr = Utilities::ReportException(e, logger); 
 		}
-		else
+		catch (CShadowSpawnException* e)
 		{
-			throw new CComException(hr, __FILE__, __LINE__);
+			Cleanup(true, mountedDevices, NULL, logger); 
+			hr = Utilities::ReportException(e, logger); 
 		}
-	} while (true);
+	}
 
-	if (systemProviderId.Data1 == GUID_NULL.Data1 && 
-		systemProviderId.Data2 == GUID_NULL.Data2 &&
-		systemProviderId.Data3 == GUID_NULL.Data3 &&
-		systemProviderId.Data4 == GUID_NULL.Data4)
+	if (s_coalescer.Release(pCoalesced))
 	{
-		throw new CShadowSpawnException(TEXT("Unable to locate the system snapshot provider."));
+		HRESULT hrFinish = FinishCoalescedSnapshot(pCoalesced); 
+		if (SUCCEEDED(hr))
+		{
+			hr = hrFinish; 
+		}
 	}
 
-	return systemProviderId;
+	if (SUCCEEDED(hr))
+	{
+		logger.WriteLine(TEXT("Shadowing successfully completed."), VERBOSITY_THRESHOLD_NORMAL); 
+	}
+	return hr; 
 }
 
-HRESULT _ShadowSpawn(LPCTSTR source,LPCTSTR device,bool debug,int verbosityLevel,bool simulate,ShadowSpawnCallback* callback,LogCallback* logCallback)
+// Like _ShadowSpawn, but hands the consumer a copy of source made by
+// CTreeCloner rather than a VSS snapshot, and deletes the copy afterwards. 
+HRESULT _ShadowSpawnClone(CShadowSpawnSession& session,LPCTSTR source,LPCTSTR cloneDirectory,DWORD threadCount,CSnapshotConsumer& consumer)
 {
-	OutputWriter logger;
-	logger.SetLogger(logCallback);
-
-	bool bSnapshotCreated = false;
-	CString mountedDevice;
-	CComPtr<IVssBackupComponents> pBackupComponents; 
-	GUID snapshotSetId = GUID_NULL; 
+	OutputWriter& logger = session.get_Logger();
+	CTreeCloner cloner(threadCount, logger); 
+	HRESULT hr = S_OK; 
 
-	int fileCount = 0; 
-	LONGLONG byteCount = 0; 
-	int directoryCount = 0; 
-	int skipCount = 0; 
-	SYSTEMTIME startTime;
 	try
 	{
+		CSnapshotMounter::CheckSource(source); 
 
-		if (debug)
+		logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Cloning %s to %s"), 
+			source, 
+			cloneDirectory); 
+
+		FILETIME cloneTime; 
+		::GetSystemTimeAsFileTime(&cloneTime); 
+		CPhaseTimer cloneTimer; 
+		cloner.Clone(source, cloneDirectory); 
+		cloneTimer.Record(SHADOWSPAWN_PHASE_CLONE, logger); 
+
+		CPhaseTimer callbackTimer; 
+		HRESULT hrCallback = consumer.Invoke(source, cloneDirectory, cloneTime); 
+		callbackTimer.Record(SHADOWSPAWN_PHASE_CALLBACK, logger); 
+		if (FAILED(hrCallback))
 		{
-			::DebugBreak(); 
+			throw new CShadowSpawnException(hrCallback, TEXT("The callback failed.")); 
 		}
+	}
+	catch (CComException* e)
+	{
+		hr = Utilities::ReportException(e, logger); 
+	}
+	catch (CShadowSpawnException* e)
+	{
+		hr = Utilities::ReportException(e, logger); 
+	}
 
-		logger.SetVerbosityLevel((VERBOSITY_LEVEL) verbosityLevel); 
-
-		if (!Utilities::DirectoryExists(source))
+	if (cloner.get_TargetCreated())
+	{
+		logger.WriteFormat(TEXT("Deleting clone %s"), cloneDirectory); 
+		CPhaseTimer deleteTimer; 
+		HRESULT hrDelete = CTreeCloner::Delete(cloneDirectory, logger); 
+		deleteTimer.Record(SHADOWSPAWN_PHASE_DELETE_CLONE, logger); 
+		if (FAILED(hrDelete))
 		{
-			CString message;
-			message.AppendFormat(TEXT("Source path is not an existing directory: %s"), source);
-			throw new CShadowSpawnException(HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND),message); 
+			logger.WriteFormat(VERBOSITY_THRESHOLD_UNLESS_SILENT, TEXT("Unable to delete all of clone %s"), cloneDirectory); 
+			if (SUCCEEDED(hr))
+			{
+				hr = hrDelete; 
+			}
 		}
+	}
 
+	if (SUCCEEDED(hr))
+	{
+		logger.WriteLine(TEXT("Shadowing successfully completed."), VERBOSITY_THRESHOLD_NORMAL); 
+	}
+	return hr; 
+}
 
+// Deletes a session made for a single call once the snapshot sets it
+// still has to finish are done, without waiting for them. 
+void ReleaseOneShotSession(CShadowSpawnSession* pSession)
+{
+	pSession->DeleteWhenIdle(); 
+}
 
-		::GetSystemTime(&startTime); 
-		CString startTimeString; 
-		Utilities::FormatDateTime(&startTime, TEXT(" "), false, startTimeString); 
+HRESULT ShadowSpawnDispatch(CShadowSpawnSession& session,LPCTSTR source,LPCTSTR device,const CDeadline& deadline,CSnapshotConsumer& consumer)
+{
+	if (s_coalescer.get_Window() > 0)
+	{
+		return _ShadowSpawnCoalesced(session,source,device,deadline,consumer);
+	}
 
-		CString message; 
-		message.AppendFormat(TEXT("Shadowing %s at %s"), 
-			source, 
-			device); 
-		logger.WriteLine(message, VERBOSITY_THRESHOLD_NORMAL); 
+	return _ShadowSpawn(session,source,device,false,false,deadline,consumer);
+}
 
-		GUID systemProviderId = GetSystemProviderID(logger);
+HRESULT ShadowSpawnDispatch(CShadowSpawnSession& session,LPCTSTR source,LPCTSTR device,const CDeadline& deadline,ShadowSpawnCallback* callback)
+{
+	CSnapshotConsumer consumer(callback);
+	return ShadowSpawnDispatch(session,source,device,deadline,consumer);
+}
 
-		logger.WriteLine(TEXT("Calling CreateVssBackupComponents")); 
-		CHECK_HRESULT(::CreateVssBackupComponents(&pBackupComponents)); 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawn(LPCTSTR source,LPCTSTR device,int verbosityLevel,ShadowSpawnCallback* callback,LogCallback* logCallback)
+{
+	CShadowSpawnSession* pSession = new CShadowSpawnSession(verbosityLevel, logCallback, NULL);
+	HRESULT hr = ShadowSpawnDispatch(*pSession,source,device,CDeadline(),callback);
+	ReleaseOneShotSession(pSession); 
+	return hr;
+}
 
-		logger.WriteLine(TEXT("Calling InitializeForBackup")); 
-		CHECK_HRESULT(pBackupComponents->InitializeForBackup()); 
+// Runs the full ShadowSpawn sequence against CMockSnapshotProvider. No VSS
+// calls are made and the "snapshot" mounted at device is the live source. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnMock(LPCTSTR source,LPCTSTR device,int verbosityLevel,const ShadowSpawnMockOptions* options,ShadowSpawnCallback* callback,LogCallback* logCallback)
+{
+	if (options == NULL)
+	{
+		return E_POINTER;
+	}
 
-		CComPtr<IVssAsync> pWriterMetadataStatus; 
+	CShadowSpawnSession* pSession = new CShadowSpawnSession(verbosityLevel, logCallback, options);
+	HRESULT hr = ShadowSpawnDispatch(*pSession,source,device,CDeadline(),callback);
+	ReleaseOneShotSession(pSession); 
+	return hr;
+}
 
-		logger.WriteLine(TEXT("Calling GatherWriterMetadata")); 
-		CHECK_HRESULT(pBackupComponents->GatherWriterMetadata(&pWriterMetadataStatus)); 
+// Creates a session that caches provider discovery and volume lookups
+// across calls to ShadowSpawnWithSession. Pass NULL for mockOptions to
+// use VSS. Sessions may be shared between threads. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnCreateSession(int verbosityLevel,const ShadowSpawnMockOptions* mockOptions,LogCallback* logCallback,ShadowSpawnSession* pSession)
+{
+	if (pSession == NULL)
+	{
+		return E_POINTER;
+	}
 
-		logger.WriteLine(TEXT("Waiting for call to GatherWriterMetadata to finish...")); 
-		CHECK_HRESULT(pWriterMetadataStatus->Wait()); 
+	*pSession = new CShadowSpawnSession(verbosityLevel, logCallback, mockOptions);
+	return S_OK;
+}
 
-		HRESULT hrGatherStatus; 
-		logger.WriteLine(TEXT("Calling QueryStatus for GatherWriterMetadata")); 
-		CHECK_HRESULT(pWriterMetadataStatus->QueryStatus(&hrGatherStatus, NULL)); 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnWithSession(ShadowSpawnSession session,LPCTSTR source,LPCTSTR device,ShadowSpawnCallback* callback)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-		if (hrGatherStatus == VSS_S_ASYNC_CANCELLED)
-		{
-			throw new CShadowSpawnException(L"GatherWriterMetadata was cancelled."); 
-		}
+	return ShadowSpawnDispatch(*((CShadowSpawnSession*) session),source,device,CDeadline(),callback);
+}
 
-		logger.WriteLine(TEXT("Call to GatherWriterMetadata finished.")); 
+// Creates a handle that can stop calls made with it in
+// ShadowSpawnCallOptions from any thread. One handle may be shared by any
+// number of calls; pass it to ShadowSpawnCloseCancellation when done. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnCreateCancellation(ShadowSpawnCancellation* pCancellation)
+{
+	if (pCancellation == NULL)
+	{
+		return E_POINTER;
+	}
 
+	*pCancellation = new CCancellation();
+	return S_OK;
+}
 
-		logger.WriteLine(TEXT("Calling GetWriterMetadataCount")); 
+// Makes every call using cancellation cancel the VSS operation it is
+// waiting on and return E_ABORT. Calls already running their callback
+// carry on until it returns. Cancelling can't be undone. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnCancel(ShadowSpawnCancellation cancellation)
+{
+	if (cancellation == NULL)
+	{
+		return E_HANDLE;
+	}
 
-		vector<CWriter> writers;
+	((CCancellation*) cancellation)->Cancel();
+	return S_OK;
+}
 
-		UINT cWriters; 
-		CHECK_HRESULT(pBackupComponents->GetWriterMetadataCount(&cWriters)); 
+// Releases the caller's handle. Calls still using it are unaffected. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnCloseCancellation(ShadowSpawnCancellation cancellation)
+{
+	if (cancellation == NULL)
+	{
+		return E_HANDLE;
+	}
 
-		for (UINT iWriter = 0; iWriter < cWriters; ++iWriter)
-		{
-			CWriter writer; 
-			CComPtr<IVssExamineWriterMetadata> pExamineWriterMetadata; 
-			GUID id; 
-			logger.WriteLine(TEXT("Calling GetWriterMetadata")); 
-			CHECK_HRESULT(pBackupComponents->GetWriterMetadata(iWriter, &id, &pExamineWriterMetadata)); 
-			GUID idInstance; 
-			GUID idWriter; 
-			BSTR bstrWriterName;
-			VSS_USAGE_TYPE usage; 
-			VSS_SOURCE_TYPE source; 
-			CHECK_HRESULT(pExamineWriterMetadata->GetIdentity(&idInstance, &idWriter, &bstrWriterName, &usage, &source)); 
-
-			writer.set_InstanceId(idInstance); 
-			writer.set_Name(bstrWriterName); 
-			writer.set_WriterId(idWriter); 
-
-			CComBSTR writerName(bstrWriterName); 
-			CString message; 
-			message.AppendFormat(TEXT("Writer %d named %s"), iWriter, (LPCTSTR) writerName); 
-			logger.WriteLine(message); 
-
-			UINT cIncludeFiles;
-			UINT cExcludeFiles; 
-			UINT cComponents; 
-			CHECK_HRESULT(pExamineWriterMetadata->GetFileCounts(&cIncludeFiles, &cExcludeFiles, &cComponents)); 
-
-			message.Empty(); 
-			message.AppendFormat(TEXT("Writer has %d components"), cComponents); 
-			logger.WriteLine(message); 
-
-			for (UINT iComponent = 0; iComponent < cComponents; ++iComponent)
-			{
-				CWriterComponent component; 
-
-				CComPtr<IVssWMComponent> pComponent; 
-				CHECK_HRESULT(pExamineWriterMetadata->GetComponent(iComponent, &pComponent)); 
-
-				PVSSCOMPONENTINFO pComponentInfo; 
-				CHECK_HRESULT(pComponent->GetComponentInfo(&pComponentInfo)); 
-
-				CString message; 
-				message.AppendFormat(TEXT("Component %d is named %s, has a path of %s, and is %sselectable for backup. %d files, %d databases, %d log files."), 
-					iComponent,
-					pComponentInfo->bstrComponentName, 
-					pComponentInfo->bstrLogicalPath, 
-					pComponentInfo->bSelectable ? TEXT("") : TEXT("not "), 
-					pComponentInfo->cFileCount, 
-					pComponentInfo->cDatabases,
-					pComponentInfo->cLogFiles); 
-				logger.WriteLine(message); 
-
-				component.set_LogicalPath(pComponentInfo->bstrLogicalPath); 
-				component.set_SelectableForBackup(pComponentInfo->bSelectable); 
-				component.set_Writer(iWriter); 
-				component.set_Name(pComponentInfo->bstrComponentName);
-				component.set_Type(pComponentInfo->type);
-
-				for (UINT iFile = 0; iFile < pComponentInfo->cFileCount; ++iFile)
-				{
-					CComPtr<IVssWMFiledesc> pFileDesc; 
-					CHECK_HRESULT(pComponent->GetFile(iFile, &pFileDesc)); 
+	((CCancellation*) cancellation)->Release();
+	return S_OK;
+}
 
-					CComBSTR bstrPath; 
-					CHECK_HRESULT(pFileDesc->GetPath(&bstrPath)); 
+// Like ShadowSpawnWithSession, but gives up once options->timeoutMs has
+// passed or options->cancellation is cancelled, cancelling whichever VSS
+// call is outstanding. Returns HRESULT_FROM_WIN32(ERROR_TIMEOUT) or E_ABORT
+// respectively. Each phase gets whatever is left of the time limit, and
+// the time spent in callback doesn't count, so BackupComplete still gets
+// what was left when the callback started. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnWithOptions(ShadowSpawnSession session,LPCTSTR source,LPCTSTR device,ShadowSpawnCallback* callback,const ShadowSpawnCallOptions* options)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-					CComBSTR bstrFileSpec; 
-					CHECK_HRESULT(pFileDesc->GetFilespec(&bstrFileSpec)); 
+	if (options == NULL)
+	{
+		return E_POINTER;
+	}
 
-					CString message; 
-					message.AppendFormat(TEXT("File %d has path %s\\%s"), iFile, bstrPath, bstrFileSpec); 
-					logger.WriteLine(message); 
-				}
+	CDeadline deadline(options->timeoutMs, (CCancellation*) options->cancellation);
+	return ShadowSpawnDispatch(*((CShadowSpawnSession*) session),source,device,deadline,callback);
+}
 
-				for (UINT iDatabase = 0; iDatabase < pComponentInfo->cDatabases; ++iDatabase)
-				{
-					CComPtr<IVssWMFiledesc> pFileDesc; 
-					CHECK_HRESULT(pComponent->GetDatabaseFile(iDatabase, &pFileDesc)); 
+// Like ShadowSpawnWithSession, but tells callback where the snapshot of
+// source is and when it was taken, and passes context through. With a NULL
+// device nothing is mounted: callback reads the snapshot through its
+// \\?\GLOBALROOT path, so drive letters don't limit how many calls can
+// run at once.
+// With workerCount above one, that many calls to callback run at once on
+// the system thread pool, told apart by workerIndex, all against the same
+// snapshot. Returns the first failure any of them returned. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnWithCallbackEx(ShadowSpawnSession session,LPCTSTR source,LPCTSTR device,ShadowSpawnCallbackEx* callback,void* context,DWORD workerCount)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	if (callback == NULL)
+	{
+		return E_POINTER;
+	}
 
-					CComBSTR bstrPath; 
-					CHECK_HRESULT(pFileDesc->GetPath(&bstrPath)); 
+	CSnapshotConsumer consumer(callback, context, workerCount);
+	return ShadowSpawnDispatch(*((CShadowSpawnSession*) session),source,device,CDeadline(),consumer);
+}
 
-					CComBSTR bstrFileSpec; 
-					CHECK_HRESULT(pFileDesc->GetFilespec(&bstrFileSpec)); 
+// Like ShadowSpawnWithCallbackEx, but gives callback a copy of source made
+// at cloneDirectory instead of a VSS snapshot, so neither VSS nor
+// administrator rights are needed. cloneDirectory must not exist yet, and
+// is deleted afterwards. threadCount threads copy different directories at
+// once; files are block-cloned where the file system allows it (ReFS, with
+// cloneDirectory on the same volume as source) and copied otherwise. The
+// copy is not taken at a single point in time: snapshotTime is when
+// copying started. Junctions and symbolic links in the copy are removed
+// without following them. If the copy can't all be deleted, the call
+// fails with the first error unless it had already failed. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnWithClone(ShadowSpawnSession session,LPCTSTR source,LPCTSTR cloneDirectory,DWORD threadCount,ShadowSpawnCallbackEx* callback,void* context,DWORD workerCount)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-					CString message; 
-					message.AppendFormat(TEXT("Database file %d has path %s\\%s"), iDatabase, bstrPath, bstrFileSpec); 
-					logger.WriteLine(message); 
-				}
+	if (source == NULL || cloneDirectory == NULL || callback == NULL)
+	{
+		return E_POINTER;
+	}
 
-				for (UINT iDatabaseLogFile = 0; iDatabaseLogFile < pComponentInfo->cLogFiles; ++iDatabaseLogFile)
-				{
-					CComPtr<IVssWMFiledesc> pFileDesc; 
-					CHECK_HRESULT(pComponent->GetDatabaseLogFile(iDatabaseLogFile, &pFileDesc)); 
+	CSnapshotConsumer consumer(callback, context, workerCount);
+	return _ShadowSpawnClone(*((CShadowSpawnSession*) session),source,cloneDirectory,threadCount,consumer);
+}
 
-					CComBSTR bstrPath; 
-					CHECK_HRESULT(pFileDesc->GetPath(&bstrPath)); 
+// Copies the tree at source into destination, on threads of its own, for
+// callbacks that want a copy of the snapshot without running Robocopy or
+// similar. Typically source is the snapshotRoot passed to a
+// ShadowSpawnCallbackEx. Files that can't be copied are logged through
+// session and counted in *pStats (which may be NULL), and the first of
+// their failures is returned once everything else is copied. options may
+// be NULL for the defaults. Each file is copied the cheapest way that
+// works for it; *pStats counts how many went each way, and with an event
+// callback set each file is reported in a FileCopied event. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnCopyTree(ShadowSpawnSession session,LPCTSTR source,LPCTSTR destination,const ShadowSpawnCopyOptions* options,ShadowSpawnCopyStats* pStats)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-					CComBSTR bstrFileSpec; 
-					CHECK_HRESULT(pFileDesc->GetFilespec(&bstrFileSpec)); 
+	if (source == NULL || destination == NULL)
+	{
+		return E_POINTER;
+	}
 
-					CString message; 
-					message.AppendFormat(TEXT("Database log file %d has path %s\\%s"), iDatabaseLogFile, bstrPath, bstrFileSpec); 
-					logger.WriteLine(message); 
-				}
+	ShadowSpawnCopyOptions defaults; 
+	::ZeroMemory(&defaults, sizeof(defaults)); 
+	defaults.flags = SHADOWSPAWN_COPY_ATTRIBUTES | SHADOWSPAWN_COPY_TIMESTAMPS; 
+	if (options == NULL)
+	{
+		options = &defaults; 
+	}
 
-				CHECK_HRESULT(pComponent->FreeComponentInfo(pComponentInfo)); 
+	OutputWriter& logger = ((CShadowSpawnSession*) session)->get_Logger();
+	CCopyEngine engine(options->threadCount, options->bufferCount, options->bufferSize, options->flags, logger); 
+	HRESULT hr; 
+	try
+	{
+		logger.WriteFormat(VERBOSITY_THRESHOLD_NORMAL, TEXT("Copying %s to %s"), source, destination); 
+		CPhaseTimer copyTimer; 
+		hr = engine.Copy(source, destination); 
+		copyTimer.Record(SHADOWSPAWN_PHASE_COPY, logger); 
+	}
+	catch (CComException* e)
+	{
+		hr = Utilities::ReportException(e, logger); 
+	}
+	catch (CShadowSpawnException* e)
+	{
+		hr = Utilities::ReportException(e, logger); 
+	}
 
-				writer.get_Components().push_back(component); 
+	if (pStats != NULL)
+	{
+		engine.GetStats(*pStats); 
+	}
+	return hr;
+}
 
-			}
+// Lists every file and directory below root on threadCount threads (zero
+// for one per processor), passing them to callback in batches, typically
+// to pick out what to back up from a snapshot. callback is called from
+// several threads at once, and the entries it is given only last until it
+// returns. Directories that can't be listed are logged through session
+// and counted in *pStats (which may be NULL); a failure returned by
+// callback stops the walk and is returned. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnWalkTree(ShadowSpawnSession session,LPCTSTR root,DWORD threadCount,ShadowSpawnWalkCallback* callback,void* context,ShadowSpawnWalkStats* pStats)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-			writer.ComputeComponentTree(); 
+	if (root == NULL || callback == NULL)
+	{
+		return E_POINTER;
+	}
 
-			for (unsigned int iComponent = 0; iComponent < writer.get_Components().size(); ++iComponent)
-			{
-				CWriterComponent& component = writer.get_Components()[iComponent]; 
-				CString message; 
-				message.AppendFormat(TEXT("Component %d has name %s, path %s, is %sselectable for backup, and has parent %s"), 
-					iComponent, 
-					component.get_Name(), 
-					component.get_LogicalPath(), 
-					component.get_SelectableForBackup() ? TEXT("") : TEXT("not "), 
-					component.get_Parent() == NULL ? TEXT("(no parent)") : component.get_Parent()->get_Name()); 
-				logger.WriteLine(message); 
-			}
+	OutputWriter& logger = ((CShadowSpawnSession*) session)->get_Logger();
+	CTreeWalker walker(threadCount, callback, context, logger); 
+	HRESULT hr; 
+	try
+	{
+		CPhaseTimer walkTimer; 
+		hr = walker.Walk(root); 
+		walkTimer.Record(SHADOWSPAWN_PHASE_WALK, logger); 
+	}
+	catch (CComException* e)
+	{
+		hr = Utilities::ReportException(e, logger); 
+	}
+	catch (CShadowSpawnException* e)
+	{
+		hr = Utilities::ReportException(e, logger); 
+	}
 
-			writers.push_back(writer); 
-		}
+	if (pStats != NULL)
+	{
+		walker.GetStats(*pStats); 
+	}
+	return hr;
+}
 
-		logger.WriteLine(TEXT("Calling StartSnapshotSet")); 
-		CHECK_HRESULT(pBackupComponents->StartSnapshotSet(&snapshotSetId));
+// Compiles pattern for ShadowSpawnMatchGlob. Matching ignores case; ?
+// matches any character but a backslash, * any run of them without a
+// backslash, ** any run at all, and [a-z] or [!a-z] one character in or
+// out of the ranges listed. Returns E_INVALIDARG for a malformed pattern,
+// such as one with an unclosed [. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnCreateGlob(LPCTSTR pattern,ShadowSpawnGlob* pGlob)
+{
+	if (pattern == NULL || pGlob == NULL)
+	{
+		return E_POINTER;
+	}
 
-		logger.WriteLine(TEXT("Calling GetVolumePathName")); 
-		WCHAR wszVolumePathName[MAX_PATH]; 
-		BOOL bWorked = ::GetVolumePathName(source, wszVolumePathName, MAX_PATH); 
+	CAutoPtr<CGlobPattern> pPattern(new CGlobPattern()); 
+	try
+	{
+		pPattern->Compile(pattern, false); 
+	}
+	catch (CShadowSpawnException* e)
+	{
+		HRESULT hr = e->get_HResult(); 
+		delete e; 
+		return hr;
+	}
 
-		if (!bWorked)
-		{
-			DWORD error = ::GetLastError(); 
-			CString errorMessage; 
-			Utilities::FormatErrorMessage(error, errorMessage); 
-			CString message; 
-			message.AppendFormat(TEXT("There was an error retrieving the volume name from the path. Path: %s Error: %s"), 
-				source, errorMessage); 
-			throw new CShadowSpawnException(message.GetString()); 
-		}
+	*pGlob = pPattern.Detach(); 
+	return S_OK;
+}
 
+// Sets results[i] to 1 if entries[i].path matches glob and to 0 if not,
+// and *pMatchCount (which may be NULL) to how many matched. Nothing is
+// allocated, so this may be called from a ShadowSpawnWalkCallback, and
+// from several threads at once with the same glob. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnMatchGlob(ShadowSpawnGlob glob,const ShadowSpawnWalkEntry* entries,DWORD count,BYTE* results,DWORD* pMatchCount)
+{
+	if (glob == NULL)
+	{
+		return E_HANDLE;
+	}
 
-		logger.WriteLine(TEXT("Calling AddToSnapshotSet")); 
-		GUID snapshotId; 
-		CHECK_HRESULT(pBackupComponents->AddToSnapshotSet(wszVolumePathName, systemProviderId, &snapshotId)); 
+	if (count > 0 && (entries == NULL || results == NULL))
+	{
+		return E_POINTER;
+	}
 
-		for (unsigned int iWriter = 0; iWriter < writers.size(); ++iWriter)
-		{
-			CWriter writer = writers[iWriter];
+	DWORD matchCount = ((const CGlobPattern*) glob)->IsMatch(entries, count, results); 
+	if (pMatchCount != NULL)
+	{
+		*pMatchCount = matchCount; 
+	}
+	return S_OK;
+}
 
-			CString message; 
-			message.AppendFormat(TEXT("Adding components to snapshot set for writer %s"), writer.get_Name()); 
-			logger.WriteLine(message); 
-			for (unsigned int iComponent = 0; iComponent < writer.get_Components().size(); ++iComponent)
-			{
-				CWriterComponent component = writer.get_Components()[iComponent];
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnCloseGlob(ShadowSpawnGlob glob)
+{
+	if (glob == NULL)
+	{
+		return E_HANDLE;
+	}
 
-				if (ShouldAddComponent(component))
-				{
-					CString message; 
-					message.AppendFormat(TEXT("Adding component %s (%s) from writer %s"), 
-						component.get_Name(), 
-						component.get_LogicalPath(), 
-						writer.get_Name()); 
-					logger.WriteLine(message); 
-					CHECK_HRESULT(pBackupComponents->AddComponent(
-						writer.get_InstanceId(), 
-						writer.get_WriterId(),
-						component.get_Type(), 
-						component.get_LogicalPath(), 
-						component.get_Name()
-						));
-				}
-				else
-				{
-					CString message; 
-					message.AppendFormat(TEXT("Not adding component %s from writer %s."), 
-						component.get_Name(), writer.get_Name()); 
-					logger.WriteLine(message); 
-				}
-			}
-		}
+	delete (CGlobPattern*) glob; 
+	return S_OK;
+}
 
-		logger.WriteLine(TEXT("Calling SetBackupState")); 
-		CHECK_HRESULT(pBackupComponents->SetBackupState(TRUE, FALSE, VSS_BACKUP_TYPE::VSS_BT_FULL, FALSE)); 
+// Makes the session reuse writer metadata saved at path by earlier runs,
+// and keep it up to date there. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnSetWriterMetadataCache(ShadowSpawnSession session,LPCTSTR path)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-		logger.WriteLine(TEXT("Calling PrepareForBackup")); 
-		CComPtr<IVssAsync> pPrepareForBackupResults; 
-		CHECK_HRESULT(pBackupComponents->PrepareForBackup(&pPrepareForBackupResults)); 
+	if (path == NULL)
+	{
+		return E_POINTER;
+	}
 
-		logger.WriteLine(TEXT("Waiting for call to PrepareForBackup to finish...")); 
-		CHECK_HRESULT(pPrepareForBackupResults->Wait()); 
+	((CShadowSpawnSession*) session)->SetWriterMetadataCachePath(path);
+	return S_OK;
+}
 
-		HRESULT hrPrepareForBackupResults; 
-		CHECK_HRESULT(pPrepareForBackupResults->QueryStatus(&hrPrepareForBackupResults, NULL)); 
+// Adds a rule to the end of session's selection policy, which decides the
+// writers and components later snapshots back up. The first rule matching
+// a component decides it; components no rule matches are included, as are
+// all of them when there are no rules. Writers left with no components
+// are disabled for the snapshot. Returns E_INVALIDARG for a rule that
+// can't be evaluated, such as a malformed writer id. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnAddSelectionRule(ShadowSpawnSession session,ShadowSpawnSelectionAction action,ShadowSpawnSelectionField field,LPCTSTR pattern)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-		if (hrPrepareForBackupResults != VSS_S_ASYNC_FINISHED)
-		{
-			throw new CShadowSpawnException(TEXT("Prepare for backup failed.")); 
-		}
+	if (pattern == NULL && field != SHADOWSPAWN_SELECT_ON_SNAPSHOT_VOLUME && field != SHADOWSPAWN_SELECT_OFF_SNAPSHOT_VOLUME)
+	{
+		return E_POINTER;
+	}
+
+	CShadowSpawnSession* pSession = (CShadowSpawnSession*) session; 
+	try
+	{
+		pSession->AddSelectionRule(action, field, pattern); 
+	}
+	catch (CShadowSpawnException* e)
+	{
+		return Utilities::ReportException(e, pSession->get_Logger()); 
+	}
+	return S_OK;
+}
 
-		logger.WriteLine(TEXT("Call to PrepareForBackup finished.")); 
+// Sets whether session's later snapshots leave out components whose files
+// are all on volumes outside the snapshot set. Off by default. Components
+// with no file information, such as those ShadowSpawnMock produces unless
+// given a componentFilePath, are never left out this way. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnSetVolumeFiltering(ShadowSpawnSession session,BOOL enabled)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-		SYSTEMTIME snapshotTime; 
-		::GetSystemTime(&snapshotTime); 
+	((CShadowSpawnSession*) session)->SetVolumeFiltering(enabled != FALSE);
+	return S_OK;
+}
 
-		if (!simulate)
-		{
-			logger.WriteLine(TEXT("Calling DoSnapshotSet")); 
-			CComPtr<IVssAsync> pDoSnapshotSetResults;
-			CHECK_HRESULT(pBackupComponents->DoSnapshotSet(&pDoSnapshotSetResults)); 
+// Removes every selection rule from session. Volume filtering, if on, still
+// applies. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnClearSelectionRules(ShadowSpawnSession session)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	((CShadowSpawnSession*) session)->ClearSelectionRules();
+	return S_OK;
+}
 
-			logger.WriteLine(TEXT("Waiting for call to DoSnapshotSet to finish...")); 
+// Snapshots the volumes holding every one of sources as one snapshot set
+// and mounts sources[i] at devices[i] before calling callback. Sources on
+// the same volume share that volume's snapshot. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnMultipleWithSession(ShadowSpawnSession session,int count,const LPCTSTR* sources,const LPCTSTR* devices,ShadowSpawnCallback* callback)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-			CHECK_HRESULT(pDoSnapshotSetResults->Wait());
+	if (count <= 0 || sources == NULL || devices == NULL)
+	{
+		return E_INVALIDARG;
+	}
 
-			bSnapshotCreated = true; 
+	vector<CString> sourceList; 
+	vector<CString> deviceList; 
+	for (int iSource = 0; iSource < count; ++iSource)
+	{
+		sourceList.push_back(CString(sources[iSource])); 
+		deviceList.push_back(CString(devices[iSource])); 
+	}
 
-			HRESULT hrDoSnapshotSetResults; 
-			CHECK_HRESULT(pDoSnapshotSetResults->QueryStatus(&hrDoSnapshotSetResults, NULL)); 
+	CSnapshotConsumer consumer(callback);
+	return _ShadowSpawnMultiple(*((CShadowSpawnSession*) session),sourceList,deviceList,false,false,CDeadline(),consumer);
+}
 
-			if (hrDoSnapshotSetResults != VSS_S_ASYNC_FINISHED)
-			{
-				throw new CShadowSpawnException(L"DoSnapshotSet failed."); 
-			}
+// Like ShadowSpawnMultipleWithSession, but calls callback as
+// ShadowSpawnWithCallbackEx does for each of sources in turn, with all of
+// them still snapshotted, stopping at the first failure. devices may be
+// NULL, or have NULL entries, for sources that needn't be mounted. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnMultipleWithCallbackEx(ShadowSpawnSession session,int count,const LPCTSTR* sources,const LPCTSTR* devices,ShadowSpawnCallbackEx* callback,void* context,DWORD workerCount)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-			logger.WriteLine(TEXT("Call to DoSnapshotSet finished.")); 
+	if (callback == NULL)
+	{
+		return E_POINTER;
+	}
 
-			logger.WriteLine(TEXT("Calling GetSnapshotProperties")); 
-			VSS_SNAPSHOT_PROP snapshotProperties; 
-			CHECK_HRESULT(pBackupComponents->GetSnapshotProperties(snapshotId, &snapshotProperties));
+	if (count <= 0 || sources == NULL)
+	{
+		return E_INVALIDARG;
+	}
 
-			logger.WriteLine(TEXT("Calling CalculateSourcePath")); 
-			// TODO: We'll eventually have to deal with mount points
-			CString wszSource;
-			CalculateSourcePath(
-				snapshotProperties.m_pwszSnapshotDeviceObject, 
-				source,
-				wszVolumePathName, 
-				wszSource
-				);
+	vector<CString> sourceList; 
+	vector<CString> deviceList; 
+	for (int iSource = 0; iSource < count; ++iSource)
+	{
+		sourceList.push_back(CString(sources[iSource])); 
+		deviceList.push_back((devices == NULL) ? CString() : CString(devices[iSource])); 
+	}
 
-			logger.WriteLine(TEXT("Calling DefineDosDevice to mount device.")); 
-			if (0 == wszSource.Find(TEXT("\\\\?\\GLOBALROOT")))
-			{
-				wszSource = wszSource.Mid(_tcslen(TEXT("\\\\?\\GLOBALROOT")));
-			}
-			bWorked = DefineDosDevice(DDD_RAW_TARGET_PATH, device, wszSource); 
-			if (!bWorked)
-			{
-				DWORD error = ::GetLastError(); 
-				CString errorMessage; 
-				Utilities::FormatErrorMessage(error, errorMessage); 
-				CString message; 
-				message.AppendFormat(TEXT("There was an error calling DefineDosDevice when mounting a device. Error: %s"), errorMessage); 
-				throw new CShadowSpawnException(message.GetString()); 
-			}
-			mountedDevice = device;
+	CSnapshotConsumer consumer(callback, context, workerCount);
+	return _ShadowSpawnMultiple(*((CShadowSpawnSession*) session),sourceList,deviceList,false,false,CDeadline(),consumer);
+}
 
-			callback();
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnMultiple(int count,const LPCTSTR* sources,const LPCTSTR* devices,int verbosityLevel,ShadowSpawnCallback* callback,LogCallback* logCallback)
+{
+	CShadowSpawnSession* pSession = new CShadowSpawnSession(verbosityLevel, logCallback, NULL);
+	HRESULT hr = ShadowSpawnMultipleWithSession(pSession,count,sources,devices,callback);
+	ReleaseOneShotSession(pSession); 
+	return hr;
+}
 
-			logger.WriteLine(TEXT("Calling DefineDosDevice to remove device.")); 
-			bWorked = DefineDosDevice(DDD_REMOVE_DEFINITION, device, NULL); 
-			if (!bWorked)
-			{
-				DWORD error = ::GetLastError(); 
-				CString errorMessage; 
-				Utilities::FormatErrorMessage(error, errorMessage); 
-				CString message; 
-				message.AppendFormat(TEXT("There was an error calling DefineDosDevice. Error: %s"), errorMessage); 
-				throw new CShadowSpawnException(message.GetString()); 
-			}
-			mountedDevice.Empty();
+// Sets how long, in milliseconds, after the first request for a volume
+// other in-process requests for it can still join its snapshot, within
+// that first request's own time limit. The snapshot is created straight
+// away, so it may be up to that old by the time they join. 
+// Only requests for the same volume through sessions with the same provider,
+// metadata cache and selection policy share a snapshot. Zero (the default)
+// disables coalescing. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnSetCoalescingWindow(DWORD windowMs)
+{
+	s_coalescer.set_Window(windowMs);
+	return S_OK;
+}
 
-			logger.WriteLine(TEXT("Calling BackupComplete")); 
-			CComPtr<IVssAsync> pBackupCompleteResults; 
-			CHECK_HRESULT(pBackupComponents->BackupComplete(&pBackupCompleteResults)); 
+// Lets calls return as soon as their callback is done and the devices are
+// unmounted, leaving BackupComplete and snapshot deletion to a background
+// thread. Up to capacity snapshot sets may be waiting there; beyond that,
+// calls finish their own as before. Failures in the background are only
+// logged, through the LogCallback of the session the set came from, which
+// ShadowSpawnDestroySession waits for. A capacity of zero (the default)
+// finishes whatever is queued and stops the thread, and must be set
+// before the library is unloaded if the queue was ever turned on. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnSetDeferredCleanup(DWORD capacity)
+{
+	s_cleanupQueue.set_Capacity(capacity);
+	return S_OK;
+}
 
-			logger.WriteLine(TEXT("Waiting for call to BackupComplete to finish...")); 
-			CHECK_HRESULT(pBackupCompleteResults->Wait());
+// Waits up to timeoutMs for every snapshot set queued by
+// ShadowSpawnSetDeferredCleanup so far to be finished. Returns
+// HRESULT_FROM_WIN32(WAIT_TIMEOUT) if some are still in progress. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnDrainCleanup(DWORD timeoutMs)
+{
+	if (!s_cleanupQueue.Drain(timeoutMs))
+	{
+		return HRESULT_FROM_WIN32(WAIT_TIMEOUT);
+	}
+	return S_OK;
+}
 
-			HRESULT hrBackupCompleteResults; 
-			CHECK_HRESULT(pBackupCompleteResults->QueryStatus(&hrBackupCompleteResults, NULL)); 
+// Starts shadowing source at device and returns without waiting. The VSS
+// phases run on the system thread pool, which also calls callback once the
+// snapshot is mounted. completionCallback (which may be NULL) is called
+// with the result and context when the job finishes; the job can also be
+// polled with ShadowSpawnGetJobStatus or waited on with ShadowSpawnWaitForJob.
+// The session must outlive the job, and *pJob must be passed to
+// ShadowSpawnCloseJob once the caller is done with it. Coalescing does not
+// apply to asynchronous jobs. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnAsync(ShadowSpawnSession session,LPCTSTR source,LPCTSTR device,ShadowSpawnCallback* callback,ShadowSpawnCompletionCallback* completionCallback,void* context,ShadowSpawnJob* pJob)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
 
-			if (hrBackupCompleteResults != VSS_S_ASYNC_FINISHED)
-			{
-				throw new CShadowSpawnException(TEXT("Completion of backup failed.")); 
-			}
+	if (source == NULL || device == NULL || callback == NULL || pJob == NULL)
+	{
+		return E_POINTER;
+	}
 
-			logger.WriteLine(TEXT("Call to BackupComplete finished.")); 
+	CShadowSpawnSession* pSession = (CShadowSpawnSession*) session; 
+	CShadowSpawnJob* pShadowSpawnJob = new CShadowSpawnJob(*pSession, source, device, callback, completionCallback, context); 
+	try
+	{
+		pShadowSpawnJob->Start(); 
+	}
+	catch (CShadowSpawnException* e)
+	{
+		pShadowSpawnJob->Release(); 
+		return Utilities::ReportException(e, pSession->get_Logger()); 
+	}
 
-		}
+	*pJob = pShadowSpawnJob; 
+	return S_OK;
+}
+
+// Reports where job has got to. *pResult is E_PENDING until the job has
+// finished, after which it holds the job's result. Either out parameter
+// may be NULL. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnGetJobStatus(ShadowSpawnJob job,ShadowSpawnJobState* pState,HRESULT* pResult)
+{
+	if (job == NULL)
+	{
+		return E_HANDLE;
 	}
-	catch (CComException* e)
+
+	CShadowSpawnJob* pShadowSpawnJob = (CShadowSpawnJob*) job; 
+	if (pState != NULL)
 	{
-		Cleanup(true, bSnapshotCreated, mountedDevice, pBackupComponents, snapshotSetId,logger);
-		CString message; 
-		CString file; 
-		e->get_File(file); 
-		message.Format(TEXT("There was a COM failure 0x%x - %s (%d)"), 
-			e->get_Hresult(), file, e->get_Line()); 
-		logger.WriteLine(message, VERBOSITY_THRESHOLD_UNLESS_SILENT); 
-		return e->get_Hresult(); 
+		*pState = pShadowSpawnJob->get_State(); 
+	}
+	if (pResult != NULL)
+	{
+		*pResult = pShadowSpawnJob->get_Result(); 
+	}
+	return S_OK;
+}
+
+// Waits up to timeoutMs for job to finish and returns its result, or
+// HRESULT_FROM_WIN32(WAIT_TIMEOUT) if it is still running. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnWaitForJob(ShadowSpawnJob job,DWORD timeoutMs)
+{
+	if (job == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	CShadowSpawnJob* pShadowSpawnJob = (CShadowSpawnJob*) job; 
+	DWORD waitResult = ::WaitForSingleObject(pShadowSpawnJob->get_FinishedEvent(), timeoutMs); 
+	if (waitResult == WAIT_TIMEOUT)
+	{
+		return HRESULT_FROM_WIN32(WAIT_TIMEOUT); 
+	}
+	if (waitResult != WAIT_OBJECT_0)
+	{
+		return HRESULT_FROM_WIN32(::GetLastError()); 
+	}
+
+	return pShadowSpawnJob->get_Result(); 
+}
+
+// Releases the caller's handle to job. A job that is still running carries
+// on and cleans up after itself when it finishes. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnCloseJob(ShadowSpawnJob job)
+{
+	if (job == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	((CShadowSpawnJob*) job)->Release(); 
+	return S_OK;
+}
+
+// Makes job cancel the VSS call it is waiting on, or skip the next one,
+// and fail with E_ABORT. A job running its callback carries on until the
+// callback returns. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnCancelJob(ShadowSpawnJob job)
+{
+	if (job == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	((CShadowSpawnJob*) job)->Cancel(); 
+	return S_OK;
+}
+
+// Makes session call its LogCallback from a background thread, through a
+// queue of up to capacity messages, so a slow log sink can't stretch a
+// snapshot. overflowPolicy says what happens when the queue is full. A
+// capacity of zero goes back to logging directly. The queue is flushed
+// when the session is destroyed, or when it is replaced. It can be
+// replaced while snapshots are in flight, but not from the LogCallback. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnSetLogQueue(ShadowSpawnSession session,DWORD capacity,ShadowSpawnLogOverflowPolicy overflowPolicy)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	if (overflowPolicy != SHADOWSPAWN_LOG_OVERFLOW_DROP && overflowPolicy != SHADOWSPAWN_LOG_OVERFLOW_BLOCK)
+	{
+		return E_INVALIDARG;
+	}
+
+	CShadowSpawnSession* pSession = (CShadowSpawnSession*) session; 
+	try
+	{
+		pSession->SetLogQueue(capacity, overflowPolicy); 
 	}
 	catch (CShadowSpawnException* e)
 	{
-		Cleanup(true, bSnapshotCreated, mountedDevice, pBackupComponents, snapshotSetId,logger);
-		logger.WriteLine(e->get_Message(), VERBOSITY_THRESHOLD_UNLESS_SILENT); 
-		return e->get_HResult(); 
+		return Utilities::ReportException(e, pSession->get_Logger()); 
 	}
+	return S_OK;
+}
 
-	Cleanup(false, bSnapshotCreated, mountedDevice, pBackupComponents, snapshotSetId,logger);
-	logger.WriteLine(TEXT("Shadowing successfully completed."), VERBOSITY_THRESHOLD_NORMAL); 
+// Waits until every message session has logged so far has been passed to
+// its LogCallback. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnFlushLog(ShadowSpawnSession session)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	((CShadowSpawnSession*) session)->FlushLog();
 	return S_OK;
 }
 
-extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawn(LPCTSTR source,LPCTSTR device,int verbosityLevel,ShadowSpawnCallback* callback,LogCallback* logCallback)
+// Records structured events (see ShadowSpawnEventRecord) for every run on
+// session and passes them to callback in batches: whenever the buffer
+// fills, on ShadowSpawnFlushEvents, and when the session is destroyed.
+// Batches arrive one at a time and in order, on the thread that filled
+// the buffer; other threads keep recording meanwhile. Pass NULL to stop.
+// The callback can be replaced while snapshots are in flight, but not from
+// within itself. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnSetEventCallback(ShadowSpawnSession session,ShadowSpawnEventCallback* callback,void* context)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	((CShadowSpawnSession*) session)->SetEventCallback(callback, context);
+	return S_OK;
+}
+
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnFlushEvents(ShadowSpawnSession session)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	((CShadowSpawnSession*) session)->FlushEvents();
+	return S_OK;
+}
+
+// Decodes length bytes of records written by an event callback, passing
+// one line of text per record to callback. Returns E_INVALIDARG if the
+// buffer ends part way through a record. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnDecodeEvents(const BYTE* records,DWORD length,LogCallback* callback)
+{
+	if ((records == NULL && length > 0) || callback == NULL)
+	{
+		return E_POINTER;
+	}
+
+	CString line; 
+	DWORD offset = 0; 
+	while (offset < length)
+	{
+		DWORD size = CEventLog::Format(records + offset, length - offset, line); 
+		if (size == 0)
+		{
+			return E_INVALIDARG;
+		}
+		callback(line); 
+		offset += size; 
+	}
+	return S_OK;
+}
+
+// Copies the latency histogram recorded for phase by every run in this
+// process into *pStats. 
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnGetPhaseStats(ShadowSpawnPhase phase,ShadowSpawnPhaseStats* pStats)
+{
+	if (pStats == NULL)
+	{
+		return E_POINTER;
+	}
+
+	if (phase < 0 || phase >= SHADOWSPAWN_PHASE_COUNT)
+	{
+		return E_INVALIDARG;
+	}
+
+	CPhaseStatistics::get_Process().CopyTo(phase, *pStats);
+	return S_OK;
+}
+
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnResetPhaseStats(void)
 {
-	return _ShadowSpawn(source,device,false,verbosityLevel,false,callback,logCallback);
+	CPhaseStatistics::get_Process().Reset();
+	return S_OK;
+}
+
+extern "C" __declspec(dllexport) HRESULT __cdecl ShadowSpawnDestroySession(ShadowSpawnSession session)
+{
+	if (session == NULL)
+	{
+		return E_HANDLE;
+	}
+
+	delete (CShadowSpawnSession*) session;
+	return S_OK;
 }
\ No newline at end of file
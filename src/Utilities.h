@@ -25,7 +25,10 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 using namespace std; 
 
+#include "CComException.h"
+#include "CGlobPattern.h"
 #include "CShadowSpawnException.h"
+#include "OutputWriter.h"
 
 class Utilities
 {
@@ -369,74 +372,17 @@ public:
 
     }
 
+    // A * matches anything, backslashes included, and "*.*" matches
+    // everything; ? and [ are plain characters. Any number of stars is
+    // allowed. To match one pattern repeatedly, with the other wildcards,
+    // hold on to a CGlobPattern instead.
     static bool IsMatch(CString& input, CString& pattern)
     {
-        // Short-circuit common cases
-        if (pattern.Compare(TEXT("*")) == 0)
-        {
-            return true; 
-        }
-
         if (pattern.Compare(TEXT("*.*")) == 0)
         {
             return true; 
-
-        }
-
-        int nStars = 0; 
-        for (int iChar = 0; iChar < pattern.GetLength(); ++iChar)
-        {
-            if (pattern[iChar] == TEXT('*'))
-            {
-                ++nStars;
-            }
-        }
-
-        if (nStars > 1)
-        {
-            CString message; 
-            message.AppendFormat(TEXT("The pattern %s is illegal: only a single wildcard is supported."), pattern); 
-            throw new CShadowSpawnException(message); 
         }
-
-        // No wildcard is present
-        if (nStars == 0)
-        {
-            return input.CompareNoCase(pattern) == 0; 
-        }
-
-        // A wildcard is present
-        int index = pattern.Find(TEXT("*")); 
-
-        if (index > 0)
-        {
-            if (index > input.GetLength())
-            {
-                return false; 
-            }
-
-            CString prefix = pattern.Left(index); 
-            CString inputStart = input.Left(index); 
-
-            if (prefix.CompareNoCase(inputStart) != 0)
-            {
-                return false; 
-            }
-        }
-
-        if (index < input.GetLength() - 1)
-        {
-            CString suffix = pattern.Mid(index + 1); 
-            CString inputEnd = input.Right(suffix.GetLength()); 
-
-            if (suffix.CompareNoCase(inputEnd) != 0)
-            {
-                return false; 
-            }
-        }
-
-        return true; 
-
+        return CGlobPattern::MatchStars(input, input.GetLength(), pattern);
     }
     //static void FreeString(LPCTSTR s)
     //{
@@ -455,6 +401,28 @@ public:
         pTime->wSecond = _ttoi(dateTimeString.Mid(16 + separatorLength, 2)); 
         pTime->wMilliseconds = 0;
     }
+    // Logs e, frees it, and returns its HRESULT.
+    static HRESULT ReportException(CComException* e, OutputWriter& logger)
+    {
+        CString message; 
+        CString file; 
+        e->get_File(file); 
+        message.Format(TEXT("There was a COM failure 0x%x - %s (%d)"), 
+            e->get_Hresult(), file, e->get_Line()); 
+        logger.WriteLine(message, VERBOSITY_THRESHOLD_UNLESS_SILENT); 
+        HRESULT hr = e->get_Hresult(); 
+        logger.WriteEvent(SHADOWSPAWN_EVENT_ERROR, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE, hr, 0, message); 
+        delete e; 
+        return hr; 
+    }
+    static HRESULT ReportException(CShadowSpawnException* e, OutputWriter& logger)
+    {
+        logger.WriteLine(e->get_Message(), VERBOSITY_THRESHOLD_UNLESS_SILENT); 
+        HRESULT hr = e->get_HResult(); 
+        logger.WriteEvent(SHADOWSPAWN_EVENT_ERROR, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE, hr, 0, e->get_Message()); 
+        delete e; 
+        return hr; 
+    }
     static bool StartsWith(CString& s1, LPCTSTR s2)
     {
         CString s2a(s2); 
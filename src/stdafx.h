@@ -56,6 +56,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <atlbase.h>
 #include <atlstr.h>
+#include <atlcoll.h>
 
 // TODO: reference additional headers your program requires here
 #include <iostream> 
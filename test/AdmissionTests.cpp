@@ -0,0 +1,168 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// The admission queue: one snapshot set created at a time, across every
+// thread and every process using the library.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+
+// Shared between the test and its child processes through a file mapping.
+struct AdmissionCounters
+{
+	volatile LONG creating;		// Snapshot sets between StartSnapshotSet and DoSnapshotSet
+	volatile LONG overlaps;		// Times a set started while another was being created
+	volatile LONG created;
+};
+
+static const int HAMMER_PROCESS_COUNT = 4;
+static const int HAMMER_THREAD_COUNT = 3;
+static const int HAMMER_RUN_COUNT = 5;
+
+static AdmissionCounters* s_pCounters;
+static volatile LONG s_hammerFailures;
+static ShadowSpawnSession s_hammerSession;
+static CString s_hammerSource;
+
+// The mock provider logs every call, so the log shows when a snapshot set
+// starts and stops being created.
+static void __stdcall HammerLog(const LPCTSTR message)
+{
+	if (_tcsstr(message, TEXT("Mock provider: StartSnapshotSet")) != NULL)
+	{
+		if (::InterlockedIncrement(&s_pCounters->creating) > 1)
+		{
+			::InterlockedIncrement(&s_pCounters->overlaps);
+		}
+	}
+	else if (_tcsstr(message, TEXT("Mock provider: DoSnapshotSet")) != NULL)
+	{
+		::InterlockedDecrement(&s_pCounters->creating);
+		::InterlockedIncrement(&s_pCounters->created);
+	}
+	CTestFixture::Log(message);
+}
+
+static HRESULT __stdcall HammerCallback(const ShadowSpawnSnapshotInfo* pInfo, void* context)
+{
+	return S_OK;
+}
+
+static DWORD WINAPI HammerThreadProc(LPVOID parameter)
+{
+	for (int iRun = 0; iRun < HAMMER_RUN_COUNT; ++iRun)
+	{
+		if (FAILED(ShadowSpawnWithCallbackEx(s_hammerSession, s_hammerSource, NULL, HammerCallback, NULL, 1)))
+		{
+			::InterlockedIncrement(&s_hammerFailures);
+		}
+	}
+	return 0;
+}
+
+SHADOWSPAWN_TEST_CHILD(AdmissionHammerChild)
+{
+	HANDLE hMapping = ::OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, argument);
+	TEST_ASSERT(hMapping != NULL);
+	s_pCounters = (AdmissionCounters*) ::MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(AdmissionCounters));
+	TEST_ASSERT(s_pCounters != NULL);
+
+	CTempDirectory source;
+	s_hammerSource = source.get_Path();
+
+	// Every provider call takes a little while, so the time spent
+	// creating each set is long enough for an overlap to show.
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.callLatencyMs = 1;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCreateSession(CTestFixture::VERBOSITY, &options, HammerLog, &s_hammerSession));
+
+	HANDLE threads[HAMMER_THREAD_COUNT];
+	for (int iThread = 0; iThread < HAMMER_THREAD_COUNT; ++iThread)
+	{
+		threads[iThread] = ::CreateThread(NULL, 0, HammerThreadProc, NULL, 0, NULL);
+		TEST_ASSERT(threads[iThread] != NULL);
+	}
+	::WaitForMultipleObjects(HAMMER_THREAD_COUNT, threads, TRUE, INFINITE);
+	for (int iThread = 0; iThread < HAMMER_THREAD_COUNT; ++iThread)
+	{
+		::CloseHandle(threads[iThread]);
+	}
+
+	ShadowSpawnDestroySession(s_hammerSession);
+	::UnmapViewOfFile(s_pCounters);
+	::CloseHandle(hMapping);
+	return s_hammerFailures == 0 ? 0 : 1;
+}
+
+// Several processes, each with several threads, creating mock snapshot
+// sets as fast as they can: no two may ever be created at once.
+SHADOWSPAWN_TEST(AdmissionSerializesAcrossProcesses)
+{
+	CString mappingName;
+	mappingName.Format(TEXT("Local\\ShadowSpawnTests-Admission-%u"), ::GetCurrentProcessId());
+	HANDLE hMapping = ::CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(AdmissionCounters), mappingName);
+	TEST_ASSERT(hMapping != NULL);
+	AdmissionCounters* pCounters = (AdmissionCounters*) ::MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(AdmissionCounters));
+	TEST_ASSERT(pCounters != NULL);
+
+	HANDLE processes[HAMMER_PROCESS_COUNT];
+	int startedCount = 0;
+	for (; startedCount < HAMMER_PROCESS_COUNT; ++startedCount)
+	{
+		processes[startedCount] = CTestRunner::StartChild(TEXT("AdmissionHammerChild"), mappingName);
+		if (processes[startedCount] == NULL)
+		{
+			break;
+		}
+	}
+
+	bool finished = startedCount > 0 &&
+		::WaitForMultipleObjects(startedCount, processes, TRUE, 120000) != WAIT_TIMEOUT;
+	int failedCount = 0;
+	for (int iProcess = 0; iProcess < startedCount; ++iProcess)
+	{
+		DWORD exitCode = 1;
+		if (!finished)
+		{
+			::TerminateProcess(processes[iProcess], 1);
+		}
+		::GetExitCodeProcess(processes[iProcess], &exitCode);
+		if (exitCode != 0)
+		{
+			++failedCount;
+		}
+		::CloseHandle(processes[iProcess]);
+	}
+
+	LONG overlaps = pCounters->overlaps;
+	LONG created = pCounters->created;
+	::UnmapViewOfFile(pCounters);
+	::CloseHandle(hMapping);
+
+	TEST_ASSERT(startedCount == HAMMER_PROCESS_COUNT);
+	TEST_ASSERT(finished);
+	TEST_ASSERT(failedCount == 0);
+	TEST_ASSERT(overlaps == 0);
+	TEST_ASSERT(created == HAMMER_PROCESS_COUNT * HAMMER_THREAD_COUNT * HAMMER_RUN_COUNT);
+}
@@ -0,0 +1,290 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "CTestRunner.h"
+#include "ShadowSpawnApi.h"
+
+using namespace std;
+
+// A directory of its own under %TEMP%, holding a single file, which is
+// deleted again along with anything the test added.
+class CTempDirectory
+{
+private:
+    CString _path;
+
+    static void DeleteTree(LPCTSTR path)
+    {
+        CString pattern(path);
+        pattern.Append(TEXT("\\*"));
+        WIN32_FIND_DATA findData;
+        HANDLE hFind = ::FindFirstFile(pattern, &findData);
+        if (hFind != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                CString name(findData.cFileName);
+                if (name == TEXT(".") || name == TEXT(".."))
+                {
+                    continue;
+                }
+
+                CString child(path);
+                child.AppendFormat(TEXT("\\%s"), (LPCTSTR) name);
+                if ((findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 &&
+                    (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+                {
+                    ::RemoveDirectory(child);
+                }
+                else if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+                {
+                    DeleteTree(child);
+                }
+                else
+                {
+                    ::SetFileAttributes(child, FILE_ATTRIBUTE_NORMAL);
+                    ::DeleteFile(child);
+                }
+            } while (::FindNextFile(hFind, &findData));
+            ::FindClose(hFind);
+        }
+        ::RemoveDirectory(path);
+    }
+
+public:
+    CTempDirectory::CTempDirectory()
+    {
+        TCHAR tempPath[MAX_PATH];
+        ::GetTempPath(MAX_PATH, tempPath);
+        static LONG s_nextId = 0;
+        _path.Format(TEXT("%sShadowSpawnTests-%u-%d"), tempPath, ::GetCurrentProcessId(), ::InterlockedIncrement(&s_nextId));
+        ::CreateDirectory(_path, NULL);
+        WriteFile(TEXT("marker.txt"), "ShadowSpawn");
+    }
+
+    CTempDirectory::~CTempDirectory()
+    {
+        DeleteTree(_path);
+    }
+
+    CString& get_Path(void)
+    {
+        return _path;
+    }
+
+    // Writes contents to name below the directory, creating or replacing it.
+    void WriteFile(LPCTSTR name, const char* contents)
+    {
+        CString path(_path);
+        path.AppendFormat(TEXT("\\%s"), name);
+        HANDLE hFile = ::CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        TEST_ASSERT(hFile != INVALID_HANDLE_VALUE);
+        DWORD written;
+        ::WriteFile(hFile, contents, (DWORD) strlen(contents), &written, NULL);
+        ::CloseHandle(hFile);
+    }
+
+    // Fills name, below the directory, with directoryCount directories
+    // spread over up to 16 parents, each holding filesPerDirectory files
+    // of fileSize bytes, with contents varying from file to file. Returns
+    // the path of name.
+    CString WriteTree(LPCTSTR name, int directoryCount, int filesPerDirectory, DWORD fileSize)
+    {
+        CString root(_path);
+        root.AppendFormat(TEXT("\\%s"), name);
+        TEST_ASSERT(::CreateDirectory(root, NULL));
+
+        vector<BYTE> contents(max(fileSize, (DWORD) 1));
+        int iFile = 0;
+        for (int iDirectory = 0; iDirectory < directoryCount; ++iDirectory)
+        {
+            CString parent;
+            parent.Format(TEXT("%s\\%02d"), (LPCTSTR) root, iDirectory % 16);
+            if (iDirectory < 16)
+            {
+                TEST_ASSERT(::CreateDirectory(parent, NULL));
+            }
+            CString directory;
+            directory.Format(TEXT("%s\\%05d"), (LPCTSTR) parent, iDirectory);
+            TEST_ASSERT(::CreateDirectory(directory, NULL));
+
+            for (int iInDirectory = 0; iInDirectory < filesPerDirectory; ++iInDirectory, ++iFile)
+            {
+                for (DWORD iByte = 0; iByte < fileSize; ++iByte)
+                {
+                    contents[iByte] = (BYTE) (iByte * 31 + iFile * 7 + (iByte >> 12));
+                }
+
+                CString path;
+                path.Format(TEXT("%s\\%04d.dat"), (LPCTSTR) directory, iInDirectory);
+                HANDLE hFile = ::CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+                TEST_ASSERT(hFile != INVALID_HANDLE_VALUE);
+                DWORD written = 0;
+                BOOL worked = ::WriteFile(hFile, &contents[0], fileSize, &written, NULL);
+                ::CloseHandle(hFile);
+                TEST_ASSERT(worked && written == fileSize);
+            }
+        }
+        return root;
+    }
+};
+
+// Plumbing shared by the tests.
+class CTestFixture
+{
+public:
+    // A LogCallback that only prints when the tests run with /verbose.
+    static void __stdcall Log(const LPCTSTR message)
+    {
+        if (CTestRunner::get_Verbose())
+        {
+            _tprintf(TEXT("    %s\n"), message);
+        }
+    }
+
+    // A few writers with a few components each, and no latency.
+    static void GetMockOptions(ShadowSpawnMockOptions& options)
+    {
+        ::ZeroMemory(&options, sizeof(options));
+        options.writerCount = 4;
+        options.componentsPerWriter = 8;
+    }
+
+    // VERBOSITY_LEVEL_VERBOSE, so that every message reaches Log.
+    static const int VERBOSITY = 4;
+
+    // A session on the mock provider, logging through Log.
+    static ShadowSpawnSession CreateMockSession(const ShadowSpawnMockOptions& options)
+    {
+        ShadowSpawnSession session = NULL;
+        TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCreateSession(VERBOSITY, &options, Log, &session));
+        return session;
+    }
+
+    // A drive letter nothing is using, such as "Q:". Tests that need
+    // several at once ask for the first, second, ... with skip.
+    static CString FindFreeDevice(int skip = 0)
+    {
+        DWORD drives = ::GetLogicalDrives();
+        for (TCHAR letter = TEXT('Z'); letter > TEXT('D'); --letter)
+        {
+            if ((drives & (1 << (letter - TEXT('A')))) == 0 && skip-- == 0)
+            {
+                CString device;
+                device.Format(TEXT("%c:"), letter);
+                return device;
+            }
+        }
+        throw new CTestFailure(TEXT(__FILE__), __LINE__, TEXT("No drive letter is free."));
+    }
+
+    static bool FileExists(LPCTSTR path)
+    {
+        return ::GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES;
+    }
+};
+
+// One ShadowSpawnWithOptions call on a thread of its own, which waits for
+// hStart first, unless it is NULL, so that several calls can be let go at
+// once. Failures are only recorded: the test thread does the asserting.
+class CTestCall
+{
+private:
+    ShadowSpawnSession _session;
+    CString _source;
+    CString _device;
+    ShadowSpawnCallback* _callback;
+    ShadowSpawnCallOptions _options;
+    HANDLE _hStart;
+    HANDLE _hThread;
+    HRESULT _hr;
+    DWORD _elapsedMs;
+
+    static DWORD WINAPI ThreadProc(LPVOID parameter)
+    {
+        CTestCall* pCall = (CTestCall*) parameter;
+        if (pCall->_hStart != NULL)
+        {
+            ::WaitForSingleObject(pCall->_hStart, INFINITE);
+        }
+        DWORD startTicks = ::GetTickCount();
+        pCall->_hr = ShadowSpawnWithOptions(pCall->_session, pCall->_source, pCall->_device, pCall->_callback, &pCall->_options);
+        pCall->_elapsedMs = ::GetTickCount() - startTicks;
+        return 0;
+    }
+
+public:
+    CTestCall::CTestCall(ShadowSpawnSession session, LPCTSTR source, LPCTSTR device, ShadowSpawnCallback* callback, HANDLE hStart)
+    {
+        _session = session;
+        _source = source;
+        _device = device;
+        _callback = callback;
+        _options.timeoutMs = INFINITE;
+        _options.cancellation = NULL;
+        _hStart = hStart;
+        _hThread = NULL;
+        _hr = E_PENDING;
+        _elapsedMs = 0;
+    }
+
+    // Waits for the call, so a test that fails early must have unblocked
+    // it first.
+    CTestCall::~CTestCall()
+    {
+        if (_hThread != NULL)
+        {
+            ::WaitForSingleObject(_hThread, INFINITE);
+            ::CloseHandle(_hThread);
+        }
+    }
+
+    ShadowSpawnCallOptions& get_Options(void)
+    {
+        return _options;
+    }
+
+    HRESULT get_Result(void)
+    {
+        return _hr;
+    }
+
+    DWORD get_ElapsedMs(void)
+    {
+        return _elapsedMs;
+    }
+
+    void Start(void)
+    {
+        _hThread = ::CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
+        TEST_ASSERT(_hThread != NULL);
+    }
+
+    // Returns false if the call is still running after timeoutMs.
+    bool Wait(DWORD timeoutMs)
+    {
+        return ::WaitForSingleObject(_hThread, timeoutMs) == WAIT_OBJECT_0;
+    }
+};
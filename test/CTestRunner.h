@@ -0,0 +1,263 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+using namespace std;
+
+// Thrown, like the library's own exceptions, as a pointer by the
+// TEST_ASSERT macros.
+class CTestFailure
+{
+private:
+    CString _message;
+
+public:
+    CTestFailure::CTestFailure(LPCTSTR file, int line, LPCTSTR message)
+    {
+        _message.Format(TEXT("%s(%d): %s"), file, line, message);
+    }
+
+    LPCTSTR get_Message(void)
+    {
+        return _message;
+    }
+};
+
+typedef void (TestFunction)(void);
+typedef int (ChildFunction)(LPCTSTR argument);
+
+// The tests and benchmarks that SHADOWSPAWN_TEST and SHADOWSPAWN_BENCHMARK
+// register as the test executable starts up. Tests pass unless they throw;
+// benchmarks print their own timings.
+class CTestRunner
+{
+private:
+    struct Test
+    {
+        LPCTSTR name;
+        TestFunction* function;
+        bool isBenchmark;
+    };
+
+    static vector<Test>& get_Tests(void)
+    {
+        static vector<Test> s_tests;
+        return s_tests;
+    }
+
+    struct Child
+    {
+        LPCTSTR name;
+        ChildFunction* function;
+    };
+
+    static vector<Child>& get_Children(void)
+    {
+        static vector<Child> s_children;
+        return s_children;
+    }
+
+    static bool& get_VerboseFlag(void)
+    {
+        static bool s_verbose = false;
+        return s_verbose;
+    }
+
+    static bool RunOne(const Test& test)
+    {
+        _tprintf(TEXT("%s\n"), test.name);
+        DWORD startTicks = ::GetTickCount();
+        CString failure;
+        try
+        {
+            test.function();
+        }
+        catch (CTestFailure* e)
+        {
+            failure = e->get_Message();
+            delete e;
+        }
+        catch (...)
+        {
+            failure = TEXT("Unexpected exception.");
+        }
+
+        if (!failure.IsEmpty())
+        {
+            _tprintf(TEXT("  FAILED: %s\n"), (LPCTSTR) failure);
+            return false;
+        }
+        _tprintf(TEXT("  passed (%u ms)\n"), ::GetTickCount() - startTicks);
+        return true;
+    }
+
+public:
+    static bool Register(LPCTSTR name, TestFunction* function, bool isBenchmark)
+    {
+        Test test;
+        test.name = name;
+        test.function = function;
+        test.isBenchmark = isBenchmark;
+        get_Tests().push_back(test);
+        return true;
+    }
+
+    static bool RegisterChild(LPCTSTR name, ChildFunction* function)
+    {
+        Child child;
+        child.name = name;
+        child.function = function;
+        get_Children().push_back(child);
+        return true;
+    }
+
+    // Starts another copy of the test executable running the child
+    // function name with argument, for tests that need several processes.
+    // Returns the process handle, or NULL if it couldn't be started.
+    static HANDLE StartChild(LPCTSTR name, LPCTSTR argument)
+    {
+        TCHAR path[MAX_PATH];
+        if (::GetModuleFileName(NULL, path, MAX_PATH) == 0)
+        {
+            return NULL;
+        }
+
+        CString commandLine;
+        commandLine.Format(TEXT("\"%s\" /child %s \"%s\""), path, name, argument);
+        if (get_Verbose())
+        {
+            commandLine.Append(TEXT(" /verbose"));
+        }
+
+        STARTUPINFO startupInfo;
+        ::ZeroMemory(&startupInfo, sizeof(startupInfo));
+        startupInfo.cb = sizeof(startupInfo);
+        PROCESS_INFORMATION processInfo;
+        BOOL created = ::CreateProcess(NULL, commandLine.GetBuffer(), NULL, NULL, FALSE, 0, NULL, NULL, &startupInfo, &processInfo);
+        commandLine.ReleaseBuffer();
+        if (!created)
+        {
+            return NULL;
+        }
+
+        ::CloseHandle(processInfo.hThread);
+        return processInfo.hProcess;
+    }
+
+    // What a process started by StartChild runs instead of the tests. The
+    // child function's result becomes the exit code.
+    static int RunChild(LPCTSTR name, LPCTSTR argument)
+    {
+        vector<Child>& children = get_Children();
+        for (unsigned int iChild = 0; iChild < children.size(); ++iChild)
+        {
+            if (_tcscmp(children[iChild].name, name) == 0)
+            {
+                try
+                {
+                    return children[iChild].function(argument);
+                }
+                catch (CTestFailure* e)
+                {
+                    _tprintf(TEXT("  FAILED in child %s: %s\n"), name, e->get_Message());
+                    delete e;
+                    return 1;
+                }
+            }
+        }
+
+        _tprintf(TEXT("No child function named %s.\n"), name);
+        return 2;
+    }
+
+    // Whether the library's log messages should be echoed.
+    static bool get_Verbose(void)
+    {
+        return get_VerboseFlag();
+    }
+
+    static void set_Verbose(bool value)
+    {
+        get_VerboseFlag() = value;
+    }
+
+    // Runs the tests, or the benchmarks, whose names contain filter, and
+    // returns how many failed.
+    static int Run(bool benchmarks, LPCTSTR filter)
+    {
+        int runCount = 0;
+        int failedCount = 0;
+        vector<Test>& tests = get_Tests();
+        for (unsigned int iTest = 0; iTest < tests.size(); ++iTest)
+        {
+            if (tests[iTest].isBenchmark != benchmarks || _tcsstr(tests[iTest].name, filter) == NULL)
+            {
+                continue;
+            }
+
+            ++runCount;
+            if (!RunOne(tests[iTest]))
+            {
+                ++failedCount;
+            }
+        }
+
+        _tprintf(TEXT("%d run, %d failed\n"), runCount, failedCount);
+        return failedCount;
+    }
+};
+
+#define SHADOWSPAWN_TEST(name) \
+    static void name(void); \
+    static bool s_##name##Registered = CTestRunner::Register(TEXT(#name), name, false); \
+    static void name(void)
+
+#define SHADOWSPAWN_BENCHMARK(name) \
+    static void name(void); \
+    static bool s_##name##Registered = CTestRunner::Register(TEXT(#name), name, true); \
+    static void name(void)
+
+// A function a test runs in other processes through StartChild.
+#define SHADOWSPAWN_TEST_CHILD(name) \
+    static int name(LPCTSTR argument); \
+    static bool s_##name##Registered = CTestRunner::RegisterChild(TEXT(#name), name); \
+    static int name(LPCTSTR argument)
+
+#define TEST_ASSERT(condition) \
+    if (!(condition)) \
+    { \
+        throw new CTestFailure(TEXT(__FILE__), __LINE__, TEXT(#condition)); \
+    }
+
+#define TEST_ASSERT_HRESULT(expected, actual) \
+    { \
+        HRESULT expectedHr = (expected); \
+        HRESULT actualHr = (actual); \
+        if (expectedHr != actualHr) \
+        { \
+            CString message; \
+            message.Format(TEXT("%s returned 0x%08x, expected 0x%08x"), TEXT(#actual), actualHr, expectedHr); \
+            throw new CTestFailure(TEXT(__FILE__), __LINE__, message); \
+        } \
+    }
@@ -0,0 +1,174 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// ShadowSpawnWithClone, which copies the source instead of snapshotting it
+// and deletes the copy afterwards, and what that costs for a large tree.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+#include <winioctl.h>
+
+static CString s_junctionTarget;
+static volatile LONG s_junctionsCreated;
+
+// The mount point flavour of REPARSE_DATA_BUFFER, which only the DDK
+// declares.
+struct MountPointReparseBuffer
+{
+	DWORD reparseTag;
+	WORD reparseDataLength;
+	WORD reserved;
+	WORD substituteNameOffset;
+	WORD substituteNameLength;
+	WORD printNameOffset;
+	WORD printNameLength;
+	WCHAR pathBuffer[MAX_PATH * 2];
+};
+
+// Makes link, an empty directory, a junction to target. Unlike a symbolic
+// link, that needs no privileges.
+static bool CreateJunction(LPCTSTR link, LPCTSTR target)
+{
+	CString substituteName(TEXT("\\??\\"));
+	substituteName.Append(target);
+	int substituteLength = substituteName.GetLength();
+	int printLength = (int) _tcslen(target);
+	if (substituteLength + printLength + 2 > MAX_PATH * 2)
+	{
+		return false;
+	}
+
+	MountPointReparseBuffer reparse;
+	::ZeroMemory(&reparse, sizeof(reparse));
+	reparse.reparseTag = IO_REPARSE_TAG_MOUNT_POINT;
+	reparse.substituteNameOffset = 0;
+	reparse.substituteNameLength = (WORD) (substituteLength * sizeof(WCHAR));
+	reparse.printNameOffset = (WORD) ((substituteLength + 1) * sizeof(WCHAR));
+	reparse.printNameLength = (WORD) (printLength * sizeof(WCHAR));
+	::CopyMemory(reparse.pathBuffer, (LPCTSTR) substituteName, substituteLength * sizeof(WCHAR));
+	::CopyMemory(reparse.pathBuffer + substituteLength + 1, target, printLength * sizeof(WCHAR));
+	reparse.reparseDataLength = (WORD) (4 * sizeof(WORD) + (substituteLength + printLength + 2) * sizeof(WCHAR));
+
+	if (!::CreateDirectory(link, NULL))
+	{
+		return false;
+	}
+	HANDLE hLink = ::CreateFile(link, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+	if (hLink == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	DWORD returned;
+	BOOL created = ::DeviceIoControl(hLink, FSCTL_SET_REPARSE_POINT, &reparse, 8 + reparse.reparseDataLength, NULL, 0, &returned, NULL);
+	::CloseHandle(hLink);
+	return created != FALSE;
+}
+
+// Leaves a junction to s_junctionTarget in the clone, as a host might.
+static HRESULT __stdcall AddJunctionCallback(const ShadowSpawnSnapshotInfo* pInfo, void* context)
+{
+	CString link(pInfo->snapshotRoot);
+	link.Append(TEXT("junction"));
+	if (!CreateJunction(link, s_junctionTarget))
+	{
+		return HRESULT_FROM_WIN32(::GetLastError());
+	}
+	::InterlockedIncrement(&s_junctionsCreated);
+	return S_OK;
+}
+
+// Deleting the clone removes a junction inside it without emptying the
+// directory it points to, and is timed as a phase of its own.
+SHADOWSPAWN_TEST(CloneDeleteLeavesJunctionTargetsAlone)
+{
+	CTempDirectory source;
+	CTempDirectory outside;
+	CString cloneDirectory(source.get_Path());
+	cloneDirectory.Append(TEXT("-clone"));
+	s_junctionTarget = outside.get_Path();
+	s_junctionsCreated = 0;
+	ShadowSpawnResetPhaseStats();
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	HRESULT hr = ShadowSpawnWithClone(session, source.get_Path(), cloneDirectory, 2, AddJunctionCallback, NULL, 1);
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT_HRESULT(S_OK, hr);
+	TEST_ASSERT(s_junctionsCreated == 1);
+	TEST_ASSERT(!CTestFixture::FileExists(cloneDirectory));
+	TEST_ASSERT(CTestFixture::FileExists(outside.get_Path() + TEXT("\\marker.txt")));
+
+	ShadowSpawnPhaseStats stats;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_DELETE_CLONE, &stats));
+	TEST_ASSERT(stats.count == 1);
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_DELETE_SNAPSHOTS, &stats));
+	TEST_ASSERT(stats.count == 0);
+}
+
+static HRESULT __stdcall IgnoreCallbackEx(const ShadowSpawnSnapshotInfo* pInfo, void* context)
+{
+	return S_OK;
+}
+
+// Clones a tree of 20,000 small files with different numbers of copying
+// threads, and reports how long copying and deleting the clone took. On
+// NTFS every file is copied; on ReFS, with the temporary directory on it,
+// they are block-cloned.
+SHADOWSPAWN_BENCHMARK(CloneLargeTree)
+{
+	const int DIRECTORY_COUNT = 1000;
+	const int FILES_PER_DIRECTORY = 20;
+	const DWORD FILE_SIZE = 4096;
+	CTempDirectory temp;
+	CString source(temp.WriteTree(TEXT("source"), DIRECTORY_COUNT, FILES_PER_DIRECTORY, FILE_SIZE));
+	CString cloneDirectory(temp.get_Path() + TEXT("\\clone"));
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+
+	int fileCount = DIRECTORY_COUNT * FILES_PER_DIRECTORY;
+	_tprintf(TEXT("  %d directories, %d files of %u bytes\n"), DIRECTORY_COUNT, fileCount, FILE_SIZE);
+	DWORD threadCounts[] = { 1, 2, 4, 8 };
+	for (int iCase = 0; iCase < (int) _countof(threadCounts); ++iCase)
+	{
+		ShadowSpawnResetPhaseStats();
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnWithClone(session, source, cloneDirectory, threadCounts[iCase], IgnoreCallbackEx, NULL, 1));
+		TEST_ASSERT(!CTestFixture::FileExists(cloneDirectory));
+
+		ShadowSpawnPhaseStats clone;
+		ShadowSpawnPhaseStats deleteClone;
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_CLONE, &clone));
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_DELETE_CLONE, &deleteClone));
+		TEST_ASSERT(clone.count == 1 && deleteClone.count == 1);
+
+		double cloneSeconds = clone.totalMicroseconds / 1e6;
+		_tprintf(TEXT("  %u threads: cloned in %.2f s (%.0f files/s, %.1f MB/s), deleted in %.2f s\n"),
+			threadCounts[iCase], cloneSeconds, fileCount / cloneSeconds,
+			(double) fileCount * FILE_SIZE / (1024 * 1024) / cloneSeconds, deleteClone.totalMicroseconds / 1e6);
+	}
+
+	ShadowSpawnDestroySession(session);
+}
@@ -0,0 +1,433 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Coalescing: concurrent requests for one volume sharing a snapshot, and
+// only when nothing about their sessions would make the snapshot differ.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+
+static volatile LONG s_callbackCount;
+
+static void __stdcall CountCallback(void)
+{
+	::InterlockedIncrement(&s_callbackCount);
+}
+
+// Turns coalescing on for the length of a test, and off again even if it
+// fails.
+class CCoalescingWindow
+{
+public:
+	CCoalescingWindow::CCoalescingWindow(DWORD windowMs)
+	{
+		ShadowSpawnSetCoalescingWindow(windowMs);
+	}
+
+	CCoalescingWindow::~CCoalescingWindow()
+	{
+		ShadowSpawnSetCoalescingWindow(0);
+	}
+};
+
+// Turns the cleanup queue on for the length of a test, and off again,
+// which finishes whatever it still holds, even if it fails.
+class CDeferredCleanup
+{
+public:
+	CDeferredCleanup::CDeferredCleanup(DWORD capacity)
+	{
+		ShadowSpawnSetDeferredCleanup(capacity);
+	}
+
+	CDeferredCleanup::~CDeferredCleanup()
+	{
+		ShadowSpawnSetDeferredCleanup(0);
+	}
+};
+
+static DWORD CountSnapshots(void)
+{
+	ShadowSpawnPhaseStats stats;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET, &stats));
+	return stats.count;
+}
+
+SHADOWSPAWN_TEST(CoalescingSharesSnapshotWithinSession)
+{
+	const int CALL_COUNT = 4;
+	CTempDirectory source;
+	CCoalescingWindow window(10000);
+	s_callbackCount = 0;
+	ShadowSpawnResetPhaseStats();
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	HANDLE hStart = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	{
+		CAutoPtr<CTestCall> calls[CALL_COUNT];
+		for (int iCall = 0; iCall < CALL_COUNT; ++iCall)
+		{
+			calls[iCall].Attach(new CTestCall(session, source.get_Path(), CTestFixture::FindFreeDevice(iCall), CountCallback, hStart));
+			calls[iCall]->Start();
+		}
+		::SetEvent(hStart);
+
+		for (int iCall = 0; iCall < CALL_COUNT; ++iCall)
+		{
+			TEST_ASSERT(calls[iCall]->Wait(30000));
+			TEST_ASSERT_HRESULT(S_OK, calls[iCall]->get_Result());
+		}
+	}
+	::CloseHandle(hStart);
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(s_callbackCount == CALL_COUNT);
+	TEST_ASSERT(CountSnapshots() == 1);
+}
+
+// A call that shows up while the first one's snapshot is still being
+// created joins it too, as long as the window isn't over.
+SHADOWSPAWN_TEST(CoalescingJoinsCallersArrivingDuringCreate)
+{
+	CTempDirectory source;
+	CCoalescingWindow window(10000);
+	s_callbackCount = 0;
+	ShadowSpawnResetPhaseStats();
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.asyncLatencyMs = 200;
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	{
+		CTestCall firstCall(session, source.get_Path(), CTestFixture::FindFreeDevice(0), CountCallback, NULL);
+		CTestCall laterCall(session, source.get_Path(), CTestFixture::FindFreeDevice(1), CountCallback, NULL);
+		firstCall.Start();
+		::Sleep(300);
+		laterCall.Start();
+
+		TEST_ASSERT(firstCall.Wait(30000));
+		TEST_ASSERT(laterCall.Wait(30000));
+		TEST_ASSERT_HRESULT(S_OK, firstCall.get_Result());
+		TEST_ASSERT_HRESULT(S_OK, laterCall.get_Result());
+	}
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(s_callbackCount == 2);
+	TEST_ASSERT(CountSnapshots() == 1);
+}
+
+// The mock options are part of what the snapshot holds, so sessions that
+// differ in them must not share one however close together they ask.
+SHADOWSPAWN_TEST(CoalescingKeepsDifferentSessionsApart)
+{
+	CTempDirectory source;
+	CCoalescingWindow window(10000);
+	s_callbackCount = 0;
+	ShadowSpawnResetPhaseStats();
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	options.writerCount += 1;
+	ShadowSpawnSession otherSession = CTestFixture::CreateMockSession(options);
+	HANDLE hStart = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	{
+		CTestCall call(session, source.get_Path(), CTestFixture::FindFreeDevice(0), CountCallback, hStart);
+		CTestCall otherCall(otherSession, source.get_Path(), CTestFixture::FindFreeDevice(1), CountCallback, hStart);
+		call.Start();
+		otherCall.Start();
+		::SetEvent(hStart);
+
+		TEST_ASSERT(call.Wait(30000));
+		TEST_ASSERT(otherCall.Wait(30000));
+		TEST_ASSERT_HRESULT(S_OK, call.get_Result());
+		TEST_ASSERT_HRESULT(S_OK, otherCall.get_Result());
+	}
+	::CloseHandle(hStart);
+	ShadowSpawnDestroySession(session);
+	ShadowSpawnDestroySession(otherSession);
+
+	TEST_ASSERT(s_callbackCount == 2);
+	TEST_ASSERT(CountSnapshots() == 2);
+}
+
+// One call hangs in DoSnapshotSet until it is cancelled; a call that asks
+// for the same snapshot with a short time limit must give up on its own
+// rather than wait for the other, whichever of the two ends up leading.
+SHADOWSPAWN_TEST(CoalescingJoinerHonoursItsDeadline)
+{
+	CTempDirectory source;
+	CCoalescingWindow window(10000);
+	s_callbackCount = 0;
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.hangPhases = 1 << SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET;
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	ShadowSpawnSession otherSession = CTestFixture::CreateMockSession(options);
+	ShadowSpawnCancellation cancellation;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCreateCancellation(&cancellation));
+	HANDLE hStart = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	bool timedCallReturned;
+	HRESULT hrTimed;
+	HRESULT hrCancelled;
+	{
+		CTestCall cancelledCall(session, source.get_Path(), CTestFixture::FindFreeDevice(0), CountCallback, hStart);
+		cancelledCall.get_Options().cancellation = cancellation;
+		CTestCall timedCall(otherSession, source.get_Path(), CTestFixture::FindFreeDevice(1), CountCallback, hStart);
+		timedCall.get_Options().timeoutMs = 500;
+		cancelledCall.Start();
+		timedCall.Start();
+		::SetEvent(hStart);
+
+		timedCallReturned = timedCall.Wait(10000);
+		ShadowSpawnCancel(cancellation);
+		TEST_ASSERT(cancelledCall.Wait(30000));
+		TEST_ASSERT(timedCall.Wait(30000));
+		hrTimed = timedCall.get_Result();
+		hrCancelled = cancelledCall.get_Result();
+	}
+	::CloseHandle(hStart);
+	ShadowSpawnCloseCancellation(cancellation);
+	ShadowSpawnDestroySession(session);
+	ShadowSpawnDestroySession(otherSession);
+
+	TEST_ASSERT(timedCallReturned);
+	TEST_ASSERT_HRESULT(HRESULT_FROM_WIN32(ERROR_TIMEOUT), hrTimed);
+	TEST_ASSERT(FAILED(hrCancelled));
+	TEST_ASSERT(s_callbackCount == 0);
+}
+
+// One ShadowSpawnMock call, which makes and releases a session of its own,
+// on a thread of its own.
+class COneShotCall
+{
+private:
+	CString _source;
+	CString _device;
+	ShadowSpawnCallback* _callback;
+	HANDLE _hThread;
+	HRESULT _hr;
+
+	static DWORD WINAPI ThreadProc(LPVOID parameter)
+	{
+		COneShotCall* pCall = (COneShotCall*) parameter;
+		ShadowSpawnMockOptions options;
+		CTestFixture::GetMockOptions(options);
+		pCall->_hr = ShadowSpawnMock(pCall->_source, pCall->_device, CTestFixture::VERBOSITY, &options, pCall->_callback, CTestFixture::Log);
+		return 0;
+	}
+
+public:
+	COneShotCall::COneShotCall(LPCTSTR source, LPCTSTR device, ShadowSpawnCallback* callback)
+	{
+		_source = source;
+		_device = device;
+		_callback = callback;
+		_hThread = NULL;
+		_hr = E_PENDING;
+	}
+
+	COneShotCall::~COneShotCall()
+	{
+		if (_hThread != NULL)
+		{
+			::WaitForSingleObject(_hThread, INFINITE);
+			::CloseHandle(_hThread);
+		}
+	}
+
+	HRESULT get_Result(void)
+	{
+		return _hr;
+	}
+
+	void Start(void)
+	{
+		_hThread = ::CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
+		TEST_ASSERT(_hThread != NULL);
+	}
+
+	bool Wait(DWORD timeoutMs)
+	{
+		return ::WaitForSingleObject(_hThread, timeoutMs) == WAIT_OBJECT_0;
+	}
+};
+
+static HANDLE s_hLeaderCalledBack;
+static HANDLE s_hJoinerCalledBack;
+static HANDLE s_hJoinerMayReturn;
+
+// Stays in the snapshot until the joiner is in it too, so the joiner is
+// the one that releases it last.
+static void __stdcall LeaderCallback(void)
+{
+	::InterlockedIncrement(&s_callbackCount);
+	::SetEvent(s_hLeaderCalledBack);
+	::WaitForSingleObject(s_hJoinerCalledBack, 30000);
+}
+
+static void __stdcall JoinerCallback(void)
+{
+	::InterlockedIncrement(&s_callbackCount);
+	::SetEvent(s_hJoinerCalledBack);
+	::WaitForSingleObject(s_hJoinerMayReturn, 30000);
+}
+
+// Two one-shot calls share a snapshot, and the leader's returns while the
+// joiner's callback is still running. The leader's session must go once
+// the joiner finishes the snapshot, without the leader, or the cleanup
+// queue, waiting for that in the meantime.
+static void RunOneShotLeaderAndLongerJoiner(DWORD cleanupCapacity)
+{
+	CTempDirectory source;
+	CCoalescingWindow window(10000);
+	CDeferredCleanup cleanup(cleanupCapacity);
+	s_callbackCount = 0;
+	ShadowSpawnResetPhaseStats();
+	s_hLeaderCalledBack = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	s_hJoinerCalledBack = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	s_hJoinerMayReturn = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	bool leaderReturned;
+	bool joinerReturned;
+	HRESULT hrLeader;
+	HRESULT hrJoiner;
+	{
+		COneShotCall leader(source.get_Path(), CTestFixture::FindFreeDevice(0), LeaderCallback);
+		COneShotCall joiner(source.get_Path(), CTestFixture::FindFreeDevice(1), JoinerCallback);
+		leader.Start();
+		::WaitForSingleObject(s_hLeaderCalledBack, 30000);
+		joiner.Start();
+
+		leaderReturned = leader.Wait(10000);
+		::SetEvent(s_hJoinerMayReturn);
+		joinerReturned = joiner.Wait(30000);
+		hrLeader = leader.get_Result();
+		hrJoiner = joiner.get_Result();
+	}
+	HRESULT hrDrain = ShadowSpawnDrainCleanup(10000);
+	::CloseHandle(s_hLeaderCalledBack);
+	::CloseHandle(s_hJoinerCalledBack);
+	::CloseHandle(s_hJoinerMayReturn);
+
+	TEST_ASSERT(leaderReturned);
+	TEST_ASSERT(joinerReturned);
+	TEST_ASSERT_HRESULT(S_OK, hrLeader);
+	TEST_ASSERT_HRESULT(S_OK, hrJoiner);
+	TEST_ASSERT_HRESULT(S_OK, hrDrain);
+	TEST_ASSERT(s_callbackCount == 2);
+	TEST_ASSERT(CountSnapshots() == 1);
+}
+
+SHADOWSPAWN_TEST(CoalescingOneShotLeaderDoesNotWaitForJoiner)
+{
+	RunOneShotLeaderAndLongerJoiner(0);
+}
+
+SHADOWSPAWN_TEST(CoalescingOneShotLeaderDoesNotBlockCleanupQueue)
+{
+	RunOneShotLeaderAndLongerJoiner(4);
+}
+
+static HRESULT __stdcall IgnoreCallbackEx(const ShadowSpawnSnapshotInfo* pInfo, void* context)
+{
+	return S_OK;
+}
+
+struct CThroughputRun
+{
+	ShadowSpawnSession session;
+	CString source;
+	int callCount;
+	volatile LONG failureCount;
+};
+
+// Makes callCount device-less calls one after the other.
+static DWORD WINAPI ThroughputThreadProc(LPVOID parameter)
+{
+	CThroughputRun* pRun = (CThroughputRun*) parameter;
+	for (int iCall = 0; iCall < pRun->callCount; ++iCall)
+	{
+		if (FAILED(ShadowSpawnWithCallbackEx(pRun->session, pRun->source, NULL, IgnoreCallbackEx, NULL, 1)))
+		{
+			::InterlockedIncrement(&pRun->failureCount);
+		}
+	}
+	return 0;
+}
+
+// THREAD_COUNT threads each snapshotting the same volume over and over,
+// without coalescing and then with it. Each snapshot takes a few tens of
+// milliseconds in the mock, and without coalescing they queue for
+// admission one at a time, as they would for VSS.
+static void MeasureThroughput(DWORD windowMs)
+{
+	const int THREAD_COUNT = 16;
+	const int CALLS_PER_THREAD = 10;
+	CTempDirectory source;
+	CCoalescingWindow window(windowMs);
+	ShadowSpawnResetPhaseStats();
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.asyncLatencyMs = 10;
+	CThroughputRun run;
+	run.session = CTestFixture::CreateMockSession(options);
+	run.source = source.get_Path();
+	run.callCount = CALLS_PER_THREAD;
+	run.failureCount = 0;
+
+	LARGE_INTEGER frequency, start, end;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&start);
+	HANDLE threads[THREAD_COUNT];
+	for (int iThread = 0; iThread < THREAD_COUNT; ++iThread)
+	{
+		threads[iThread] = ::CreateThread(NULL, 0, ThroughputThreadProc, &run, 0, NULL);
+		TEST_ASSERT(threads[iThread] != NULL);
+	}
+	::WaitForMultipleObjects(THREAD_COUNT, threads, TRUE, INFINITE);
+	::QueryPerformanceCounter(&end);
+	for (int iThread = 0; iThread < THREAD_COUNT; ++iThread)
+	{
+		::CloseHandle(threads[iThread]);
+	}
+	ShadowSpawnDestroySession(run.session);
+	TEST_ASSERT(run.failureCount == 0);
+
+	double seconds = (double) (end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	int callCount = THREAD_COUNT * CALLS_PER_THREAD;
+	_tprintf(TEXT("  window %5u ms: %d calls on %d threads, %u snapshots, %.1f calls/s\n"),
+		windowMs, callCount, THREAD_COUNT, CountSnapshots(), callCount / seconds);
+}
+
+SHADOWSPAWN_BENCHMARK(CoalescingThroughput)
+{
+	MeasureThroughput(0);
+	MeasureThroughput(50);
+	MeasureThroughput(200);
+}
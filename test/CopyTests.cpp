@@ -0,0 +1,410 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// ShadowSpawnCopyTree: that a copy matches its source in contents,
+// attributes and timestamps, that each file went the expected way, and
+// how fast each way is.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+
+// The attributes ShadowSpawnCopyTree carries over with
+// SHADOWSPAWN_COPY_ATTRIBUTES.
+static const DWORD COPIED_ATTRIBUTES = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM |
+	FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED | FILE_ATTRIBUTE_TEMPORARY;
+
+static void WriteBytes(LPCTSTR path, ULONGLONG size, BYTE seed)
+{
+	HANDLE hFile = ::CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+	TEST_ASSERT(hFile != INVALID_HANDLE_VALUE);
+
+	vector<BYTE> chunk(64 * 1024);
+	ULONGLONG offset = 0;
+	while (offset < size)
+	{
+		DWORD length = (DWORD) min((ULONGLONG) chunk.size(), size - offset);
+		for (DWORD iByte = 0; iByte < length; ++iByte)
+		{
+			ULONGLONG position = offset + iByte;
+			chunk[iByte] = (BYTE) (position * 13 + (position >> 16) + seed);
+		}
+		DWORD written = 0;
+		TEST_ASSERT(::WriteFile(hFile, &chunk[0], length, &written, NULL) && written == length);
+		offset += length;
+	}
+	::CloseHandle(hFile);
+}
+
+// Gives path creation and last write times in 2001, so a copy that took
+// the times of its own creation instead shows up.
+static void SetOldTimes(LPCTSTR path, int day)
+{
+	SYSTEMTIME systemTime;
+	::ZeroMemory(&systemTime, sizeof(systemTime));
+	systemTime.wYear = 2001;
+	systemTime.wMonth = 2;
+	systemTime.wDay = (WORD) day;
+	systemTime.wHour = 12;
+	FILETIME fileTime;
+	TEST_ASSERT(::SystemTimeToFileTime(&systemTime, &fileTime));
+
+	HANDLE hFile = ::CreateFile(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	TEST_ASSERT(hFile != INVALID_HANDLE_VALUE);
+	TEST_ASSERT(::SetFileTime(hFile, &fileTime, NULL, &fileTime));
+	::CloseHandle(hFile);
+}
+
+static bool SameContents(LPCTSTR first, LPCTSTR second)
+{
+	HANDLE hFirst = ::CreateFile(first, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	HANDLE hSecond = ::CreateFile(second, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	bool same = (hFirst != INVALID_HANDLE_VALUE && hSecond != INVALID_HANDLE_VALUE);
+
+	vector<BYTE> firstChunk(64 * 1024);
+	vector<BYTE> secondChunk(64 * 1024);
+	while (same)
+	{
+		DWORD firstRead = 0;
+		DWORD secondRead = 0;
+		same = ::ReadFile(hFirst, &firstChunk[0], (DWORD) firstChunk.size(), &firstRead, NULL) &&
+			::ReadFile(hSecond, &secondChunk[0], (DWORD) secondChunk.size(), &secondRead, NULL) &&
+			firstRead == secondRead &&
+			(firstRead == 0 || memcmp(&firstChunk[0], &secondChunk[0], firstRead) == 0);
+		if (firstRead == 0)
+		{
+			break;
+		}
+	}
+
+	if (hFirst != INVALID_HANDLE_VALUE)
+	{
+		::CloseHandle(hFirst);
+	}
+	if (hSecond != INVALID_HANDLE_VALUE)
+	{
+		::CloseHandle(hSecond);
+	}
+	return same;
+}
+
+// Counts the entries below target that differ from their counterparts
+// below source, or have none, and every entry below source that target
+// lacks. Files are compared byte for byte; both files and directories
+// must have the same copied attributes and creation and last write times.
+static int CountDifferences(const CString& source, const CString& target)
+{
+	int differences = 0;
+	int targetCount = 0;
+
+	WIN32_FIND_DATA targetData;
+	HANDLE hFind = ::FindFirstFile(target + TEXT("\\*"), &targetData);
+	TEST_ASSERT(hFind != INVALID_HANDLE_VALUE);
+	do
+	{
+		if (_tcscmp(targetData.cFileName, TEXT(".")) == 0 || _tcscmp(targetData.cFileName, TEXT("..")) == 0)
+		{
+			continue;
+		}
+		++targetCount;
+
+		CString sourcePath(source + TEXT("\\") + targetData.cFileName);
+		CString targetPath(target + TEXT("\\") + targetData.cFileName);
+		WIN32_FILE_ATTRIBUTE_DATA sourceData;
+		if (!::GetFileAttributesEx(sourcePath, GetFileExInfoStandard, &sourceData))
+		{
+			++differences;
+			continue;
+		}
+
+		if ((sourceData.dwFileAttributes & COPIED_ATTRIBUTES) != (targetData.dwFileAttributes & COPIED_ATTRIBUTES) ||
+			((sourceData.dwFileAttributes ^ targetData.dwFileAttributes) & FILE_ATTRIBUTE_DIRECTORY) != 0 ||
+			::CompareFileTime(&sourceData.ftCreationTime, &targetData.ftCreationTime) != 0 ||
+			::CompareFileTime(&sourceData.ftLastWriteTime, &targetData.ftLastWriteTime) != 0)
+		{
+			++differences;
+		}
+		else if ((targetData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+		{
+			differences += CountDifferences(sourcePath, targetPath);
+		}
+		else if (!SameContents(sourcePath, targetPath))
+		{
+			++differences;
+		}
+	} while (::FindNextFile(hFind, &targetData));
+	::FindClose(hFind);
+
+	int sourceCount = 0;
+	WIN32_FIND_DATA sourceData;
+	hFind = ::FindFirstFile(source + TEXT("\\*"), &sourceData);
+	TEST_ASSERT(hFind != INVALID_HANDLE_VALUE);
+	do
+	{
+		if (_tcscmp(sourceData.cFileName, TEXT(".")) != 0 && _tcscmp(sourceData.cFileName, TEXT("..")) != 0)
+		{
+			++sourceCount;
+		}
+	} while (::FindNextFile(hFind, &sourceData));
+	::FindClose(hFind);
+
+	return differences + max(sourceCount - targetCount, 0);
+}
+
+static void GetCopyOptions(ShadowSpawnCopyOptions& options, DWORD bufferSize)
+{
+	::ZeroMemory(&options, sizeof(options));
+	options.threadCount = 4;
+	options.bufferSize = bufferSize;
+	options.flags = SHADOWSPAWN_COPY_ATTRIBUTES | SHADOWSPAWN_COPY_TIMESTAMPS;
+}
+
+// A synthetic tree with many small files, a few larger than a copy buffer
+// and one large enough to copy without the file cache, some of them
+// read-only, hidden or dated in the past, comes out identical, with every
+// file counted under the method its size calls for.
+SHADOWSPAWN_TEST(CopyTreeMatchesSource)
+{
+	const DWORD BUFFER_SIZE = 64 * 1024;
+	const int DIRECTORY_COUNT = 40;
+	const int FILES_PER_DIRECTORY = 25;
+	const DWORD SMALL_FILE_SIZE = 3000;
+	CTempDirectory temp;
+	CString source(temp.WriteTree(TEXT("source"), DIRECTORY_COUNT, FILES_PER_DIRECTORY, SMALL_FILE_SIZE));
+	CString target(temp.get_Path() + TEXT("\\target"));
+
+	CString special(source + TEXT("\\special"));
+	TEST_ASSERT(::CreateDirectory(special, NULL));
+	ULONGLONG largerSizes[] = { BUFFER_SIZE + 1, 5 * BUFFER_SIZE / 2, 20 * BUFFER_SIZE };
+	ULONGLONG largerBytes = 0;
+	for (int iFile = 0; iFile < (int) _countof(largerSizes); ++iFile)
+	{
+		CString path;
+		path.Format(TEXT("%s\\larger%d.dat"), (LPCTSTR) special, iFile);
+		WriteBytes(path, largerSizes[iFile], (BYTE) iFile);
+		largerBytes += largerSizes[iFile];
+	}
+	const ULONGLONG UNBUFFERED_SIZE = 17 * 1024 * 1024;
+	WriteBytes(special + TEXT("\\unbuffered.dat"), UNBUFFERED_SIZE, 99);
+	WriteBytes(special + TEXT("\\empty.dat"), 0, 0);
+	WriteBytes(special + TEXT("\\readonly.dat"), 100, 1);
+	WriteBytes(special + TEXT("\\hidden.dat"), 100, 2);
+	SetOldTimes(special + TEXT("\\readonly.dat"), 1);
+	SetOldTimes(special + TEXT("\\larger0.dat"), 2);
+	SetOldTimes(special + TEXT("\\unbuffered.dat"), 3);
+	TEST_ASSERT(::SetFileAttributes(special + TEXT("\\readonly.dat"), FILE_ATTRIBUTE_READONLY));
+	TEST_ASSERT(::SetFileAttributes(special + TEXT("\\hidden.dat"), FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_ARCHIVE));
+	SetOldTimes(special, 4);
+
+	int smallCount = DIRECTORY_COUNT * FILES_PER_DIRECTORY + 3;		// With the empty, read-only and hidden files
+	int largerCount = (int) _countof(largerSizes);
+	ULONGLONG smallBytes = (ULONGLONG) DIRECTORY_COUNT * FILES_PER_DIRECTORY * SMALL_FILE_SIZE + 200;
+
+	ShadowSpawnMockOptions mockOptions;
+	CTestFixture::GetMockOptions(mockOptions);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(mockOptions);
+	ShadowSpawnCopyOptions options;
+	GetCopyOptions(options, BUFFER_SIZE);
+	ShadowSpawnCopyStats stats;
+	HRESULT hr = ShadowSpawnCopyTree(session, source, target, &options, &stats);
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT_HRESULT(S_OK, hr);
+	TEST_ASSERT(stats.failedCount == 0);
+	// The root, the 16 parents WriteTree spreads its directories over,
+	// its directories and the special one.
+	TEST_ASSERT(stats.directoryCount == 1 + 16 + DIRECTORY_COUNT + 1);
+	TEST_ASSERT(stats.fileCount == (ULONGLONG) (smallCount + largerCount + 1));
+	TEST_ASSERT(stats.byteCount == smallBytes + largerBytes + UNBUFFERED_SIZE);
+
+	ULONGLONG countedFiles = 0;
+	ULONGLONG countedBytes = 0;
+	for (int iMethod = 0; iMethod < SHADOWSPAWN_COPY_METHOD_COUNT; ++iMethod)
+	{
+		countedFiles += stats.methodFileCounts[iMethod];
+		countedBytes += stats.methodByteCounts[iMethod];
+	}
+	TEST_ASSERT(countedFiles == stats.fileCount && countedBytes == stats.byteCount);
+
+	// With the temporary directory on ReFS everything is block-cloned.
+	// Otherwise only a system whose CopyFileEx can't bypass the cache
+	// copies the largest file overlapped instead.
+	if (stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_CLONE] == 0)
+	{
+		TEST_ASSERT(stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_BUFFERED] == (ULONGLONG) smallCount);
+		TEST_ASSERT(stats.methodByteCounts[SHADOWSPAWN_COPY_METHOD_BUFFERED] == smallBytes);
+		TEST_ASSERT(stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_UNBUFFERED] <= 1);
+		TEST_ASSERT(stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_OVERLAPPED] + stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_UNBUFFERED] ==
+			(ULONGLONG) largerCount + 1);
+		TEST_ASSERT(stats.methodByteCounts[SHADOWSPAWN_COPY_METHOD_UNBUFFERED] ==
+			stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_UNBUFFERED] * UNBUFFERED_SIZE);
+	}
+	else
+	{
+		TEST_ASSERT(stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_CLONE] == stats.fileCount);
+	}
+
+	TEST_ASSERT(CountDifferences(source, target) == 0);
+}
+
+// Files from just over one buffer to a few hundred buffers long, some
+// of them a whole number of buffers, all go through CopyOverlapped intact,
+// whether each can have a single request in flight for want of buffers or
+// its full queue.
+SHADOWSPAWN_TEST(CopyOverlappedFilesLargerThanBuffer)
+{
+	const DWORD BUFFER_SIZE = 4096;
+	ULONGLONG sizes[] = { BUFFER_SIZE + 1, 2 * BUFFER_SIZE, 8 * BUFFER_SIZE, 8 * BUFFER_SIZE + 17, 37 * BUFFER_SIZE + 5,
+		300 * BUFFER_SIZE + 123 };
+	CTempDirectory temp;
+	CString source(temp.get_Path() + TEXT("\\source"));
+	TEST_ASSERT(::CreateDirectory(source, NULL));
+	ULONGLONG totalBytes = 0;
+	for (int iFile = 0; iFile < (int) _countof(sizes); ++iFile)
+	{
+		CString path;
+		path.Format(TEXT("%s\\%d.dat"), (LPCTSTR) source, iFile);
+		WriteBytes(path, sizes[iFile], (BYTE) (iFile * 41));
+		totalBytes += sizes[iFile];
+	}
+
+	ShadowSpawnMockOptions mockOptions;
+	CTestFixture::GetMockOptions(mockOptions);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(mockOptions);
+
+	DWORD bufferCounts[] = { 1, 32 };
+	for (int iCase = 0; iCase < (int) _countof(bufferCounts); ++iCase)
+	{
+		CTempDirectory target;
+		CString targetPath(target.get_Path() + TEXT("\\copy"));
+		ShadowSpawnCopyOptions options;
+		GetCopyOptions(options, BUFFER_SIZE);
+		options.threadCount = 2;
+		options.bufferCount = bufferCounts[iCase];
+		ShadowSpawnCopyStats stats;
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCopyTree(session, source, targetPath, &options, &stats));
+
+		TEST_ASSERT(stats.failedCount == 0);
+		TEST_ASSERT(stats.fileCount == _countof(sizes) && stats.byteCount == totalBytes);
+		TEST_ASSERT(stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_OVERLAPPED] + stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_CLONE] ==
+			_countof(sizes));
+		TEST_ASSERT(CountDifferences(source, targetPath) == 0);
+	}
+
+	ShadowSpawnDestroySession(session);
+}
+
+// Copies source into a directory of its own with options, which is
+// deleted again afterwards, and reports how fast that went and how the
+// files were copied.
+static void MeasureCopy(ShadowSpawnSession session, LPCTSTR name, LPCTSTR source, const ShadowSpawnCopyOptions& options)
+{
+	CTempDirectory target;
+	CString targetPath(target.get_Path() + TEXT("\\copy"));
+	ShadowSpawnResetPhaseStats();
+	ShadowSpawnCopyStats stats;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCopyTree(session, source, targetPath, &options, &stats));
+	TEST_ASSERT(stats.failedCount == 0);
+
+	ShadowSpawnPhaseStats copy;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_COPY, &copy));
+	double seconds = copy.totalMicroseconds / 1e6;
+	_tprintf(TEXT("  %-11s %6.0f files/s %7.1f MB/s  (cloned %I64u, unbuffered %I64u, overlapped %I64u, buffered %I64u)\n"),
+		name, stats.fileCount / seconds, stats.byteCount / (1024.0 * 1024) / seconds,
+		stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_CLONE], stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_UNBUFFERED],
+		stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_OVERLAPPED], stats.methodFileCounts[SHADOWSPAWN_COPY_METHOD_BUFFERED]);
+}
+
+// The same sixteen 16 MB files copied through one buffer per file, with
+// several reads and writes in flight per file, and by CopyFileEx without
+// the file cache. A first copy warms the cache for the source, so every
+// method reads from the same state; on ReFS all of them block-clone
+// instead.
+SHADOWSPAWN_BENCHMARK(CopyMethodThroughput)
+{
+	const int DIRECTORY_COUNT = 2;
+	const int FILES_PER_DIRECTORY = 8;
+	const DWORD FILE_SIZE = 16 * 1024 * 1024;
+	const DWORD THREAD_COUNT = 2;
+	CTempDirectory temp;
+	CString source(temp.WriteTree(TEXT("source"), DIRECTORY_COUNT, FILES_PER_DIRECTORY, FILE_SIZE));
+
+	ShadowSpawnMockOptions mockOptions;
+	CTestFixture::GetMockOptions(mockOptions);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(mockOptions);
+
+	// Files no bigger than a buffer are copied through it in one go.
+	ShadowSpawnCopyOptions buffered;
+	GetCopyOptions(buffered, FILE_SIZE);
+	buffered.threadCount = THREAD_COUNT;
+	buffered.bufferCount = THREAD_COUNT;
+	buffered.flags |= SHADOWSPAWN_COPY_CACHED;
+
+	ShadowSpawnCopyOptions overlapped;
+	GetCopyOptions(overlapped, 0);
+	overlapped.threadCount = THREAD_COUNT;
+	overlapped.flags |= SHADOWSPAWN_COPY_CACHED;
+
+	ShadowSpawnCopyOptions unbuffered;
+	GetCopyOptions(unbuffered, 0);
+	unbuffered.threadCount = THREAD_COUNT;
+
+	_tprintf(TEXT("  %d files of %u MB on %u threads\n"), DIRECTORY_COUNT * FILES_PER_DIRECTORY, FILE_SIZE / (1024 * 1024), THREAD_COUNT);
+	MeasureCopy(session, TEXT("warm-up"), source, overlapped);
+	MeasureCopy(session, TEXT("buffered"), source, buffered);
+	MeasureCopy(session, TEXT("overlapped"), source, overlapped);
+	MeasureCopy(session, TEXT("unbuffered"), source, unbuffered);
+
+	ShadowSpawnDestroySession(session);
+}
+
+// Sixty-four 4 MB files copied overlapped with one, two and eight 1 MB
+// buffers per thread, which bounds how many reads and writes each file
+// can have in flight.
+SHADOWSPAWN_BENCHMARK(CopyOverlappedQueueDepth)
+{
+	const int DIRECTORY_COUNT = 8;
+	const int FILES_PER_DIRECTORY = 8;
+	const DWORD FILE_SIZE = 4 * 1024 * 1024;
+	const DWORD THREAD_COUNT = 2;
+	CTempDirectory temp;
+	CString source(temp.WriteTree(TEXT("source"), DIRECTORY_COUNT, FILES_PER_DIRECTORY, FILE_SIZE));
+
+	ShadowSpawnMockOptions mockOptions;
+	CTestFixture::GetMockOptions(mockOptions);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(mockOptions);
+
+	_tprintf(TEXT("  %d files of %u MB on %u threads\n"), DIRECTORY_COUNT * FILES_PER_DIRECTORY, FILE_SIZE / (1024 * 1024), THREAD_COUNT);
+	DWORD buffersPerThread[] = { 2, 1, 2, 8 };
+	LPCTSTR names[] = { TEXT("warm-up"), TEXT("depth 1"), TEXT("depth 2"), TEXT("depth 8") };
+	for (int iCase = 0; iCase < (int) _countof(buffersPerThread); ++iCase)
+	{
+		ShadowSpawnCopyOptions options;
+		GetCopyOptions(options, 0);
+		options.threadCount = THREAD_COUNT;
+		options.bufferCount = THREAD_COUNT * buffersPerThread[iCase];
+		MeasureCopy(session, names[iCase], source, options);
+	}
+
+	ShadowSpawnDestroySession(session);
+}
@@ -0,0 +1,141 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Time limits and cancellation, against mock phases that never finish by
+// themselves.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+
+static volatile LONG s_callbackCount;
+static DWORD s_callbackSleepMs;
+
+static void __stdcall SleepingCallback(void)
+{
+	::InterlockedIncrement(&s_callbackCount);
+	::Sleep(s_callbackSleepMs);
+}
+
+static void ResetCallback(DWORD sleepMs)
+{
+	s_callbackCount = 0;
+	s_callbackSleepMs = sleepMs;
+}
+
+SHADOWSPAWN_TEST(HungPhaseTimesOut)
+{
+	CTempDirectory source;
+	ResetCallback(0);
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.hangPhases = 1 << SHADOWSPAWN_PHASE_PREPARE_FOR_BACKUP;
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	{
+		CTestCall call(session, source.get_Path(), CTestFixture::FindFreeDevice(), SleepingCallback, NULL);
+		call.get_Options().timeoutMs = 300;
+		call.Start();
+		TEST_ASSERT(call.Wait(10000));
+		TEST_ASSERT_HRESULT(HRESULT_FROM_WIN32(ERROR_TIMEOUT), call.get_Result());
+		TEST_ASSERT(call.get_ElapsedMs() >= 250);
+	}
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(s_callbackCount == 0);
+}
+
+SHADOWSPAWN_TEST(HungPhaseIsCancelled)
+{
+	CTempDirectory source;
+	ResetCallback(0);
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.hangPhases = 1 << SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET;
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	ShadowSpawnCancellation cancellation;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCreateCancellation(&cancellation));
+	{
+		CTestCall call(session, source.get_Path(), CTestFixture::FindFreeDevice(), SleepingCallback, NULL);
+		call.get_Options().cancellation = cancellation;
+		call.Start();
+		bool returnedEarly = call.Wait(300);
+		ShadowSpawnCancel(cancellation);
+		TEST_ASSERT(call.Wait(10000));
+		TEST_ASSERT(!returnedEarly);
+		TEST_ASSERT_HRESULT(E_ABORT, call.get_Result());
+	}
+	ShadowSpawnCloseCancellation(cancellation);
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(s_callbackCount == 0);
+}
+
+// A callback that takes longer than the whole time limit doesn't make
+// BackupComplete fail afterwards.
+SHADOWSPAWN_TEST(CallbackTimeDoesNotCountAgainstDeadline)
+{
+	CTempDirectory source;
+	ResetCallback(800);
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.asyncLatencyMs = 50;
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	{
+		CTestCall call(session, source.get_Path(), CTestFixture::FindFreeDevice(), SleepingCallback, NULL);
+		call.get_Options().timeoutMs = 500;
+		call.Start();
+		TEST_ASSERT(call.Wait(10000));
+		TEST_ASSERT_HRESULT(S_OK, call.get_Result());
+	}
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(s_callbackCount == 1);
+}
+
+// BackupComplete still gets what was left of the time limit when the
+// callback started, and no more.
+SHADOWSPAWN_TEST(HungBackupCompleteTimesOutAfterCallback)
+{
+	CTempDirectory source;
+	ResetCallback(800);
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.hangPhases = 1 << SHADOWSPAWN_PHASE_BACKUP_COMPLETE;
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	{
+		CTestCall call(session, source.get_Path(), CTestFixture::FindFreeDevice(), SleepingCallback, NULL);
+		call.get_Options().timeoutMs = 500;
+		call.Start();
+		TEST_ASSERT(call.Wait(10000));
+		TEST_ASSERT_HRESULT(HRESULT_FROM_WIN32(ERROR_TIMEOUT), call.get_Result());
+		// The callback's 800 ms, then most of the 500 ms budget, which
+		// the mock's setup barely touches.
+		TEST_ASSERT(call.get_ElapsedMs() >= 800 + 300);
+	}
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(s_callbackCount == 1);
+}
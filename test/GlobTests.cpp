@@ -0,0 +1,185 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Wildcard matching: CGlobPattern, MatchStars behind the legacy
+// Utilities::IsMatch, and how both compare with what came before and with
+// atlrx.h.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+#include "CGlobPattern.h"
+#include <atlrx.h>
+
+static bool GlobMatches(LPCTSTR pattern, LPCTSTR input)
+{
+	CGlobPattern glob;
+	glob.Compile(pattern, false);
+	return glob.IsMatch(input);
+}
+
+static bool StarsMatch(LPCTSTR pattern, LPCTSTR input)
+{
+	return CGlobPattern::MatchStars(input, _tcslen(input), pattern);
+}
+
+// Utilities::IsMatch as it was before CGlobPattern, for the benchmark:
+// one star at most, and several temporary strings per call.
+static bool OldIsMatch(CString& input, CString& pattern)
+{
+	if (pattern.Compare(TEXT("*")) == 0 || pattern.Compare(TEXT("*.*")) == 0)
+	{
+		return true;
+	}
+
+	int index = pattern.Find(TEXT("*"));
+	if (index < 0)
+	{
+		return input.CompareNoCase(pattern) == 0;
+	}
+
+	if (index > 0)
+	{
+		if (index > input.GetLength())
+		{
+			return false;
+		}
+
+		CString prefix = pattern.Left(index);
+		CString inputStart = input.Left(index);
+		if (prefix.CompareNoCase(inputStart) != 0)
+		{
+			return false;
+		}
+	}
+
+	if (index < input.GetLength() - 1)
+	{
+		CString suffix = pattern.Mid(index + 1);
+		CString inputEnd = input.Right(suffix.GetLength());
+		if (suffix.CompareNoCase(inputEnd) != 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+SHADOWSPAWN_TEST(GlobMatchesWildcards)
+{
+	TEST_ASSERT(GlobMatches(TEXT("*.txt"), TEXT("Notes.TXT")));
+	TEST_ASSERT(!GlobMatches(TEXT("*.txt"), TEXT("dir\\notes.txt")));
+	TEST_ASSERT(GlobMatches(TEXT("**\\*.txt"), TEXT("dir\\sub\\notes.txt")));
+	TEST_ASSERT(GlobMatches(TEXT("file?.log"), TEXT("file1.log")));
+	TEST_ASSERT(!GlobMatches(TEXT("file?.log"), TEXT("file\\.log")));
+	TEST_ASSERT(GlobMatches(TEXT("[a-c]*"), TEXT("Bravo")));
+	TEST_ASSERT(!GlobMatches(TEXT("[!a-c]*"), TEXT("bravo")));
+	TEST_ASSERT(GlobMatches(TEXT("a*b*c"), TEXT("aXbYbZc")));
+	TEST_ASSERT(!GlobMatches(TEXT("a*b*c"), TEXT("aXbYbZ")));
+}
+
+// What Utilities::IsMatch has always meant: only * is a wildcard, and it
+// crosses backslashes. It no longer stops at one star.
+SHADOWSPAWN_TEST(MatchStarsTreatsOnlyStarsAsWildcards)
+{
+	TEST_ASSERT(StarsMatch(TEXT("C:\\data[1]\\*"), TEXT("c:\\DATA[1]\\x\\y.txt")));
+	TEST_ASSERT(!StarsMatch(TEXT("C:\\data[1]\\*"), TEXT("C:\\data1\\y.txt")));
+	TEST_ASSERT(StarsMatch(TEXT("what?"), TEXT("What?")));
+	TEST_ASSERT(!StarsMatch(TEXT("what?"), TEXT("whats")));
+	TEST_ASSERT(StarsMatch(TEXT("*\\logs\\*.log"), TEXT("C:\\app\\logs\\today.log")));
+	TEST_ASSERT(!StarsMatch(TEXT("*\\logs\\*.log"), TEXT("C:\\app\\logs\\today.txt")));
+	TEST_ASSERT(StarsMatch(TEXT("exact"), TEXT("EXACT")));
+	TEST_ASSERT(!StarsMatch(TEXT("exact"), TEXT("exactly")));
+}
+
+static double ElapsedMicroseconds(const LARGE_INTEGER& start, const LARGE_INTEGER& frequency)
+{
+	LARGE_INTEGER end;
+	::QueryPerformanceCounter(&end);
+	return (end.QuadPart - start.QuadPart) * 1000000.0 / frequency.QuadPart;
+}
+
+// One single-star pattern, which all four can express, over paths like
+// those a snapshot walk produces.
+SHADOWSPAWN_BENCHMARK(GlobMatchingThroughput)
+{
+	const int PATH_COUNT = 200000;
+	vector<CString> paths(PATH_COUNT);
+	for (int iPath = 0; iPath < PATH_COUNT; ++iPath)
+	{
+		paths[iPath].Format(TEXT("C:\\Users\\user%d\\Documents\\Project %d\\file%d.%s"),
+			iPath % 50, iPath % 400, iPath, (iPath % 3 == 0) ? TEXT("txt") : TEXT("docx"));
+	}
+	CString pattern(TEXT("C:\\Users\\*.TXT"));
+
+	LARGE_INTEGER frequency, start;
+	::QueryPerformanceFrequency(&frequency);
+
+	int oldCount = 0;
+	::QueryPerformanceCounter(&start);
+	for (int iPath = 0; iPath < PATH_COUNT; ++iPath)
+	{
+		oldCount += OldIsMatch(paths[iPath], pattern) ? 1 : 0;
+	}
+	double oldMicroseconds = ElapsedMicroseconds(start, frequency);
+
+	int starsCount = 0;
+	::QueryPerformanceCounter(&start);
+	for (int iPath = 0; iPath < PATH_COUNT; ++iPath)
+	{
+		starsCount += CGlobPattern::MatchStars(paths[iPath], paths[iPath].GetLength(), pattern) ? 1 : 0;
+	}
+	double starsMicroseconds = ElapsedMicroseconds(start, frequency);
+
+	int globCount = 0;
+	::QueryPerformanceCounter(&start);
+	CGlobPattern glob;
+	glob.Compile(pattern, true);
+	for (int iPath = 0; iPath < PATH_COUNT; ++iPath)
+	{
+		globCount += glob.IsMatch(paths[iPath], paths[iPath].GetLength()) ? 1 : 0;
+	}
+	double globMicroseconds = ElapsedMicroseconds(start, frequency);
+
+	int regexCount = 0;
+	::QueryPerformanceCounter(&start);
+	CAtlRegExp<> regex;
+	TEST_ASSERT(regex.Parse(TEXT("^C:\\\\Users\\\\.*\\.TXT$"), FALSE) == REPARSE_ERROR_OK);
+	CAtlREMatchContext<> context;
+	for (int iPath = 0; iPath < PATH_COUNT; ++iPath)
+	{
+		regexCount += regex.Match(paths[iPath], &context) ? 1 : 0;
+	}
+	double regexMicroseconds = ElapsedMicroseconds(start, frequency);
+
+	TEST_ASSERT(oldCount == PATH_COUNT / 3 + 1);
+	TEST_ASSERT(starsCount == oldCount);
+	TEST_ASSERT(globCount == oldCount);
+	TEST_ASSERT(regexCount == oldCount);
+
+	_tprintf(TEXT("  %d paths, %d matches\n"), PATH_COUNT, oldCount);
+	_tprintf(TEXT("  old IsMatch:        %.3f us per path\n"), oldMicroseconds / PATH_COUNT);
+	_tprintf(TEXT("  MatchStars:         %.3f us per path\n"), starsMicroseconds / PATH_COUNT);
+	_tprintf(TEXT("  CGlobPattern:       %.3f us per path\n"), globMicroseconds / PATH_COUNT);
+	_tprintf(TEXT("  CAtlRegExp:         %.3f us per path\n"), regexMicroseconds / PATH_COUNT);
+}
@@ -0,0 +1,197 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// ShadowSpawnAsync jobs, which run on the system thread pool and must
+// never tie up a pool thread while they wait.
+
+#include "stdafx.h"
+#include <tlhelp32.h>
+#include "CTestFixture.h"
+
+static volatile LONG s_callbackCount;
+
+static void __stdcall CountCallback(void)
+{
+	::InterlockedIncrement(&s_callbackCount);
+}
+
+static int CountThreads(void)
+{
+	HANDLE hSnapshot = ::CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+	TEST_ASSERT(hSnapshot != INVALID_HANDLE_VALUE);
+
+	int count = 0;
+	THREADENTRY32 entry;
+	entry.dwSize = sizeof(entry);
+	for (BOOL more = ::Thread32First(hSnapshot, &entry); more; more = ::Thread32Next(hSnapshot, &entry))
+	{
+		if (entry.th32OwnerProcessID == ::GetCurrentProcessId())
+		{
+			++count;
+		}
+	}
+	::CloseHandle(hSnapshot);
+	return count;
+}
+
+static ShadowSpawnJobState GetState(ShadowSpawnJob job)
+{
+	ShadowSpawnJobState state;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetJobStatus(job, &state, NULL));
+	return state;
+}
+
+// Polls until job reaches state, or fails the test after a while.
+static void WaitForState(ShadowSpawnJob job, ShadowSpawnJobState state)
+{
+	for (int iPoll = 0; GetState(job) != state; ++iPoll)
+	{
+		TEST_ASSERT(iPoll < 1000);
+		::Sleep(10);
+	}
+}
+
+// One job holds the admission queue, hanging in DoSnapshotSet; the jobs
+// queued behind it must wait from a timer, not from pool threads of their
+// own.
+SHADOWSPAWN_TEST(JobsQueueWithoutHoldingThreads)
+{
+	const int QUEUED_COUNT = 16;
+	CTempDirectory source;
+	s_callbackCount = 0;
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.hangPhases = 1 << SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET;
+	ShadowSpawnSession hungSession = CTestFixture::CreateMockSession(options);
+	CTestFixture::GetMockOptions(options);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+
+	ShadowSpawnJob hungJob;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnAsync(hungSession, source.get_Path(), CTestFixture::FindFreeDevice(0), CountCallback, NULL, NULL, &hungJob));
+	WaitForState(hungJob, SHADOWSPAWN_JOB_CREATING_SNAPSHOT);
+	int baseThreadCount = CountThreads();
+
+	// None of these gets as far as mounting, so they can share a device.
+	CString device(CTestFixture::FindFreeDevice(1));
+	ShadowSpawnJob jobs[QUEUED_COUNT];
+	for (int iJob = 0; iJob < QUEUED_COUNT; ++iJob)
+	{
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnAsync(session, source.get_Path(), device, CountCallback, NULL, NULL, &jobs[iJob]));
+	}
+	for (int iJob = 0; iJob < QUEUED_COUNT; ++iJob)
+	{
+		WaitForState(jobs[iJob], SHADOWSPAWN_JOB_GATHERING_WRITER_METADATA);
+	}
+
+	// Long enough for each queued job to have polled several times.
+	::Sleep(500);
+	int queuedThreadCount = CountThreads();
+
+	for (int iJob = 0; iJob < QUEUED_COUNT; ++iJob)
+	{
+		ShadowSpawnCancelJob(jobs[iJob]);
+	}
+	ShadowSpawnCancelJob(hungJob);
+
+	for (int iJob = 0; iJob < QUEUED_COUNT; ++iJob)
+	{
+		TEST_ASSERT_HRESULT(E_ABORT, ShadowSpawnWaitForJob(jobs[iJob], 30000));
+		ShadowSpawnCloseJob(jobs[iJob]);
+	}
+	TEST_ASSERT(FAILED(ShadowSpawnWaitForJob(hungJob, 30000)));
+	ShadowSpawnCloseJob(hungJob);
+	ShadowSpawnDestroySession(session);
+	ShadowSpawnDestroySession(hungSession);
+
+	TEST_ASSERT(s_callbackCount == 0);
+	TEST_ASSERT(queuedThreadCount - baseThreadCount < QUEUED_COUNT / 2);
+}
+
+static volatile LONG s_completedCount;
+
+static void __stdcall CountCompletion(ShadowSpawnJob job, HRESULT hr, void* context)
+{
+	if (SUCCEEDED(hr))
+	{
+		::InterlockedIncrement(&s_completedCount);
+	}
+}
+
+// Several jobs on one session, each taking a while in every VSS phase,
+// should be in flight together rather than one after another.
+SHADOWSPAWN_TEST(JobsInterleave)
+{
+	const int JOB_COUNT = 4;
+	CTempDirectory source;
+	s_callbackCount = 0;
+	s_completedCount = 0;
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.asyncLatencyMs = 100;
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+
+	ShadowSpawnJob jobs[JOB_COUNT];
+	for (int iJob = 0; iJob < JOB_COUNT; ++iJob)
+	{
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnAsync(session, source.get_Path(), CTestFixture::FindFreeDevice(iJob), CountCallback, CountCompletion, NULL, &jobs[iJob]));
+	}
+
+	// Samples how many jobs are somewhere between starting and finishing.
+	int maxInFlight = 0;
+	for (int iPoll = 0; iPoll < 3000; ++iPoll)
+	{
+		int inFlight = 0;
+		int finished = 0;
+		for (int iJob = 0; iJob < JOB_COUNT; ++iJob)
+		{
+			ShadowSpawnJobState state = GetState(jobs[iJob]);
+			if (state == SHADOWSPAWN_JOB_SUCCEEDED || state == SHADOWSPAWN_JOB_FAILED)
+			{
+				++finished;
+			}
+			else if (state != SHADOWSPAWN_JOB_PENDING)
+			{
+				++inFlight;
+			}
+		}
+		maxInFlight = max(maxInFlight, inFlight);
+		if (finished == JOB_COUNT)
+		{
+			break;
+		}
+		::Sleep(5);
+	}
+
+	for (int iJob = 0; iJob < JOB_COUNT; ++iJob)
+	{
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnWaitForJob(jobs[iJob], 30000));
+		ShadowSpawnCloseJob(jobs[iJob]);
+	}
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(s_callbackCount == JOB_COUNT);
+	TEST_ASSERT(s_completedCount == JOB_COUNT);
+	TEST_ASSERT(maxInFlight > 1);
+}
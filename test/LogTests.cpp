@@ -0,0 +1,373 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// The log queue and event log: everything logged reaching the host, both
+// being swapped out under runs that are logging through them, decoding
+// event records, and what logging costs.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+#include "OutputWriter.h"
+
+static volatile LONG s_messageCount;
+
+static void __stdcall CountLog(const LPCTSTR message)
+{
+	::InterlockedIncrement(&s_messageCount);
+	CTestFixture::Log(message);
+}
+
+static void __stdcall IgnoreCallback(void)
+{
+}
+
+static volatile LONG s_batchCount;
+static volatile LONG s_badBatchCount;
+
+// Runs on the library's threads, so it only counts what the test asserts.
+static void __stdcall CountEvents(const BYTE* records, DWORD length, void* context)
+{
+	::InterlockedIncrement(&s_batchCount);
+	if (FAILED(ShadowSpawnDecodeEvents(records, length, CTestFixture::Log)))
+	{
+		::InterlockedIncrement(&s_badBatchCount);
+	}
+}
+
+static ShadowSpawnSession CreateCountingSession(const ShadowSpawnMockOptions& options)
+{
+	ShadowSpawnSession session = NULL;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCreateSession(CTestFixture::VERBOSITY, &options, CountLog, &session));
+	return session;
+}
+
+// A queue much smaller than what a run logs, so producers wait for room,
+// still delivers every message by the time ShadowSpawnFlushLog returns.
+SHADOWSPAWN_TEST(LogQueueFlushDeliversEverything)
+{
+	CTempDirectory source;
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	ShadowSpawnSession session = CreateCountingSession(options);
+
+	s_messageCount = 0;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback));
+	LONG directCount = s_messageCount;
+
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnSetLogQueue(session, 4, SHADOWSPAWN_LOG_OVERFLOW_BLOCK));
+	s_messageCount = 0;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback));
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnFlushLog(session));
+	LONG queuedCount = s_messageCount;
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(directCount > 0);
+	TEST_ASSERT(queuedCount == directCount);
+}
+
+// Runs keep logging while the test thread replaces the queue over and
+// over, back and forth between queued and direct logging. Nothing may
+// log through a queue after it has been freed.
+SHADOWSPAWN_TEST(LogQueueCanBeReplacedDuringRuns)
+{
+	const int CALL_COUNT = 4;
+	CTempDirectory source;
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.asyncLatencyMs = 20;
+	ShadowSpawnSession session = CreateCountingSession(options);
+	HANDLE hStart = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	s_messageCount = 0;
+	{
+		CAutoPtr<CTestCall> calls[CALL_COUNT];
+		for (int iCall = 0; iCall < CALL_COUNT; ++iCall)
+		{
+			calls[iCall].Attach(new CTestCall(session, source.get_Path(), CTestFixture::FindFreeDevice(iCall), IgnoreCallback, hStart));
+			calls[iCall]->Start();
+		}
+		::SetEvent(hStart);
+
+		const DWORD capacities[] = { 0, 2, 64, 0, 4096 };
+		int swaps = 0;
+		bool running = true;
+		while (running)
+		{
+			DWORD capacity = capacities[swaps % _countof(capacities)];
+			ShadowSpawnLogOverflowPolicy policy = (swaps % 2 == 0) ? SHADOWSPAWN_LOG_OVERFLOW_BLOCK : SHADOWSPAWN_LOG_OVERFLOW_DROP;
+			TEST_ASSERT_HRESULT(S_OK, ShadowSpawnSetLogQueue(session, capacity, policy));
+			++swaps;
+
+			running = false;
+			for (int iCall = 0; iCall < CALL_COUNT; ++iCall)
+			{
+				if (!calls[iCall]->Wait(0))
+				{
+					running = true;
+				}
+			}
+		}
+
+		for (int iCall = 0; iCall < CALL_COUNT; ++iCall)
+		{
+			TEST_ASSERT_HRESULT(S_OK, calls[iCall]->get_Result());
+		}
+		TEST_ASSERT(swaps > 1);
+	}
+	::CloseHandle(hStart);
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(s_messageCount > 0);
+}
+
+// The same for the event callback, which is also called outside the event
+// log's lock and so can run while other threads are recording.
+SHADOWSPAWN_TEST(EventCallbackCanBeReplacedDuringRuns)
+{
+	const int CALL_COUNT = 4;
+	CTempDirectory source;
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.asyncLatencyMs = 20;
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	HANDLE hStart = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	s_batchCount = 0;
+	s_badBatchCount = 0;
+	{
+		CAutoPtr<CTestCall> calls[CALL_COUNT];
+		for (int iCall = 0; iCall < CALL_COUNT; ++iCall)
+		{
+			calls[iCall].Attach(new CTestCall(session, source.get_Path(), CTestFixture::FindFreeDevice(iCall), IgnoreCallback, hStart));
+			calls[iCall]->Start();
+		}
+		::SetEvent(hStart);
+
+		int swaps = 0;
+		bool running = true;
+		while (running)
+		{
+			TEST_ASSERT_HRESULT(S_OK, ShadowSpawnSetEventCallback(session, (swaps % 3 == 2) ? NULL : CountEvents, NULL));
+			TEST_ASSERT_HRESULT(S_OK, ShadowSpawnFlushEvents(session));
+			++swaps;
+
+			running = false;
+			for (int iCall = 0; iCall < CALL_COUNT; ++iCall)
+			{
+				if (!calls[iCall]->Wait(0))
+				{
+					running = true;
+				}
+			}
+		}
+
+		for (int iCall = 0; iCall < CALL_COUNT; ++iCall)
+		{
+			TEST_ASSERT_HRESULT(S_OK, calls[iCall]->get_Result());
+		}
+	}
+	::CloseHandle(hStart);
+	ShadowSpawnDestroySession(session);
+
+	TEST_ASSERT(s_batchCount > 0);
+	TEST_ASSERT(s_badBatchCount == 0);
+}
+
+static volatile LONG s_deliveredCount;
+
+static void __stdcall CountDelivered(const LPCTSTR message)
+{
+	::InterlockedIncrement(&s_deliveredCount);
+}
+
+// What a verbose-only message costs at normal verbosity, where it is
+// thrown away: formatted up front and passed to WriteLine, as the
+// component loops used to, against WriteFormat, which checks the level
+// before formatting anything.
+SHADOWSPAWN_BENCHMARK(DisabledLoggingCostPerMessage)
+{
+	const int MESSAGE_COUNT = 1000000;
+	OutputWriter logger;
+	logger.SetLogger(CountDelivered);
+	logger.SetVerbosityLevel(VERBOSITY_LEVEL_NORMAL);
+	CString name(TEXT("Component name"));
+	CString logicalPath(TEXT("Writer\\Logical\\Path"));
+	s_deliveredCount = 0;
+
+	LARGE_INTEGER frequency, start, end;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&start);
+	for (int iMessage = 0; iMessage < MESSAGE_COUNT; ++iMessage)
+	{
+		CString message;
+		message.AppendFormat(TEXT("Component %d is named %s, has a path of %s, and is %sselectable for backup."),
+			iMessage, (LPCTSTR) name, (LPCTSTR) logicalPath, (iMessage & 1) ? TEXT("") : TEXT("not "));
+		logger.WriteLine(message);
+	}
+	::QueryPerformanceCounter(&end);
+	double eagerNanoseconds = (end.QuadPart - start.QuadPart) * 1000000000.0 / frequency.QuadPart / MESSAGE_COUNT;
+
+	::QueryPerformanceCounter(&start);
+	for (int iMessage = 0; iMessage < MESSAGE_COUNT; ++iMessage)
+	{
+		logger.WriteFormat(TEXT("Component %d is named %s, has a path of %s, and is %sselectable for backup."),
+			iMessage, (LPCTSTR) name, (LPCTSTR) logicalPath, (iMessage & 1) ? TEXT("") : TEXT("not "));
+	}
+	::QueryPerformanceCounter(&end);
+	double gatedNanoseconds = (end.QuadPart - start.QuadPart) * 1000000000.0 / frequency.QuadPart / MESSAGE_COUNT;
+
+	TEST_ASSERT(s_deliveredCount == 0);
+	_tprintf(TEXT("  %d disabled messages\n"), MESSAGE_COUNT);
+	_tprintf(TEXT("  formatted, then WriteLine: %.1f ns per message\n"), eagerNanoseconds);
+	_tprintf(TEXT("  WriteFormat:               %.1f ns per message\n"), gatedNanoseconds);
+}
+
+static vector<BYTE> s_records;
+
+static void __stdcall CollectEvents(const BYTE* records, DWORD length, void* context)
+{
+	s_records.insert(s_records.end(), records, records + length);
+}
+
+static vector<CString> s_lines;
+
+static void __stdcall CollectLines(const LPCTSTR message)
+{
+	s_lines.push_back(CString(message));
+}
+
+// Records written through CEventLog come back out of
+// ShadowSpawnDecodeEvents one line each, with every field in place, and
+// a buffer cut off part way through a record is refused.
+SHADOWSPAWN_TEST(EventRecordsDecode)
+{
+	s_records.clear();
+	s_lines.clear();
+	{
+		CEventLog eventLog(CollectEvents, NULL);
+		eventLog.Write(SHADOWSPAWN_EVENT_COMPONENT_ADDED, SHADOWSPAWN_PHASE_ADD_COMPONENTS, 2, 7, S_OK, 0, NULL);
+		eventLog.Write(SHADOWSPAWN_EVENT_VOLUME_ADDED, SHADOWSPAWN_PHASE_ADD_COMPONENTS, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE, S_OK, 0, TEXT("C:\\"));
+		eventLog.Write(SHADOWSPAWN_EVENT_ERROR, SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET, SHADOWSPAWN_EVENT_NONE, SHADOWSPAWN_EVENT_NONE, E_ACCESSDENIED, 42, TEXT("Odd length"));
+		eventLog.Flush();
+	}
+
+	TEST_ASSERT(s_records.size() % 8 == 0);
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnDecodeEvents(&s_records[0], (DWORD) s_records.size(), CollectLines));
+	TEST_ASSERT(s_lines.size() == 3);
+	TEST_ASSERT(s_lines[0].Find(TEXT(" ComponentAdded phase=AddComponents writer=2 component=7 hr=0x00000000 value=0")) > 0);
+	TEST_ASSERT(s_lines[0].Right(7) == TEXT("value=0"));
+	TEST_ASSERT(s_lines[1].Find(TEXT(" VolumeAdded phase=AddComponents writer=- component=- hr=0x00000000 value=0 C:\\")) > 0);
+	TEST_ASSERT(s_lines[2].Find(TEXT(" Error phase=DoSnapshotSet writer=- component=- hr=0x80070005 value=42 Odd length")) > 0);
+	TEST_ASSERT(s_lines[2].Right(10) == TEXT("Odd length"));
+
+	// CEventLog::Format, which the export uses, walks the same records.
+	CString line;
+	DWORD offset = 0;
+	int recordCount = 0;
+	while (offset < s_records.size())
+	{
+		DWORD size = CEventLog::Format(&s_records[offset], (DWORD) s_records.size() - offset, line);
+		TEST_ASSERT(size >= sizeof(ShadowSpawnEventRecord) && size % 8 == 0);
+		TEST_ASSERT(line == s_lines[recordCount]);
+		offset += size;
+		++recordCount;
+	}
+	TEST_ASSERT(recordCount == 3);
+
+	TEST_ASSERT(CEventLog::Format(&s_records[0], sizeof(ShadowSpawnEventRecord) - 1, line) == 0);
+	TEST_ASSERT_HRESULT(E_INVALIDARG, ShadowSpawnDecodeEvents(&s_records[0], (DWORD) s_records.size() - 8, CollectLines));
+}
+
+static LONGLONG s_eventBytes;
+
+// Batches are delivered one at a time, so this needn't be atomic.
+static void __stdcall CountEventBytes(const BYTE* records, DWORD length, void* context)
+{
+	s_eventBytes += length;
+}
+
+struct CEventWriterRun
+{
+	CEventLog* pEventLog;
+	int eventCount;
+};
+
+static DWORD WINAPI WriteEventsThreadProc(LPVOID parameter)
+{
+	CEventWriterRun* pRun = (CEventWriterRun*) parameter;
+	for (int iEvent = 0; iEvent < pRun->eventCount; ++iEvent)
+	{
+		pRun->pEventLog->Write(SHADOWSPAWN_EVENT_COMPONENT_ADDED, SHADOWSPAWN_PHASE_ADD_COMPONENTS, iEvent % 16, iEvent, S_OK, 0, NULL);
+	}
+	return 0;
+}
+
+// How fast events can be recorded, from one thread and from several at
+// once, next to formatting the same information as a line of text.
+SHADOWSPAWN_BENCHMARK(EventLogWriteThroughput)
+{
+	const int EVENT_COUNT = 1000000;
+	LARGE_INTEGER frequency, start, end;
+	::QueryPerformanceFrequency(&frequency);
+
+	::QueryPerformanceCounter(&start);
+	for (int iEvent = 0; iEvent < EVENT_COUNT; ++iEvent)
+	{
+		CString message;
+		message.Format(TEXT("Component %d of writer %d added"), iEvent, iEvent % 16);
+	}
+	::QueryPerformanceCounter(&end);
+	double seconds = (double) (end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	_tprintf(TEXT("  formatted text:      %.0f messages/s\n"), EVENT_COUNT / seconds);
+
+	const int threadCounts[] = { 1, 4 };
+	for (int iCase = 0; iCase < (int) _countof(threadCounts); ++iCase)
+	{
+		const int THREAD_MAX = 4;
+		int threadCount = threadCounts[iCase];
+		s_eventBytes = 0;
+		CEventLog eventLog(CountEventBytes, NULL);
+		CEventWriterRun run;
+		run.pEventLog = &eventLog;
+		run.eventCount = EVENT_COUNT / threadCount;
+
+		HANDLE threads[THREAD_MAX];
+		::QueryPerformanceCounter(&start);
+		for (int iThread = 0; iThread < threadCount; ++iThread)
+		{
+			threads[iThread] = ::CreateThread(NULL, 0, WriteEventsThreadProc, &run, 0, NULL);
+			TEST_ASSERT(threads[iThread] != NULL);
+		}
+		::WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+		eventLog.Flush();
+		::QueryPerformanceCounter(&end);
+		for (int iThread = 0; iThread < threadCount; ++iThread)
+		{
+			::CloseHandle(threads[iThread]);
+		}
+
+		seconds = (double) (end.QuadPart - start.QuadPart) / frequency.QuadPart;
+		int eventCount = run.eventCount * threadCount;
+		TEST_ASSERT(s_eventBytes == (LONGLONG) eventCount * sizeof(ShadowSpawnEventRecord));
+		_tprintf(TEXT("  events, %d thread%s: %.0f events/s, %.1f MB/s\n"), threadCount, threadCount == 1 ? TEXT(" ") : TEXT("s"),
+			eventCount / seconds, s_eventBytes / seconds / (1024 * 1024));
+	}
+}
@@ -0,0 +1,150 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// The writer metadata cache, driven through mock writers: later runs find
+// the metadata again, and what that saves with thousands of components.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+
+static volatile LONG s_cacheHitCount;
+
+static void __stdcall CountCacheHits(const LPCTSTR message)
+{
+	if (_tcscmp(message, TEXT("Using cached metadata for writer")) == 0)
+	{
+		::InterlockedIncrement(&s_cacheHitCount);
+	}
+	CTestFixture::Log(message);
+}
+
+static void __stdcall IgnoreCallback(void)
+{
+}
+
+// A session on the mock provider keeping its writer metadata at cachePath,
+// or in no cache at all if cachePath is NULL.
+static ShadowSpawnSession CreateCachingSession(const ShadowSpawnMockOptions& options, LPCTSTR cachePath, LogCallback* logCallback)
+{
+	ShadowSpawnSession session = NULL;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCreateSession(CTestFixture::VERBOSITY, &options, logCallback, &session));
+	if (cachePath != NULL)
+	{
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnSetWriterMetadataCache(session, cachePath));
+	}
+	return session;
+}
+
+// The first session fills the cache file; a second one loading it uses
+// every writer from it.
+SHADOWSPAWN_TEST(MetadataCacheServesLaterSessions)
+{
+	CTempDirectory source;
+	CTempDirectory cacheDirectory;
+	CString cachePath(cacheDirectory.get_Path() + TEXT("\\writers.cache"));
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+
+	s_cacheHitCount = 0;
+	ShadowSpawnSession session = CreateCachingSession(options, cachePath, CountCacheHits);
+	HRESULT hr = ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback);
+	ShadowSpawnDestroySession(session);
+	TEST_ASSERT_HRESULT(S_OK, hr);
+	TEST_ASSERT(s_cacheHitCount == 0);
+	TEST_ASSERT(CTestFixture::FileExists(cachePath));
+
+	session = CreateCachingSession(options, cachePath, CountCacheHits);
+	hr = ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback);
+	ShadowSpawnDestroySession(session);
+	TEST_ASSERT_HRESULT(S_OK, hr);
+	TEST_ASSERT(s_cacheHitCount == (LONG) options.writerCount);
+}
+
+// Writers whose component count changed since they were cached are read
+// afresh rather than taken from the cache.
+SHADOWSPAWN_TEST(MetadataCacheIgnoresChangedWriters)
+{
+	CTempDirectory source;
+	CTempDirectory cacheDirectory;
+	CString cachePath(cacheDirectory.get_Path() + TEXT("\\writers.cache"));
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+
+	ShadowSpawnSession session = CreateCachingSession(options, cachePath, CTestFixture::Log);
+	HRESULT hr = ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback);
+	ShadowSpawnDestroySession(session);
+	TEST_ASSERT_HRESULT(S_OK, hr);
+
+	s_cacheHitCount = 0;
+	options.componentsPerWriter += 1;
+	session = CreateCachingSession(options, cachePath, CountCacheHits);
+	hr = ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback);
+	ShadowSpawnDestroySession(session);
+	TEST_ASSERT_HRESULT(S_OK, hr);
+	TEST_ASSERT(s_cacheHitCount == 0);
+}
+
+// Reads thousands of mock components RUN_COUNT times with and without the
+// cache, and reports what the writer walk and component selection phase
+// took each time. The mock builds components far quicker than VSS walks
+// them, so this mostly shows what a hit costs rather than what it saves.
+static double TimeAddComponents(ShadowSpawnSession session, LPCTSTR source, int runCount)
+{
+	// The first run fills the cache, if there is one.
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnWithSession(session, source, CTestFixture::FindFreeDevice(), IgnoreCallback));
+	ShadowSpawnResetPhaseStats();
+	for (int iRun = 0; iRun < runCount; ++iRun)
+	{
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnWithSession(session, source, CTestFixture::FindFreeDevice(), IgnoreCallback));
+	}
+
+	ShadowSpawnPhaseStats stats;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_ADD_COMPONENTS, &stats));
+	TEST_ASSERT(stats.count == (DWORD) runCount);
+	return (double) stats.totalMicroseconds / stats.count;
+}
+
+SHADOWSPAWN_BENCHMARK(MetadataCacheWithThousandsOfComponents)
+{
+	const int RUN_COUNT = 20;
+	CTempDirectory source;
+	CTempDirectory cacheDirectory;
+	CString cachePath(cacheDirectory.get_Path() + TEXT("\\writers.cache"));
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	options.writerCount = 10;
+	options.componentsPerWriter = 500;
+
+	ShadowSpawnSession session = CreateCachingSession(options, NULL, CTestFixture::Log);
+	double uncachedMicroseconds = TimeAddComponents(session, source.get_Path(), RUN_COUNT);
+	ShadowSpawnDestroySession(session);
+
+	session = CreateCachingSession(options, cachePath, CTestFixture::Log);
+	double cachedMicroseconds = TimeAddComponents(session, source.get_Path(), RUN_COUNT);
+	ShadowSpawnDestroySession(session);
+
+	_tprintf(TEXT("  %u components, %d runs each\n"), options.writerCount * options.componentsPerWriter, RUN_COUNT);
+	_tprintf(TEXT("  without cache: %.1f us per run\n"), uncachedMicroseconds);
+	_tprintf(TEXT("  with cache:    %.1f us per run\n"), cachedMicroseconds);
+}
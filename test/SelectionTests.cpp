@@ -0,0 +1,188 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Selection rules on the mock provider: which writers a snapshot leaves
+// out, and how much shorter excluding them makes the freeze.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+
+static volatile LONG s_disableCount;
+
+static void __stdcall CountDisables(const LPCTSTR message)
+{
+	if (_tcscmp(message, TEXT("Mock provider: DisableWriterInstances")) == 0)
+	{
+		::InterlockedIncrement(&s_disableCount);
+	}
+	CTestFixture::Log(message);
+}
+
+static void __stdcall IgnoreCallback(void)
+{
+}
+
+// Named after writers found on a typical server, only the first of which
+// has anything to do with a plain data directory.
+static LPCTSTR s_writerNames[] =
+{
+	TEXT("Data Writer"),
+	TEXT("SqlServerWriter"),
+	TEXT("Microsoft Hyper-V VSS Writer"),
+	TEXT("Microsoft Exchange Writer"),
+	TEXT("Registry Writer"),
+	TEXT("COM+ REGDB Writer"),
+	TEXT("WMI Writer"),
+	TEXT("IIS Metabase Writer"),
+};
+
+static void GetNamedWriterOptions(ShadowSpawnMockOptions& options)
+{
+	CTestFixture::GetMockOptions(options);
+	options.writerCount = _countof(s_writerNames);
+	options.writerNames = s_writerNames;
+}
+
+// Keeps the named writer and excludes every other one.
+static void KeepOnlyWriter(ShadowSpawnSession session, LPCTSTR writerName)
+{
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnAddSelectionRule(session, SHADOWSPAWN_SELECT_INCLUDE, SHADOWSPAWN_SELECT_WRITER_NAME, writerName));
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnAddSelectionRule(session, SHADOWSPAWN_SELECT_EXCLUDE, SHADOWSPAWN_SELECT_WRITER_NAME, TEXT("*")));
+}
+
+// Without rules nothing is disabled; excluding writers by name disables
+// them and takes them out of the freeze.
+SHADOWSPAWN_TEST(SelectionExcludesWritersByName)
+{
+	CTempDirectory source;
+	ShadowSpawnMockOptions options;
+	GetNamedWriterOptions(options);
+	options.freezeLatencyMsPerWriter = 20;
+
+	ShadowSpawnSession session = NULL;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCreateSession(CTestFixture::VERBOSITY, &options, CountDisables, &session));
+
+	s_disableCount = 0;
+	ShadowSpawnResetPhaseStats();
+	HRESULT hr = ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback);
+	TEST_ASSERT_HRESULT(S_OK, hr);
+	TEST_ASSERT(s_disableCount == 0);
+
+	ShadowSpawnPhaseStats allWriters;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET, &allWriters));
+
+	KeepOnlyWriter(session, TEXT("Data Writer"));
+	ShadowSpawnResetPhaseStats();
+	hr = ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback);
+	ShadowSpawnDestroySession(session);
+	TEST_ASSERT_HRESULT(S_OK, hr);
+	TEST_ASSERT(s_disableCount == 1);
+
+	ShadowSpawnPhaseStats oneWriter;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET, &oneWriter));
+	// Eight writers freeze for 160 ms, one for 20; GetTickCount, which
+	// the mock times itself with, is only good to 10-16 ms.
+	TEST_ASSERT(allWriters.minMicroseconds >= 120 * 1000);
+	TEST_ASSERT(oneWriter.minMicroseconds < 100 * 1000);
+}
+
+// Components whose files are on the snapshotted volume match the volume
+// rules through the file path the mock reports for them.
+SHADOWSPAWN_TEST(SelectionMatchesComponentFilesToVolumes)
+{
+	CTempDirectory source;
+	ShadowSpawnMockOptions options;
+	GetNamedWriterOptions(options);
+	options.componentFilePath = source.get_Path();
+
+	ShadowSpawnSession session = NULL;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnCreateSession(CTestFixture::VERBOSITY, &options, CountDisables, &session));
+
+	s_disableCount = 0;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnAddSelectionRule(session, SHADOWSPAWN_SELECT_EXCLUDE, SHADOWSPAWN_SELECT_OFF_SNAPSHOT_VOLUME, NULL));
+	HRESULT hr = ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback);
+	TEST_ASSERT_HRESULT(S_OK, hr);
+	TEST_ASSERT(s_disableCount == 0);
+
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnClearSelectionRules(session));
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnAddSelectionRule(session, SHADOWSPAWN_SELECT_EXCLUDE, SHADOWSPAWN_SELECT_ON_SNAPSHOT_VOLUME, NULL));
+	hr = ShadowSpawnWithSession(session, source.get_Path(), CTestFixture::FindFreeDevice(), IgnoreCallback);
+	ShadowSpawnDestroySession(session);
+	TEST_ASSERT_HRESULT(S_OK, hr);
+	TEST_ASSERT(s_disableCount == 1);
+}
+
+// Mean time in PrepareForBackup and DoSnapshotSet together over runCount
+// snapshots of source.
+static double TimeFreeze(ShadowSpawnSession session, LPCTSTR source, int runCount)
+{
+	ShadowSpawnResetPhaseStats();
+	for (int iRun = 0; iRun < runCount; ++iRun)
+	{
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnWithSession(session, source, CTestFixture::FindFreeDevice(), IgnoreCallback));
+	}
+
+	ShadowSpawnPhaseStats prepare;
+	ShadowSpawnPhaseStats snapshot;
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_PREPARE_FOR_BACKUP, &prepare));
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_DO_SNAPSHOT_SET, &snapshot));
+	TEST_ASSERT(prepare.count == (DWORD) runCount && snapshot.count == (DWORD) runCount);
+	return (double) (prepare.totalMicroseconds + snapshot.totalMicroseconds) / runCount / 1000;
+}
+
+// Eight writers that each add 25 ms to both freeze phases, snapshotted
+// with every writer and with all but one excluded, first by a rule on
+// writer names and then by a rule on where their files are, which also
+// pays for matching every component's files to volumes.
+SHADOWSPAWN_BENCHMARK(SelectionFreezeTime)
+{
+	const int RUN_COUNT = 10;
+	CTempDirectory source;
+
+	ShadowSpawnMockOptions options;
+	GetNamedWriterOptions(options);
+	options.componentsPerWriter = 16;
+	options.freezeLatencyMsPerWriter = 25;
+
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	double allWriters = TimeFreeze(session, source.get_Path(), RUN_COUNT);
+	KeepOnlyWriter(session, TEXT("Data Writer"));
+	double byName = TimeFreeze(session, source.get_Path(), RUN_COUNT);
+	ShadowSpawnDestroySession(session);
+
+	// Every writer's components are in the source, so the volume rule
+	// has to be turned around to leave one writer: keep the first and
+	// exclude what is on the snapshotted volume.
+	options.componentFilePath = source.get_Path();
+	session = CTestFixture::CreateMockSession(options);
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnAddSelectionRule(session, SHADOWSPAWN_SELECT_INCLUDE, SHADOWSPAWN_SELECT_WRITER_NAME, TEXT("Data Writer")));
+	TEST_ASSERT_HRESULT(S_OK, ShadowSpawnAddSelectionRule(session, SHADOWSPAWN_SELECT_EXCLUDE, SHADOWSPAWN_SELECT_ON_SNAPSHOT_VOLUME, NULL));
+	double byVolume = TimeFreeze(session, source.get_Path(), RUN_COUNT);
+	ShadowSpawnDestroySession(session);
+
+	_tprintf(TEXT("  %u writers, %u ms freeze each per phase, %d runs each\n"),
+		options.writerCount, options.freezeLatencyMsPerWriter, RUN_COUNT);
+	_tprintf(TEXT("  no rules:           %.1f ms frozen per snapshot\n"), allWriters);
+	_tprintf(TEXT("  excluded by name:   %.1f ms frozen per snapshot\n"), byName);
+	_tprintf(TEXT("  excluded by volume: %.1f ms frozen per snapshot\n"), byVolume);
+}
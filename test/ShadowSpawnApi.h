@@ -0,0 +1,70 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "Exports.h"
+
+// Declarations of ShadowSpawn.dll's exports, which ShadowSpawn.cpp only
+// defines. See there for what each one does.
+extern "C"
+{
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawn(LPCTSTR source, LPCTSTR device, int verbosityLevel, ShadowSpawnCallback* callback, LogCallback* logCallback);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnMock(LPCTSTR source, LPCTSTR device, int verbosityLevel, const ShadowSpawnMockOptions* options, ShadowSpawnCallback* callback, LogCallback* logCallback);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnCreateSession(int verbosityLevel, const ShadowSpawnMockOptions* mockOptions, LogCallback* logCallback, ShadowSpawnSession* pSession);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnWithSession(ShadowSpawnSession session, LPCTSTR source, LPCTSTR device, ShadowSpawnCallback* callback);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnCreateCancellation(ShadowSpawnCancellation* pCancellation);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnCancel(ShadowSpawnCancellation cancellation);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnCloseCancellation(ShadowSpawnCancellation cancellation);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnWithOptions(ShadowSpawnSession session, LPCTSTR source, LPCTSTR device, ShadowSpawnCallback* callback, const ShadowSpawnCallOptions* options);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnWithCallbackEx(ShadowSpawnSession session, LPCTSTR source, LPCTSTR device, ShadowSpawnCallbackEx* callback, void* context, DWORD workerCount);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnWithClone(ShadowSpawnSession session, LPCTSTR source, LPCTSTR cloneDirectory, DWORD threadCount, ShadowSpawnCallbackEx* callback, void* context, DWORD workerCount);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnCopyTree(ShadowSpawnSession session, LPCTSTR source, LPCTSTR destination, const ShadowSpawnCopyOptions* options, ShadowSpawnCopyStats* pStats);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnWalkTree(ShadowSpawnSession session, LPCTSTR root, DWORD threadCount, ShadowSpawnWalkCallback* callback, void* context, ShadowSpawnWalkStats* pStats);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnCreateGlob(LPCTSTR pattern, ShadowSpawnGlob* pGlob);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnMatchGlob(ShadowSpawnGlob glob, const ShadowSpawnWalkEntry* entries, DWORD count, BYTE* results, DWORD* pMatchCount);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnCloseGlob(ShadowSpawnGlob glob);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnSetWriterMetadataCache(ShadowSpawnSession session, LPCTSTR path);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnAddSelectionRule(ShadowSpawnSession session, ShadowSpawnSelectionAction action, ShadowSpawnSelectionField field, LPCTSTR pattern);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnSetVolumeFiltering(ShadowSpawnSession session, BOOL enabled);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnClearSelectionRules(ShadowSpawnSession session);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnMultipleWithSession(ShadowSpawnSession session, int count, const LPCTSTR* sources, const LPCTSTR* devices, ShadowSpawnCallback* callback);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnMultipleWithCallbackEx(ShadowSpawnSession session, int count, const LPCTSTR* sources, const LPCTSTR* devices, ShadowSpawnCallbackEx* callback, void* context, DWORD workerCount);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnMultiple(int count, const LPCTSTR* sources, const LPCTSTR* devices, int verbosityLevel, ShadowSpawnCallback* callback, LogCallback* logCallback);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnSetCoalescingWindow(DWORD windowMs);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnSetDeferredCleanup(DWORD capacity);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnDrainCleanup(DWORD timeoutMs);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnAsync(ShadowSpawnSession session, LPCTSTR source, LPCTSTR device, ShadowSpawnCallback* callback, ShadowSpawnCompletionCallback* completionCallback, void* context, ShadowSpawnJob* pJob);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnGetJobStatus(ShadowSpawnJob job, ShadowSpawnJobState* pState, HRESULT* pResult);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnWaitForJob(ShadowSpawnJob job, DWORD timeoutMs);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnCloseJob(ShadowSpawnJob job);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnCancelJob(ShadowSpawnJob job);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnSetLogQueue(ShadowSpawnSession session, DWORD capacity, ShadowSpawnLogOverflowPolicy overflowPolicy);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnFlushLog(ShadowSpawnSession session);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnSetEventCallback(ShadowSpawnSession session, ShadowSpawnEventCallback* callback, void* context);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnFlushEvents(ShadowSpawnSession session);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnDecodeEvents(const BYTE* records, DWORD length, LogCallback* callback);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnGetPhaseStats(ShadowSpawnPhase phase, ShadowSpawnPhaseStats* pStats);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnResetPhaseStats(void);
+	__declspec(dllimport) HRESULT __cdecl ShadowSpawnDestroySession(ShadowSpawnSession session);
+}
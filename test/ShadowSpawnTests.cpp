@@ -0,0 +1,69 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Runs the tests against ShadowSpawn.dll, which the mock snapshot provider
+// lets them do without VSS or administrator rights.
+//
+//   ShadowSpawnTests [/bench] [/verbose] [filter]
+//
+// runs every test (or with /bench, every benchmark) whose name contains
+// filter, and exits with 1 if any failed. Tests that need other processes
+// start this executable again with /child name argument.
+
+#include "stdafx.h"
+#include "CTestRunner.h"
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+	bool benchmarks = false; 
+	LPCTSTR filter = TEXT(""); 
+	LPCTSTR child = NULL; 
+	LPCTSTR childArgument = TEXT(""); 
+	for (int iArg = 1; iArg < argc; ++iArg)
+	{
+		if (_tcsicmp(argv[iArg], TEXT("/child")) == 0 && iArg + 2 < argc)
+		{
+			child = argv[++iArg]; 
+			childArgument = argv[++iArg]; 
+		}
+		else if (_tcsicmp(argv[iArg], TEXT("/bench")) == 0)
+		{
+			benchmarks = true; 
+		}
+		else if (_tcsicmp(argv[iArg], TEXT("/verbose")) == 0)
+		{
+			CTestRunner::set_Verbose(true); 
+		}
+		else
+		{
+			filter = argv[iArg]; 
+		}
+	}
+
+	if (child != NULL)
+	{
+		return CTestRunner::RunChild(child, childArgument); 
+	}
+
+	return CTestRunner::Run(benchmarks, filter) == 0 ? 0 : 1; 
+}
@@ -0,0 +1,168 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// The volume path cache, compared with asking the system each time.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+#include "CVolumePathCache.h"
+
+static volatile LONG s_loadCount;
+
+static void __stdcall CountLoads(const LPCTSTR message)
+{
+	if (_tcscmp(message, TEXT("Enumerating volume mount points")) == 0)
+	{
+		::InterlockedIncrement(&s_loadCount);
+	}
+	CTestFixture::Log(message);
+}
+
+static void CreateLogger(OutputWriter& logger)
+{
+	logger.SetLogger(CTestFixture::Log);
+	logger.SetVerbosityLevel(VERBOSITY_LEVEL_VERBOSE);
+}
+
+static CString SystemVolumePathName(LPCTSTR path)
+{
+	TCHAR volumePathName[MAX_PATH];
+	TEST_ASSERT(::GetVolumePathName(path, volumePathName, MAX_PATH));
+	return CString(volumePathName);
+}
+
+// A volume mounted at a directory for the length of a test, and taken
+// away again even if it fails.
+class CMountPoint
+{
+private:
+	CString _path;
+	bool _mounted;
+
+public:
+	CMountPoint::CMountPoint(LPCTSTR path)
+	{
+		_path = path;
+		_mounted = false;
+	}
+
+	CMountPoint::~CMountPoint()
+	{
+		if (_mounted)
+		{
+			::DeleteVolumeMountPoint(_path);
+		}
+	}
+
+	// Mounts the volume that holds volumePathName. Returns false if this
+	// process isn't allowed to, which takes an administrator.
+	bool Mount(LPCTSTR volumePathName)
+	{
+		TCHAR volumeName[MAX_PATH];
+		TEST_ASSERT(::GetVolumeNameForVolumeMountPoint(volumePathName, volumeName, MAX_PATH));
+		if (!::SetVolumeMountPoint(_path, volumeName))
+		{
+			TEST_ASSERT(::GetLastError() == ERROR_ACCESS_DENIED || ::GetLastError() == ERROR_PRIVILEGE_NOT_HELD);
+			return false;
+		}
+		_mounted = true;
+		return true;
+	}
+};
+
+SHADOWSPAWN_TEST(VolumePathCacheAgreesWithSystem)
+{
+	CTempDirectory directory;
+	TCHAR systemDirectory[MAX_PATH];
+	TEST_ASSERT(::GetSystemDirectory(systemDirectory, MAX_PATH) > 0);
+	CString missing(directory.get_Path());
+	missing.Append(TEXT("\\missing\\file.txt"));
+	LPCTSTR paths[] = { systemDirectory, directory.get_Path(), missing, systemDirectory };
+
+	OutputWriter logger;
+	CreateLogger(logger);
+	CVolumePathCache cache;
+	for (int iPath = 0; iPath < (int) _countof(paths); ++iPath)
+	{
+		CString volumePathName;
+		TEST_ASSERT(cache.Lookup(paths[iPath], volumePathName, logger));
+		TEST_ASSERT(volumePathName.CompareNoCase(SystemVolumePathName(paths[iPath])) == 0);
+	}
+}
+
+// Volumes mounted after the cache has read the mount points are only seen
+// once it has been invalidated, which the session does as each snapshot
+// starts if its selection rules look at volumes.
+SHADOWSPAWN_TEST(VolumePathCacheSeesVolumeMountedAfterInvalidate)
+{
+	CTempDirectory directory;
+	CString mountPath(directory.get_Path());
+	mountPath.Append(TEXT("\\mount\\"));
+	TEST_ASSERT(::CreateDirectory(mountPath, NULL));
+	CString below(mountPath);
+	below.Append(TEXT("Windows"));
+
+	OutputWriter logger;
+	CreateLogger(logger);
+	CVolumePathCache cache;
+	CString before;
+	TEST_ASSERT(cache.Lookup(below, before, logger));
+	TEST_ASSERT(before.CompareNoCase(SystemVolumePathName(directory.get_Path())) == 0);
+
+	TCHAR systemDirectory[MAX_PATH];
+	TEST_ASSERT(::GetSystemDirectory(systemDirectory, MAX_PATH) > 0);
+	CMountPoint mountPoint(mountPath);
+	if (!mountPoint.Mount(SystemVolumePathName(systemDirectory)))
+	{
+		_tprintf(TEXT("  skipped: mounting a volume needs an administrator\n"));
+		return;
+	}
+
+	cache.Invalidate();
+	CString after;
+	TEST_ASSERT(cache.Lookup(below, after, logger));
+	TEST_ASSERT(after.CompareNoCase(mountPath) == 0);
+	TEST_ASSERT(after.CompareNoCase(SystemVolumePathName(below)) == 0);
+}
+
+// Without being invalidated, the cache reads the mount points again only
+// once they are older than its maximum age.
+SHADOWSPAWN_TEST(VolumePathCacheReloadsAfterMaxAge)
+{
+	CTempDirectory directory;
+	OutputWriter logger;
+	logger.SetLogger(CountLoads);
+	logger.SetVerbosityLevel(VERBOSITY_LEVEL_VERBOSE);
+	CVolumePathCache cache(200);
+
+	s_loadCount = 0;
+	CString volumePathName;
+	TEST_ASSERT(cache.Lookup(directory.get_Path(), volumePathName, logger));
+	TEST_ASSERT(cache.Lookup(directory.get_Path(), volumePathName, logger));
+	TEST_ASSERT(s_loadCount == 1);
+
+	::Sleep(300);
+	TEST_ASSERT(cache.Lookup(directory.get_Path(), volumePathName, logger));
+	TEST_ASSERT(s_loadCount == 2);
+	TEST_ASSERT(volumePathName.CompareNoCase(SystemVolumePathName(directory.get_Path())) == 0);
+}
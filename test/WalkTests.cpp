@@ -0,0 +1,166 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// ShadowSpawnWalkTree: that it finds every entry of a tree, and how fast
+// it gets through a large one against a plain recursive listing.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+
+struct CWalkCount
+{
+	volatile LONG directoryCount;
+	volatile LONG fileCount;
+	volatile LONG badEntryCount;
+};
+
+static HRESULT __stdcall CountEntries(const ShadowSpawnWalkEntry* entries, DWORD count, void* context)
+{
+	CWalkCount* pCount = (CWalkCount*) context;
+	LONG directories = 0;
+	LONG files = 0;
+	for (DWORD iEntry = 0; iEntry < count; ++iEntry)
+	{
+		if (entries[iEntry].pathLength != _tcslen(entries[iEntry].path))
+		{
+			::InterlockedIncrement(&pCount->badEntryCount);
+		}
+
+		if ((entries[iEntry].attributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+		{
+			++directories;
+		}
+		else
+		{
+			++files;
+		}
+	}
+	::InterlockedExchangeAdd(&pCount->directoryCount, directories);
+	::InterlockedExchangeAdd(&pCount->fileCount, files);
+	return S_OK;
+}
+
+static HRESULT Walk(ShadowSpawnSession session, LPCTSTR root, DWORD threadCount, CWalkCount& count, ShadowSpawnWalkStats& stats)
+{
+	::ZeroMemory((void*) &count, sizeof(count));
+	return ShadowSpawnWalkTree(session, root, threadCount, CountEntries, &count, &stats);
+}
+
+// The walk hands every directory and file below the root to the callback
+// once, with whole relative paths, and its statistics agree.
+SHADOWSPAWN_TEST(WalkFindsEveryEntry)
+{
+	const int DIRECTORY_COUNT = 50;
+	const int FILES_PER_DIRECTORY = 30;
+	CTempDirectory temp;
+	CString root(temp.WriteTree(TEXT("tree"), DIRECTORY_COUNT, FILES_PER_DIRECTORY, 0));
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	DWORD threadCounts[] = { 1, 4 };
+	for (int iCase = 0; iCase < (int) _countof(threadCounts); ++iCase)
+	{
+		CWalkCount count;
+		ShadowSpawnWalkStats stats;
+		TEST_ASSERT_HRESULT(S_OK, Walk(session, root, threadCounts[iCase], count, stats));
+
+		// WriteTree spreads its directories over 16 parents.
+		TEST_ASSERT(count.directoryCount == 16 + DIRECTORY_COUNT);
+		TEST_ASSERT(count.fileCount == DIRECTORY_COUNT * FILES_PER_DIRECTORY);
+		TEST_ASSERT(count.badEntryCount == 0);
+		TEST_ASSERT(stats.directoryCount == 1 + 16 + DIRECTORY_COUNT);
+		TEST_ASSERT(stats.fileCount == (ULONGLONG) count.fileCount);
+		TEST_ASSERT(stats.failedCount == 0);
+	}
+	ShadowSpawnDestroySession(session);
+}
+
+// What a caller would write without ShadowSpawnWalkTree: FindFirstFile
+// and FindNextFile, one directory after another.
+static void ListRecursively(const CString& directory, LONG& entryCount)
+{
+	WIN32_FIND_DATA findData;
+	HANDLE hFind = ::FindFirstFile(directory + TEXT("\\*"), &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+	do
+	{
+		if (_tcscmp(findData.cFileName, TEXT(".")) == 0 || _tcscmp(findData.cFileName, TEXT("..")) == 0)
+		{
+			continue;
+		}
+		++entryCount;
+		if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+		{
+			ListRecursively(directory + TEXT("\\") + findData.cFileName, entryCount);
+		}
+	} while (::FindNextFile(hFind, &findData));
+	::FindClose(hFind);
+}
+
+// Lists a tree of 100,000 empty files recursively on one thread, then
+// walks it on one to eight threads. The listing goes first, so every
+// run finds the directories in the cache.
+SHADOWSPAWN_BENCHMARK(WalkLargeTree)
+{
+	const int DIRECTORY_COUNT = 2000;
+	const int FILES_PER_DIRECTORY = 50;
+	CTempDirectory temp;
+	CString root(temp.WriteTree(TEXT("tree"), DIRECTORY_COUNT, FILES_PER_DIRECTORY, 0));
+	LONG expectedEntries = 16 + DIRECTORY_COUNT + DIRECTORY_COUNT * FILES_PER_DIRECTORY;
+
+	LARGE_INTEGER frequency, start, end;
+	::QueryPerformanceFrequency(&frequency);
+	LONG listedEntries = 0;
+	ListRecursively(root, listedEntries);
+	listedEntries = 0;
+	::QueryPerformanceCounter(&start);
+	ListRecursively(root, listedEntries);
+	::QueryPerformanceCounter(&end);
+	TEST_ASSERT(listedEntries == expectedEntries);
+	double seconds = (double) (end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	_tprintf(TEXT("  %d entries\n"), expectedEntries);
+	_tprintf(TEXT("  FindFirstFile, 1 thread: %7.1f ms, %8.0f entries/s\n"), seconds * 1000, expectedEntries / seconds);
+
+	ShadowSpawnMockOptions options;
+	CTestFixture::GetMockOptions(options);
+	ShadowSpawnSession session = CTestFixture::CreateMockSession(options);
+	DWORD threadCounts[] = { 1, 2, 4, 8 };
+	for (int iCase = 0; iCase < (int) _countof(threadCounts); ++iCase)
+	{
+		CWalkCount count;
+		ShadowSpawnWalkStats stats;
+		ShadowSpawnResetPhaseStats();
+		TEST_ASSERT_HRESULT(S_OK, Walk(session, root, threadCounts[iCase], count, stats));
+		TEST_ASSERT(count.directoryCount + count.fileCount == expectedEntries);
+
+		ShadowSpawnPhaseStats walk;
+		TEST_ASSERT_HRESULT(S_OK, ShadowSpawnGetPhaseStats(SHADOWSPAWN_PHASE_WALK, &walk));
+		seconds = walk.totalMicroseconds / 1e6;
+		_tprintf(TEXT("  walk, %u threads:         %7.1f ms, %8.0f entries/s\n"), threadCounts[iCase], seconds * 1000, expectedEntries / seconds);
+	}
+	ShadowSpawnDestroySession(session);
+}
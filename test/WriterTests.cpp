@@ -0,0 +1,220 @@
+/* 
+Copyright (c) 2011 Craig Andera (shadowspawn@wangdera.com)
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// CWriter's component model: linking components to their parents, and
+// what building and keeping it costs for writers with very many
+// components.
+
+#include "stdafx.h"
+#include "CTestFixture.h"
+#include "CWriter.h"
+#include "CStringPool.h"
+
+static void AddComponent(CWriter& writer, LPCTSTR logicalPath, LPCTSTR name, bool selectable)
+{
+	writer.get_Components().push_back(CWriterComponent());
+	CWriterComponent& component = writer.get_Components().back();
+	component.set_Type(VSS_CT_FILEGROUP);
+	component.set_LogicalPath(CString(logicalPath));
+	component.set_Name(CString(name));
+	component.set_SelectableForBackup(selectable);
+}
+
+SHADOWSPAWN_TEST(ComponentTreeLinksParents)
+{
+	CWriter writer;
+	AddComponent(writer, TEXT(""), TEXT("Root"), false);				// 0
+	AddComponent(writer, TEXT("Root"), TEXT("Database"), true);			// 1
+	AddComponent(writer, TEXT("Root\\Database"), TEXT("Logs"), false);	// 2
+	AddComponent(writer, TEXT("Root\\Database\\Logs"), TEXT("Old"), true);	// 3
+	AddComponent(writer, TEXT("Root"), TEXT("Loose"), false);			// 4
+	AddComponent(writer, TEXT("Elsewhere"), TEXT("Orphan"), true);		// 5
+	// The same full path again: the first component with it is the parent.
+	AddComponent(writer, TEXT(""), TEXT("Root"), true);					// 6
+	writer.ComputeComponentTree();
+
+	vector<CWriterComponent>& components = writer.get_Components();
+	TEST_ASSERT(components[0].get_ParentIndex() == -1);
+	TEST_ASSERT(components[1].get_ParentIndex() == 0);
+	TEST_ASSERT(components[2].get_ParentIndex() == 1);
+	TEST_ASSERT(components[3].get_ParentIndex() == 2);
+	TEST_ASSERT(components[4].get_ParentIndex() == 0);
+	TEST_ASSERT(components[5].get_ParentIndex() == -1);
+	TEST_ASSERT(writer.FindParent(components[3]) == &components[2]);
+	TEST_ASSERT(writer.FindParent(components[0]) == NULL);
+
+	TEST_ASSERT(!components[0].get_HasSelectableAncestor());
+	TEST_ASSERT(!components[1].get_HasSelectableAncestor());
+	TEST_ASSERT(components[2].get_HasSelectableAncestor());
+	TEST_ASSERT(components[3].get_HasSelectableAncestor());
+	TEST_ASSERT(!components[4].get_HasSelectableAncestor());
+	TEST_ASSERT(!components[5].get_HasSelectableAncestor());
+	TEST_ASSERT(components[6].get_ParentIndex() == -1);
+}
+
+// A writer with componentCount components: a root, and below it groups of
+// GROUP_SIZE, each a group component and its leaves. Every other group is
+// selectable.
+static void BuildSyntheticWriter(CWriter& writer, int componentCount)
+{
+	const int GROUP_SIZE = 1000;
+	writer.get_Components().reserve(componentCount);
+	AddComponent(writer, TEXT(""), TEXT("Root"), false);
+
+	CString groupPath;
+	CString name;
+	int iGroup = -1;
+	for (int iComponent = 1; iComponent < componentCount; ++iComponent)
+	{
+		if ((iComponent - 1) % GROUP_SIZE == 0)
+		{
+			++iGroup;
+			name.Format(TEXT("Group %d"), iGroup);
+			AddComponent(writer, TEXT("Root"), name, iGroup % 2 == 0);
+			groupPath.Format(TEXT("Root\\Group %d"), iGroup);
+			continue;
+		}
+
+		name.Format(TEXT("Component %d"), iComponent);
+		AddComponent(writer, groupPath, name, true);
+	}
+}
+
+// ComputeComponentTree for synthetic writers of up to 100,000 components.
+// It should take about as long per component at every size.
+SHADOWSPAWN_BENCHMARK(ComponentTreeWith100kComponents)
+{
+	const int sizes[] = { 1000, 10000, 100000 };
+	for (int iSize = 0; iSize < (int) _countof(sizes); ++iSize)
+	{
+		CWriter writer;
+		BuildSyntheticWriter(writer, sizes[iSize]);
+
+		LARGE_INTEGER frequency, start, end;
+		::QueryPerformanceFrequency(&frequency);
+		::QueryPerformanceCounter(&start);
+		writer.ComputeComponentTree();
+		::QueryPerformanceCounter(&end);
+
+		vector<CWriterComponent>& components = writer.get_Components();
+		TEST_ASSERT(components.back().get_ParentIndex() > 0);
+		TEST_ASSERT(components[components.back().get_ParentIndex()].get_ParentIndex() == 0);
+
+		double microseconds = (end.QuadPart - start.QuadPart) * 1000000.0 / frequency.QuadPart;
+		_tprintf(TEXT("  %6d components: %9.0f us, %.3f us per component\n"),
+			sizes[iSize], microseconds, microseconds / sizes[iSize]);
+	}
+}
+
+// Live blocks and bytes on every heap in the process.
+static void MeasureHeaps(SIZE_T& blockCount, SIZE_T& byteCount)
+{
+	blockCount = 0;
+	byteCount = 0;
+
+	HANDLE heaps[64];
+	DWORD heapCount = ::GetProcessHeaps(_countof(heaps), heaps);
+	for (DWORD iHeap = 0; iHeap < heapCount && iHeap < _countof(heaps); ++iHeap)
+	{
+		if (!::HeapLock(heaps[iHeap]))
+		{
+			continue;
+		}
+
+		PROCESS_HEAP_ENTRY entry;
+		entry.lpData = NULL;
+		while (::HeapWalk(heaps[iHeap], &entry))
+		{
+			if ((entry.wFlags & PROCESS_HEAP_ENTRY_BUSY) != 0)
+			{
+				++blockCount;
+				byteCount += entry.cbData;
+			}
+		}
+		::HeapUnlock(heaps[iHeap]);
+	}
+}
+
+// Fills writer the way CVssSnapshotProvider does, with strings that come
+// from a fresh buffer every time, like the BSTRs VSS hands back: interned
+// through pool, or, with pool NULL, copied into each component.
+static void BuildFromFreshStrings(CWriter& writer, int componentCount, CStringPool* pool)
+{
+	writer.get_Components().reserve(componentCount);
+	for (int iComponent = 0; iComponent < componentCount; ++iComponent)
+	{
+		TCHAR logicalPath[64];
+		TCHAR name[64];
+		_stprintf_s(logicalPath, TEXT("Root\\Group %d"), iComponent / 1000);
+		_stprintf_s(name, TEXT("Component %d"), iComponent);
+
+		writer.get_Components().push_back(CWriterComponent());
+		CWriterComponent& component = writer.get_Components().back();
+		component.set_Type(VSS_CT_FILEGROUP);
+		component.set_SelectableForBackup(true);
+		if (pool == NULL)
+		{
+			component.set_LogicalPath(CString(logicalPath));
+			component.set_Name(CString(name));
+		}
+		else
+		{
+			component.set_LogicalPath(pool->Intern(logicalPath));
+			component.set_Name(pool->Intern(name));
+		}
+	}
+	writer.ComputeComponentTree();
+}
+
+// Heap blocks and bytes still in use per component once a writer of
+// 100,000 components is built, with and without the string pool, and
+// what copying that writer adds. Names are unique, so the pool saves
+// only on the logical paths, shared by a thousand components each; the
+// pool's own map is counted while the writer is alive.
+SHADOWSPAWN_BENCHMARK(ComponentMemoryPerComponent)
+{
+	const int COMPONENT_COUNT = 100000;
+	for (int iCase = 0; iCase < 2; ++iCase)
+	{
+		bool interned = (iCase == 1);
+		SIZE_T blocksBefore, bytesBefore, blocksBuilt, bytesBuilt, blocksCopied, bytesCopied;
+		MeasureHeaps(blocksBefore, bytesBefore);
+		{
+			CStringPool pool;
+			CWriter writer;
+			BuildFromFreshStrings(writer, COMPONENT_COUNT, interned ? &pool : NULL);
+			MeasureHeaps(blocksBuilt, bytesBuilt);
+
+			CWriter copy(writer);
+			MeasureHeaps(blocksCopied, bytesCopied);
+			TEST_ASSERT(copy.get_Components().size() == COMPONENT_COUNT);
+		}
+
+		_tprintf(TEXT("  %s: %.2f blocks, %.1f bytes per component; a copy adds %.2f blocks, %.1f bytes\n"),
+			interned ? TEXT("interned") : TEXT("copied  "),
+			(double) (blocksBuilt - blocksBefore) / COMPONENT_COUNT,
+			(double) (bytesBuilt - bytesBefore) / COMPONENT_COUNT,
+			(double) (blocksCopied - blocksBuilt) / COMPONENT_COUNT,
+			(double) (bytesCopied - bytesBuilt) / COMPONENT_COUNT);
+	}
+}